@@ -19,6 +19,7 @@
  */
 
 #include "chanserv.h"
+#include "cidr.h"
 #include "conf.h"
 #include "global.h"
 #include "modcmd.h"
@@ -1181,6 +1182,229 @@ del_channel_user(struct userData *user, int do_gc)
 
 static void expire_ban(void *data);
 
+static int
+user_matches_ban(struct userNode *user, struct banData *ban, int flags)
+{
+    if(ban->compiled)
+        return user_matches_compiled(user, ban->compiled, flags);
+    return user_matches_glob(user, ban->mask, flags);
+}
+
+/* Registered bans are indexed by the host part of their mask so that
+ * a joining user is only tested against bans that could match:
+ *   - suffixes: keyed by the trailing literal part of the host glob,
+ *     from its first '.' (so "*.isp.example" is under ".isp.example");
+ *   - prefixes: keyed by the first label of a leading literal that
+ *     contains a '.' or ':' (so "10.1.*" is under "10");
+ *   - cidrs: address masks, by the parsed address and prefix length;
+ *   - residual: everything else, such as "nick!*@*".
+ * An address mask is filed under both cidrs and its text, since
+ * user_matches_glob() also tests it against the host names. */
+DECLARE_LIST(banDataList, struct banData *);
+DEFINE_LIST(banDataList, struct banData *)
+
+struct ban_index
+{
+    dict_t suffixes;
+    dict_t prefixes;
+    struct cidr_tree cidrs;
+    struct banDataList residual;
+};
+
+static unsigned long ban_rank;
+
+static void
+ban_index_free_list(void *data)
+{
+    banDataList_clean(data);
+    free(data);
+}
+
+static struct ban_index *
+ban_index_new(void)
+{
+    struct ban_index *idx;
+
+    idx = calloc(1, sizeof(*idx));
+    idx->suffixes = dict_new();
+    dict_set_free_keys(idx->suffixes, free);
+    dict_set_free_data(idx->suffixes, ban_index_free_list);
+    idx->prefixes = dict_new();
+    dict_set_free_keys(idx->prefixes, free);
+    dict_set_free_data(idx->prefixes, ban_index_free_list);
+    cidr_tree_init(&idx->cidrs);
+    banDataList_init(&idx->residual);
+    return idx;
+}
+
+static void
+ban_index_free(struct ban_index *idx)
+{
+    if(!idx)
+        return;
+    dict_delete(idx->suffixes);
+    dict_delete(idx->prefixes);
+    cidr_tree_clean(&idx->cidrs);
+    banDataList_clean(&idx->residual);
+    free(idx);
+}
+
+/* Decide where a ban's host text is filed: returns the dict to use
+ * (with its key in key[]), or NULL for the residual list. */
+static dict_t
+ban_index_key(struct ban_index *idx, struct banData *bd, char key[])
+{
+    const char *host, *tail, *sep;
+    unsigned int len;
+
+    if(!bd->compiled || bd->compiled->host.type == GLOB_ANY)
+        return NULL;
+    host = bd->compiled->host.glob;
+    if(strchr(host, '\\'))
+        return NULL;
+    len = strlen(host);
+    for(tail = host + len; (tail > host) && (tail[-1] != '*') && (tail[-1] != '?'); tail--) ;
+    if((sep = strchr(tail, '.')))
+    {
+        safestrncpy(key, sep, HOSTLEN + 1);
+        return idx->suffixes;
+    }
+    len = strcspn(host, "*?");
+    sep = host + strcspn(host, ".:");
+    if(sep < host + len)
+    {
+        len = sep - host;
+        if(len > HOSTLEN)
+            return NULL;
+        memcpy(key, host, len);
+        key[len] = '\0';
+        return idx->prefixes;
+    }
+    return NULL;
+}
+
+static void
+ban_index_add(struct chanData *channel, struct banData *bd)
+{
+    struct banDataList *list;
+    char key[HOSTLEN + 1];
+    dict_t dict;
+
+    if(!channel->ban_index)
+        channel->ban_index = ban_index_new();
+    if(bd->compiled && bd->compiled->has_ip)
+        cidr_tree_insert(&channel->ban_index->cidrs, &bd->compiled->ip, bd->compiled->ip_bits, bd);
+    if(!(dict = ban_index_key(channel->ban_index, bd, key)))
+    {
+        banDataList_append(&channel->ban_index->residual, bd);
+        return;
+    }
+    if(!(list = dict_find(dict, key, NULL)))
+    {
+        list = malloc(sizeof(*list));
+        banDataList_init(list);
+        dict_insert(dict, strdup(key), list);
+    }
+    banDataList_append(list, bd);
+}
+
+static void
+ban_index_remove(struct chanData *channel, struct banData *bd)
+{
+    struct banDataList *list;
+    char key[HOSTLEN + 1];
+    dict_t dict;
+
+    if(!channel->ban_index)
+        return;
+    if(bd->compiled && bd->compiled->has_ip)
+        cidr_tree_remove(&channel->ban_index->cidrs, &bd->compiled->ip, bd->compiled->ip_bits, bd);
+    if(!(dict = ban_index_key(channel->ban_index, bd, key)))
+    {
+        banDataList_remove(&channel->ban_index->residual, bd);
+        return;
+    }
+    if((list = dict_find(dict, key, NULL)))
+    {
+        banDataList_remove(list, bd);
+        if(!list->used)
+            dict_remove(dict, key);
+    }
+}
+
+struct ban_index_search
+{
+    struct userNode *user;
+    int flags;
+    struct banData *best;
+};
+
+/* Keep the matching ban nearest the head of the channel's list, to
+ * give the same answer as walking that list. */
+static int
+ban_index_test(void *data, void *extra)
+{
+    struct ban_index_search *search = extra;
+    struct banData *bd = data;
+
+    if((!search->best || (bd->rank > search->best->rank))
+       && user_matches_ban(search->user, bd, search->flags))
+        search->best = bd;
+    return 0;
+}
+
+static void
+ban_index_test_list(struct banDataList *list, struct ban_index_search *search)
+{
+    unsigned int ii;
+
+    if(!list)
+        return;
+    for(ii = 0; ii < list->used; ++ii)
+        ban_index_test(list->list[ii], search);
+}
+
+static void
+ban_index_test_host(struct ban_index *idx, const char *host, struct ban_index_search *search)
+{
+    char label[HOSTLEN + 1];
+    const char *pos;
+    unsigned int len;
+
+    for(pos = host; (pos = strchr(pos, '.')); ++pos)
+        ban_index_test_list(dict_find(idx->suffixes, pos, NULL), search);
+    len = strcspn(host, ".:");
+    if(host[len] && (len <= HOSTLEN))
+    {
+        memcpy(label, host, len);
+        label[len] = '\0';
+        ban_index_test_list(dict_find(idx->prefixes, label, NULL), search);
+    }
+}
+
+/* Find the first ban in channel->bans that matches user. */
+static struct banData *
+find_registered_ban(struct chanData *channel, struct userNode *user, int flags)
+{
+    struct ban_index_search search;
+    struct ban_index *idx;
+    const char *hidden_host;
+
+    search.user = user;
+    search.flags = flags;
+    search.best = NULL;
+    if(!(idx = channel->ban_index))
+        return NULL;
+    ban_index_test_list(&idx->residual, &search);
+    cidr_tree_walk(&idx->cidrs, &user->ip, ban_index_test, &search);
+    ban_index_test_host(idx, user->hostname, &search);
+    if(IsFakeHost(user))
+        ban_index_test_host(idx, user->fakehost, &search);
+    if((hidden_host = user_hidden_host(user)))
+        ban_index_test_host(idx, hidden_host, &search);
+    return search.best;
+}
+
 static struct banData*
 add_channel_ban(struct chanData *channel, const char *mask, char *owner, unsigned long set, unsigned long triggered, unsigned long expires, char *reason)
 {
@@ -1214,6 +1438,7 @@ add_channel_ban(struct chanData *channel, const char *mask, char *owner, unsigne
         mask = new_mask;
     }
     safestrncpy(bd->mask, mask, sizeof(bd->mask));
+    bd->compiled = compiled_mask_new(bd->mask, MATCH_USENICK);
     if(owner)
         safestrncpy(bd->owner, owner, sizeof(bd->owner));
     bd->reason = strdup(reason);
@@ -1226,6 +1451,8 @@ add_channel_ban(struct chanData *channel, const char *mask, char *owner, unsigne
     if(channel->bans)
         channel->bans->prev = bd;
     channel->bans = bd;
+    bd->rank = ++ban_rank;
+    ban_index_add(channel, bd);
     channel->banCount++;
     banCount++;
 
@@ -1237,6 +1464,7 @@ del_channel_ban(struct banData *ban)
 {
     ban->channel->banCount--;
     banCount--;
+    ban_index_remove(ban->channel, ban);
 
     if(ban->prev)
         ban->prev->next = ban->next;
@@ -1252,6 +1480,8 @@ del_channel_ban(struct banData *ban)
     if(ban->reason)
         free(ban->reason);
 
+    if(ban->compiled)
+        compiled_mask_free(ban->compiled);
     free(ban);
 }
 
@@ -1316,6 +1546,7 @@ unregister_channel(struct chanData *channel, const char *reason)
 
     while(channel->bans)
         del_channel_ban(channel->bans);
+    ban_index_free(channel->ban_index);
 
     free(channel->topic);
     free(channel->registrar);
@@ -2425,6 +2656,7 @@ merge_bans(struct chanData *source, struct chanData *target)
             /* Remove the source ban from the source ban list. */
             if(sbData->next)
                 sbData->next->prev = sbData->prev;
+            ban_index_remove(source, sbData);
 
             /* Modify the source ban's associated channel. */
             sbData->channel = target;
@@ -2436,6 +2668,8 @@ merge_bans(struct chanData *source, struct chanData *target)
             if(target->bans)
                 target->bans->prev = sbData;
             target->bans = sbData;
+            sbData->rank = ++ban_rank;
+            ban_index_add(target, sbData);
 
             /* Update the user counts for the target channel. */
             target->banCount++;
@@ -3540,8 +3774,8 @@ unban_user(struct userNode *user, struct chanNode *channel, unsigned int argc, c
         while(ban)
         {
             if(actee)
-                for( ; ban && !user_matches_glob(actee, ban->mask,
-                                                 MATCH_USENICK | MATCH_VISIBLE);
+                for( ; ban && !user_matches_ban(actee, ban,
+                                                MATCH_USENICK | MATCH_VISIBLE);
                      ban = ban->next);
             else
                 for( ; ban && !match_ircglobs(mask, ban->mask);
@@ -3988,7 +4222,7 @@ static CHANSERV_FUNC(cmd_bans)
     {
         if(search_u)
         {
-            if(!user_matches_glob(search_u, ban->mask, MATCH_USENICK | MATCH_VISIBLE))
+            if(!user_matches_ban(search_u, ban, MATCH_USENICK | MATCH_VISIBLE))
                 continue;
         }
         else if(search)
@@ -6442,9 +6676,7 @@ handle_join(struct modeNode *mNode)
     if(channel->banlist.used < MAXBANS)
     {
         /* Not joining through a ban. */
-        for(bData = cData->bans;
-            bData && !user_matches_glob(user, bData->mask, MATCH_USENICK);
-            bData = bData->next);
+        bData = find_registered_ban(cData, user, MATCH_USENICK);
 
         if(bData)
         {
@@ -6454,6 +6686,7 @@ handle_join(struct modeNode *mNode)
             bData->triggered = now;
             if(bData != cData->bans)
             {
+                bData->rank = ++ban_rank;
                 /* Shuffle the ban to the head of the list. */
                 if(bData->next)
                     bData->next->prev = bData->prev;
@@ -6631,18 +6864,15 @@ handle_auth(struct userNode *user, UNUSED_ARG(struct handle_info *old_handle))
                 break;
         if(jj < chan->banlist.used)
             continue;
-        for(ban = chan->channel_info->bans; ban; ban = ban->next)
+        if((ban = find_registered_ban(chan->channel_info, user, MATCH_USENICK | MATCH_VISIBLE)))
         {
             char kick_reason[MAXLEN];
-            if(!user_matches_glob(user, ban->mask, MATCH_USENICK | MATCH_VISIBLE))
-                continue;
             change.args[0].mode = MODE_BAN;
             change.args[0].u.hostmask = ban->mask;
             mod_chanmode_announce(chanserv, chan, &change);
             sprintf(kick_reason, "(%s) %s", ban->owner, ban->reason);
             KickChannelUser(user, chan, chanserv, kick_reason);
             ban->triggered = now;
-            break;
         }
     }
 
@@ -6859,16 +7089,13 @@ handle_nick_change(struct userNode *user, UNUSED_ARG(const char *old_nick))
         if(jj < channel->banlist.used)
             continue;
         /* Look for a matching ban in this channel. */
-        for(bData = channel->channel_info->bans; bData; bData = bData->next)
+        if((bData = find_registered_ban(channel->channel_info, user, MATCH_USENICK | MATCH_VISIBLE)))
         {
-            if(!user_matches_glob(user, bData->mask, MATCH_USENICK | MATCH_VISIBLE))
-                continue;
             change.args[0].u.hostmask = bData->mask;
             mod_chanmode_announce(chanserv, channel, &change);
             sprintf(kick_reason, "(%s) %s", bData->owner, bData->reason);
             KickChannelUser(user, channel, chanserv, kick_reason);
             bData->triggered = now;
-            break; /* we don't need to check any more bans in the channel */
         }
     }
 }
@@ -101,6 +101,7 @@ struct chanData
 
     struct userData     *users;
     struct banData      *bans;
+    struct ban_index    *ban_index;
     struct dict         *notes;
     struct suspended    *suspended;
     struct chanData     *prev;
@@ -140,6 +141,8 @@ struct banData
     char            mask[NICKLEN + USERLEN + HOSTLEN + 3];
     char            owner[NICKLEN+1];
     struct chanData *channel;
+    struct compiled_mask *compiled;
+    unsigned long   rank; /* larger is nearer the head of channel->bans */
 
     unsigned long   set;
     unsigned long   triggered;
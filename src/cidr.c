@@ -0,0 +1,244 @@
+/* cidr.c - Path-compressed binary trie of address prefixes
+ * Copyright 2026 srvx Development Team
+ *
+ * This file is part of srvx.
+ *
+ * srvx is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with srvx; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+ */
+
+#include "cidr.h"
+
+#ifdef HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+#ifdef HAVE_ARPA_INET_H
+#include <arpa/inet.h>
+#endif
+
+/* Each node covers the first "bits" bits of its address (the rest are
+ * zero).  A node's children extend its prefix by at least one bit,
+ * branching on the first bit past it.  Nodes with no entries exist
+ * only where two subtrees diverge. */
+
+static unsigned int
+cidr_bit(const irc_in_addr_t *addr, unsigned int n)
+{
+    return (ntohs(addr->in6[n >> 4]) >> (15 - (n & 15))) & 1;
+}
+
+/* Length of the common prefix of a and b, up to limit bits. */
+static unsigned int
+cidr_common(const irc_in_addr_t *a, const irc_in_addr_t *b, unsigned int limit)
+{
+    unsigned int ii, diff, bits;
+
+    for (ii = bits = 0; bits < limit; ii++, bits += 16) {
+        diff = ntohs(a->in6[ii] ^ b->in6[ii]);
+        if (diff) {
+            while (!(diff & 0x8000)) {
+                diff <<= 1;
+                bits++;
+            }
+            break;
+        }
+    }
+    return (bits < limit) ? bits : limit;
+}
+
+static struct cidr_node *
+cidr_node_new(const irc_in_addr_t *addr, unsigned int bits)
+{
+    struct cidr_node *node;
+    unsigned int ii;
+
+    node = calloc(1, sizeof(*node));
+    node->bits = bits;
+    for (ii = 0; ii < 8; ii++, bits = (bits > 16) ? bits - 16 : 0)
+        node->addr.in6[ii] = (bits >= 16) ? addr->in6[ii] : htons(ntohs(addr->in6[ii]) & ~(0xffff >> bits));
+    return node;
+}
+
+static void
+cidr_node_add(struct cidr_node *node, void *data)
+{
+    if (node->used == node->size) {
+        node->size = node->size ? node->size << 1 : 2;
+        node->data = realloc(node->data, node->size * sizeof(node->data[0]));
+    }
+    node->data[node->used++] = data;
+}
+
+static void
+cidr_node_free(struct cidr_node *node)
+{
+    if (!node)
+        return;
+    cidr_node_free(node->child[0]);
+    cidr_node_free(node->child[1]);
+    free(node->data);
+    free(node);
+}
+
+void
+cidr_tree_init(struct cidr_tree *tree)
+{
+    tree->root = NULL;
+    tree->count = 0;
+}
+
+void
+cidr_tree_clean(struct cidr_tree *tree)
+{
+    cidr_node_free(tree->root);
+    cidr_tree_init(tree);
+}
+
+void
+cidr_tree_insert(struct cidr_tree *tree, const irc_in_addr_t *addr, unsigned char bits, void *data)
+{
+    struct cidr_node **pp, *node, *mid;
+    unsigned int common;
+
+    if (bits > 128)
+        bits = 128;
+    tree->count++;
+    for (pp = &tree->root; (node = *pp); pp = &node->child[cidr_bit(addr, node->bits)]) {
+        common = cidr_common(&node->addr, addr, (node->bits < bits) ? node->bits : bits);
+        if (common < node->bits) {
+            /* Split node's edge where the new prefix leaves it. */
+            mid = cidr_node_new(addr, common);
+            mid->child[cidr_bit(&node->addr, common)] = node;
+            *pp = mid;
+            if (common == bits)
+                cidr_node_add(mid, data);
+            else
+                cidr_node_add(mid->child[cidr_bit(addr, common)] = cidr_node_new(addr, bits), data);
+            return;
+        }
+        if (node->bits == bits) {
+            cidr_node_add(node, data);
+            return;
+        }
+    }
+    cidr_node_add(*pp = cidr_node_new(addr, bits), data);
+}
+
+int
+cidr_tree_remove(struct cidr_tree *tree, const irc_in_addr_t *addr, unsigned char bits, void *data)
+{
+    struct cidr_node **pp, **parent, *node;
+    unsigned int ii;
+
+    if (bits > 128)
+        bits = 128;
+    for (parent = NULL, pp = &tree->root; (node = *pp); parent = pp, pp = &node->child[cidr_bit(addr, node->bits)]) {
+        if ((node->bits > bits) || (cidr_common(&node->addr, addr, node->bits) < node->bits))
+            return 0;
+        if (node->bits == bits)
+            break;
+    }
+    if (!node)
+        return 0;
+    for (ii = 0; (ii < node->used) && (node->data[ii] != data); ii++) ;
+    if (ii == node->used)
+        return 0;
+    memmove(node->data + ii, node->data + ii + 1, (node->used - ii - 1) * sizeof(node->data[0]));
+    node->used--;
+    tree->count--;
+
+    /* Drop the node if it no longer holds entries or joins subtrees,
+     * then its parent if that was only there to join this node in. */
+    while (node && !node->used && !(node->child[0] && node->child[1])) {
+        *pp = node->child[0] ? node->child[0] : node->child[1];
+        free(node->data);
+        free(node);
+        if (!parent)
+            break;
+        pp = parent;
+        parent = NULL;
+        node = *pp;
+    }
+    return 1;
+}
+
+void *
+cidr_tree_walk(const struct cidr_tree *tree, const irc_in_addr_t *addr, cidr_walk_f func, void *extra)
+{
+    struct cidr_node *node;
+    unsigned int ii;
+
+    for (node = tree->root; node; node = node->child[cidr_bit(addr, node->bits)]) {
+        if (cidr_common(&node->addr, addr, node->bits) < node->bits)
+            break;
+        for (ii = 0; ii < node->used; ii++)
+            if (func(node->data[ii], extra))
+                return node->data[ii];
+        if (node->bits == 128)
+            break;
+    }
+    return NULL;
+}
+
+void *
+cidr_tree_longest(const struct cidr_tree *tree, const irc_in_addr_t *addr)
+{
+    struct cidr_node *node;
+    void *best;
+
+    for (best = NULL, node = tree->root; node; node = node->child[cidr_bit(addr, node->bits)]) {
+        if (cidr_common(&node->addr, addr, node->bits) < node->bits)
+            break;
+        if (node->used)
+            best = node->data[0];
+        if (node->bits == 128)
+            break;
+    }
+    return best;
+}
+
+static void *
+cidr_node_foreach(const struct cidr_node *node, cidr_walk_f func, void *extra)
+{
+    unsigned int ii;
+    void *found;
+
+    if (!node)
+        return NULL;
+    for (ii = 0; ii < node->used; ii++)
+        if (func(node->data[ii], extra))
+            return node->data[ii];
+    if ((found = cidr_node_foreach(node->child[0], func, extra)))
+        return found;
+    return cidr_node_foreach(node->child[1], func, extra);
+}
+
+void *
+cidr_tree_foreach(const struct cidr_tree *tree, cidr_walk_f func, void *extra)
+{
+    return cidr_node_foreach(tree->root, func, extra);
+}
+
+void *
+cidr_tree_foreach_within(const struct cidr_tree *tree, const irc_in_addr_t *addr, unsigned char bits, cidr_walk_f func, void *extra)
+{
+    struct cidr_node *node;
+
+    for (node = tree->root; node && (node->bits < bits); node = node->child[cidr_bit(addr, node->bits)])
+        if (cidr_common(&node->addr, addr, node->bits) < node->bits)
+            return NULL;
+    if (!node || (cidr_common(&node->addr, addr, bits) < bits))
+        return NULL;
+    return cidr_node_foreach(node, func, extra);
+}
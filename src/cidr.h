@@ -0,0 +1,56 @@
+/* cidr.h - Path-compressed binary trie of address prefixes
+ * Copyright 2026 srvx Development Team
+ *
+ * This file is part of srvx.
+ *
+ * srvx is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with srvx; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+ */
+
+#ifndef CIDR_H
+#define CIDR_H
+
+#include "common.h"
+
+/* Several entries may share one prefix; the tree does not own them. */
+struct cidr_node {
+    irc_in_addr_t addr;
+    unsigned char bits;
+    unsigned int used, size;
+    void **data;
+    struct cidr_node *child[2];
+};
+
+struct cidr_tree {
+    struct cidr_node *root;
+    unsigned int count;
+};
+
+/* Return non-zero to stop the walk. */
+typedef int (*cidr_walk_f)(void *data, void *extra);
+
+void cidr_tree_init(struct cidr_tree *tree);
+void cidr_tree_clean(struct cidr_tree *tree);
+void cidr_tree_insert(struct cidr_tree *tree, const irc_in_addr_t *addr, unsigned char bits, void *data);
+int cidr_tree_remove(struct cidr_tree *tree, const irc_in_addr_t *addr, unsigned char bits, void *data);
+/* Visits every entry whose prefix covers addr, shortest prefix first. */
+void *cidr_tree_walk(const struct cidr_tree *tree, const irc_in_addr_t *addr, cidr_walk_f func, void *extra);
+/* Returns an entry with the longest prefix covering addr, or NULL. */
+void *cidr_tree_longest(const struct cidr_tree *tree, const irc_in_addr_t *addr);
+/* Visits every entry in the tree, stopping like cidr_tree_walk(). */
+void *cidr_tree_foreach(const struct cidr_tree *tree, cidr_walk_f func, void *extra);
+/* Visits every entry whose prefix lies within addr/bits. */
+void *cidr_tree_foreach_within(const struct cidr_tree *tree, const irc_in_addr_t *addr, unsigned char bits, cidr_walk_f func, void *extra);
+
+#endif /* !defined(CIDR_H) */
@@ -177,6 +177,45 @@ int match_ircglob(const char *text, const char *glob);
 #define MATCH_VISIBLE 2
 int user_matches_glob(struct userNode *user, const char *glob, int flags);
 
+/* Strings derived from a user are built on first use and kept in the
+ * userNode.  user_hidden_host() returns NULL when the user has no
+ * account host; call user_forms_invalidate() when the user's account
+ * (or its name) changes, and user_forms_invalidate_all() when the
+ * hidden host suffix does. */
+const char *user_ip_text(struct userNode *user);
+const char *user_hidden_host(struct userNode *user);
+void user_forms_invalidate(struct userNode *user);
+void user_forms_invalidate_all(void);
+
+/* A glob analysed once for repeated matching; see compiled_glob_init(). */
+#define GLOB_GENERAL 0
+#define GLOB_ANY     1
+#define GLOB_LITERAL 2
+#define GLOB_PREFIX  3
+#define GLOB_SUFFIX  4
+struct compiled_glob {
+    const char *glob; /* not owned */
+    unsigned char type;
+    unsigned char tail_len;
+    unsigned short lit_len;
+    unsigned short min_len;
+    char tail[16]; /* lowercased end of the trailing literal */
+};
+void compiled_glob_init(struct compiled_glob *cg, const char *glob);
+int compiled_glob_match(const struct compiled_glob *cg, const char *text);
+
+struct compiled_mask {
+    char *mask;
+    struct compiled_glob full, nick, ident, host;
+    irc_in_addr_t ip;
+    unsigned char ip_bits;
+    unsigned char has_ip;
+    unsigned char flags;
+};
+struct compiled_mask *compiled_mask_new(const char *mask, int flags);
+void compiled_mask_free(struct compiled_mask *cm);
+int user_matches_compiled(struct userNode *user, const struct compiled_mask *cm, int flags);
+
 int is_ircmask(const char *text);
 int is_gline(const char *text);
 
@@ -191,6 +230,12 @@ unsigned long ParseVolume(const char *volume);
  */
 const char *cryptpass(const char *pass, char buffer[]);
 int checkpass(const char *pass, const char *crypt);
+/* The same, but hashing on the ioset worker pool; func gets the new
+ * hash (or whether pass matched) later, from the main loop. */
+typedef void (*cryptpass_func_t)(void *data, const char *crypted);
+typedef void (*checkpass_func_t)(void *data, int matched);
+void cryptpass_async(const char *pass, cryptpass_func_t func, void *data);
+void checkpass_async(const char *pass, const char *crypted, checkpass_func_t func, void *data);
 
 int split_ircmask(char *text, char **nick, char **ident, char **host);
 char *unsplit_string(char *set[], unsigned int max, char *dest);
@@ -257,6 +302,14 @@ int ircncasecmp(const char *stra, const char *strb, unsigned int len);
 const char *irccasestr(const char *haystack, const char *needle);
 char *ircstrlower(char *str);
 
+/* Finds any of a fixed set of words (case-insensitively) in a single
+ * pass over the text; see string_matcher_new(). */
+struct string_list;
+struct string_matcher;
+struct string_matcher *string_matcher_new(const struct string_list *words);
+void string_matcher_free(struct string_matcher *sm);
+int string_matcher_find(const struct string_matcher *sm, const char *text);
+
 DECLARE_LIST(string_buffer, char);
 void string_buffer_append_string(struct string_buffer *buf, const char *tail);
 void string_buffer_append_substring(struct string_buffer *buf, const char *tail, unsigned int len);
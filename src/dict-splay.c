@@ -277,6 +277,22 @@ dict_find(dict_t dict, const char *key, int *found)
     return was_found ? dict->root->data : NULL;
 }
 
+/*
+ *    Find the first node whose key is not less than key.  Splaying
+ *    leaves a neighbour of key at the root if key itself is absent.
+ */
+dict_iterator_t
+dict_lower_bound(dict_t dict, const char *key)
+{
+    if (!dict || !dict->root || !key)
+        return NULL;
+    verify(dict);
+    dict->root = dict_splay(dict->root, key);
+    if (irccasecmp(key, dict->root->key) > 0)
+        return dict->root->next;
+    return dict->root;
+}
+
 /*
  *    Delete an entire dictionary.
  */
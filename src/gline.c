@@ -18,6 +18,7 @@
  * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
  */
 
+#include "cidr.h"
 #include "heap.h"
 #include "helpfile.h"
 #include "log.h"
@@ -48,6 +49,185 @@
 static heap_t gline_heap; /* key: expiry time, data: struct gline_entry* */
 static dict_t gline_dict; /* key: target, data: struct gline_entry* */
 
+/* G-lines are also indexed so that neither a user nor a wildcard
+ * target has to be compared against all of them:
+ *   - gline_cidrs holds every user@host G-line whose host is an
+ *     address mask;
+ *   - gline_labels is a trie, keyed by host name labels from the
+ *     right, of G-lines whose host ends in a literal containing a '.'
+ *     (a G-line for *@*.isp.example sits under example, then isp);
+ *   - gline_ip_text holds address masks with no such literal, which
+ *     only textual searches need;
+ *   - gline_residual holds everything else.
+ */
+DECLARE_LIST(glineList, struct gline *);
+DEFINE_LIST(glineList, struct gline *)
+
+struct gline_label {
+    dict_t children; /* key: label, data: struct gline_label* */
+    struct glineList glines;
+};
+
+static struct cidr_tree gline_cidrs;
+static struct gline_label *gline_labels;
+static struct glineList gline_ip_text;
+static struct glineList gline_residual;
+
+typedef int (*gline_test_func)(struct gline *gline, void *extra);
+
+static void
+gline_label_free(void *data)
+{
+    struct gline_label *node = data;
+
+    dict_delete(node->children);
+    glineList_clean(&node->glines);
+    free(node);
+}
+
+static struct gline_label *
+gline_label_new(void)
+{
+    struct gline_label *node;
+
+    node = calloc(1, sizeof(*node));
+    node->children = dict_new();
+    dict_set_free_keys(node->children, free);
+    dict_set_free_data(node->children, gline_label_free);
+    glineList_init(&node->glines);
+    return node;
+}
+
+/* Returns the dotted name whose labels locate gline in gline_labels,
+ * or NULL if it does not belong there. */
+static const char *
+gline_label_path(struct gline *gline)
+{
+    const char *host, *tail;
+
+    if (!gline->compiled)
+        return NULL;
+    host = gline->compiled->host.glob;
+    if (strchr(host, '\\'))
+        return NULL;
+    if (!host[strcspn(host, "*?")])
+        return host;
+    for (tail = host + strlen(host); (tail[-1] != '*') && (tail[-1] != '?'); tail--) ;
+    if (!(tail = strchr(tail, '.')))
+        return NULL;
+    return tail + 1;
+}
+
+/* Copy the label of name that ends at end into label[], returning
+ * where the label starts. */
+static const char *
+gline_label_prev(const char *name, const char *end, char label[])
+{
+    const char *start;
+
+    for (start = end; (start > name) && (start[-1] != '.'); start--) ;
+    if ((unsigned int)(end - start) > HOSTLEN)
+        end = start + HOSTLEN;
+    memcpy(label, start, end - start);
+    label[end - start] = '\0';
+    return start;
+}
+
+static void
+gline_label_insert(struct gline *gline, const char *path)
+{
+    struct gline_label *node, *child;
+    const char *end;
+    char label[HOSTLEN + 1];
+
+    node = gline_labels;
+    end = path + strlen(path);
+    while (end > path) {
+        end = gline_label_prev(path, end, label);
+        if (!(child = dict_find(node->children, label, NULL))) {
+            child = gline_label_new();
+            dict_insert(node->children, strdup(label), child);
+        }
+        node = child;
+        if (end > path)
+            end--;
+    }
+    glineList_append(&node->glines, gline);
+}
+
+/* Returns non-zero if node is left empty. */
+static int
+gline_label_delete(struct gline_label *node, struct gline *gline, const char *path, const char *end)
+{
+    struct gline_label *child;
+    char label[HOSTLEN + 1];
+    const char *start;
+
+    if (end == path)
+        glineList_remove(&node->glines, gline);
+    else {
+        start = gline_label_prev(path, end, label);
+        if ((child = dict_find(node->children, label, NULL))
+            && gline_label_delete(child, gline, path, (start > path) ? start - 1 : start))
+            dict_remove(node->children, label);
+    }
+    return !node->glines.used && !dict_size(node->children);
+}
+
+static struct gline *
+gline_label_walk(const char *name, gline_test_func test, void *extra)
+{
+    struct gline_label *node;
+    const char *end;
+    char label[HOSTLEN + 1];
+    unsigned int ii;
+
+    node = gline_labels;
+    end = name + strlen(name);
+    while (node) {
+        for (ii = 0; ii < node->glines.used; ii++)
+            if (test(node->glines.list[ii], extra))
+                return node->glines.list[ii];
+        if (end == name)
+            break;
+        end = gline_label_prev(name, end, label);
+        node = dict_find(node->children, label, NULL);
+        if (end > name)
+            end--;
+    }
+    return NULL;
+}
+
+static void
+gline_index_add(struct gline *gline)
+{
+    const char *path;
+
+    if (gline->compiled && gline->compiled->has_ip)
+        cidr_tree_insert(&gline_cidrs, &gline->compiled->ip, gline->compiled->ip_bits, gline);
+    if ((path = gline_label_path(gline)))
+        gline_label_insert(gline, path);
+    else if (gline->compiled && gline->compiled->has_ip)
+        glineList_append(&gline_ip_text, gline);
+    else
+        glineList_append(&gline_residual, gline);
+}
+
+static void
+gline_index_remove(struct gline *gline)
+{
+    const char *path;
+
+    if (gline->compiled && gline->compiled->has_ip)
+        cidr_tree_remove(&gline_cidrs, &gline->compiled->ip, gline->compiled->ip_bits, gline);
+    if ((path = gline_label_path(gline)))
+        gline_label_delete(gline_labels, gline, path, path + strlen(path));
+    else if (gline->compiled && gline->compiled->has_ip)
+        glineList_remove(&gline_ip_text, gline);
+    else
+        glineList_remove(&gline_residual, gline);
+}
+
 static int
 gline_comparator(const void *a, const void *b)
 {
@@ -59,9 +239,12 @@ static void
 free_gline_from_dict(void *data)
 {
     struct gline *ent = data;
+    gline_index_remove(ent);
     free(ent->issuer);
     free(ent->target);
     free(ent->reason);
+    if (ent->compiled)
+        compiled_mask_free(ent->compiled);
     free(ent);
 }
 
@@ -143,10 +326,12 @@ gline_add(const char *issuer, const char *target, unsigned long duration, const
         ent->lastmod = lastmod;
         ent->issuer = strdup(issuer);
         ent->target = strdup(target);
+        ent->compiled = compiled_mask_new(ent->target, 0);
         ent->expires = expires;
         ent->lifetime = lifetime;
         ent->reason = strdup(reason);
         dict_insert(gline_dict, ent->target, ent);
+        gline_index_add(ent);
     }
     heap_insert(gline_heap, ent, ent);
     if (!prev_first || (ent->lifetime < prev_first->lifetime)) {
@@ -182,11 +367,39 @@ gline_alternate_target(const char *target)
 #endif
 }
 
+struct gline_search_text {
+    const char *target;
+    struct gline *best;
+};
+
+/* Of the G-lines whose mask matches the text, keep the one that sorts
+ * first, as a walk of gline_dict would find. */
+static int
+gline_test_text(struct gline *gline, void *extra)
+{
+    struct gline_search_text *search = extra;
+
+    if ((!search->best || (irccasecmp(gline->target, search->best->target) < 0))
+        && (gline->compiled ? compiled_glob_match(&gline->compiled->full, search->target) : match_ircglob(search->target, gline->target)))
+        search->best = gline;
+    return 0;
+}
+
+static void
+gline_test_list(struct glineList *list, gline_test_func test, void *extra)
+{
+    unsigned int ii;
+
+    for (ii = 0; ii < list->used; ii++)
+        test(list->list[ii], extra);
+}
+
 struct gline *
 gline_find(const char *target)
 {
+    struct gline_search_text search;
     struct gline *res;
-    dict_iterator_t it;
+    const char *host;
     char *alt_target;
 
     res = dict_find(gline_dict, target, NULL);
@@ -196,12 +409,15 @@ gline_find(const char *target)
     if ((target[0] == '#') || (target[0] == '&'))
         return NULL;
     else if (target[strcspn(target, "*?")]) {
-        /* Wildcard: do an obnoxiously long search. */
-        for (it = dict_first(gline_dict); it; it = iter_next(it)) {
-            res = iter_data(it);
-            if (match_ircglob(target, res->target))
-                return res;
-        }
+        /* Wildcard: test the G-lines whose masks it might match. */
+        search.target = target;
+        search.best = NULL;
+        host = strrchr(target, '@');
+        gline_label_walk(host ? host + 1 : target, gline_test_text, &search);
+        gline_test_list(&gline_ip_text, gline_test_text, &search);
+        gline_test_list(&gline_residual, gline_test_text, &search);
+        if (search.best)
+            return search.best;
     }
     /* See if we can resolve the hostname part of the mask. */
     if ((alt_target = gline_alternate_target(target))) {
@@ -212,6 +428,55 @@ gline_find(const char *target)
     return NULL;
 }
 
+/* Like ircu: the ident must match, and then the address if the G-line
+ * is for an address mask, otherwise the real host name. */
+static int
+gline_covers_user(struct gline *gline, struct userNode *user)
+{
+    struct compiled_mask *cm = gline->compiled;
+
+    if (!cm || (gline->expires <= now) || !compiled_glob_match(&cm->ident, user->ident))
+        return 0;
+    if (cm->has_ip)
+        return irc_check_mask(&user->ip, &cm->ip, cm->ip_bits);
+    return compiled_glob_match(&cm->host, user->hostname);
+}
+
+struct gline_search_user {
+    struct userNode *user;
+    struct gline *best;
+};
+
+static int
+gline_test_user(struct gline *gline, void *extra)
+{
+    struct gline_search_user *search = extra;
+
+    if ((!search->best || (irccasecmp(gline->target, search->best->target) < 0))
+        && gline_covers_user(gline, search->user))
+        search->best = gline;
+    return 0;
+}
+
+static int
+gline_test_user_cidr(void *data, void *extra)
+{
+    return gline_test_user(data, extra);
+}
+
+struct gline *
+gline_match_user(struct userNode *user)
+{
+    struct gline_search_user search;
+
+    search.user = user;
+    search.best = NULL;
+    cidr_tree_walk(&gline_cidrs, &user->ip, gline_test_user_cidr, &search);
+    gline_label_walk(user->hostname, gline_test_user, &search);
+    gline_test_list(&gline_residual, gline_test_user, &search);
+    return search.best;
+}
+
 static int
 gline_refresh_helper(UNUSED_ARG(void *key), void *data, void *extra)
 {
@@ -303,6 +568,10 @@ gline_db_cleanup(void)
 {
     heap_delete(gline_heap);
     dict_delete(gline_dict);
+    gline_label_free(gline_labels);
+    cidr_tree_clean(&gline_cidrs);
+    glineList_clean(&gline_ip_text);
+    glineList_clean(&gline_residual);
 }
 
 void
@@ -311,6 +580,10 @@ gline_init(void)
     gline_heap = heap_new(gline_comparator);
     gline_dict = dict_new();
     dict_set_free_data(gline_dict, free_gline_from_dict);
+    gline_labels = gline_label_new();
+    cidr_tree_init(&gline_cidrs);
+    glineList_init(&gline_ip_text);
+    glineList_init(&gline_residual);
     saxdb_register("gline", gline_saxdb_read, gline_saxdb_write);
     reg_exit_func(gline_db_cleanup);
 }
@@ -399,6 +672,8 @@ gline_discrim_create(struct userNode *user, struct userNode *src, unsigned int a
             goto fail;
         }
     }
+    compiled_glob_init(&discrim->issuer_glob, discrim->issuer_mask);
+    compiled_glob_init(&discrim->reason_glob, discrim->reason_mask);
     return discrim;
   fail:
     free(discrim->alt_target_mask);
@@ -416,8 +691,8 @@ struct gline_search {
 static int
 gline_discrim_match(struct gline *gline, struct gline_discrim *discrim)
 {
-    if ((discrim->issuer_mask && !match_ircglob(gline->issuer, discrim->issuer_mask))
-        || (discrim->reason_mask && !match_ircglob(gline->reason, discrim->reason_mask))
+    if ((discrim->issuer_mask && !compiled_glob_match(&discrim->issuer_glob, gline->issuer))
+        || (discrim->reason_mask && !compiled_glob_match(&discrim->reason_glob, gline->reason))
         || (discrim->target_mask
             && (((discrim->target_mask_type == SUBSET)
                  && !match_ircglobs(discrim->target_mask, gline->target)
@@ -38,6 +38,8 @@ struct gline {
     char *issuer;
     /** user@host mask covered by the G-line. */
     char *target;
+    /** Pre-parsed form of target, or NULL if it is not a user@host mask. */
+    struct compiled_mask *compiled;
     /** What to tell affected users. */
     char *reason;
 };
@@ -49,6 +51,8 @@ struct gline_discrim {
     char *target_mask;
     char *alt_target_mask;
     char *reason_mask;
+    struct compiled_glob issuer_glob;
+    struct compiled_glob reason_glob;
     unsigned long max_issued;
     unsigned long min_expire;
     unsigned long min_lastmod;
@@ -60,6 +64,7 @@ struct gline_discrim {
 void gline_init(void);
 struct gline *gline_add(const char *issuer, const char *target, unsigned long duration, const char *reason, unsigned long issued, unsigned long lastmod, unsigned long lifetime, int announce);
 struct gline *gline_find(const char *target);
+struct gline *gline_match_user(struct userNode *user);
 int gline_remove(const char *target, int announce);
 void gline_refresh_server(struct server *srv);
 void gline_refresh_all(void);
@@ -1,6 +1,7 @@
 #include "hash.h"
 #include "log.h"
 #include "helpfile.h"
+#include "recdb.h"
 
 struct glob_test {
     const char *glob;
@@ -37,12 +38,83 @@ struct glob_test glob_globs[] = {
     { 0, { 0 } }
 };
 
+/* Check that compiled globs agree with match_ircglob() on short
+ * strings drawn from a small alphabet. */
+static void
+check_compiled_globs(void)
+{
+    static const char alphabet[] = "aAb.*?";
+    char glob[8], text[8];
+    struct compiled_glob cg;
+    unsigned int seed, i, j, k, len;
+
+    for (seed = 1, i = 0; i < 20000; i++) {
+        len = (seed = seed * 1103515245 + 12345) >> 16 & 7;
+        for (k = 0; k < len; k++)
+            glob[k] = alphabet[((seed = seed * 1103515245 + 12345) >> 16) % 6];
+        glob[k] = 0;
+        compiled_glob_init(&cg, glob);
+        for (j = 0; j < 20; j++) {
+            len = (seed = seed * 1103515245 + 12345) >> 16 & 7;
+            for (k = 0; k < len; k++)
+                text[k] = alphabet[((seed = seed * 1103515245 + 12345) >> 16) % 4];
+            text[k] = 0;
+            if (!compiled_glob_match(&cg, text) != !match_ircglob(text, glob)) {
+                fprintf(stderr, "compiled glob %s disagrees on %s!\n",
+                        glob, text);
+            }
+        }
+    }
+}
+
+/* Check that string_matcher_find() agrees with irccasestr() on short
+ * word lists and texts drawn from a small alphabet. */
+static void
+check_string_matcher(void)
+{
+    static const char alphabet[] = "aAbB[{c";
+    char buf[4][6], text[12];
+    char *list[4];
+    struct string_list words;
+    struct string_matcher *sm;
+    unsigned int seed, i, j, k, len, found;
+    int hit;
+
+    words.list = list;
+    for (seed = 1, i = 0; i < 5000; i++) {
+        words.used = words.size = ((seed = seed * 1103515245 + 12345) >> 16) % 4 + 1;
+        for (j = 0; j < words.used; j++) {
+            len = ((seed = seed * 1103515245 + 12345) >> 16) % 5 + 1;
+            for (k = 0; k < len; k++)
+                buf[j][k] = alphabet[((seed = seed * 1103515245 + 12345) >> 16) % 7];
+            buf[j][k] = 0;
+            list[j] = buf[j];
+        }
+        sm = string_matcher_new(&words);
+        for (j = 0; j < 20; j++) {
+            len = ((seed = seed * 1103515245 + 12345) >> 16) % 12;
+            for (k = 0; k < len; k++)
+                text[k] = alphabet[((seed = seed * 1103515245 + 12345) >> 16) % 7];
+            text[k] = 0;
+            for (k = found = 0; k < words.used; k++)
+                if (irccasestr(text, list[k]))
+                    found = 1;
+            hit = string_matcher_find(sm, text);
+            if ((hit >= 0) != found || (hit >= 0 && !irccasestr(text, list[hit])))
+                fprintf(stderr, "string matcher disagrees on %s!\n", text);
+        }
+        string_matcher_free(sm);
+    }
+}
+
 int
 main(UNUSED_ARG(int argc), UNUSED_ARG(char *argv[]))
 {
     int i, j;
 
     tools_init();
+    check_compiled_globs();
+    check_string_matcher();
     for (i = 0; glob_yes[i].glob; i++) {
         for (j=0; glob_yes[i].texts[j]; j++) {
             if (!match_ircglob(glob_yes[i].texts[j], glob_yes[i].glob)) {
@@ -25,17 +25,57 @@
 
 struct server *self;
 dict_t channels;
+struct channelList channels_by_size[CHANNEL_SIZE_BUCKETS];
+dict_t channels_by_time;
 dict_t clients;
 dict_t servers;
 unsigned int max_clients, invis_clients;
 unsigned long max_clients_time;
 struct userList curr_opers;
+struct hook_stat_list hook_stats;
 
 static void hash_cleanup(void);
 
+DEFINE_LIST(hook_stat_list, struct hook_stat*)
+
+struct hook_stat *
+hook_stat_register(const char *hook, const char *handler, const char *file)
+{
+    struct hook_stat *stat;
+    const char *slash;
+    char *dot;
+
+    /* Reduce the file name to the module it came from. */
+    if ((slash = strrchr(file, '/')))
+        file = slash + 1;
+    stat = calloc(1, sizeof(*stat) + strlen(file));
+    stat->hook = hook;
+    stat->handler = handler;
+    strcpy(stat->module, file);
+    if ((dot = strrchr(stat->module, '.')))
+        *dot = '\0';
+    if (!hook_stats.list)
+        hook_stat_list_init(&hook_stats);
+    hook_stat_list_append(&hook_stats, stat);
+    return stat;
+}
+
+void
+hook_stat_unregister(struct hook_stat *stat)
+{
+    if (hook_stats.list && hook_stat_list_remove(&hook_stats, stat))
+        free(stat);
+}
+
 void init_structs(void)
 {
+    unsigned int nn;
+
     channels = dict_new();
+    for (nn = 0; nn < CHANNEL_SIZE_BUCKETS; nn++)
+        channelList_init(&channels_by_size[nn]);
+    channels_by_time = dict_new();
+    dict_set_free_keys(channels_by_time, free);
     clients = dict_new();
     servers = dict_new();
     userList_init(&curr_opers);
@@ -55,20 +95,24 @@ int userList_contains(struct userList *list, struct userNode *user)
 }
 
 server_link_func_t *slf_list;
+struct hook_stat **slf_stats;
 unsigned int slf_size = 0, slf_used = 0;
 
 void
-reg_server_link_func(server_link_func_t handler)
+reg_server_link_func_named(server_link_func_t handler, const char *name, const char *file)
 {
     if (slf_used == slf_size) {
         if (slf_size) {
             slf_size <<= 1;
             slf_list = realloc(slf_list, slf_size*sizeof(server_link_func_t));
+            slf_stats = realloc(slf_stats, slf_size*sizeof(slf_stats[0]));
         } else {
             slf_size = 8;
             slf_list = malloc(slf_size*sizeof(server_link_func_t));
+            slf_stats = malloc(slf_size*sizeof(slf_stats[0]));
         }
     }
+    slf_stats[slf_used] = hook_stat_register("server_link", name, file);
     slf_list[slf_used++] = handler;
 }
 
@@ -94,57 +138,69 @@ GetServerH(const char *name)
 }
 
 new_user_func_t *nuf_list;
+struct hook_stat **nuf_stats;
 unsigned int nuf_size = 0, nuf_used = 0;
 
 void
-reg_new_user_func(new_user_func_t handler)
+reg_new_user_func_named(new_user_func_t handler, const char *name, const char *file)
 {
     if (nuf_used == nuf_size) {
         if (nuf_size) {
             nuf_size <<= 1;
             nuf_list = realloc(nuf_list, nuf_size*sizeof(new_user_func_t));
+            nuf_stats = realloc(nuf_stats, nuf_size*sizeof(nuf_stats[0]));
         } else {
             nuf_size = 8;
             nuf_list = malloc(nuf_size*sizeof(new_user_func_t));
+            nuf_stats = malloc(nuf_size*sizeof(nuf_stats[0]));
         }
     }
+    nuf_stats[nuf_used] = hook_stat_register("new_user", name, file);
     nuf_list[nuf_used++] = handler;
 }
 
 static nick_change_func_t *ncf2_list;
+static struct hook_stat **ncf2_stats;
 static unsigned int ncf2_size = 0, ncf2_used = 0;
 
 void
-reg_nick_change_func(nick_change_func_t handler)
+reg_nick_change_func_named(nick_change_func_t handler, const char *name, const char *file)
 {
     if (ncf2_used == ncf2_size) {
         if (ncf2_size) {
             ncf2_size <<= 1;
             ncf2_list = realloc(ncf2_list, ncf2_size*sizeof(nick_change_func_t));
+            ncf2_stats = realloc(ncf2_stats, ncf2_size*sizeof(ncf2_stats[0]));
         } else {
             ncf2_size = 8;
             ncf2_list = malloc(ncf2_size*sizeof(nick_change_func_t));
+            ncf2_stats = malloc(ncf2_size*sizeof(ncf2_stats[0]));
         }
     }
+    ncf2_stats[ncf2_used] = hook_stat_register("nick_change", name, file);
     ncf2_list[ncf2_used++] = handler;
 }
 
 
 del_user_func_t *duf_list;
+struct hook_stat **duf_stats;
 unsigned int duf_size = 0, duf_used = 0;
 
 void
-reg_del_user_func(del_user_func_t handler)
+reg_del_user_func_named(del_user_func_t handler, const char *name, const char *file)
 {
     if (duf_used == duf_size) {
         if (duf_size) {
             duf_size <<= 1;
             duf_list = realloc(duf_list, duf_size*sizeof(del_user_func_t));
+            duf_stats = realloc(duf_stats, duf_size*sizeof(duf_stats[0]));
         } else {
             duf_size = 8;
             duf_list = malloc(duf_size*sizeof(del_user_func_t));
+            duf_stats = malloc(duf_size*sizeof(duf_stats[0]));
         }
     }
+    duf_stats[duf_used] = hook_stat_register("del_user", name, file);
     duf_list[duf_used++] = handler;
 }
 
@@ -156,7 +212,9 @@ unreg_del_user_func(del_user_func_t handler)
         if (duf_list[i] == handler) break;
     }
     if (i == duf_used) return;
+    hook_stat_unregister(duf_stats[i]);
     memmove(duf_list+i, duf_list+i+1, (duf_used-i-1)*sizeof(duf_list[0]));
+    memmove(duf_stats+i, duf_stats+i+1, (duf_used-i-1)*sizeof(duf_stats[0]));
     duf_used--;
 }
 
@@ -211,7 +269,7 @@ NickChange(struct userNode* user, const char *new_nick, int no_announce)
      * confused by the user having disappeared.
      */
     for (nn=0; (nn<ncf2_used) && !user->dead; nn++)
-        ncf2_list[nn](user, old_nick);
+        HOOK_CALL(ncf2_stats[nn], ncf2_list[nn](user, old_nick));
     user->timestamp = now;
     if (IsLocal(user) && !no_announce)
         irc_nick(user, old_nick);
@@ -279,43 +337,121 @@ assign_fakehost(struct userNode *user, const char *host, const char *ident, int
 }
 
 static new_channel_func_t *ncf_list;
+static struct hook_stat **ncf_stats;
 static unsigned int ncf_size = 0, ncf_used = 0;
 
 void
-reg_new_channel_func(new_channel_func_t handler)
+reg_new_channel_func_named(new_channel_func_t handler, const char *name, const char *file)
 {
     if (ncf_used == ncf_size) {
         if (ncf_size) {
             ncf_size <<= 1;
             ncf_list = realloc(ncf_list, ncf_size*sizeof(ncf_list[0]));
+            ncf_stats = realloc(ncf_stats, ncf_size*sizeof(ncf_stats[0]));
         } else {
             ncf_size = 8;
             ncf_list = malloc(ncf_size*sizeof(ncf_list[0]));
+            ncf_stats = malloc(ncf_size*sizeof(ncf_stats[0]));
         }
     }
+    ncf_stats[ncf_used] = hook_stat_register("new_channel", name, file);
     ncf_list[ncf_used++] = handler;
 }
 
 static join_func_t *jf_list;
+static struct hook_stat **jf_stats;
 static unsigned int jf_size = 0, jf_used = 0;
 
 void
-reg_join_func(join_func_t handler)
+reg_join_func_named(join_func_t handler, const char *name, const char *file)
 {
     if (jf_used == jf_size) {
         if (jf_size) {
             jf_size <<= 1;
             jf_list = realloc(jf_list, jf_size*sizeof(join_func_t));
+            jf_stats = realloc(jf_stats, jf_size*sizeof(jf_stats[0]));
         } else {
             jf_size = 8;
             jf_list = malloc(jf_size*sizeof(join_func_t));
+            jf_stats = malloc(jf_size*sizeof(jf_stats[0]));
         }
     }
+    jf_stats[jf_used] = hook_stat_register("join", name, file);
     jf_list[jf_used++] = handler;
 }
 
 int rel_age;
 
+unsigned int
+channel_size_bucket(unsigned int members)
+{
+    unsigned int bucket;
+
+    for (bucket = 0; members && (bucket < CHANNEL_SIZE_BUCKETS - 1); members >>= 1)
+        bucket++;
+    return bucket;
+}
+
+static void
+channel_size_add(struct chanNode *channel)
+{
+    struct channelList *bucket;
+
+    channel->size_bucket = channel_size_bucket(channel->members.used);
+    bucket = &channels_by_size[channel->size_bucket];
+    channel->size_slot = bucket->used;
+    channelList_append(bucket, channel);
+}
+
+static void
+channel_size_del(struct chanNode *channel)
+{
+    struct channelList *bucket;
+    struct chanNode *last;
+
+    bucket = &channels_by_size[channel->size_bucket];
+    last = bucket->list[--bucket->used];
+    bucket->list[channel->size_slot] = last;
+    last->size_slot = channel->size_slot;
+}
+
+static void
+channel_size_update(struct chanNode *channel)
+{
+    if (channel_size_bucket(channel->members.used) != channel->size_bucket) {
+        channel_size_del(channel);
+        channel_size_add(channel);
+    }
+}
+
+static void
+channel_time_add(struct chanNode *channel)
+{
+    char key[MAXLEN];
+
+    snprintf(key, sizeof(key), "%016lx%s", channel->timestamp, channel->name);
+    dict_insert(channels_by_time, strdup(key), channel);
+}
+
+static void
+channel_time_del(struct chanNode *channel)
+{
+    char key[MAXLEN];
+
+    snprintf(key, sizeof(key), "%016lx%s", channel->timestamp, channel->name);
+    dict_remove(channels_by_time, key);
+}
+
+void
+SetChannelTimestamp(struct chanNode *channel, unsigned long timestamp)
+{
+    if (channel->timestamp == timestamp)
+        return;
+    channel_time_del(channel);
+    channel->timestamp = timestamp;
+    channel_time_add(channel);
+}
+
 static void
 wipeout_channel(struct chanNode *cNode, unsigned long new_time, char **modes, unsigned int modec) {
     unsigned int orig_limit;
@@ -338,7 +474,7 @@ wipeout_channel(struct chanNode *cNode, unsigned long new_time, char **modes, un
     strcpy(orig_apass, cNode->apass);
     cNode->modes = 0;
     mod_chanmode(NULL, cNode, modes, modec, 0);
-    cNode->timestamp = new_time;
+    SetChannelTimestamp(cNode, new_time);
 
     /* remove our old ban list, replace it with the new one */
     for (nn=0; nn<cNode->banlist.used; nn++)
@@ -400,6 +536,8 @@ AddChannel(const char *name, unsigned long time_, const char *modes, char *banli
         mod_chanmode(NULL, cNode, argv, nn, MCP_FROM_SERVER);
         dict_insert(channels, cNode->name, cNode);
         cNode->timestamp = time_;
+        channel_time_add(cNode);
+        channel_size_add(cNode);
         rel_age = 1;
     } else if (cNode->timestamp > time_) {
         wipeout_channel(cNode, time_, argv, nn);
@@ -418,7 +556,7 @@ AddChannel(const char *name, unsigned long time_, const char *modes, char *banli
     /* if it's a new or updated channel, make callbacks */
     if (rel_age > 0)
         for (nn=0; nn<ncf_used; nn++)
-            ncf_list[nn](cNode);
+            HOOK_CALL(ncf_stats[nn], ncf_list[nn](cNode));
 
     /* go through list of bans and add each one */
     if (banlist && (rel_age >= 0)) {
@@ -441,20 +579,24 @@ AddChannel(const char *name, unsigned long time_, const char *modes, char *banli
 }
 
 static del_channel_func_t *dcf_list;
+static struct hook_stat **dcf_stats;
 static unsigned int dcf_size = 0, dcf_used = 0;
 
 void
-reg_del_channel_func(del_channel_func_t handler)
+reg_del_channel_func_named(del_channel_func_t handler, const char *name, const char *file)
 {
     if (dcf_used == dcf_size) {
         if (dcf_size) {
             dcf_size <<= 1;
             dcf_list = realloc(dcf_list, dcf_size*sizeof(dcf_list[0]));
+            dcf_stats = realloc(dcf_stats, dcf_size*sizeof(dcf_stats[0]));
         } else {
             dcf_size = 8;
             dcf_list = malloc(dcf_size*sizeof(dcf_list[0]));
+            dcf_stats = malloc(dcf_size*sizeof(dcf_stats[0]));
         }
     }
+    dcf_stats[dcf_used] = hook_stat_register("del_channel", name, file);
     dcf_list[dcf_used++] = handler;
 }
 
@@ -465,6 +607,7 @@ DelChannel(struct chanNode *channel)
 
     verify(channel);
     dict_remove(channels, channel->name);
+    channel_time_del(channel);
 
     if (channel->members.used || channel->locks) {
         log_module(MAIN_LOG, LOG_ERROR, "Warning: deleting channel %s with %d users and %d locks remaining.", channel->name, channel->members.used, channel->locks);
@@ -480,8 +623,9 @@ DelChannel(struct chanNode *channel)
     channel->banlist.used = 0;
 
     for (n=0; n<dcf_used; n++)
-        dcf_list[n](channel);
+        HOOK_CALL(dcf_stats[n], dcf_list[n](channel));
 
+    channel_size_del(channel);
     modeList_clean(&channel->members);
     banList_clean(&channel->banlist);
     free(channel);
@@ -492,6 +636,7 @@ AddChannelUser(struct userNode *user, struct chanNode* channel)
 {
         struct modeNode *mNode;
         unsigned int n;
+        int res;
 
         mNode = GetUserMode(channel, user);
         if (mNode)
@@ -512,6 +657,7 @@ AddChannelUser(struct userNode *user, struct chanNode* channel)
          */
         modeList_append(&channel->members, mNode);
         modeList_append(&user->channels, mNode);
+        channel_size_update(channel);
 
         if (channel->members.used == 1
             && !(channel->modes & MODE_REGISTERED)
@@ -525,7 +671,8 @@ AddChannelUser(struct userNode *user, struct chanNode* channel)
         for (n=0; (n<jf_used) && !user->dead; n++) {
             /* Callbacks return true if they kick or kill the user,
              * and we can continue without removing mNode. */
-            if (jf_list[n](mNode))
+            HOOK_CALL(jf_stats[n], res = jf_list[n](mNode));
+            if (res)
                 return NULL;
         }
 
@@ -560,20 +707,24 @@ modeNode_sort(const void *pa, const void *pb)
 }
 
 static part_func_t *pf_list;
+static struct hook_stat **pf_stats;
 static unsigned int pf_size = 0, pf_used = 0;
 
 void
-reg_part_func(part_func_t handler)
+reg_part_func_named(part_func_t handler, const char *name, const char *file)
 {
     if (pf_used == pf_size) {
         if (pf_size) {
             pf_size <<= 1;
             pf_list = realloc(pf_list, pf_size*sizeof(part_func_t));
+            pf_stats = realloc(pf_stats, pf_size*sizeof(pf_stats[0]));
         } else {
             pf_size = 8;
             pf_list = malloc(pf_size*sizeof(part_func_t));
+            pf_stats = malloc(pf_size*sizeof(pf_stats[0]));
         }
     }
+    pf_stats[pf_used] = hook_stat_register("part", name, file);
     pf_list[pf_used++] = handler;
 }
 
@@ -586,7 +737,9 @@ unreg_part_func(part_func_t handler)
             break;
     if (i == pf_used)
         return;
+    hook_stat_unregister(pf_stats[i]);
     memmove(pf_list+i, pf_list+i+1, (pf_used-i-1)*sizeof(pf_list[0]));
+    memmove(pf_stats+i, pf_stats+i+1, (pf_used-i-1)*sizeof(pf_stats[0]));
     pf_used--;
 }
 
@@ -624,10 +777,11 @@ DelChannelUser(struct userNode* user, struct chanNode* channel, const char *reas
     /* remove modeNode from channel and user */
     modeList_remove(&channel->members, mNode);
     modeList_remove(&user->channels, mNode);
+    channel_size_update(channel);
 
     /* make callbacks */
     for (n=0; n<pf_used; n++)
-        pf_list[n](mNode, reason);
+        HOOK_CALL(pf_stats[n], pf_list[n](mNode, reason));
 
     /* free memory */
     free(mNode);
@@ -655,20 +809,24 @@ KickChannelUser(struct userNode* target, struct chanNode* channel, struct userNo
 }
 
 static kick_func_t *kf_list;
+static struct hook_stat **kf_stats;
 static unsigned int kf_size = 0, kf_used = 0;
 
 void
-reg_kick_func(kick_func_t handler)
+reg_kick_func_named(kick_func_t handler, const char *name, const char *file)
 {
     if (kf_used == kf_size) {
         if (kf_size) {
             kf_size <<= 1;
             kf_list = realloc(kf_list, kf_size*sizeof(kick_func_t));
+            kf_stats = realloc(kf_stats, kf_size*sizeof(kf_stats[0]));
         } else {
             kf_size = 8;
             kf_list = malloc(kf_size*sizeof(kick_func_t));
+            kf_stats = malloc(kf_size*sizeof(kf_stats[0]));
         }
     }
+    kf_stats[kf_used] = hook_stat_register("kick", name, file);
     kf_list[kf_used++] = handler;
 }
 
@@ -686,7 +844,7 @@ ChannelUserKicked(struct userNode* kicker, struct userNode* victim, struct chanN
         mn->idle_since = now;
 
     for (n=0; n<kf_used; n++)
-        kf_list[n](kicker, victim, channel);
+        HOOK_CALL(kf_stats[n], kf_list[n](kicker, victim, channel));
 
     DelChannelUser(victim, channel, 0, 0);
 
@@ -705,20 +863,24 @@ int ChannelBanExists(struct chanNode *channel, const char *ban)
 }
 
 static topic_func_t *tf_list;
+static struct hook_stat **tf_stats;
 static unsigned int tf_size = 0, tf_used = 0;
 
 void
-reg_topic_func(topic_func_t handler)
+reg_topic_func_named(topic_func_t handler, const char *name, const char *file)
 {
     if (tf_used == tf_size) {
         if (tf_size) {
             tf_size <<= 1;
             tf_list = realloc(tf_list, tf_size*sizeof(topic_func_t));
+            tf_stats = realloc(tf_stats, tf_size*sizeof(tf_stats[0]));
         } else {
             tf_size = 8;
             tf_list = malloc(tf_size*sizeof(topic_func_t));
+            tf_stats = malloc(tf_size*sizeof(tf_stats[0]));
         }
     }
+    tf_stats[tf_used] = hook_stat_register("topic", name, file);
     tf_list[tf_used++] = handler;
 }
 
@@ -726,6 +888,7 @@ void
 SetChannelTopic(struct chanNode *channel, struct userNode *user, const char *topic, int announce)
 {
     unsigned int n;
+    int res;
     struct modeNode *mn;
     char old_topic[TOPICLEN+1];
 
@@ -746,13 +909,15 @@ SetChannelTopic(struct chanNode *channel, struct userNode *user, const char *top
          * so don't call the tf_list functions. */
         irc_topic(user, channel, topic);
     } else {
-        for (n=0; n<tf_used; n++)
+        for (n=0; n<tf_used; n++) {
             /* A topic change handler can return non-zero to indicate
              * that it has reverted the topic change, and that further
              * hooks should not be called.
              */
-            if (tf_list[n](user, channel, old_topic))
+            HOOK_CALL(tf_stats[n], res = tf_list[n](user, channel, old_topic));
+            if (res)
                 break;
+        }
     }
 }
 
@@ -802,6 +967,7 @@ static void
 hash_cleanup(void)
 {
     dict_iterator_t it, next;
+    unsigned int nn;
 
     DelServer(self, 0, NULL);
     for (it = dict_first(channels); it; it = next) {
@@ -809,18 +975,34 @@ hash_cleanup(void)
         DelChannel(iter_data(it));
     }
     dict_delete(channels);
+    for (nn = 0; nn < CHANNEL_SIZE_BUCKETS; nn++)
+        channelList_clean(&channels_by_size[nn]);
+    dict_delete(channels_by_time);
     dict_delete(clients);
     dict_delete(servers);
     userList_clean(&curr_opers);
 
     free(slf_list);
+    free(slf_stats);
     free(nuf_list);
+    free(nuf_stats);
     free(ncf2_list);
+    free(ncf2_stats);
     free(duf_list);
+    free(duf_stats);
     free(ncf_list);
+    free(ncf_stats);
     free(jf_list);
+    free(jf_stats);
     free(dcf_list);
+    free(dcf_stats);
     free(pf_list);
+    free(pf_stats);
     free(kf_list);
+    free(kf_stats);
     free(tf_list);
+    free(tf_stats);
+    while (hook_stats.used)
+        free(hook_stats.list[--hook_stats.used]);
+    hook_stat_list_clean(&hook_stats);
 }
@@ -23,6 +23,7 @@
 
 #include "common.h"
 #include "dict.h"
+#include "perf.h"
 #include "policer.h"
 
 #define MODE_CHANOP         0x0001 /* +o USER */
@@ -117,6 +118,11 @@ struct userNode {
     irc_in_addr_t ip;             /* User's IP address */
     long modes;                   /* user flags +isw etc... */
 
+    /* Derived forms, filled in by user_ip_text() and user_hidden_host() */
+    char ip_text[IRC_NTOP_MAX_SIZE];
+    char hidden_host[HOSTLEN + 1];
+    unsigned long hidden_host_gen;
+
     unsigned long   timestamp;    /* Time of last nick change */
     unsigned long   idle_since;   /* Last time user did something on or to a channel */
     struct server   *uplink;      /* Server that user is connected to */
@@ -142,6 +148,8 @@ struct chanNode {
     unsigned long topic_time;
 
     struct modeList members;
+    unsigned int size_bucket; /* which of channels_by_size[] holds this */
+    unsigned int size_slot; /* .. and where in it */
     struct banList banlist;
     struct policer join_policer;
     unsigned int join_flooded : 1;
@@ -205,17 +213,47 @@ struct modeNode* GetUserMode(struct chanNode* channel, struct userNode* user);
 
 int userList_contains(struct userList *list, struct userNode *user);
 
+/* Each registered hook callback gets a hook_stat so that the time
+ * spent in it can be profiled (see OpServ STATS HOOKS).  The reg_*
+ * macros capture the handler's name and the registering file. */
+struct hook_stat {
+    const char *hook;
+    const char *handler;
+    struct perf_stat cost;
+    char module[1];
+};
+DECLARE_LIST(hook_stat_list, struct hook_stat*);
+extern struct hook_stat_list hook_stats;
+struct hook_stat *hook_stat_register(const char *hook, const char *handler, const char *file);
+/* Drops a callback's stat when the callback is unregistered. */
+void hook_stat_unregister(struct hook_stat *stat);
+
+#define HOOK_SOURCE(HANDLER) (HANDLER), #HANDLER, __FILE__
+#define HOOK_CALL(STAT, CALL) do { \
+    if (perf_enabled) { \
+        unsigned long hook_start_ = perf_now(); \
+        CALL; \
+        perf_record(&(STAT)->cost, perf_now() - hook_start_); \
+    } else { \
+        CALL; \
+    } \
+} while (0)
+
 typedef void (*server_link_func_t) (struct server *server);
-void reg_server_link_func(server_link_func_t handler);
+void reg_server_link_func_named(server_link_func_t handler, const char *name, const char *file);
+#define reg_server_link_func(HANDLER) reg_server_link_func_named(HOOK_SOURCE(HANDLER))
 
 typedef void (*new_user_func_t) (struct userNode *user);
-void reg_new_user_func(new_user_func_t handler);
+void reg_new_user_func_named(new_user_func_t handler, const char *name, const char *file);
+#define reg_new_user_func(HANDLER) reg_new_user_func_named(HOOK_SOURCE(HANDLER))
 typedef void (*del_user_func_t) (struct userNode *user, struct userNode *killer, const char *why);
-void reg_del_user_func(del_user_func_t handler);
+void reg_del_user_func_named(del_user_func_t handler, const char *name, const char *file);
+#define reg_del_user_func(HANDLER) reg_del_user_func_named(HOOK_SOURCE(HANDLER))
 void unreg_del_user_func(del_user_func_t handler);
 void ReintroduceUser(struct userNode* user);
 typedef void (*nick_change_func_t)(struct userNode *user, const char *old_nick);
-void reg_nick_change_func(nick_change_func_t handler);
+void reg_nick_change_func_named(nick_change_func_t handler, const char *name, const char *file);
+#define reg_nick_change_func(HANDLER) reg_nick_change_func_named(HOOK_SOURCE(HANDLER))
 void NickChange(struct userNode* user, const char *new_nick, int no_announce);
 
 typedef void (*account_func_t) (struct userNode *user, const char *stamp, unsigned long timestamp, unsigned long serial);
@@ -225,13 +263,28 @@ void StampUser(struct userNode *user, const char *stamp, unsigned long timestamp
 void assign_fakehost(struct userNode *user, const char *host, const char *ident, int force, int announce);
 
 typedef void (*new_channel_func_t) (struct chanNode *chan);
-void reg_new_channel_func(new_channel_func_t handler);
+void reg_new_channel_func_named(new_channel_func_t handler, const char *name, const char *file);
+#define reg_new_channel_func(HANDLER) reg_new_channel_func_named(HOOK_SOURCE(HANDLER))
 typedef int (*join_func_t) (struct modeNode *mNode);
-void reg_join_func(join_func_t handler);
+void reg_join_func_named(join_func_t handler, const char *name, const char *file);
+#define reg_join_func(HANDLER) reg_join_func_named(HOOK_SOURCE(HANDLER))
 typedef void (*del_channel_func_t) (struct chanNode *chan);
-void reg_del_channel_func(del_channel_func_t handler);
+void reg_del_channel_func_named(del_channel_func_t handler, const char *name, const char *file);
+#define reg_del_channel_func(HANDLER) reg_del_channel_func_named(HOOK_SOURCE(HANDLER))
+
+/* Secondary channel indexes, kept up to date by the functions below.
+ * channels_by_size[0] holds empty channels, and channels_by_size[N]
+ * those with 2^(N-1) to 2^N - 1 members; the last bucket also holds
+ * anything larger.  channels_by_time is keyed by the channel's
+ * timestamp as 16 hex digits followed by its name, so it iterates in
+ * timestamp order. */
+#define CHANNEL_SIZE_BUCKETS 16
+extern struct channelList channels_by_size[CHANNEL_SIZE_BUCKETS];
+extern dict_t channels_by_time;
+unsigned int channel_size_bucket(unsigned int members);
 
 struct chanNode* AddChannel(const char *name, unsigned long time_, const char *modes, char *banlist);
+void SetChannelTimestamp(struct chanNode *channel, unsigned long timestamp);
 void LockChannel(struct chanNode *channel);
 void UnlockChannel(struct chanNode *channel);
 
@@ -239,19 +292,22 @@ struct modeNode* AddChannelUser(struct userNode* user, struct chanNode* channel)
 
 int modeNode_sort(const void *pa, const void *pb);
 typedef void (*part_func_t) (struct modeNode *mn, const char *reason);
-void reg_part_func(part_func_t handler);
+void reg_part_func_named(part_func_t handler, const char *name, const char *file);
+#define reg_part_func(HANDLER) reg_part_func_named(HOOK_SOURCE(HANDLER))
 void unreg_part_func(part_func_t handler);
 void DelChannelUser(struct userNode* user, struct chanNode* channel, const char *reason, int deleting);
 void KickChannelUser(struct userNode* target, struct chanNode* channel, struct userNode *kicker, const char *why);
 
 typedef void (*kick_func_t) (struct userNode *kicker, struct userNode *user, struct chanNode *chan);
-void reg_kick_func(kick_func_t handler);
+void reg_kick_func_named(kick_func_t handler, const char *name, const char *file);
+#define reg_kick_func(HANDLER) reg_kick_func_named(HOOK_SOURCE(HANDLER))
 void ChannelUserKicked(struct userNode* kicker, struct userNode* victim, struct chanNode* channel);
 
 int ChannelBanExists(struct chanNode *channel, const char *ban);
 
 typedef int (*topic_func_t)(struct userNode *who, struct chanNode *chan, const char *old_topic);
-void reg_topic_func(topic_func_t handler);
+void reg_topic_func_named(topic_func_t handler, const char *name, const char *file);
+#define reg_topic_func(HANDLER) reg_topic_func_named(HOOK_SOURCE(HANDLER))
 void SetChannelTopic(struct chanNode *channel, struct userNode *user, const char *topic, int announce);
 
 void init_structs(void);
@@ -44,6 +44,7 @@ static const struct message_entry msgtab[] = {
 extern struct userNode *global, *chanserv, *opserv, *nickserv;
 struct userNode *message_dest;
 struct userNode *message_source;
+unsigned long message_bytes_sent;
 struct language *lang_C;
 struct dict *languages;
 
@@ -355,6 +356,7 @@ table_send(struct userNode *from, const char *to, unsigned int size, irc_send_fu
         }
         line[pos] = 0;
         irc_send(from, to, line);
+        message_bytes_sent += pos;
         ii = 1;
     }
     /* Send the table. */
@@ -371,6 +373,7 @@ table_send(struct userNode *from, const char *to, unsigned int size, irc_send_fu
                 if ((reps == nreps) || (ii == table.length)) {
                     line[pos] = 0;
                     irc_send(from, to, line);
+                    message_bytes_sent += pos;
                     pos = reps = 0;
                     break;
                 }
@@ -546,6 +549,7 @@ vsend_message(const char *dest, struct userNode *src, struct handle_info *handle
         irc_send(src, dest, line); \
     } \
     chars_sent += pos; \
+    message_bytes_sent += pos; \
     pos = 0; \
     newline_ipos = ipos; \
     if (!(msg_type & MSG_TYPE_MULTILINE)) return chars_sent; \
@@ -28,6 +28,7 @@ struct handle_info;
 struct string_list;
 
 extern struct userNode *message_dest; /* message destination; useful in expansion callbacks */
+extern unsigned long message_bytes_sent; /* running total of text sent by send_message() and friends */
 
 #define MIN_LINE_SIZE       40
 #define MAX_LINE_SIZE       450
@@ -20,9 +20,11 @@
 
 #include "ioset-impl.h"
 #include "log.h"
+#include "modcmd.h"
 #include "timeq.h"
 #include "saxdb.h"
 #include "conf.h"
+#include "perf.h"
 
 #ifdef HAVE_FCNTL_H
 #include <fcntl.h>
@@ -30,6 +32,13 @@
 #ifdef HAVE_SYS_SOCKET_H
 #include <sys/socket.h>
 #endif
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_PTHREAD_CREATE)
+#include <pthread.h>
+#define WITH_IOSET_WORKERS 1
+#endif
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
 
 #ifdef WITH_IOSET_WIN32
 
@@ -86,8 +95,13 @@ extern int uplink_connect(void);
 int clock_skew;
 int do_write_dbs;
 int do_reopen;
+int do_dump_events;
 static struct io_engine *engine;
 static struct io_fd *active_fd;
+/* Time spent (and descriptors handled) in ioset_events() during the
+ * current loop iteration, for the stall detector. */
+static unsigned long loop_busy;
+static unsigned int loop_events;
 
 static void
 ioq_init(struct ioq *ioq, int size) {
@@ -169,8 +183,225 @@ ioset_init(void)
     log_module(MAIN_LOG, LOG_DEBUG, "Using %s I/O engine.", engine->name);
 }
 
+/* Worker pool.  Jobs are handed to the workers through work_queue;
+ * finished jobs go on done_queue, and the workers poke work_wake (an
+ * eventfd, or a pipe where there is none) so the main loop wakes up
+ * and runs their done callbacks.  work_pending counts jobs whose done
+ * callback has not run yet, and is only touched by the main thread. */
+#if WITH_IOSET_WORKERS
+
+#define IOSET_MAX_WORKERS 16
+
+struct ioset_job {
+    ioset_work_func_t work;
+    ioset_work_func_t done;
+    void *data;
+    struct ioset_job *next;
+};
+
+static pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static struct ioset_job *work_queue, **work_tail = &work_queue;
+static struct ioset_job *done_queue, **done_tail = &done_queue;
+static pthread_t workers[IOSET_MAX_WORKERS];
+static unsigned int workers_used;
+static int workers_stopping;
+static int work_wake_write = -1;
+static struct io_fd *work_wake;
+static unsigned int work_pending;
+
+static void *
+ioset_worker(UNUSED_ARG(void *arg))
+{
+    struct ioset_job *job;
+    static const uint64_t one = 1;
+    int res;
+
+    pthread_mutex_lock(&work_lock);
+    for (;;) {
+        while (!work_queue && !workers_stopping)
+            pthread_cond_wait(&work_cond, &work_lock);
+        if (!(job = work_queue))
+            break;
+        if (!(work_queue = job->next))
+            work_tail = &work_queue;
+        pthread_mutex_unlock(&work_lock);
+
+        job->work(job->data);
+
+        pthread_mutex_lock(&work_lock);
+        job->next = NULL;
+        *done_tail = job;
+        done_tail = &job->next;
+        pthread_cond_signal(&done_cond);
+        if (done_queue == job) {
+            /* An eventfd wants eight bytes; a pipe takes any of them. */
+            res = write(work_wake_write, &one, sizeof(one));
+            (void)res;
+        }
+    }
+    pthread_mutex_unlock(&work_lock);
+    return NULL;
+}
+
+/* Runs the done callbacks for every finished job. */
+static void
+ioset_work_deliver(void)
+{
+    struct ioset_job *job, *next;
+
+    pthread_mutex_lock(&work_lock);
+    job = done_queue;
+    done_queue = NULL;
+    done_tail = &done_queue;
+    pthread_mutex_unlock(&work_lock);
+    for (; job; job = next) {
+        next = job->next;
+        job->done(job->data);
+        free(job);
+        work_pending--;
+    }
+}
+
+static void
+ioset_work_readable(struct io_fd *fd)
+{
+    char buf[64];
+
+    while (read(fd->fd, buf, sizeof(buf)) > 0) ;
+    ioset_work_deliver();
+}
+
+static int
+ioset_work_start(void)
+{
+    const char *str;
+    unsigned int count;
+    sigset_t all, old;
+    int fds[2];
+
+    str = conf_get_data("server/worker_threads", RECDB_QSTRING);
+    count = str ? strtoul(str, NULL, 0) : 2;
+    if (count > IOSET_MAX_WORKERS)
+        count = IOSET_MAX_WORKERS;
+    if (!count)
+        return 0;
+#ifdef HAVE_SYS_EVENTFD_H
+    fds[0] = fds[1] = eventfd(0, 0);
+#else
+    fds[0] = -1;
+#endif
+    if ((fds[0] < 0) && (pipe(fds) < 0)) {
+        log_module(MAIN_LOG, LOG_ERROR, "Unable to create worker wakeup descriptor: %s", strerror(errno));
+        return 0;
+    }
+    if (!(work_wake = ioset_add(fds[0]))) {
+        close(fds[0]);
+        if (fds[1] != fds[0])
+            close(fds[1]);
+        return 0;
+    }
+    if (fds[1] != fds[0])
+        fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+    work_wake_write = fds[1];
+    work_wake->state = IO_CONNECTED;
+    work_wake->readable_cb = ioset_work_readable;
+    engine->update(work_wake);
+    workers_stopping = 0;
+    /* Workers inherit this mask, so signals only reach the main thread. */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    while (workers_used < count && !pthread_create(&workers[workers_used], NULL, ioset_worker, NULL))
+        workers_used++;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (!workers_used)
+        log_module(MAIN_LOG, LOG_ERROR, "Unable to start worker threads; running jobs inline.");
+    return workers_used;
+}
+
+void
+ioset_work(ioset_work_func_t work, ioset_work_func_t done, void *data)
+{
+    struct ioset_job *job;
+
+    if (!workers_used && (work_wake || !ioset_work_start())) {
+        work(data);
+        done(data);
+        return;
+    }
+    job = malloc(sizeof(*job));
+    job->work = work;
+    job->done = done;
+    job->data = data;
+    job->next = NULL;
+    work_pending++;
+    pthread_mutex_lock(&work_lock);
+    *work_tail = job;
+    work_tail = &job->next;
+    pthread_cond_signal(&work_cond);
+    pthread_mutex_unlock(&work_lock);
+}
+
+void
+ioset_work_wait(void)
+{
+    while (work_pending) {
+        pthread_mutex_lock(&work_lock);
+        while (!done_queue)
+            pthread_cond_wait(&done_cond, &work_lock);
+        pthread_mutex_unlock(&work_lock);
+        ioset_work_deliver();
+    }
+}
+
+/* Lets the workers finish what is queued, then delivers the results. */
+static void
+ioset_work_cleanup(void)
+{
+    unsigned int ii;
+
+    pthread_mutex_lock(&work_lock);
+    workers_stopping = 1;
+    pthread_cond_broadcast(&work_cond);
+    pthread_mutex_unlock(&work_lock);
+    for (ii = 0; ii < workers_used; ii++)
+        pthread_join(workers[ii], NULL);
+    workers_used = 0;
+    ioset_work_deliver();
+    if (work_wake) {
+        if (work_wake_write != work_wake->fd)
+            close(work_wake_write);
+        ioset_close(work_wake, 1);
+        work_wake = NULL;
+        work_wake_write = -1;
+    }
+}
+
+#else /* !WITH_IOSET_WORKERS */
+
+void
+ioset_work(ioset_work_func_t work, ioset_work_func_t done, void *data)
+{
+    work(data);
+    done(data);
+}
+
+void
+ioset_work_wait(void)
+{
+}
+
+static void
+ioset_work_cleanup(void)
+{
+}
+
+#endif /* WITH_IOSET_WORKERS */
+
 void
 ioset_cleanup(void) {
+    ioset_work_cleanup();
     engine->cleanup();
 }
 
@@ -530,8 +761,11 @@ ioset_line_read(struct io_fd *fd, char *dest, int max) {
 void
 ioset_events(struct io_fd *fd, int readable, int writable)
 {
+    unsigned long start;
+
     if (!fd || (!readable && !writable))
         return;
+    start = perf_stall_threshold ? perf_now() : 0;
     active_fd = fd;
     switch (fd->state) {
     case IO_CLOSED:
@@ -574,13 +808,18 @@ ioset_events(struct io_fd *fd, int readable, int writable)
             ioset_try_write(fd);
         break;
     }
+    if (start) {
+        loop_busy += perf_now() - start;
+        loop_events++;
+    }
 }
 
 void
 ioset_run(void) {
     extern struct io_fd *socket_io_fd;
     struct timeval timeout;
-    unsigned long wakey;
+    unsigned long wakey, start, elapsed;
+    char label[PERF_EVENT_LABEL];
 
     while (!quit_services) {
         while (!socket_io_fd)
@@ -588,19 +827,25 @@ ioset_run(void) {
 
         /* How long to sleep? (fill in select_timeout) */
         wakey = timeq_next();
-        if (wakey < now)
+        if (wakey < now || svccmd_cursors_ready())
             timeout.tv_sec = 0;
         else
             timeout.tv_sec = wakey - now;
         timeout.tv_usec = 0;
 
+        loop_busy = loop_events = 0;
         if (engine->loop(&timeout))
             continue;
 
         /* Call any timeq events we need to call. */
+        start = perf_stall_threshold ? perf_now() : 0;
         timeq_run();
+        svccmd_cursors_run();
         if (do_write_dbs) {
+            unsigned long db_start = start ? perf_now() : 0;
             saxdb_write_all();
+            if (db_start)
+                perf_event_record(PERF_EVENT_SAXDB, perf_now() - db_start, "saxdb_write_all");
             do_write_dbs = 0;
         }
         if (do_reopen) {
@@ -608,6 +853,16 @@ ioset_run(void) {
             conf_read(services_config);
             do_reopen = 0;
         }
+        if (start) {
+            /* Only count time spent working, not waiting in the engine. */
+            elapsed = loop_busy + perf_now() - start;
+            snprintf(label, sizeof(label), "iteration (%u fd events)", loop_events);
+            perf_event_record(PERF_EVENT_LOOP, elapsed, label);
+        }
+        if (do_dump_events) {
+            perf_event_dump();
+            do_dump_events = 0;
+        }
     }
 }
 
@@ -630,6 +885,11 @@ ioset_write(struct io_fd *fd, const char *buf, unsigned int nbw) {
     engine->update(fd);
 }
 
+unsigned int
+ioset_queued(const struct io_fd *fd) {
+    return ioq_used(&fd->send);
+}
+
 int
 ioset_printf(struct io_fd *fd, const char *fmt, ...) {
     char tmpbuf[MAXLEN];
@@ -46,6 +46,7 @@ struct io_fd {
 };
 extern int do_write_dbs;
 extern int do_reopen;
+extern int do_dump_events;
 
 void ioset_init(void);
 struct io_fd *ioset_add(int fd);
@@ -54,10 +55,21 @@ struct io_fd *ioset_connect(struct sockaddr *local, unsigned int sa_size, const
 void ioset_update(struct io_fd *fd);
 void ioset_run(void);
 void ioset_write(struct io_fd *fd, const char *buf, unsigned int nbw);
+unsigned int ioset_queued(const struct io_fd *fd);
 int ioset_printf(struct io_fd *fd, const char *fmt, ...) PRINTF_LIKE(2, 3);
 int ioset_line_read(struct io_fd *fd, char *buf, int maxlen);
 void ioset_close(struct io_fd *fd, int os_close);
 void ioset_cleanup(void);
 void ioset_set_time(unsigned long new_now);
 
+/* Runs work(data) on a worker thread, then done(data) from the main
+ * loop.  work must not touch anything the main thread might be using.
+ * done is called exactly once for every job, even at shutdown (after
+ * the modules have cleaned up); without worker threads, both run
+ * before ioset_work() returns. */
+typedef void (*ioset_work_func_t)(void *data);
+void ioset_work(ioset_work_func_t work, ioset_work_func_t done, void *data);
+/* Blocks until every job so far is done; for the replay loop. */
+void ioset_work_wait(void);
+
 #endif /* !defined(IOSET_H) */
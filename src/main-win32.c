@@ -5,6 +5,7 @@
 #include "modcmd.h"
 #include "saxdb.h"
 #include "mail.h"
+#include "perf.h"
 #include "timeq.h"
 
 #include "chanserv.h"
@@ -119,6 +120,7 @@ int APIENTRY WinMain(HINSTANCE hInst, HINSTANCE hPrevInst, LPSTR lpCmdLine, int
     if (debug)
         log_debug();
     ioset_init();
+    perf_init();
     init_structs();
     init_parse();
     modcmd_init();
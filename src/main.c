@@ -26,6 +26,7 @@
 #include "modcmd.h"
 #include "saxdb.h"
 #include "mail.h"
+#include "perf.h"
 #include "timeq.h"
 #include "sar.h"
 
@@ -91,6 +92,16 @@ void sigaction_rehash(int x)
     do_reopen = 1;
 }
 
+void sigaction_dumpevents(int x)
+{
+#ifndef HAVE_STRSIGNAL
+    log_module(MAIN_LOG, LOG_INFO, "Signal %d -- dumping flight recorder.", x);
+#else
+    log_module(MAIN_LOG, LOG_INFO, "%s -- dumping flight recorder.", strsignal(x));
+#endif
+    do_dump_events = 1;
+}
+
 #if WITH_MALLOC_BOEHM_GC
 void
 gc_warn_proc(char *msg, GC_word arg)
@@ -130,6 +141,8 @@ int main(int argc, char *argv[])
     sigaction(SIGQUIT, &sv, NULL);
     sv.sa_handler = sigaction_wait;
     sigaction(SIGCHLD, &sv, NULL);
+    sv.sa_handler = sigaction_dumpevents;
+    sigaction(SIGUSR2, &sv, NULL);
 
     if (argc > 1) { /* parse command line, if any */
         int c;
@@ -242,6 +255,7 @@ int main(int argc, char *argv[])
     if (debug)
         log_debug();
     ioset_init();
+    perf_init();
     init_structs();
     init_parse();
     modcmd_init();
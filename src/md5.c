@@ -23,6 +23,7 @@ documentation and/or software.
  */
 
 #include "common.h"
+#include "ioset.h"
 #include "md5.h"
 
 /* Constants for MD5Transform routine.
@@ -455,3 +456,74 @@ checkpass(const char *pass, const char *crypted)
     }
     return !strcmp(crypted, new_crypted);
 }
+
+/* A password hash being computed on the worker pool.  The salt for a
+ * new hash is picked before the job is queued, so rand() is only
+ * ever called from the main thread. */
+struct pass_job {
+    char *pass;
+    char crypted[MD5_CRYPT_LENGTH];
+    int matched;
+    cryptpass_func_t crypt_func;
+    checkpass_func_t check_func;
+    void *data;
+};
+
+static struct pass_job *
+pass_job_new(const char *pass, void *data)
+{
+    struct pass_job *job;
+
+    job = calloc(1, sizeof(*job));
+    job->pass = strdup(pass);
+    job->data = data;
+    return job;
+}
+
+static void
+pass_job_work(void *data)
+{
+    struct pass_job *job = data;
+
+    if (job->check_func)
+        job->matched = checkpass(job->pass, job->crypted);
+    else
+        cryptpass_sha256(job->pass, job->crypted + 1);
+}
+
+static void
+pass_job_done(void *data)
+{
+    struct pass_job *job = data;
+
+    if (job->check_func)
+        job->check_func(job->data, job->matched);
+    else
+        job->crypt_func(job->data, job->crypted);
+    memset(job->pass, 0, strlen(job->pass));
+    free(job->pass);
+    free(job);
+}
+
+void
+cryptpass_async(const char *pass, cryptpass_func_t func, void *data)
+{
+    struct pass_job *job;
+
+    job = pass_job_new(pass, data);
+    job->crypt_func = func;
+    job->crypted[0] = '^';
+    inttoz85(job->crypted + 1, rand());
+    ioset_work(pass_job_work, pass_job_done, job);
+}
+
+void
+checkpass_async(const char *pass, const char *crypted, checkpass_func_t func, void *data)
+{
+    struct pass_job *job;
+
+    job = pass_job_new(pass, data);
+    job->check_func = func;
+    safestrncpy(job->crypted, crypted, sizeof(job->crypted));
+    ioset_work(pass_job_work, pass_job_done, job);
+}
@@ -18,11 +18,23 @@
  * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
  */
 
+#include "cidr.h"
 #include "conf.h"
 #include "gline.h"
 #include "modcmd.h"
 #include "proto.h"
 #include "sar.h"
+#include "timeq.h"
+
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
 
 const char *blacklist_module_deps[] = { NULL };
 
@@ -36,22 +48,169 @@ struct dnsbl_zone {
     char zone[1];
 };
 
+/* DNSBL answers are cached by query name (reversed IP plus zone).
+ * While a query is outstanding, expires is zero and users from the
+ * same address are added to waiters instead of sending another one. */
+struct dnsbl_cache_entry {
+    unsigned long expires;
+    unsigned int mask;
+    char *txt;
+    struct string_list waiters;
+    const char *zone_name;
+    char name[1];
+};
+
 struct dnsbl_data {
-    char client_ip[IRC_NTOP_MAX_SIZE];
-    char zone_name[1];
+    char name[1];
 };
 
+/* The local blacklist file is compiled into an image that is written
+ * to the compiled file and mapped back in on later rehashes, so that
+ * it is only parsed again when it changes.  The image holds, in
+ * native byte order:
+ *   struct blacklist_header
+ *   struct blacklist_ipv4 ipv4[ipv4_count]  (sorted, disjoint ranges)
+ *   struct blacklist_ipv6 ipv6[ipv6_count]  (sorted, disjoint ranges)
+ *   struct blacklist_host hosts[host_count] (sorted by irccasecmp)
+ *   uint32_t reasons[reason_count]          (offsets into strings)
+ *   char strings[strings_size]
+ * reasons[0] is the file_reason it was compiled with.
+ */
+#define BLACKLIST_MAGIC "srvxbl\0\1"
+
+struct blacklist_header {
+    char magic[8];
+    uint32_t source_size;
+    uint32_t source_mtime;
+    uint32_t ipv4_count;
+    uint32_t ipv6_count;
+    uint32_t host_count;
+    uint32_t reason_count;
+    uint32_t strings_size;
+};
+
+struct blacklist_ipv4 {
+    uint32_t first;
+    uint32_t last;
+    uint32_t reason;
+};
+
+struct blacklist_ipv6 {
+    uint8_t first[16];
+    uint8_t last[16];
+    uint32_t reason;
+};
+
+struct blacklist_host {
+    uint32_t name;
+    uint32_t reason;
+};
+
+static struct {
+    char *base;
+    size_t length;
+    int mapped;
+    const struct blacklist_header *header;
+    const struct blacklist_ipv4 *ipv4;
+    const struct blacklist_ipv6 *ipv6;
+    const struct blacklist_host *hosts;
+    const uint32_t *reasons;
+    const char *strings;
+} blacklist_image;
+
 static struct log_type *bl_log;
+static struct module *blacklist_module;
 static dict_t blacklist_zones; /* contains struct dnsbl_zone */
-static dict_t blacklist_hosts; /* maps IPs or hostnames to reasons from blacklist_reasons */
-static dict_t blacklist_reasons; /* maps strings to themselves (poor man's data sharing) */
+static dict_t dnsbl_cache; /* contains struct dnsbl_cache_entry */
+static int dnsbl_sweep_queued;
+
+static struct {
+    unsigned long lookups;
+    unsigned long hits;
+    unsigned long coalesced;
+    unsigned long queries;
+    unsigned long negative;
+    unsigned long failures;
+} dnsbl_stats;
 
 static struct {
     struct userNode *debug_bot;
     struct chanNode *debug_channel;
     unsigned long gline_duration;
+    unsigned long dnsbl_negative_ttl;
+    unsigned long dnsbl_max_ttl;
 } conf;
 
+#define DNSBL_SWEEP_INTERVAL 60
+
+static const struct message_entry msgtab[] = {
+    { "BLMSG_STATS_ZONES", "DNSBL zones: $b%u$b; local blacklist: $b%u$b IPv4 ranges, $b%u$b IPv6 ranges, $b%u$b hosts." },
+    { "BLMSG_STATS_CACHE", "DNSBL cache: $b%u$b entries ($b%u$b pending, $b%u$b listed)." },
+    { "BLMSG_STATS_LOOKUPS", "DNSBL lookups: $b%lu$b; cache hits: $b%lu$b (%lu%%); coalesced: $b%lu$b; queries sent: $b%lu$b." },
+    { "BLMSG_STATS_ANSWERS", "DNSBL negative answers: $b%lu$b; failed queries: $b%lu$b." },
+    { NULL, NULL }
+};
+
+static const char *
+blacklist_find_addr(const irc_in_addr_t *addr)
+{
+    const struct blacklist_ipv4 *v4;
+    const struct blacklist_ipv6 *v6;
+    unsigned int lo, hi, mid;
+    uint32_t ip;
+
+    if (!blacklist_image.header)
+        return NULL;
+    if (irc_in_addr_is_ipv4(*addr)) {
+        ip = ntohl(addr->in6_32[3]);
+        v4 = blacklist_image.ipv4;
+        for (lo = 0, hi = blacklist_image.header->ipv4_count; lo < hi; ) {
+            mid = (lo + hi) / 2;
+            if (ip < v4[mid].first)
+                hi = mid;
+            else if (ip > v4[mid].last)
+                lo = mid + 1;
+            else
+                return blacklist_image.strings + blacklist_image.reasons[v4[mid].reason];
+        }
+    } else {
+        v6 = blacklist_image.ipv6;
+        for (lo = 0, hi = blacklist_image.header->ipv6_count; lo < hi; ) {
+            mid = (lo + hi) / 2;
+            if (memcmp(addr->in6_8, v6[mid].first, 16) < 0)
+                hi = mid;
+            else if (memcmp(addr->in6_8, v6[mid].last, 16) > 0)
+                lo = mid + 1;
+            else
+                return blacklist_image.strings + blacklist_image.reasons[v6[mid].reason];
+        }
+    }
+    return NULL;
+}
+
+static const char *
+blacklist_find_host(const char *host)
+{
+    const struct blacklist_host *hosts;
+    unsigned int lo, hi, mid;
+    int cmp;
+
+    if (!blacklist_image.header)
+        return NULL;
+    hosts = blacklist_image.hosts;
+    for (lo = 0, hi = blacklist_image.header->host_count; lo < hi; ) {
+        mid = (lo + hi) / 2;
+        cmp = irccasecmp(host, blacklist_image.strings + hosts[mid].name);
+        if (cmp < 0)
+            hi = mid;
+        else if (cmp > 0)
+            lo = mid + 1;
+        else
+            return blacklist_image.strings + blacklist_image.reasons[hosts[mid].reason];
+    }
+    return NULL;
+}
+
 #if defined(GCC_VARMACROS)
 # define blacklist_debug(ARGS...) do { if (conf.debug_bot && conf.debug_channel) send_channel_notice(conf.debug_channel, conf.debug_bot, ARGS); } while (0)
 #elif defined(C99_VARMACROS)
@@ -59,27 +218,147 @@ static struct {
 #endif
 
 static void
-dnsbl_hit(struct sar_request *req, struct dns_header *hdr, struct dns_rr *rr, unsigned char *raw, unsigned int raw_size)
+dnsbl_apply(struct dnsbl_zone *zone, unsigned int mask, const char *txt, const char *client_ip)
 {
-    struct dnsbl_data *data;
-    struct dnsbl_zone *zone;
     const char *message;
-    char *txt;
-    unsigned int mask;
-    unsigned int pos;
-    unsigned int len;
     unsigned int ii;
     char reason[MAXLEN];
     char target[IRC_NTOP_MAX_SIZE + 2];
 
+    /* Do we care about one of the masks we found? */
+    if (!(mask & zone->mask))
+        return;
+
+    /* See if a per-result message was provided. */
+    for (ii = 0, message = NULL; mask && (ii < zone->reasons.used); ++ii, mask >>= 1) {
+        if (0 == (mask & 1))
+            continue;
+        if (NULL != (message = zone->reasons.list[ii]))
+            break;
+    }
+
+    /* If not, use a standard fallback. */
+    if (message == NULL) {
+        message = zone->reason;
+        if (message == NULL)
+            message = "client is blacklisted";
+    }
+
+    /* Prepend "AUTO " prefix so the g-lines are put in a different snomask. */
+    strcpy(reason, "AUTO ");
+
+    /* Expand elements of the message as necessary. */
+    do_expandos(reason + 5, sizeof(reason) - 5, message, "%txt%", (txt ? txt : "(no-txt)"), "%ip%", client_ip, NULL);
+
+    if (zone->debug) {
+        blacklist_debug("DNSBL match: [%s] %s (%s)", zone->zone, client_ip, reason);
+    } else {
+        /* Now generate the G-line. */
+        target[0] = '*';
+        target[1] = '@';
+        strcpy(target + 2, client_ip);
+        gline_add(self->name, target, zone->duration, reason, now, now, 0, 1);
+    }
+}
+
+static void
+dnsbl_cache_free(void *pointer)
+{
+    struct dnsbl_cache_entry *entry;
+    unsigned int ii;
+
+    entry = pointer;
+    for (ii = 0; ii < entry->waiters.used; ++ii)
+        free(entry->waiters.list[ii]);
+    free(entry->waiters.list);
+    free(entry->txt);
+    free(entry);
+}
+
+static void
+dnsbl_cache_sweep(UNUSED_ARG(void *data))
+{
+    struct dnsbl_cache_entry *entry;
+    dict_iterator_t it;
+    dict_iterator_t next;
+
+    dnsbl_sweep_queued = 0;
+    for (it = dict_first(dnsbl_cache); it; it = next) {
+        next = iter_next(it);
+        entry = iter_data(it);
+        if (entry->expires && entry->expires <= now)
+            dict_remove(dnsbl_cache, entry->name);
+    }
+    if (dict_size(dnsbl_cache)) {
+        timeq_add(now + DNSBL_SWEEP_INTERVAL, dnsbl_cache_sweep, NULL);
+        dnsbl_sweep_queued = 1;
+    }
+}
+
+/* Record the answer for a pending entry and act on it for every user
+ * who was waiting for it. */
+static void
+dnsbl_cache_answer(struct dnsbl_cache_entry *entry, unsigned int mask, char *txt, unsigned long ttl)
+{
+    struct dnsbl_zone *zone;
+    unsigned int ii;
+
+    if (ttl > conf.dnsbl_max_ttl)
+        ttl = conf.dnsbl_max_ttl;
+    if (!mask && ttl < conf.dnsbl_negative_ttl)
+        ttl = conf.dnsbl_negative_ttl;
+    entry->mask = mask;
+    entry->txt = txt;
+    entry->expires = now + ttl;
+
     /* Get the DNSBL zone (to make sure it has not disappeared in a rehash). */
+    zone = dict_find(blacklist_zones, entry->zone_name, NULL);
+    for (ii = 0; ii < entry->waiters.used; ++ii) {
+        if (zone)
+            dnsbl_apply(zone, mask, txt, entry->waiters.list[ii]);
+        free(entry->waiters.list[ii]);
+    }
+    entry->waiters.used = 0;
+
+    if (!dnsbl_sweep_queued) {
+        timeq_add(now + DNSBL_SWEEP_INTERVAL, dnsbl_cache_sweep, NULL);
+        dnsbl_sweep_queued = 1;
+    }
+}
+
+static struct dnsbl_cache_entry *
+dnsbl_cache_pending(struct sar_request *req)
+{
+    struct dnsbl_cache_entry *entry;
+    struct dnsbl_data *data;
+
+    /* The cache is gone if we are being cleaned up. */
+    if (!dnsbl_cache)
+        return NULL;
     data = (struct dnsbl_data*)(req + 1);
-    zone = dict_find(blacklist_zones, data->zone_name, NULL);
-    if (!zone)
+    entry = dict_find(dnsbl_cache, data->name, NULL);
+    return (entry && !entry->expires) ? entry : NULL;
+}
+
+static void
+dnsbl_hit(struct sar_request *req, struct dns_header *hdr, struct dns_rr *rr, unsigned char *raw, unsigned int raw_size)
+{
+    struct dnsbl_cache_entry *entry;
+    char *txt;
+    char *name;
+    unsigned long ttl;
+    unsigned long minimum;
+    unsigned int mask;
+    unsigned int pos;
+    unsigned int len;
+    unsigned int ii;
+
+    entry = dnsbl_cache_pending(req);
+    if (!entry)
         return;
 
     /* Scan the results. */
-    for (mask = 0, ii = 0, txt = NULL; ii < hdr->ancount; ++ii) {
+    for (mask = 0, ii = 0, txt = NULL, ttl = ULONG_MAX; ii < hdr->ancount; ++ii) {
         pos = rr[ii].rd_start;
         switch (rr[ii].type) {
         case REQ_TYPE_A:
@@ -94,43 +373,105 @@ dnsbl_hit(struct sar_request *req, struct dns_header *hdr, struct dns_rr *rr, un
             memcpy(txt, raw + pos + 1, len);
             txt[len] = '\0';
             break;
+        default:
+            continue;
         }
+        if (rr[ii].ttl < ttl)
+            ttl = rr[ii].ttl;
     }
 
-    /* Do we care about one of the masks we found? */
-    if (mask & zone->mask) {
-        /* See if a per-result message was provided. */
-        for (ii = 0, message = NULL; mask && (ii < zone->reasons.used); ++ii, mask >>= 1) {
-            if (0 == (mask & 1))
+    if (!mask) {
+        /* Per RFC 2308, a negative answer may be cached for the lesser
+         * of the SOA record's TTL and its MINIMUM field. */
+        for (ttl = 0; ii < (unsigned int)hdr->ancount + hdr->nscount; ++ii) {
+            if (rr[ii].type != REQ_TYPE_SOA)
                 continue;
-            if (NULL != (message = zone->reasons.list[ii]))
+            pos = rr[ii].rd_start;
+            if (!(name = sar_extract_name(raw, raw_size, &pos)))
+                break;
+            free(name);
+            if (!(name = sar_extract_name(raw, raw_size, &pos)))
                 break;
+            free(name);
+            if (pos + 20 > raw_size)
+                break;
+            minimum = raw[pos+16] << 24 | raw[pos+17] << 16 | raw[pos+18] << 8 | raw[pos+19];
+            ttl = (rr[ii].ttl < minimum) ? rr[ii].ttl : minimum;
+            break;
         }
+        dnsbl_stats.negative++;
+    }
+    dnsbl_cache_answer(entry, mask, txt, ttl);
+}
 
-        /* If not, use a standard fallback. */
-        if (message == NULL) {
-            message = zone->reason;
-            if (message == NULL)
-                message = "client is blacklisted";
-        }
+static void
+dnsbl_fail(struct sar_request *req, unsigned int rcode)
+{
+    struct dnsbl_cache_entry *entry;
 
-        /* Prepend "AUTO " prefix so the g-lines are put in a different snomask. */
-        strcpy(reason, "AUTO ");
+    entry = dnsbl_cache_pending(req);
+    if (!entry)
+        return;
+    if (rcode == RCODE_NAME_ERROR) {
+        /* NXDOMAIN is the usual "not listed" answer. */
+        dnsbl_stats.negative++;
+        dnsbl_cache_answer(entry, 0, NULL, 0);
+    } else {
+        /* Do not cache anything else; the next user will retry. */
+        log_module(bl_log, LOG_DEBUG, "DNSBL lookup for %s failed: %s", entry->name, sar_rcode_text(rcode));
+        dnsbl_stats.failures++;
+        dict_remove(dnsbl_cache, entry->name);
+    }
+}
 
-        /* Expand elements of the message as necessary. */
-        do_expandos(reason + 5, sizeof(reason) - 5, message, "%txt%", (txt ? txt : "(no-txt)"), "%ip%", data->client_ip, NULL);
+static void
+dnsbl_lookup(const char *name, const char *zone, const char *client_ip)
+{
+    struct dnsbl_cache_entry *entry;
+    struct dnsbl_data *data;
+    struct sar_request *req;
+    struct dnsbl_zone *dz;
 
-        if (zone->debug) {
-            blacklist_debug("DNSBL match: [%s] %s (%s)", zone->zone, data->client_ip, reason);
-        } else {
-            /* Now generate the G-line. */
-            target[0] = '*';
-            target[1] = '@';
-            strcpy(target + 2, data->client_ip);
-            gline_add(self->name, target, zone->duration, reason, now, now, 0, 1);
-        }
+    dnsbl_stats.lookups++;
+    entry = dict_find(dnsbl_cache, name, NULL);
+    if (entry && entry->expires > now) {
+        dnsbl_stats.hits++;
+        if ((dz = dict_find(blacklist_zones, zone, NULL)))
+            dnsbl_apply(dz, entry->mask, entry->txt, client_ip);
+        return;
+    } else if (entry && !entry->expires) {
+        dnsbl_stats.coalesced++;
+        string_list_append(&entry->waiters, strdup(client_ip));
+        return;
+    } else if (entry) {
+        /* Stale; reuse the entry for a fresh query. */
+        free(entry->txt);
+        entry->txt = NULL;
+        entry->expires = 0;
+    } else {
+        entry = calloc(1, sizeof(*entry) + strlen(name));
+        strcpy(entry->name, name);
+        entry->zone_name = entry->name + strlen(name) - strlen(zone);
+        dict_insert(dnsbl_cache, entry->name, entry);
     }
-    free(txt);
+    string_list_append(&entry->waiters, strdup(client_ip));
+
+    /* The entry must exist before the request is sent, since a send
+     * failure calls dnsbl_fail() right away. */
+    dnsbl_stats.queries++;
+    req = sar_request_alloc(sizeof(*data) + strlen(name), dnsbl_hit, dnsbl_fail);
+    if (!req) {
+        dnsbl_stats.failures++;
+        dict_remove(dnsbl_cache, entry->name);
+        return;
+    }
+    data = (struct dnsbl_data*)(req + 1);
+    strcpy(data->name, name);
+    sar_request_build(req, name, REQ_QTYPE_ALL, NULL);
+    /* A listed client stays connected until the answer comes back,
+     * so ask every nameserver rather than wait out a slow one. */
+    req->critical = 1;
+    sar_request_send(req);
 }
 
 static void
@@ -140,9 +481,9 @@ blacklist_check_user(struct userNode *user)
     dict_iterator_t it;
     const char *reason;
     const char *host;
+    const char *ip;
     unsigned int dnsbl_len;
     unsigned int ii;
-    char ip[IRC_NTOP_MAX_SIZE];
     char dnsbl_target[128];
 
     /* Users added during burst should not be checked. */
@@ -153,11 +494,16 @@ blacklist_check_user(struct userNode *user)
     if (!irc_in_addr_is_valid(user->ip))
         return;
 
+    /* Users who are already G-lined need no new one. */
+    if (gline_match_user(user))
+        return;
+
     /* Check local file-based blacklist. */
-    irc_ntop(ip, sizeof(ip), &user->ip);
-    reason = dict_find(blacklist_hosts, host = ip, NULL);
+    ip = user_ip_text(user);
+    reason = blacklist_find_addr(&user->ip);
+    host = ip;
     if (reason == NULL) {
-        reason = dict_find(blacklist_hosts, host = user->hostname, NULL);
+        reason = blacklist_find_host(host = user->hostname);
     }
     if (reason != NULL) {
         char *target;
@@ -184,71 +530,479 @@ blacklist_check_user(struct userNode *user)
         return;
     }
 
-    /* Start a lookup for the appropriate hostname in each DNSBL. */
+    /* Look up (or reuse) the appropriate hostname in each DNSBL. */
     for (it = dict_first(blacklist_zones); it; it = iter_next(it)) {
-        struct dnsbl_data *data;
-        struct sar_request *req;
         const char *zone;
 
         zone = iter_key(it);
-        safestrncpy(dnsbl_target + dnsbl_len, zone, sizeof(dnsbl_target) - dnsbl_len);
-        req = sar_request_simple(sizeof(*data) + strlen(zone), dnsbl_hit, NULL, dnsbl_target, REQ_QTYPE_ALL, NULL);
-        if (req) {
-            data = (struct dnsbl_data*)(req + 1);
-            strcpy(data->client_ip, ip);
-            strcpy(data->zone_name, zone);
+        if (dnsbl_len + strlen(zone) >= sizeof(dnsbl_target))
+            continue;
+        strcpy(dnsbl_target + dnsbl_len, zone);
+        dnsbl_lookup(dnsbl_target, zone, ip);
+    }
+}
+
+static void
+blacklist_image_free(void)
+{
+#ifdef HAVE_MMAP
+    if (blacklist_image.mapped)
+        munmap(blacklist_image.base, blacklist_image.length);
+    else
+#endif
+        free(blacklist_image.base);
+    memset(&blacklist_image, 0, sizeof(blacklist_image));
+}
+
+/* Point blacklist_image at the image in base, if it is well formed. */
+static int
+blacklist_image_set(char *base, size_t length, int mapped)
+{
+    const struct blacklist_header *header;
+    const struct blacklist_host *hosts;
+    const uint32_t *reasons;
+    size_t expected;
+    unsigned int ii;
+
+    header = (const struct blacklist_header*)base;
+    if (length < sizeof(*header) || memcmp(header->magic, BLACKLIST_MAGIC, sizeof(header->magic)))
+        return 0;
+    expected = sizeof(*header)
+        + header->ipv4_count * sizeof(struct blacklist_ipv4)
+        + header->ipv6_count * sizeof(struct blacklist_ipv6)
+        + header->host_count * sizeof(struct blacklist_host)
+        + header->reason_count * sizeof(uint32_t)
+        + header->strings_size;
+    if ((expected != length) || !header->reason_count || !header->strings_size
+        || base[length - 1] != '\0')
+        return 0;
+    blacklist_image_free();
+    blacklist_image.base = base;
+    blacklist_image.length = length;
+    blacklist_image.mapped = mapped;
+    blacklist_image.header = header;
+    blacklist_image.ipv4 = (const struct blacklist_ipv4*)(header + 1);
+    blacklist_image.ipv6 = (const struct blacklist_ipv6*)(blacklist_image.ipv4 + header->ipv4_count);
+    blacklist_image.hosts = hosts = (const struct blacklist_host*)(blacklist_image.ipv6 + header->ipv6_count);
+    blacklist_image.reasons = reasons = (const uint32_t*)(hosts + header->host_count);
+    blacklist_image.strings = (const char*)(reasons + header->reason_count);
+
+    /* Make sure every index and offset stays inside the image. */
+    for (ii = 0; ii < header->reason_count; ii++)
+        if (reasons[ii] >= header->strings_size)
+            goto bad_image;
+    for (ii = 0; ii < header->ipv4_count; ii++)
+        if (blacklist_image.ipv4[ii].reason >= header->reason_count)
+            goto bad_image;
+    for (ii = 0; ii < header->ipv6_count; ii++)
+        if (blacklist_image.ipv6[ii].reason >= header->reason_count)
+            goto bad_image;
+    for (ii = 0; ii < header->host_count; ii++)
+        if ((hosts[ii].reason >= header->reason_count) || (hosts[ii].name >= header->strings_size))
+            goto bad_image;
+    return 1;
+
+  bad_image:
+    /* Do not free the caller's buffer along with the image. */
+    memset(&blacklist_image, 0, sizeof(blacklist_image));
+    return 0;
+}
+
+/* Load a compiled image from disk; returns non-zero on success. */
+static int
+blacklist_image_read(const char *filename)
+{
+    struct stat sb;
+    char *base;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    if (fstat(fd, &sb) < 0 || sb.st_size < (off_t)sizeof(struct blacklist_header)) {
+        close(fd);
+        return 0;
+    }
+#ifdef HAVE_MMAP
+    base = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return 0;
+    if (!blacklist_image_set(base, sb.st_size, 1)) {
+        munmap(base, sb.st_size);
+        return 0;
+    }
+#else
+    base = malloc(sb.st_size);
+    if (read(fd, base, sb.st_size) != sb.st_size || !blacklist_image_set(base, sb.st_size, 0)) {
+        close(fd);
+        free(base);
+        return 0;
+    }
+    close(fd);
+#endif
+    return 1;
+}
+
+struct blacklist_section {
+    char *data;
+    size_t used, size;
+};
+
+static void *
+blacklist_section_append(struct blacklist_section *sec, const void *data, size_t len)
+{
+    void *dest;
+
+    if (!len)
+        return NULL;
+    while (sec->used + len > sec->size) {
+        sec->size = sec->size ? sec->size << 1 : 4096;
+        sec->data = realloc(sec->data, sec->size);
+    }
+    dest = sec->data + sec->used;
+    memcpy(dest, data, len);
+    sec->used += len;
+    return dest;
+}
+
+struct blacklist_reason {
+    uint32_t index;
+};
+
+struct blacklist_compiler {
+    struct blacklist_header header;
+    struct blacklist_section ipv4;
+    struct blacklist_section ipv6;
+    struct blacklist_section host_list;
+    struct blacklist_section reasons;
+    struct blacklist_section strings;
+    struct cidr_tree ranges; /* data is struct blacklist_reason* */
+    dict_t hosts; /* data is struct blacklist_reason* */
+    dict_t reason_dict; /* data is struct blacklist_reason* */
+};
+
+static uint32_t
+blacklist_add_string(struct blacklist_compiler *bc, const char *str)
+{
+    uint32_t offset;
+
+    offset = bc->strings.used;
+    blacklist_section_append(&bc->strings, str, strlen(str) + 1);
+    return offset;
+}
+
+static struct blacklist_reason *
+blacklist_add_reason(struct blacklist_compiler *bc, const char *text)
+{
+    struct blacklist_reason *reason;
+    uint32_t offset;
+
+    reason = dict_find(bc->reason_dict, text, NULL);
+    if (!reason) {
+        reason = malloc(sizeof(*reason));
+        reason->index = bc->header.reason_count++;
+        offset = blacklist_add_string(bc, text);
+        blacklist_section_append(&bc->reasons, &offset, sizeof(offset));
+        dict_insert(bc->reason_dict, strdup(text), reason);
+    }
+    return reason;
+}
+
+static void
+blacklist_emit_ipv4(struct blacklist_compiler *bc, uint32_t first, uint32_t last, uint32_t reason)
+{
+    struct blacklist_ipv4 *prev, range;
+
+    if (bc->header.ipv4_count) {
+        prev = (struct blacklist_ipv4*)(bc->ipv4.data + bc->ipv4.used) - 1;
+        if ((prev->reason == reason) && (prev->last + 1 == first)) {
+            prev->last = last;
+            return;
         }
     }
+    range.first = first;
+    range.last = last;
+    range.reason = reason;
+    blacklist_section_append(&bc->ipv4, &range, sizeof(range));
+    bc->header.ipv4_count++;
 }
 
 static void
-blacklist_load_file(const char *filename, const char *default_reason)
+blacklist_emit_ipv6(struct blacklist_compiler *bc, const uint8_t *first, const uint8_t *last, uint32_t reason)
 {
-    FILE *file;
-    const char *reason;
-    char *mapped_reason;
-    char *sep;
-    size_t len;
-    char linebuf[MAXLEN];
+    struct blacklist_ipv6 *prev, range;
+    uint8_t next[16];
+    int ii;
 
-    if (!filename)
-        return;
-    if (!default_reason)
-        default_reason = "client is blacklisted";
-    file = fopen(filename, "r");
-    if (!file) {
-        log_module(bl_log, LOG_ERROR, "Unable to open %s for reading: %s", filename, strerror(errno));
+    if (bc->header.ipv6_count
+        && ((prev = (struct blacklist_ipv6*)(bc->ipv6.data + bc->ipv6.used) - 1)->reason == reason)) {
+        memcpy(next, prev->last, 16);
+        for (ii = 15; (ii >= 0) && !++next[ii]; ii--) ;
+        if (!memcmp(next, first, 16)) {
+            memcpy(prev->last, last, 16);
+            return;
+        }
+    }
+    memcpy(range.first, first, 16);
+    memcpy(range.last, last, 16);
+    range.reason = reason;
+    blacklist_section_append(&bc->ipv6, &range, sizeof(range));
+    bc->header.ipv6_count++;
+}
+
+/* Emit [first, last], putting the part within ::ffff:0:0/96 into the
+ * IPv4 table.  Ranges arrive in address order. */
+static void
+blacklist_emit(struct blacklist_compiler *bc, const uint8_t *first, const uint8_t *last, struct blacklist_reason *reason)
+{
+    static const uint8_t v4_first[16] = { 0,0,0,0, 0,0,0,0, 0,0,255,255, 0,0,0,0 };
+    static const uint8_t v4_last[16] = { 0,0,0,0, 0,0,0,0, 0,0,255,255, 255,255,255,255 };
+    static const uint8_t v4_before[16] = { 0,0,0,0, 0,0,0,0, 0,0,255,254, 255,255,255,255 };
+    static const uint8_t v4_after[16] = { 0,0,0,0, 0,0,0,0, 0,1,0,0, 0,0,0,0 };
+    const uint8_t *lo, *hi;
+
+    if (!reason)
         return;
+    if (memcmp(first, v4_first, 16) < 0)
+        blacklist_emit_ipv6(bc, first, (memcmp(last, v4_before, 16) < 0) ? last : v4_before, reason->index);
+    if ((memcmp(last, v4_first, 16) >= 0) && (memcmp(first, v4_last, 16) <= 0)) {
+        lo = (memcmp(first, v4_first, 16) > 0) ? first : v4_first;
+        hi = (memcmp(last, v4_last, 16) < 0) ? last : v4_last;
+        blacklist_emit_ipv4(bc, (lo[12] << 24) | (lo[13] << 16) | (lo[14] << 8) | lo[15],
+                            (hi[12] << 24) | (hi[13] << 16) | (hi[14] << 8) | hi[15], reason->index);
     }
-    log_module(bl_log, LOG_DEBUG, "Loading blacklist from %s.", filename);
+    if (memcmp(last, v4_last, 16) > 0)
+        blacklist_emit_ipv6(bc, (memcmp(first, v4_after, 16) > 0) ? first : v4_after, last, reason->index);
+}
+
+static void
+blacklist_node_range(const struct cidr_node *node, uint8_t *first, uint8_t *last)
+{
+    unsigned int ii;
+
+    memcpy(first, node->addr.in6_8, 16);
+    for (ii = 0; ii < 16; ii++)
+        last[ii] = first[ii] | ((node->bits >= (ii + 1) * 8) ? 0 : (node->bits <= ii * 8) ? 0xff : (0xff >> (node->bits - ii * 8)));
+}
+
+/* Flatten a subtree into disjoint ranges, each taking the reason of
+ * the most specific entry that covers it. */
+static void
+blacklist_flatten(struct blacklist_compiler *bc, const struct cidr_node *node, struct blacklist_reason *reason)
+{
+    uint8_t cursor[16], first[16], last[16], child_first[16], child_last[16];
+    unsigned int ii;
+    int jj;
+
+    if (node->used)
+        reason = node->data[node->used - 1];
+    blacklist_node_range(node, first, last);
+    memcpy(cursor, first, 16);
+    for (ii = 0; ii < 2; ii++) {
+        if (!node->child[ii])
+            continue;
+        blacklist_node_range(node->child[ii], child_first, child_last);
+        if (memcmp(cursor, child_first, 16) < 0) {
+            for (jj = 15; (jj >= 0) && !child_first[jj]--; jj--) ;
+            blacklist_emit(bc, cursor, child_first, reason);
+        }
+        blacklist_flatten(bc, node->child[ii], reason);
+        memcpy(cursor, child_last, 16);
+        for (jj = 15; (jj >= 0) && !++cursor[jj]; jj--) ;
+        if (jj < 0)
+            return;
+    }
+    if (memcmp(cursor, last, 16) <= 0)
+        blacklist_emit(bc, cursor, last, reason);
+}
+
+static void
+blacklist_compile(struct blacklist_compiler *bc, FILE *file, const char *default_reason)
+{
+    struct blacklist_reason *reason;
+    irc_in_addr_t addr;
+    unsigned char bits;
+    unsigned int len;
+    char *sep;
+    char linebuf[MAXLEN];
+
+    blacklist_add_reason(bc, default_reason);
     while (fgets(linebuf, sizeof(linebuf), file)) {
         /* Trim whitespace from end of line. */
         len = strlen(linebuf);
-        while (isspace(linebuf[len-1]))
+        while (len && isspace(linebuf[len-1]))
             linebuf[--len] = '\0';
+        if (!len)
+            continue;
 
         /* Figure out which reason string we should use. */
-        reason = default_reason;
+        reason = NULL;
         sep = strchr(linebuf, ' ');
         if (sep) {
             *sep++ = '\0';
             while (isspace(*sep))
                 sep++;
             if (*sep != '\0')
-                reason = sep;
+                reason = blacklist_add_reason(bc, sep);
         }
+        if (!reason)
+            reason = blacklist_add_reason(bc, default_reason);
 
-        /* See if the reason string is already known. */
-        mapped_reason = dict_find(blacklist_reasons, reason, NULL);
-        if (!mapped_reason) {
-            mapped_reason = strdup(reason);
-            dict_insert(blacklist_reasons, mapped_reason, (char*)mapped_reason);
-        }
+        /* Store the blacklist entry as an address range or a host. */
+        len = irc_pton(&addr, &bits, linebuf);
+        if (len && !linebuf[len] && !strchr(linebuf, '*'))
+            cidr_tree_insert(&bc->ranges, &addr, bits, reason);
+        else
+            dict_insert(bc->hosts, strdup(linebuf), reason);
+    }
+}
+
+/* Build an image from the text blacklist and write it out; returns
+ * the image, or NULL if nothing could be built. */
+static char *
+blacklist_build(const char *filename, const struct stat *sb, const char *default_reason, const char *compiled, size_t *length)
+{
+    struct blacklist_compiler bc;
+    struct blacklist_host host;
+    struct blacklist_section image;
+    dict_iterator_t it;
+    FILE *file;
+    char *tmpname;
+    int written;
 
-        /* Store the blacklist entry. */
-        dict_insert(blacklist_hosts, strdup(linebuf), mapped_reason);
+    file = fopen(filename, "r");
+    if (!file) {
+        log_module(bl_log, LOG_ERROR, "Unable to open %s for reading: %s", filename, strerror(errno));
+        return NULL;
     }
+    log_module(bl_log, LOG_DEBUG, "Loading blacklist from %s.", filename);
+    memset(&bc, 0, sizeof(bc));
+    memcpy(bc.header.magic, BLACKLIST_MAGIC, sizeof(bc.header.magic));
+    bc.header.source_size = sb->st_size;
+    bc.header.source_mtime = sb->st_mtime;
+    cidr_tree_init(&bc.ranges);
+    bc.hosts = dict_new();
+    dict_set_free_keys(bc.hosts, free);
+    bc.reason_dict = dict_new();
+    dict_set_free_keys(bc.reason_dict, free);
+    dict_set_free_data(bc.reason_dict, free);
+    blacklist_compile(&bc, file, default_reason);
     fclose(file);
+
+    if (bc.ranges.root)
+        blacklist_flatten(&bc, bc.ranges.root, NULL);
+    for (it = dict_first(bc.hosts); it; it = iter_next(it)) {
+        host.name = blacklist_add_string(&bc, iter_key(it));
+        host.reason = ((struct blacklist_reason*)iter_data(it))->index;
+        blacklist_section_append(&bc.host_list, &host, sizeof(host));
+        bc.header.host_count++;
+    }
+    bc.header.strings_size = bc.strings.used;
+
+    memset(&image, 0, sizeof(image));
+    blacklist_section_append(&image, &bc.header, sizeof(bc.header));
+    blacklist_section_append(&image, bc.ipv4.data, bc.ipv4.used);
+    blacklist_section_append(&image, bc.ipv6.data, bc.ipv6.used);
+    blacklist_section_append(&image, bc.host_list.data, bc.host_list.used);
+    blacklist_section_append(&image, bc.reasons.data, bc.reasons.used);
+    blacklist_section_append(&image, bc.strings.data, bc.strings.used);
+    *length = image.used;
+    log_module(bl_log, LOG_INFO, "Compiled %s: %u IPv4 ranges, %u IPv6 ranges, %u hosts, %u reasons.", filename, bc.header.ipv4_count, bc.header.ipv6_count, bc.header.host_count, bc.header.reason_count);
+
+    free(bc.ipv4.data);
+    free(bc.ipv6.data);
+    free(bc.host_list.data);
+    free(bc.reasons.data);
+    free(bc.strings.data);
+    cidr_tree_clean(&bc.ranges);
+    dict_delete(bc.hosts);
+    dict_delete(bc.reason_dict);
+
+    /* Write it through a temporary file so a crash cannot leave a
+     * truncated image behind. */
+    tmpname = alloca(strlen(compiled) + 5);
+    sprintf(tmpname, "%s.new", compiled);
+    written = 0;
+    if ((file = fopen(tmpname, "wb"))) {
+        written = fwrite(image.data, image.used, 1, file) == 1;
+        written = !fclose(file) && written;
+        if (written && rename(tmpname, compiled) < 0)
+            written = 0;
+        if (!written)
+            remove(tmpname);
+    }
+    if (!written)
+        log_module(bl_log, LOG_WARNING, "Unable to write compiled blacklist %s: %s", compiled, strerror(errno));
+    return image.data;
+}
+
+static void
+blacklist_load_file(const char *filename, const char *default_reason, const char *compiled)
+{
+    const struct blacklist_header *header;
+    struct stat sb;
+    char *image;
+    size_t length;
+
+    blacklist_image_free();
+    if (!filename)
+        return;
+    if (!default_reason)
+        default_reason = "client is blacklisted";
+    if (stat(filename, &sb) < 0) {
+        log_module(bl_log, LOG_ERROR, "Unable to open %s for reading: %s", filename, strerror(errno));
+        return;
+    }
+    if (!compiled) {
+        char *name = alloca(strlen(filename) + 5);
+        sprintf(name, "%s.bin", filename);
+        compiled = name;
+    }
+
+    /* Use the compiled image if it is still current. */
+    if (blacklist_image_read(compiled)) {
+        header = blacklist_image.header;
+        if ((header->source_size == (uint32_t)sb.st_size)
+            && (header->source_mtime == (uint32_t)sb.st_mtime)
+            && !strcmp(blacklist_image.strings + blacklist_image.reasons[0], default_reason)) {
+            log_module(bl_log, LOG_DEBUG, "Using compiled blacklist %s.", compiled);
+            return;
+        }
+        blacklist_image_free();
+    }
+
+    image = blacklist_build(filename, &sb, default_reason, compiled, &length);
+    if (image && !blacklist_image_set(image, length, 0)) {
+        log_module(bl_log, LOG_ERROR, "Compiled blacklist for %s is malformed.", filename);
+        free(image);
+    }
+}
+
+static MODCMD_FUNC(cmd_stats_blacklist)
+{
+    struct dnsbl_cache_entry *entry;
+    dict_iterator_t it;
+    unsigned int pending;
+    unsigned int listed;
+
+    for (it = dict_first(dnsbl_cache), pending = listed = 0; it; it = iter_next(it)) {
+        entry = iter_data(it);
+        if (!entry->expires)
+            pending++;
+        else if (entry->mask)
+            listed++;
+    }
+    reply("BLMSG_STATS_ZONES", dict_size(blacklist_zones),
+          blacklist_image.header ? blacklist_image.header->ipv4_count : 0,
+          blacklist_image.header ? blacklist_image.header->ipv6_count : 0,
+          blacklist_image.header ? blacklist_image.header->host_count : 0);
+    reply("BLMSG_STATS_CACHE", dict_size(dnsbl_cache), pending, listed);
+    reply("BLMSG_STATS_LOOKUPS", dnsbl_stats.lookups, dnsbl_stats.hits,
+          dnsbl_stats.lookups ? dnsbl_stats.hits * 100 / dnsbl_stats.lookups : 0,
+          dnsbl_stats.coalesced, dnsbl_stats.queries);
+    reply("BLMSG_STATS_ANSWERS", dnsbl_stats.negative, dnsbl_stats.failures);
+    return 1;
 }
 
 static void
@@ -272,17 +1026,11 @@ blacklist_conf_read(void)
     blacklist_zones = dict_new();
     dict_set_free_data(blacklist_zones, dnsbl_zone_free);
 
-    dict_delete(blacklist_hosts);
-    blacklist_hosts = dict_new();
-    dict_set_free_keys(blacklist_hosts, free);
-
-    dict_delete(blacklist_reasons);
-    blacklist_reasons = dict_new();
-    dict_set_free_keys(blacklist_reasons, free);
-
     node = conf_get_data("modules/blacklist", RECDB_OBJECT);
-    if (node == NULL)
+    if (node == NULL) {
+        blacklist_image_free();
         return;
+    }
 
     str1 = database_get_data(node, "debug_bot", RECDB_QSTRING);
     if (str1)
@@ -301,13 +1049,19 @@ blacklist_conf_read(void)
 
     str1 = database_get_data(node, "file", RECDB_QSTRING);
     str2 = database_get_data(node, "file_reason", RECDB_QSTRING);
-    blacklist_load_file(str1, str2);
+    blacklist_load_file(str1, str2, database_get_data(node, "compiled_file", RECDB_QSTRING));
 
     str1 = database_get_data(node, "gline_duration", RECDB_QSTRING);
     if (str1 == NULL)
         str1 = "1h";
     conf.gline_duration = ParseInterval(str1);
 
+    str1 = database_get_data(node, "dnsbl_negative_ttl", RECDB_QSTRING);
+    conf.dnsbl_negative_ttl = str1 ? ParseInterval(str1) : 300;
+
+    str1 = database_get_data(node, "dnsbl_max_ttl", RECDB_QSTRING);
+    conf.dnsbl_max_ttl = str1 ? ParseInterval(str1) : 3600;
+
     subnode = database_get_data(node, "dnsbl", RECDB_OBJECT);
     if (subnode) {
         static const char *reason_prefix = "reason_";
@@ -362,18 +1116,30 @@ blacklist_conf_read(void)
 static void
 blacklist_cleanup(void)
 {
+    dict_t cache;
+
+    /* Clear dnsbl_cache first so that requests destroyed later do not
+     * try to use it. */
+    cache = dnsbl_cache;
+    dnsbl_cache = NULL;
+    dict_delete(cache);
+    timeq_del(0, dnsbl_cache_sweep, NULL, TIMEQ_IGNORE_WHEN | TIMEQ_IGNORE_DATA);
     dict_delete(blacklist_zones);
-    dict_delete(blacklist_hosts);
-    dict_delete(blacklist_reasons);
+    blacklist_image_free();
 }
 
 int
 blacklist_init(void)
 {
     bl_log = log_register_type("blacklist", "file:blacklist.log");
+    dnsbl_cache = dict_new();
+    dict_set_free_data(dnsbl_cache, dnsbl_cache_free);
     conf_register_reload(blacklist_conf_read);
     reg_new_user_func(blacklist_check_user);
     reg_exit_func(blacklist_cleanup);
+    message_register_table(msgtab);
+    blacklist_module = module_register("Blacklist", bl_log, "mod-blacklist.help", NULL);
+    modcmd_register(blacklist_module, "stats blacklist", cmd_stats_blacklist, 0, 0, NULL);
     return 1;
 }
 
@@ -37,6 +37,50 @@ static struct {
 # define loc_debug(...) do { if (conf.debug_bot && conf.debug_channel) send_channel_notice(conf.debug_channel, conf.debug_bot, __VA_ARGS__); } while (0)
 #endif
 
+/* A LOGIN2 waiting for its password check.  The server and account
+ * are looked up again by name when the result arrives, since either
+ * may have gone away in the meantime; server is cleared on shutdown. */
+struct iauth_loc_login {
+    char *server;
+    char *routing;
+    char *account;
+    char crypted[MD5_CRYPT_LENGTH];
+    struct iauth_loc_login *next;
+};
+
+static struct iauth_loc_login *iauth_loc_logins;
+
+static void
+iauth_loc_checked(void *data, int matched)
+{
+    struct iauth_loc_login *login = data, **pp;
+    struct handle_info *hi;
+    struct server *source;
+
+    if (login->server && (source = GetServerH(login->server))) {
+        hi = get_handle_info(login->account);
+        if (hi && strcmp(hi->passwd, login->crypted)) {
+            /* The result is for a password the account no longer has. */
+            irc_xresponse(source, login->routing, "AGAIN Account changed during login; please try again");
+        } else if (!hi || !matched) {
+            irc_xresponse(source, login->routing, "AGAIN Bad username, account or source");
+        } else if (HANDLE_FLAGGED(hi, SUSPENDED)) {
+            irc_xresponse(source, login->routing, "AGAIN That account is suspended");
+        } else {
+            char response[68];
+            snprintf(response, sizeof(response), "OK %s:%lu", hi->handle, hi->registered);
+            irc_xresponse(source, login->routing, response);
+        }
+    }
+
+    for (pp = &iauth_loc_logins; *pp != login; pp = &(*pp)->next) ;
+    *pp = login->next;
+    free(login->server);
+    free(login->routing);
+    free(login->account);
+    free(login);
+}
+
 static void
 iauth_loc_xquery(struct server *source, const char routing[], const char query[])
 {
@@ -44,6 +88,7 @@ iauth_loc_xquery(struct server *source, const char routing[], const char query[]
         /* Make "user" static for better valgrind tests. */
         static struct userNode user;
         const char *ip_str, *hostname, *username, *account, *password;
+        struct iauth_loc_login *login;
         struct handle_info *hi = NULL;
         char *qdup, *saveptr = NULL;
         unsigned int ii;
@@ -80,20 +125,23 @@ iauth_loc_xquery(struct server *source, const char routing[], const char query[]
             if (user_matches_glob(&user, hi->masks->list[ii], 0))
                 valid = 1;
         }
-        if (hi && !checkpass(password, hi->passwd))
-            valid = 0;
-
-        /* Send our response. */
-        free(qdup);
         if (!valid) {
             irc_xresponse(source, routing, "AGAIN Bad username, account or source");
-        } else if (hi && HANDLE_FLAGGED(hi, SUSPENDED)) {
-            irc_xresponse(source, routing, "AGAIN That account is suspended");
-        } else {
-            char response[68];
-            snprintf(response, sizeof(response), "OK %s:%lu", hi->handle, hi->registered);
-            irc_xresponse(source, routing, response);
+            free(qdup);
+            return;
         }
+
+        /* The password is checked off the main loop; iauth_loc_checked()
+         * sends our response. */
+        login = calloc(1, sizeof(*login));
+        login->server = strdup(source->name);
+        login->routing = strdup(routing);
+        login->account = strdup(hi->handle);
+        safestrncpy(login->crypted, hi->passwd, sizeof(login->crypted));
+        login->next = iauth_loc_logins;
+        iauth_loc_logins = login;
+        checkpass_async(password, hi->passwd, iauth_loc_checked, login);
+        free(qdup);
     } /* else unknown or unsupported command */
 }
 
@@ -125,12 +173,24 @@ iauth_loc_conf_read(void)
     }
 }
 
+static void
+iauth_loc_cleanup(void)
+{
+    struct iauth_loc_login *login;
+
+    for (login = iauth_loc_logins; login; login = login->next) {
+        free(login->server);
+        login->server = NULL;
+    }
+}
+
 int
 iauth_loc_init(void)
 {
     loc_log = log_register_type("iauth_loc", "file:iauth_loc.log");
     conf_register_reload(iauth_loc_conf_read);
     reg_xquery_func(iauth_loc_xquery);
+    reg_exit_func(iauth_loc_cleanup);
     return 1;
 }
 
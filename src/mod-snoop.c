@@ -102,7 +102,7 @@ snoop_new_user(struct userNode *user) {
     if (!snoop_cfg.bot) return;
     if (user->uplink->burst && !snoop_cfg.show_bursts) return;
     UPDATE_TIMESTAMP();
-    SNOOP("$bNICK$b %s %s@%s [%s] on %s", user->nick, user->ident, user->hostname, irc_ntoa(&user->ip), user->uplink->name);
+    SNOOP("$bNICK$b %s %s@%s [%s] on %s", user->nick, user->ident, user->hostname, user_ip_text(user), user->uplink->name);
 }
 
 static void
@@ -1023,7 +1023,6 @@ static MODCMD_FUNC(cmd_hostscan)
 {
     unsigned int n;
     irc_in_addr_t ipaddr;
-    char hnamebuf[IRC_NTOP_MAX_SIZE];
 
     for (n=1; n<argc; n++) {
         struct userNode *un = GetUserH(argv[n]);
@@ -1033,9 +1032,8 @@ static MODCMD_FUNC(cmd_hostscan)
                 || irc_in_addr_is_loopback(un->ip)) {
                 reply("PCMSG_UNSCANNABLE_IP", un->nick);
             } else {
-                irc_ntop(hnamebuf, sizeof(hnamebuf), &un->ip);
                 sockcheck_queue_address(un->ip);
-                reply("PCMSG_ADDRESS_QUEUED", hnamebuf);
+                reply("PCMSG_ADDRESS_QUEUED", user_ip_text(un));
             }
         } else {
             char *scanhost = argv[n];
@@ -1053,15 +1051,13 @@ static MODCMD_FUNC(cmd_hostscan)
 static MODCMD_FUNC(cmd_clearhost)
 {
     unsigned int n;
-    char hnamebuf[IRC_NTOP_MAX_SIZE];
 
     for (n=1; n<argc; n++) {
         struct userNode *un = GetUserH(argv[n]);
         const char *scanhost;
 
         if (un) {
-            irc_ntop(hnamebuf, sizeof(hnamebuf), &un->ip);
-            scanhost = hnamebuf;
+            scanhost = user_ip_text(un);
         } else {
             scanhost = argv[n];
         }
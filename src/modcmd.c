@@ -20,6 +20,7 @@
 
 #include "chanserv.h"
 #include "conf.h"
+#include "ioset.h"
 #include "log.h"
 #include "modcmd.h"
 #include "saxdb.h"
@@ -103,6 +104,8 @@ static const struct message_entry msgtab[] = {
     { "MCMSG_JOINER_CHOICES", "Subcommands of %s: %s" },
     { "MCMSG_MODULE_INFO", "Commands exported by module $b%s$b:" },
     { "MCMSG_SERVICE_INFO", "Commands bound to service $b%s$b:" },
+    { "MCMSG_COMMAND_STATS_EMPTY", "No command statistics have been collected (see $b$O PROFILE$b)." },
+    { "MCMSG_COMMAND_STATS_SORT", "$b%s$b is not a valid sort key; use TOTAL, AVERAGE, MAX, USES or OUTPUT." },
     { "MCMSG_TOYS_DISABLED", "Toys are disabled in %s." },
     { "MCMSG_PUBLIC_DENY", "Public commands in $b%s$b are restricted." },
     { "MCMSG_HELPFILE_SEQUENCE", "Help priority %d: %s" },
@@ -129,6 +132,7 @@ static const struct message_entry msgtab[] = {
     { "MCMSG_COMMAND_ACCOUNT_FLAGS", "Requires account flags +%s, prohibits account flags +%s." },
     { "MCMSG_COMMAND_ACCESS_LEVEL", "Requires channel access %d and $O access %d." },
     { "MCMSG_COMMAND_USES", "%s has been used %d times." },
+    { "MCMSG_CURSOR_AUTH_CHANGED", "Your account changed, so the command you were running has been stopped." },
     { NULL, NULL }
 };
 struct userData *_GetChannelUser(struct chanData *channel, struct handle_info *handle, int override, int allow_suspended);
@@ -755,7 +759,21 @@ svccmd_invoke_argv(struct userNode *user, struct service *service, struct chanNo
         safestrncpy(channel_name, channel->name, sizeof(channel_name));
     else
         channel_name[0] = 0;
-    if (!(result = cmd->command->func(user, channel, argc, argv, cmd)))
+    if (perf_stall_threshold)
+        perf_event_command(service->bot->nick, cmd->name);
+    if (perf_enabled) {
+        unsigned long start, sent;
+
+        start = perf_now();
+        sent = message_bytes_sent;
+        result = cmd->command->func(user, channel, argc, argv, cmd);
+        if (!perf_stat_current(&cmd->cost))
+            cmd->output = 0;
+        perf_record(&cmd->cost, perf_now() - start);
+        cmd->output += message_bytes_sent - sent;
+    } else
+        result = cmd->command->func(user, channel, argc, argv, cmd);
+    if (!result)
         return 0;
     if (!(flags & MODCMD_NO_LOG)) {
         enum log_severity slvl;
@@ -1163,6 +1181,100 @@ reg_svccmd_unbind_func(svccmd_unbind_func_t handler) {
     suf_list[suf_used++] = handler;
 }
 
+/* Cursors are kept in start order so each gets its turn. */
+static struct svccmd_cursor *svccmd_cursors;
+
+/* Hold cursors back while this much output is waiting for the uplink. */
+#define SVCCMD_CURSOR_MAX_QUEUED 65536
+
+struct svccmd_cursor *
+svccmd_cursor_start(struct userNode *user, struct userNode *bot, svccmd_cursor_step_t step, svccmd_cursor_cleanup_t cleanup, void *data) {
+    struct svccmd_cursor *cursor, **pcursor;
+
+    cursor = calloc(1, sizeof(*cursor));
+    cursor->user = user;
+    cursor->bot = bot;
+    cursor->step = step;
+    cursor->cleanup = cleanup;
+    cursor->data = data;
+    for (pcursor = &svccmd_cursors; *pcursor; pcursor = &(*pcursor)->next) ;
+    *pcursor = cursor;
+    return cursor;
+}
+
+static void
+svccmd_cursor_free(struct svccmd_cursor *cursor) {
+    if (cursor->cleanup)
+        cursor->cleanup(cursor->data);
+    free(cursor);
+}
+
+static int
+svccmd_cursors_paced(void) {
+    extern struct io_fd *socket_io_fd;
+    return socket_io_fd && (ioset_queued(socket_io_fd) > SVCCMD_CURSOR_MAX_QUEUED);
+}
+
+int
+svccmd_cursors_ready(void) {
+    return svccmd_cursors && !svccmd_cursors_paced();
+}
+
+void
+svccmd_cursors_run(void) {
+    struct svccmd_cursor *cursor, **pcursor;
+
+    for (pcursor = &svccmd_cursors; (cursor = *pcursor); ) {
+        /* A step may kill its own user, so check again afterwards. */
+        if (cursor->user
+            && (svccmd_cursors_paced() || cursor->step(cursor))
+            && cursor->user) {
+            pcursor = &cursor->next;
+            continue;
+        }
+        *pcursor = cursor->next;
+        svccmd_cursor_free(cursor);
+    }
+}
+
+void
+svccmd_cursors_cancel(svccmd_cursor_step_t step) {
+    struct svccmd_cursor *cursor, **pcursor;
+
+    for (pcursor = &svccmd_cursors; (cursor = *pcursor); ) {
+        if (cursor->step != step) {
+            pcursor = &cursor->next;
+            continue;
+        }
+        *pcursor = cursor->next;
+        svccmd_cursor_free(cursor);
+    }
+}
+
+static void
+modcmd_cursor_user_quit(struct userNode *user, UNUSED_ARG(struct userNode *killer), UNUSED_ARG(const char *why)) {
+    struct svccmd_cursor *cursor;
+
+    /* Only mark them here; this may be called from inside a step. */
+    for (cursor = svccmd_cursors; cursor; cursor = cursor->next)
+        if (cursor->user == user)
+            cursor->user = NULL;
+}
+
+static void
+modcmd_cursor_user_auth(struct userNode *user, UNUSED_ARG(struct handle_info *old_handle)) {
+    struct svccmd_cursor *cursor;
+
+    /* The command was only checked against the old account, so do
+     * not let its remaining steps run under the new one. */
+    for (cursor = svccmd_cursors; cursor; cursor = cursor->next) {
+        if (cursor->user != user)
+            continue;
+        send_message(user, cursor->bot, "MCMSG_CURSOR_AUTH_CHANGED");
+        cursor->user = NULL;
+    }
+}
+
 static MODCMD_FUNC(cmd_unbind) {
     struct service *service;
     struct userNode *bot;
@@ -1636,6 +1748,127 @@ static MODCMD_FUNC(cmd_stats_services) {
     }
 }
 
+enum svccmd_cost_key {
+    COST_TOTAL,
+    COST_AVERAGE,
+    COST_MAX,
+    COST_USES,
+    COST_OUTPUT
+};
+
+static enum svccmd_cost_key svccmd_cost_key;
+
+static double
+svccmd_cost(const struct svccmd *svccmd)
+{
+    switch (svccmd_cost_key) {
+    case COST_AVERAGE: return svccmd->cost.total / svccmd->cost.count;
+    case COST_MAX: return svccmd->cost.max;
+    case COST_USES: return svccmd->cost.count;
+    case COST_OUTPUT: return svccmd->output;
+    case COST_TOTAL: default: return svccmd->cost.total;
+    }
+}
+
+static int
+svccmd_cost_compare(const void *a_, const void *b_)
+{
+    struct svccmd *a = *(struct svccmd**)a_, *b = *(struct svccmd**)b_;
+    double ca = svccmd_cost(a), cb = svccmd_cost(b);
+    if (ca != cb)
+        return (ca < cb) ? 1 : -1;
+    return irccasecmp(a->name, b->name);
+}
+
+static MODCMD_FUNC(cmd_stats_commands) {
+    struct helpfile_table tbl;
+    struct svccmd_list found;
+    dict_iterator_t it, it2;
+    struct service *service;
+    struct svccmd *svccmd;
+    unsigned int ii, pos, limit;
+    char *buffer;
+
+    svccmd_cost_key = COST_TOTAL;
+    limit = 20;
+    for (ii = 1; ii < argc; ii++) {
+        if (isdigit(argv[ii][0]))
+            limit = strtoul(argv[ii], NULL, 10);
+        else if (!irccasecmp(argv[ii], "total"))
+            svccmd_cost_key = COST_TOTAL;
+        else if (!irccasecmp(argv[ii], "average") || !irccasecmp(argv[ii], "avg"))
+            svccmd_cost_key = COST_AVERAGE;
+        else if (!irccasecmp(argv[ii], "max"))
+            svccmd_cost_key = COST_MAX;
+        else if (!irccasecmp(argv[ii], "uses"))
+            svccmd_cost_key = COST_USES;
+        else if (!irccasecmp(argv[ii], "output"))
+            svccmd_cost_key = COST_OUTPUT;
+        else {
+            reply("MCMSG_COMMAND_STATS_SORT", argv[ii]);
+            return 0;
+        }
+    }
+
+    svccmd_list_init(&found);
+    for (it = dict_first(services); it; it = iter_next(it)) {
+        service = iter_data(it);
+        for (it2 = dict_first(service->commands); it2; it2 = iter_next(it2)) {
+            svccmd = iter_data(it2);
+            if (perf_stat_current(&svccmd->cost))
+                svccmd_list_append(&found, svccmd);
+        }
+    }
+    if (!found.used) {
+        reply("MCMSG_COMMAND_STATS_EMPTY");
+        svccmd_list_clean(&found);
+        return 0;
+    }
+    qsort(found.list, found.used, sizeof(found.list[0]), svccmd_cost_compare);
+    if (limit && (found.used > limit))
+        found.used = limit;
+
+    tbl.length = found.used + 1;
+    tbl.width = 7;
+    tbl.flags = TABLE_PAD_LEFT | TABLE_NO_FREE;
+    tbl.contents = calloc(tbl.length, sizeof(tbl.contents[0]));
+    tbl.contents[0] = calloc(tbl.width, sizeof(tbl.contents[0][0]));
+    tbl.contents[0][0] = "Service";
+    tbl.contents[0][1] = "Command";
+    tbl.contents[0][2] = "Uses";
+    tbl.contents[0][3] = "Total ms";
+    tbl.contents[0][4] = "Avg us";
+    tbl.contents[0][5] = "Max us";
+    tbl.contents[0][6] = "Output";
+    for (ii = 1; ii < tbl.length; ii++) {
+        svccmd = found.list[ii-1];
+        tbl.contents[ii] = calloc(tbl.width, sizeof(tbl.contents[ii][0]));
+        tbl.contents[ii][0] = svccmd->parent->bot->nick;
+        tbl.contents[ii][1] = svccmd->name;
+        buffer = malloc(96);
+        pos = 0;
+        tbl.contents[ii][2] = buffer + pos;
+        pos += sprintf(buffer + pos, "%lu", svccmd->cost.count) + 1;
+        tbl.contents[ii][3] = buffer + pos;
+        pos += sprintf(buffer + pos, "%.1f", svccmd->cost.total / 1000.0) + 1;
+        tbl.contents[ii][4] = buffer + pos;
+        pos += sprintf(buffer + pos, "%.0f", svccmd->cost.total / svccmd->cost.count) + 1;
+        tbl.contents[ii][5] = buffer + pos;
+        pos += sprintf(buffer + pos, "%lu", svccmd->cost.max) + 1;
+        tbl.contents[ii][6] = buffer + pos;
+        sprintf(buffer + pos, "%lu", svccmd->output);
+    }
+    table_send(cmd->parent->bot, user->nick, 0, 0, tbl);
+    for (ii = 1; ii < tbl.length; ii++) {
+        free((char*)tbl.contents[ii][2]);
+        free(tbl.contents[ii]);
+    }
+    free(tbl.contents[0]);
+    free(tbl.contents);
+    svccmd_list_clean(&found);
+    return 0;
+}
+
 static MODCMD_FUNC(cmd_showcommands) {
     struct svccmd_list commands;
     struct helpfile_table tbl;
@@ -1954,6 +2187,12 @@ modcmd_nick_change(struct userNode *user, const char *old_nick) {
 
 void
 modcmd_cleanup(void) {
+    struct svccmd_cursor *cursor;
+
+    while ((cursor = svccmd_cursors)) {
+        svccmd_cursors = cursor->next;
+        svccmd_cursor_free(cursor);
+    }
     dict_delete(services);
     dict_delete(modules);
     if (suf_list)
@@ -2177,6 +2416,8 @@ modcmd_init(void) {
     services = dict_new();
     dict_set_free_data(services, free_service);
     reg_nick_change_func(modcmd_nick_change);
+    reg_del_user_func(modcmd_cursor_user_quit);
+    reg_auth_func(modcmd_cursor_user_auth);
     reg_exit_func(modcmd_cleanup);
     conf_register_reload(modcmd_conf_read);
 
@@ -2190,6 +2431,7 @@ modcmd_init(void) {
     modcmd_register(modcmd_module, "timecmd", cmd_timecmd, 2, 0, "oper_level", "1", NULL);
     modcmd_register(modcmd_module, "unbind", cmd_unbind, 3, 0, "template", "bind", NULL);
     modcmd_register(modcmd_module, "joiner", cmd_joiner, 1, 0, NULL);
+    modcmd_register(modcmd_module, "stats commands", cmd_stats_commands, 1, 0, "flags", "+oper", NULL);
     modcmd_register(modcmd_module, "stats modules", cmd_stats_modules, 1, 0, "flags", "+oper", NULL);
     modcmd_register(modcmd_module, "stats services", cmd_stats_services, 1, 0, "flags", "+oper", NULL);
     modcmd_register(modcmd_module, "showcommands", cmd_showcommands, 1, 0, "flags", "+acceptchan", NULL);
@@ -2384,7 +2626,7 @@ create_default_binds(void) {
         { "ChanServ", { "ChanServ", NULL } },
         { "Global", { "Global", NULL } },
         { "NickServ", { "NickServ", NULL } },
-        { "OpServ", { "OpServ", "modcmd", "sendmail", "saxdb", "proxycheck", NULL } },
+        { "OpServ", { "OpServ", "modcmd", "sendmail", "saxdb", "proxycheck", "blacklist", NULL } },
         { NULL, { NULL } }
     };
     unsigned int ii, jj;
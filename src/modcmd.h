@@ -24,6 +24,7 @@
 #include "recdb.h"
 #include "helpfile.h"
 #include "log.h"
+#include "perf.h"
 
 struct service;
 struct svccmd;
@@ -127,6 +128,8 @@ struct svccmd {
     unsigned int min_opserv_level;
     unsigned int min_channel_access;
     unsigned int effective_flags;
+    struct perf_stat cost; /* time spent in the command (when profiling) */
+    unsigned long output; /* bytes of text sent during those invocations */
 };
 
 struct module {
@@ -187,6 +190,35 @@ int svccmd_invoke_argv(struct userNode *user, struct service *service, struct ch
 typedef void (*svccmd_unbind_func_t)(struct svccmd *target);
 void reg_svccmd_unbind_func(svccmd_unbind_func_t handler);
 
+/* Long-running commands can hand their remaining work to a cursor,
+ * which is stepped once per pass through the main loop.  The step
+ * function should do a bounded amount of work and return non-zero
+ * if it wants to be called again; when it returns zero (or the user
+ * quits or changes account), the cleanup function is called to
+ * release its data.
+ * Steps are held back while the uplink has a long send queue, so
+ * output is paced to what the server is actually accepting.
+ */
+struct svccmd_cursor;
+typedef int (*svccmd_cursor_step_t)(struct svccmd_cursor *cursor);
+typedef void (*svccmd_cursor_cleanup_t)(void *data);
+
+struct svccmd_cursor {
+    struct userNode *user; /* NULL once the user quits or changes account */
+    struct userNode *bot;
+    svccmd_cursor_step_t step;
+    svccmd_cursor_cleanup_t cleanup;
+    void *data;
+    struct svccmd_cursor *next;
+};
+
+struct svccmd_cursor *svccmd_cursor_start(struct userNode *user, struct userNode *bot, svccmd_cursor_step_t step, svccmd_cursor_cleanup_t cleanup, void *data);
+/* Returns non-zero if some cursor could make progress right now. */
+int svccmd_cursors_ready(void);
+void svccmd_cursors_run(void);
+/* Drop every cursor using step; for modules that are shutting down. */
+void svccmd_cursors_cancel(svccmd_cursor_step_t step);
+
 /* Initialize the module command subsystem. */
 void modcmd_init(void);
 /* Finalize the command mappings, read aliases, etc.  Do this after
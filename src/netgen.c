@@ -0,0 +1,941 @@
+/* netgen.c - Synthetic P10 network generator for replay testing
+ * Copyright 2026 srvx Development Team
+ *
+ * This file is part of srvx.
+ *
+ * srvx is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with srvx; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+ */
+
+/* This writes a replay log (as read by "srvx -r") that looks like an
+ * uplink hub bursting a network of leaf servers, users, channels,
+ * bans and G-lines, followed by a stream of steady-state traffic.
+ * Everything is driven by a seeded PRNG, so the same options always
+ * produce the same stream.  Typical use:
+ *
+ *   ./netgen -s 8 -u 100000 -t 200000 > net-100k.log
+ *   ./srvx -f -c srvx.conf -r net-100k.log
+ *
+ * Adding "-O 50" ends the stream with fifty OpServ searches over the
+ * whole user table, for comparing settings of opserv/search_threads.
+ *
+ * The services server name (-n), uplink password (-p) and services
+ * numeric (-x) must agree with the srvx.conf being used.  Lines that
+ * services send are not predicted, so the replay log will complain
+ * about unexpected output; only the inbound side is simulated.
+ * Large networks need more memory than the "rlimits" section of the
+ * sample test configuration allows, so relax or remove it first.
+ */
+
+#include "common.h"
+#include <math.h>
+
+#define NG_NICKLEN      15
+#define NG_IDENTLEN     10
+#define NG_HOSTLEN      63
+#define NG_CHANLEN      32
+#define NG_MAXLINE      500
+#define NG_MAX_UCHANS   10
+#define NG_SERVER_USERS 262144
+#define NG_MAX_SERVERS  4096
+
+struct ng_user {
+    char nick[NG_NICKLEN + 1];
+    char ident[NG_IDENTLEN + 1];
+    char host[NG_HOSTLEN + 1];
+    char ip64[26];
+    unsigned int server;
+    unsigned int num_local;
+    unsigned int alive : 1;
+    unsigned int chan_count : 4;
+    unsigned int chans[NG_MAX_UCHANS];
+};
+
+struct ng_channel {
+    char name[NG_CHANLEN + 1];
+    unsigned long ts;
+    unsigned int members;
+};
+
+struct ng_server {
+    char name[64];
+    char numeric[3];
+    unsigned int users;
+    unsigned int linked : 1;
+};
+
+struct ng_isp {
+    char domain[32];
+    unsigned int pattern;
+    unsigned int v4_hi;
+};
+
+static const char convert2y[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789[]";
+
+static const char *nick_words[] = {
+    "Zoot", "dragon", "Kitty", "neo", "Shadow", "pixel", "Ghost", "luna",
+    "Rex", "nova", "Bandit", "echo", "Max", "storm", "Jinx", "vex",
+    "Ace", "blaze", "Milo", "sky", "Duke", "frost", "Ivy", "wolf"
+};
+
+static const char *ident_words[] = {
+    "user", "me", "john", "anna", "bot", "admin", "guest", "mike",
+    "sarah", "x", "irc", "root", "www", "kid", "pc"
+};
+
+static const char *info_words[] = {
+    "Real name", "I am bored", "http://example.com/", "...", "Yes",
+    "Generated user", "no info", "gamer", "coffee please", "lurker"
+};
+
+static const char *isp_words[] = {
+    "telco", "cable", "fiber", "wave", "link", "broad", "tele", "net",
+    "online", "connect", "speed", "home"
+};
+
+static const char *isp_tlds[] = {
+    "net", "com", "de", "fr", "nl", "se", "co.uk", "com.br", "pl", "fi"
+};
+
+static const char *chan_words[] = {
+    "help", "games", "chat", "linux", "music", "quake", "dev", "news",
+    "anime", "trade", "clan", "fun", "code", "radio", "movies", "lobby"
+};
+
+static const char *msg_words[] = {
+    "lol", "hi all", "anyone here?", "brb", "what's up", "nice",
+    "that was a good game", "ok", "thanks!", "hmm", "see you"
+};
+
+/* Full user table scans for the OpServ search benchmark (-O). */
+static const char *search_criteria[] = {
+    "info *bored*", "mask *!*@*.de", "ident ~*", "nick *a*z*",
+    "host *.dyn.*", "server leaf1.*", "info *e*e*e*", "mask *!~*@*1*"
+};
+
+static const char *service_commands[] = {
+    "HELP", "INFO %n", "INFO %c", "ACCESS %c", "VERSION", "USERS %c"
+};
+
+static struct ng_server *servers;
+static struct ng_user *users;
+static struct ng_channel *chans;
+static struct ng_isp *isps;
+static double *chan_cdf;
+static double *isp_cdf;
+static unsigned int **server_slots;
+
+static unsigned int n_servers = 4;
+static unsigned int n_users = 10000;
+static unsigned int n_chans;
+static unsigned int n_isps = 200;
+static unsigned int max_bans = 10;
+static unsigned int n_glines = 1000;
+static unsigned int n_events;
+static unsigned int event_rate = 100;
+static unsigned int split_every;
+static unsigned int account_permille;
+static unsigned int n_searches;
+static unsigned int services_numeric = 10;
+static unsigned int users_alloc;
+static unsigned int users_used;
+static unsigned long nick_serial;
+static unsigned long gline_serial;
+static double zipf_s = 1.0;
+static const char *password = "password";
+static const char *services_name = "srvx.test.net";
+static char *service_bots[16];
+static unsigned int n_service_bots;
+unsigned long now = 1700000000;
+static unsigned long last_pong;
+static unsigned long lines_written;
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint64_t
+rng_next(void)
+{
+    /* xorshift64*, so streams do not depend on the platform's rand() */
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+static unsigned int
+rng_below(unsigned int limit)
+{
+    return limit ? (unsigned int)(rng_next() % limit) : 0;
+}
+
+static double
+rng_unit(void)
+{
+    return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int
+rng_percent(unsigned int pct)
+{
+    return rng_below(100) < pct;
+}
+
+static unsigned int
+cdf_sample(const double *cdf, unsigned int count)
+{
+    double target;
+    unsigned int lo, hi, mid;
+
+    target = rng_unit() * cdf[count - 1];
+    for (lo = 0, hi = count - 1; lo < hi; ) {
+        mid = (lo + hi) / 2;
+        if (cdf[mid] < target)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static double *
+zipf_cdf(unsigned int count, double exponent)
+{
+    double *cdf, total;
+    unsigned int ii;
+
+    cdf = malloc(count * sizeof(cdf[0]));
+    for (ii = 0, total = 0; ii < count; ++ii) {
+        total += 1.0 / pow(ii + 1, exponent);
+        cdf[ii] = total;
+    }
+    return cdf;
+}
+
+static void
+ng_inttobase64(char *buf, unsigned int v, unsigned int count)
+{
+    buf[count] = '\0';
+    while (count > 0) {
+        buf[--count] = convert2y[v & 63];
+        v >>= 6;
+    }
+}
+
+static void
+emit(const char *fmt, ...) PRINTF_LIKE(1, 2);
+
+static void
+emit(const char *fmt, ...)
+{
+    struct tm local;
+    time_t feh;
+    va_list args;
+
+    feh = now;
+    localtime_r(&feh, &local);
+    fprintf(stdout, "[%02d:%02d:%02d %02d/%02d/%04d] (info)    ",
+            local.tm_hour, local.tm_min, local.tm_sec, local.tm_mon+1,
+            local.tm_mday, local.tm_year+1900);
+    va_start(args, fmt);
+    vfprintf(stdout, fmt, args);
+    va_end(args);
+    fputc('\n', stdout);
+    lines_written++;
+}
+
+static const char *
+user_numeric(const struct ng_user *user)
+{
+    static char buf[6];
+    memcpy(buf, servers[user->server].numeric, 2);
+    ng_inttobase64(buf + 2, user->num_local, 3);
+    return buf;
+}
+
+static void
+make_nick(struct ng_user *user)
+{
+    char tail[16];
+    unsigned long serial;
+    unsigned int len;
+
+    serial = nick_serial++;
+    for (len = 0; serial || !len; serial /= 36)
+        tail[len++] = "0123456789abcdefghijklmnopqrstuvwxyz"[serial % 36];
+    tail[len] = '\0';
+    snprintf(user->nick, sizeof(user->nick), "%s%s",
+             nick_words[rng_below(ArrayLength(nick_words))], tail);
+}
+
+static void
+make_host(struct ng_user *user)
+{
+    const struct ng_isp *isp;
+    unsigned int b, c, d, r1, r2;
+
+    isp = &isps[cdf_sample(isp_cdf, n_isps)];
+    if (rng_percent(15)) {
+        /* IPv6: 2001:db8:<isp>:<r1>::<r2> */
+        char *pos = user->ip64;
+        r1 = 1 + rng_below(65535);
+        r2 = 1 + rng_below(65535);
+        ng_inttobase64(pos, 0x2001, 3);
+        ng_inttobase64(pos + 3, 0x0db8, 3);
+        ng_inttobase64(pos + 6, isp->v4_hi + 1, 3);
+        ng_inttobase64(pos + 9, r1, 3);
+        pos[12] = '_';
+        ng_inttobase64(pos + 13, r2, 3);
+        if (rng_percent(50))
+            snprintf(user->host, sizeof(user->host), "2001:db8:%x:%x::%x", isp->v4_hi + 1, r1, r2);
+        else
+            snprintf(user->host, sizeof(user->host), "ip6-%x-%x.%s", r1, r2, isp->domain);
+        return;
+    }
+
+    b = isp->v4_hi & 255;
+    c = rng_below(256);
+    d = 1 + rng_below(254);
+    ng_inttobase64(user->ip64, ((20 + (isp->v4_hi >> 8)) << 24) | (b << 16) | (c << 8) | d, 6);
+    if (rng_percent(12)) {
+        snprintf(user->host, sizeof(user->host), "%u.%u.%u.%u", 20 + (isp->v4_hi >> 8), b, c, d);
+        return;
+    }
+    switch (isp->pattern) {
+    case 0:
+        snprintf(user->host, sizeof(user->host), "dsl-%u-%u-%u-%u.%s", 20 + (isp->v4_hi >> 8), b, c, d, isp->domain);
+        break;
+    case 1:
+        snprintf(user->host, sizeof(user->host), "%u-%u-%u-%u.dyn.%s", 20 + (isp->v4_hi >> 8), b, c, d, isp->domain);
+        break;
+    case 2:
+        snprintf(user->host, sizeof(user->host), "cpe-%u-%u.%s", c, d, isp->domain);
+        break;
+    case 3:
+        snprintf(user->host, sizeof(user->host), "host%u.%u.%s", d, c, isp->domain);
+        break;
+    default:
+        snprintf(user->host, sizeof(user->host), "%u.%u.%u.%u.in-addr.%s", d, c, b, 20 + (isp->v4_hi >> 8), isp->domain);
+        break;
+    }
+}
+
+static void
+make_user(struct ng_user *user)
+{
+    unsigned int ii;
+
+    memset(user, 0, sizeof(*user));
+    make_nick(user);
+    ii = rng_below(ArrayLength(ident_words));
+    snprintf(user->ident, sizeof(user->ident), "%s%s", rng_percent(60) ? "~" : "", ident_words[ii]);
+    if (users_used > 0 && rng_percent(4)) {
+        /* Clone of an earlier user: NAT gateway, shell box or bouncer. */
+        const struct ng_user *orig = &users[rng_below(users_used)];
+        strcpy(user->host, orig->host);
+        strcpy(user->ip64, orig->ip64);
+    } else {
+        make_host(user);
+    }
+}
+
+static int
+alloc_slot(struct ng_user *user)
+{
+    unsigned int ii, jj, best;
+
+    /* Put the user on the leaf with the fewest users that still has room. */
+    for (ii = 1, best = 0; ii <= n_servers; ++ii) {
+        if (!servers[ii].linked || servers[ii].users >= NG_SERVER_USERS)
+            continue;
+        if (!best || servers[ii].users < servers[best].users)
+            best = ii;
+    }
+    if (!best) {
+        if (servers[0].users >= NG_SERVER_USERS)
+            return 0;
+        best = 0;
+    }
+    for (jj = rng_below(NG_SERVER_USERS); server_slots[best][jj] != UINT_MAX; jj = (jj + 1) % NG_SERVER_USERS) ;
+    server_slots[best][jj] = user - users;
+    servers[best].users++;
+    user->server = best;
+    user->num_local = jj;
+    return 1;
+}
+
+static void
+free_slot(struct ng_user *user)
+{
+    server_slots[user->server][user->num_local] = UINT_MAX;
+    servers[user->server].users--;
+}
+
+static void
+emit_user(struct ng_user *user)
+{
+    char modes[64];
+    unsigned int roll;
+
+    roll = rng_below(1000);
+    if (roll < 2)
+        strcpy(modes, "+iow");
+    else if (roll < 2 + account_permille)
+        snprintf(modes, sizeof(modes), "+ixr %s:%lu", user->nick, now - rng_below(86400*365));
+    else if (roll < 900)
+        strcpy(modes, "+i");
+    else
+        strcpy(modes, "+iw");
+    emit("%s N %s %u %lu %s %s %s %s %s :%s",
+         servers[user->server].numeric, user->nick, user->server ? 2 : 1, now,
+         user->ident, user->host, modes, user->ip64, user_numeric(user),
+         info_words[rng_below(ArrayLength(info_words))]);
+}
+
+static void
+emit_server(unsigned int idx)
+{
+    emit("%s S %s 2 %lu %lu J10 %s]]] +h6 :Generated leaf %u",
+         servers[0].numeric, servers[idx].name, now, now, servers[idx].numeric, idx);
+}
+
+static int
+user_in_chan(const struct ng_user *user, unsigned int chan)
+{
+    unsigned int ii;
+    for (ii = 0; ii < user->chan_count; ++ii)
+        if (user->chans[ii] == chan)
+            return 1;
+    return 0;
+}
+
+static void
+make_ban(char *buf, size_t size)
+{
+    const struct ng_user *user;
+    const char *dot;
+
+    user = &users[rng_below(users_used)];
+    dot = strchr(user->host, '.');
+    switch (rng_below(8)) {
+    case 0:
+        snprintf(buf, size, "*!*@%s", user->host);
+        break;
+    case 1:
+        snprintf(buf, size, "*!*@*%s", dot ? dot : ".example.net");
+        break;
+    case 2:
+        snprintf(buf, size, "%s!*@*", user->nick);
+        break;
+    case 3:
+        snprintf(buf, size, "*!%s@*", user->ident);
+        break;
+    case 4:
+        snprintf(buf, size, "*!*@%u.%u.*", 20 + rng_below(2), rng_below(256));
+        break;
+    case 5:
+        snprintf(buf, size, "*!*@%u.%u.%u.0/24", 20 + rng_below(2), rng_below(256), rng_below(256));
+        break;
+    case 6:
+        snprintf(buf, size, "*!*%s*@*dsl*", ident_words[rng_below(ArrayLength(ident_words))]);
+        break;
+    default:
+        snprintf(buf, size, "*%s*!*@*", nick_words[rng_below(ArrayLength(nick_words))]);
+        break;
+    }
+}
+
+struct membership {
+    unsigned int chan;
+    unsigned int user;
+    unsigned int mode;
+};
+
+static int
+membership_compare(const void *a_, const void *b_)
+{
+    const struct membership *a = a_, *b = b_;
+    if (a->chan != b->chan)
+        return (a->chan < b->chan) ? -1 : 1;
+    if (a->mode != b->mode)
+        return (a->mode < b->mode) ? -1 : 1;
+    return (a->user < b->user) ? -1 : (a->user > b->user);
+}
+
+/* Burst channel memberships for users on the given server (or every
+ * server, if srv is UINT_MAX), splitting long lines like ircu does.
+ * Bans are only sent with the initial (full network) burst.
+ */
+static void
+emit_channel_bursts(unsigned int srv)
+{
+    struct membership *list;
+    char line[NG_MAXLINE + 1];
+    char ban[128];
+    const char *origin;
+    unsigned int count, ii, jj, kk, nbans, len, last_mode;
+
+    for (ii = count = 0; ii < users_used; ++ii)
+        if (users[ii].alive && (srv == UINT_MAX || users[ii].server == srv))
+            count += users[ii].chan_count;
+    list = malloc((count + 1) * sizeof(list[0]));
+    for (ii = count = 0; ii < users_used; ++ii) {
+        if (!users[ii].alive || (srv != UINT_MAX && users[ii].server != srv))
+            continue;
+        for (jj = 0; jj < users[ii].chan_count; ++jj) {
+            list[count].chan = users[ii].chans[jj];
+            list[count].user = ii;
+            list[count].mode = rng_below(100);
+            list[count].mode = (list[count].mode < 4) ? 2 : (list[count].mode < 8) ? 1 : 0;
+            count++;
+        }
+    }
+    qsort(list, count, sizeof(list[0]), membership_compare);
+    origin = servers[srv == UINT_MAX ? 0 : srv].numeric;
+
+    for (ii = 0; ii < count; ii = jj) {
+        struct ng_channel *chan = &chans[list[ii].chan];
+        const char *modes;
+
+        modes = (list[ii].chan % 7 == 0) ? "+ntl 1000" : (list[ii].chan % 5 == 0) ? "+nts" : "+nt";
+        len = 0;
+        last_mode = 0;
+        for (jj = ii; jj < count && list[jj].chan == list[ii].chan; ++jj) {
+            const char *suffix = "";
+            if (list[jj].mode != last_mode) {
+                suffix = (list[jj].mode == 2) ? ":o" : ":v";
+                last_mode = list[jj].mode;
+            }
+            if (len > NG_MAXLINE - 80) {
+                emit("%s", line);
+                len = 0;
+                suffix = (last_mode == 2) ? ":o" : (last_mode == 1) ? ":v" : "";
+            }
+            if (!len && jj == ii)
+                len = snprintf(line, sizeof(line), "%s B %s %lu %s %s%s", origin, chan->name, chan->ts,
+                               modes, user_numeric(&users[list[jj].user]), suffix);
+            else if (!len)
+                len = snprintf(line, sizeof(line), "%s B %s %lu %s%s", origin, chan->name, chan->ts,
+                               user_numeric(&users[list[jj].user]), suffix);
+            else
+                len += snprintf(line + len, sizeof(line) - len, ",%s%s", user_numeric(&users[list[jj].user]), suffix);
+        }
+        if (len)
+            emit("%s", line);
+
+        if (srv != UINT_MAX)
+            continue;
+        /* Bigger channels tend to carry more bans. */
+        nbans = max_bans * (chan_cdf[0] / pow(list[ii].chan + 1, zipf_s)) / chan_cdf[0];
+        nbans += rng_below(max_bans / 10 + 1);
+        if (nbans > max_bans)
+            nbans = max_bans;
+        for (kk = len = 0; kk < nbans; ++kk) {
+            make_ban(ban, sizeof(ban));
+            if (len && len + strlen(ban) > NG_MAXLINE - 8) {
+                emit("%s", line);
+                len = 0;
+            }
+            if (!len)
+                len = snprintf(line, sizeof(line), "%s B %s %lu :%%%s", origin, chan->name, chan->ts, ban);
+            else
+                len += snprintf(line + len, sizeof(line) - len, " %s", ban);
+        }
+        if (len)
+            emit("%s", line);
+    }
+    free(list);
+}
+
+static void
+emit_gline(void)
+{
+    char mask[80];
+    unsigned int a = 20 + rng_below(2), b = rng_below(256), c = rng_below(256);
+
+    switch (rng_below(10)) {
+    case 0: case 1: case 2: case 3:
+        snprintf(mask, sizeof(mask), "*@%u.%u.%u.%u", a, b, c, 1 + rng_below(254));
+        break;
+    case 4: case 5:
+        snprintf(mask, sizeof(mask), "*@%u.%u.%u.0/24", a, b, c);
+        break;
+    case 6:
+        snprintf(mask, sizeof(mask), "*@2001:db8:%x::/48", 1 + rng_below(n_isps));
+        break;
+    case 7: case 8:
+        snprintf(mask, sizeof(mask), "*@*.%s", isps[rng_below(n_isps)].domain);
+        break;
+    default:
+        snprintf(mask, sizeof(mask), "*%s@*%s*", ident_words[rng_below(ArrayLength(ident_words))],
+                 isp_words[rng_below(ArrayLength(isp_words))]);
+        break;
+    }
+    emit("%s GL * +%s %u %lu 0 :Generated G-line %lu", servers[0].numeric, mask,
+         3600 + rng_below(86400 * 30), now, ++gline_serial);
+}
+
+static void
+join_random(struct ng_user *user, int announce)
+{
+    unsigned int chan;
+    struct ng_channel *cn;
+
+    if (user->chan_count >= NG_MAX_UCHANS)
+        return;
+    chan = cdf_sample(chan_cdf, n_chans);
+    if (user_in_chan(user, chan))
+        return;
+    cn = &chans[chan];
+    if (!cn->members)
+        cn->ts = now;
+    cn->members++;
+    user->chans[user->chan_count++] = chan;
+    if (announce)
+        emit("%s %s %s %lu", user_numeric(user), cn->members == 1 ? "C" : "J", cn->name, cn->ts);
+}
+
+static void
+part_index(struct ng_user *user, unsigned int idx, int announce)
+{
+    struct ng_channel *cn = &chans[user->chans[idx]];
+
+    cn->members--;
+    if (announce)
+        emit("%s L %s :%s", user_numeric(user), cn->name, msg_words[rng_below(ArrayLength(msg_words))]);
+    user->chans[idx] = user->chans[--user->chan_count];
+}
+
+static struct ng_user *
+random_live_user(void)
+{
+    unsigned int tries, idx;
+
+    for (tries = 0; tries < 64; ++tries) {
+        idx = rng_below(users_used);
+        if (users[idx].alive)
+            return &users[idx];
+    }
+    return NULL;
+}
+
+static void
+connect_user(struct ng_user *user, int announce)
+{
+    unsigned int nchans;
+
+    if (!alloc_slot(user))
+        return;
+    user->alive = 1;
+    if (announce)
+        emit_user(user);
+    if (rng_percent(10))
+        return;
+    for (nchans = 1; nchans < NG_MAX_UCHANS && rng_percent(55); ++nchans) ;
+    while (nchans--)
+        join_random(user, announce);
+}
+
+static void
+quit_user(struct ng_user *user, int announce)
+{
+    if (announce)
+        emit("%s Q :Quit: %s", user_numeric(user), msg_words[rng_below(ArrayLength(msg_words))]);
+    while (user->chan_count)
+        part_index(user, 0, 0);
+    user->alive = 0;
+    free_slot(user);
+}
+
+static void
+split_server(unsigned int idx)
+{
+    unsigned int ii;
+
+    emit("%s SQ %s %lu :Ping timeout", servers[0].numeric, servers[idx].name, now);
+    servers[idx].linked = 0;
+    for (ii = 0; ii < users_used; ++ii)
+        if (users[ii].alive && users[ii].server == idx) {
+            /* Keep channel list so the netjoin can burst it back. */
+            unsigned int jj;
+            for (jj = 0; jj < users[ii].chan_count; ++jj)
+                chans[users[ii].chans[jj]].members--;
+            users[ii].alive = 0;
+        }
+}
+
+static void
+rejoin_server(unsigned int idx)
+{
+    unsigned int ii, jj;
+
+    now += 30 + rng_below(300);
+    servers[idx].linked = 1;
+    emit_server(idx);
+    for (ii = 0; ii < users_used; ++ii) {
+        if (users[ii].server != idx || server_slots[idx][users[ii].num_local] != ii || users[ii].alive)
+            continue;
+        users[ii].alive = 1;
+        for (jj = 0; jj < users[ii].chan_count; ++jj)
+            if (!chans[users[ii].chans[jj]].members++)
+                chans[users[ii].chans[jj]].ts = now;
+        emit_user(&users[ii]);
+    }
+    emit_channel_bursts(idx);
+    emit("%s EB", servers[idx].numeric);
+}
+
+static void
+traffic_event(void)
+{
+    struct ng_user *user;
+    unsigned int roll;
+
+    roll = rng_below(100);
+    if (roll < 8 || !(user = random_live_user())) {
+        if (users_used < users_alloc) {
+            user = &users[users_used];
+            make_user(user);
+            users_used++;
+            connect_user(user, 1);
+        }
+        return;
+    }
+
+    if (roll < 16) {
+        quit_user(user, 1);
+    } else if (roll < 46) {
+        if (user->chan_count)
+            emit("%s P %s :%s", user_numeric(user), chans[user->chans[rng_below(user->chan_count)]].name,
+                 msg_words[rng_below(ArrayLength(msg_words))]);
+    } else if (roll < 61) {
+        join_random(user, 1);
+    } else if (roll < 73) {
+        if (user->chan_count)
+            part_index(user, rng_below(user->chan_count), 1);
+    } else if (roll < 81) {
+        make_nick(user);
+        emit("%s N %s %lu", user_numeric(user), user->nick, now);
+    } else if (roll < 93) {
+        const char *fmt, *pos;
+        char text[128];
+        unsigned int len;
+
+        fmt = service_commands[rng_below(ArrayLength(service_commands))];
+        for (pos = fmt, len = 0; *pos && len < sizeof(text) - NG_CHANLEN - NG_NICKLEN; ++pos) {
+            if (pos[0] == '%' && pos[1] == 'n') {
+                const struct ng_user *other = random_live_user();
+                len += sprintf(text + len, "%s", other ? other->nick : user->nick);
+                pos++;
+            } else if (pos[0] == '%' && pos[1] == 'c') {
+                len += sprintf(text + len, "%s", chans[cdf_sample(chan_cdf, n_chans)].name);
+                pos++;
+            } else
+                text[len++] = *pos;
+        }
+        text[len] = '\0';
+        emit("%s P %s@%s :%s", user_numeric(user), service_bots[rng_below(n_service_bots)], services_name, text);
+    } else if (roll < 97) {
+        if (rng_percent(50))
+            emit("%s A :%s", user_numeric(user), msg_words[rng_below(ArrayLength(msg_words))]);
+        else
+            emit("%s A", user_numeric(user));
+    } else if (roll < 99) {
+        emit_gline();
+    } else {
+        emit("%s GL * -*@%u.%u.%u.%u %lu", servers[0].numeric, 20 + rng_below(2),
+             rng_below(256), rng_below(256), 1 + rng_below(254), now);
+    }
+}
+
+/* Introduce an oper on the hub, give it an account (the first account
+ * registered gets full OpServ access), turn on profiling and have it
+ * run TRACE COUNT searches; STATS COMMANDS then shows what they cost. */
+static void
+emit_searches(void)
+{
+    unsigned int ii;
+
+    emit("%s N SearchOper 1 %lu oper oper.generated.example.net +o AAAAAA %s]]] :Benchmark oper",
+         servers[0].numeric, now, servers[0].numeric);
+    emit("%s]]] P NickServ@%s :REGISTER searchoper secret99", servers[0].numeric, services_name);
+    emit("%s]]] P OpServ@%s :PROFILE ON", servers[0].numeric, services_name);
+    emit("%s]]] P OpServ@%s :PROFILE RESET", servers[0].numeric, services_name);
+    for (ii = 0; ii < n_searches; ++ii)
+        emit("%s]]] P OpServ@%s :TRACE COUNT %s", servers[0].numeric, services_name,
+             search_criteria[ii % ArrayLength(search_criteria)]);
+    emit("%s]]] P OpServ@%s :STATS COMMANDS", servers[0].numeric, services_name);
+}
+
+static void
+usage(const char *exe_name)
+{
+    fprintf(stderr, "Usage: %s [options] > replay.log\n"
+            " -s servers    number of leaf servers behind the hub (default 4)\n"
+            " -u users      number of users in the initial burst (default 10000)\n"
+            " -c channels   number of distinct channels (default users/8)\n"
+            " -z exponent   Zipf exponent for channel sizes (default 1.0)\n"
+            " -b bans       maximum bans on the biggest channel (default 10)\n"
+            " -g glines     number of G-lines in the burst (default 1000)\n"
+            " -t events     steady-state traffic events after the burst (default users)\n"
+            " -e rate       traffic events per simulated second (default 100)\n"
+            " -S interval   split and rejoin a leaf every <interval> events (default never)\n"
+            " -a percent    percentage of users that arrive with an account stamp (default 0)\n"
+            " -i isps       number of simulated ISPs (default 200)\n"
+            " -B bots       comma-separated service bot nicks (default NickServ,ChanServ,OpServ)\n"
+            " -O searches   finish with this many OpServ TRACE COUNT searches (default 0)\n"
+            " -n name       services server name (default srvx.test.net)\n"
+            " -x numeric    services server numeric, never used for generated servers (default 10)\n"
+            " -p password   uplink password (default \"password\")\n"
+            " -T time       starting timestamp (default 1700000000)\n"
+            " -r seed       random seed\n",
+            exe_name);
+}
+
+int
+main(int argc, char *argv[])
+{
+    char *bots = NULL, *bot;
+    unsigned int ii, jj, numeric;
+    int c;
+
+    while ((c = getopt(argc, argv, "s:u:c:z:b:g:t:e:S:a:i:B:O:n:x:p:T:r:h")) != -1) {
+        switch (c) {
+        case 's': n_servers = strtoul(optarg, NULL, 0); break;
+        case 'u': n_users = strtoul(optarg, NULL, 0); break;
+        case 'c': n_chans = strtoul(optarg, NULL, 0); break;
+        case 'z': zipf_s = strtod(optarg, NULL); break;
+        case 'b': max_bans = strtoul(optarg, NULL, 0); break;
+        case 'g': n_glines = strtoul(optarg, NULL, 0); break;
+        case 't': n_events = strtoul(optarg, NULL, 0); break;
+        case 'e': event_rate = strtoul(optarg, NULL, 0); break;
+        case 'S': split_every = strtoul(optarg, NULL, 0); break;
+        case 'a': account_permille = 10 * strtoul(optarg, NULL, 0); break;
+        case 'i': n_isps = strtoul(optarg, NULL, 0); break;
+        case 'B': bots = optarg; break;
+        case 'O': n_searches = strtoul(optarg, NULL, 0); break;
+        case 'n': services_name = optarg; break;
+        case 'x': services_numeric = strtoul(optarg, NULL, 0); break;
+        case 'p': password = optarg; break;
+        case 'T': now = strtoul(optarg, NULL, 0); break;
+        case 'r': rng_state ^= strtoull(optarg, NULL, 0) * 0x9E3779B97F4A7C15ULL; break;
+        case 'h':
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!n_chans)
+        n_chans = n_users / 8 + 1;
+    if (!n_events)
+        n_events = n_users;
+    if (!event_rate)
+        event_rate = 1;
+    if (!n_isps || n_isps > 4096)
+        n_isps = 200;
+    if (n_servers + 1 >= NG_MAX_SERVERS) {
+        fprintf(stderr, "Too many servers (at most %u).\n", NG_MAX_SERVERS - 2);
+        return 1;
+    }
+    if (n_users > (n_servers ? n_servers : 1) * (double)NG_SERVER_USERS) {
+        fprintf(stderr, "%u users need at least %u leaf servers.\n", n_users, n_users / NG_SERVER_USERS + 1);
+        return 1;
+    }
+    if (!rng_state)
+        rng_state = 1;
+    for (bot = strtok(bots ? bots : strdup("NickServ,ChanServ,OpServ"), ",");
+         bot && n_service_bots < ArrayLength(service_bots);
+         bot = strtok(NULL, ","))
+        service_bots[n_service_bots++] = bot;
+    if (!n_service_bots) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    /* Build the simulated world. */
+    servers = calloc(n_servers + 1, sizeof(servers[0]));
+    server_slots = calloc(n_servers + 1, sizeof(server_slots[0]));
+    for (ii = 0, numeric = 1; ii <= n_servers; ++ii, ++numeric) {
+        if (numeric == services_numeric)
+            numeric++;
+        ng_inttobase64(servers[ii].numeric, numeric, 2);
+        if (ii)
+            snprintf(servers[ii].name, sizeof(servers[ii].name), "leaf%u.generated.example.net", ii);
+        else
+            strcpy(servers[ii].name, "hub.generated.example.net");
+        servers[ii].linked = 1;
+        server_slots[ii] = malloc(NG_SERVER_USERS * sizeof(server_slots[ii][0]));
+        for (jj = 0; jj < NG_SERVER_USERS; ++jj)
+            server_slots[ii][jj] = UINT_MAX;
+    }
+    isps = calloc(n_isps, sizeof(isps[0]));
+    for (ii = 0; ii < n_isps; ++ii) {
+        snprintf(isps[ii].domain, sizeof(isps[ii].domain), "%s%u.%s",
+                 isp_words[ii % ArrayLength(isp_words)], ii, isp_tlds[rng_below(ArrayLength(isp_tlds))]);
+        isps[ii].pattern = rng_below(5);
+        isps[ii].v4_hi = ii;
+    }
+    isp_cdf = zipf_cdf(n_isps, 0.9);
+    chans = calloc(n_chans, sizeof(chans[0]));
+    for (ii = 0; ii < n_chans; ++ii) {
+        snprintf(chans[ii].name, sizeof(chans[ii].name), "#%s%s%u",
+                 chan_words[ii % ArrayLength(chan_words)], (ii & 16) ? "-" : "", ii);
+        chans[ii].ts = now - rng_below(86400 * 365 * 3);
+    }
+    chan_cdf = zipf_cdf(n_chans, zipf_s);
+    users_alloc = n_users + n_events / 8 + 16;
+    users = calloc(users_alloc, sizeof(users[0]));
+    for (users_used = 0; users_used < n_users; ++users_used) {
+        make_user(&users[users_used]);
+        connect_user(&users[users_used], 0);
+    }
+
+    /* Link and burst. */
+    emit("PASS :%s", password);
+    emit("SERVER %s 1 %lu %lu J10 %s]]] +h6 :Generated hub", servers[0].name, now, now, servers[0].numeric);
+    for (ii = 1; ii <= n_servers; ++ii)
+        emit_server(ii);
+    for (ii = 0; ii < users_used; ++ii)
+        emit_user(&users[ii]);
+    emit_channel_bursts(UINT_MAX);
+    for (ii = 0; ii < n_glines; ++ii)
+        emit_gline();
+    for (ii = 1; ii <= n_servers; ++ii)
+        emit("%s EB", servers[ii].numeric);
+    emit("%s EB", servers[0].numeric);
+    emit("%s EA", servers[0].numeric);
+    last_pong = now;
+
+    /* Steady-state traffic. */
+    for (ii = 0; ii < n_events; ++ii) {
+        if (ii && !(ii % event_rate))
+            now++;
+        if (now - last_pong >= 30) {
+            emit("%s Z %s :%s", servers[0].numeric, servers[0].numeric, services_name);
+            last_pong = now;
+        }
+        if (split_every && n_servers && ii && !(ii % split_every)) {
+            unsigned int victim = 1 + rng_below(n_servers);
+            split_server(victim);
+            rejoin_server(victim);
+            continue;
+        }
+        traffic_event();
+    }
+    if (n_searches)
+        emit_searches();
+
+    fprintf(stderr, "Wrote %lu lines: %u servers, %u users (%u total), %u channels, %u G-lines, %u events.\n",
+            lines_written, n_servers + 1, n_users, users_used, n_chans, n_glines, n_events);
+    return 0;
+}
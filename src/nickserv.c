@@ -138,6 +138,9 @@ static dict_t nickserv_nick_dict; /* contains struct nick_info* */
 static dict_t nickserv_opt_dict; /* contains option_func_t* */
 static dict_t nickserv_allow_auth_dict; /* contains struct handle_info* */
 static dict_t nickserv_email_dict; /* contains struct handle_info_list*, indexed by email addr */
+static dict_t nickserv_domain_dict; /* contains struct handle_info_list*, indexed by email domain */
+static dict_t nickserv_registered_dict; /* contains struct handle_info*, indexed by registered time and id */
+static dict_t nickserv_lastseen_dict; /* contains struct handle_info*, indexed by lastseen time and id */
 static char handle_inverse_flags[256];
 static unsigned int flag_access_levels[32];
 static const struct message_entry msgtab[] = {
@@ -190,6 +193,7 @@ static const struct message_entry msgtab[] = {
     { "NSMSG_MAX_LOGINS", "Your account already has its limit of %d user(s) logged in." },
     { "NSMSG_STAMPED_REGISTER", "You have already authenticated to an account once this session; you may not register a new account." },
     { "NSMSG_STAMPED_AUTH", "You have already authenticated to an account once this session; you may not authenticate to another." },
+    { "NSMSG_AUTH_PENDING", "Your last password is still being checked; please wait for the answer before trying again." },
     { "NSMSG_STAMPED_RESETPASS", "You have already authenticated to an account once this session; you may not reset your password to authenticate again." },
     { "NSMSG_STAMPED_AUTHCOOKIE",  "You have already authenticated to an account once this session; you may not use a cookie to authenticate to another account." },
     { "NSMSG_TITLE_INVALID", "Titles cannot contain any dots; please choose another." },
@@ -234,6 +238,7 @@ static const struct message_entry msgtab[] = {
     { "NSMSG_NOTE", "Note %d (%s ago by %s): %s" },
     { "NSMSG_NOTE_COUNT", "%u note(s) for %s." },
     { "NSMSG_PASSWORD_INVALID", "Incorrect password; please try again." },
+    { "NSMSG_PASSWORD_STALE", "Account $b%s$b changed while your password was being checked; please try again." },
     { "NSMSG_PLEASE_SET_EMAIL", "We now require email addresses for users.  Please use the $bset email$b command to set your email address!" },
     { "NSMSG_WEAK_PASSWORD", "WARNING: You are using a password that is considered weak (easy to guess).  It is STRONGLY recommended you change it (now, if not sooner) by typing \"/msg $S@$s PASS oldpass newpass\" (with your current password and a new password)." },
     { "NSMSG_HANDLE_SUSPENDED", "Your $b$N$b account has been suspended; you may not use it." },
@@ -470,6 +475,29 @@ register_handle(const char *handle, const char *passwd, unsigned long id)
     return hi;
 }
 
+/* The time indexes are sorted by a fixed-width hex timestamp; the
+ * account ID keeps keys unique and does not change on rename. */
+static void
+handle_time_key(char *key, unsigned long when, const struct handle_info *hi)
+{
+    sprintf(key, "%016lx%016lx", when, hi->id);
+}
+
+static void
+handle_set_time(dict_t index, struct handle_info *hi, unsigned long *field, unsigned long when)
+{
+    char key[40];
+
+    handle_time_key(key, *field, hi);
+    dict_remove(index, key);
+    *field = when;
+    handle_time_key(key, when, hi);
+    dict_insert(index, strdup(key), hi);
+}
+
+#define handle_set_registered(HI, WHEN) handle_set_time(nickserv_registered_dict, (HI), &(HI)->registered, (WHEN))
+#define handle_set_lastseen(HI, WHEN) handle_set_time(nickserv_lastseen_dict, (HI), &(HI)->lastseen, (WHEN))
+
 static void
 register_nick(const char *nick, struct handle_info *owner)
 {
@@ -508,20 +536,24 @@ delete_nick(struct nick_info *ni)
 }
 
 static unreg_func_t *unreg_func_list;
+static struct hook_stat **unreg_func_stats;
 static unsigned int unreg_func_size = 0, unreg_func_used = 0;
 
 void
-reg_unreg_func(unreg_func_t func)
+reg_unreg_func_named(unreg_func_t func, const char *name, const char *file)
 {
     if (unreg_func_used == unreg_func_size) {
         if (unreg_func_size) {
             unreg_func_size <<= 1;
             unreg_func_list = realloc(unreg_func_list, unreg_func_size*sizeof(unreg_func_t));
+            unreg_func_stats = realloc(unreg_func_stats, unreg_func_size*sizeof(unreg_func_stats[0]));
         } else {
             unreg_func_size = 8;
             unreg_func_list = malloc(unreg_func_size*sizeof(unreg_func_t));
+            unreg_func_stats = malloc(unreg_func_size*sizeof(unreg_func_stats[0]));
         }
     }
+    unreg_func_stats[unreg_func_used] = hook_stat_register("unreg", name, file);
     unreg_func_list[unreg_func_used++] = func;
 }
 
@@ -534,11 +566,14 @@ nickserv_free_cookie(void *data)
     free(cookie);
 }
 
+static void nickserv_set_email_addr(struct handle_info *hi, const char *new_email_addr);
+
 static void
 free_handle_info(void *vhi)
 {
     struct handle_info *hi = vhi;
     char id[IDLEN + 1];
+    char key[40];
 
     inttobase64(id, hi->id, IDLEN);
     dict_remove(nickserv_id_dict, id);
@@ -561,12 +596,11 @@ free_handle_info(void *vhi)
         hi->notes = note->next;
         free(note);
     }
-    if (hi->email_addr) {
-        struct handle_info_list *hil = dict_find(nickserv_email_dict, hi->email_addr, NULL);
-        handle_info_list_remove(hil, hi);
-        if (!hil->used)
-            dict_remove(nickserv_email_dict, hi->email_addr);
-    }
+    nickserv_set_email_addr(hi, NULL);
+    handle_time_key(key, hi->registered, hi);
+    dict_remove(nickserv_registered_dict, key);
+    handle_time_key(key, hi->lastseen, hi);
+    dict_remove(nickserv_lastseen_dict, key);
     free(hi);
 }
 
@@ -578,7 +612,7 @@ nickserv_unregister_handle(struct handle_info *hi, struct userNode *notify)
     unsigned int n;
 
     for (n=0; n<unreg_func_used; n++)
-        unreg_func_list[n](notify, hi);
+        HOOK_CALL(unreg_func_stats[n], unreg_func_list[n](notify, hi));
     while (hi->users)
         set_user_handle_info(hi->users, NULL, 0);
     if (notify) {
@@ -845,38 +879,46 @@ is_secure_password(const char *handle, const char *pass, struct userNode *user)
 }
 
 static auth_func_t *auth_func_list;
+static struct hook_stat **auth_func_stats;
 static unsigned int auth_func_size = 0, auth_func_used = 0;
 
 void
-reg_auth_func(auth_func_t func)
+reg_auth_func_named(auth_func_t func, const char *name, const char *file)
 {
     if (auth_func_used == auth_func_size) {
         if (auth_func_size) {
             auth_func_size <<= 1;
             auth_func_list = realloc(auth_func_list, auth_func_size*sizeof(auth_func_t));
+            auth_func_stats = realloc(auth_func_stats, auth_func_size*sizeof(auth_func_stats[0]));
         } else {
             auth_func_size = 8;
             auth_func_list = malloc(auth_func_size*sizeof(auth_func_t));
+            auth_func_stats = malloc(auth_func_size*sizeof(auth_func_stats[0]));
         }
     }
+    auth_func_stats[auth_func_used] = hook_stat_register("auth", name, file);
     auth_func_list[auth_func_used++] = func;
 }
 
 static handle_rename_func_t *rf_list;
+static struct hook_stat **rf_stats;
 static unsigned int rf_list_size, rf_list_used;
 
 void
-reg_handle_rename_func(handle_rename_func_t func)
+reg_handle_rename_func_named(handle_rename_func_t func, const char *name, const char *file)
 {
     if (rf_list_used == rf_list_size) {
         if (rf_list_size) {
             rf_list_size <<= 1;
             rf_list = realloc(rf_list, rf_list_size*sizeof(rf_list[0]));
+            rf_stats = realloc(rf_stats, rf_list_size*sizeof(rf_stats[0]));
         } else {
             rf_list_size = 8;
             rf_list = malloc(rf_list_size*sizeof(rf_list[0]));
+            rf_stats = malloc(rf_list_size*sizeof(rf_stats[0]));
         }
     }
+    rf_stats[rf_list_used] = hook_stat_register("handle_rename", name, file);
     rf_list[rf_list_used++] = func;
 }
 
@@ -968,16 +1010,17 @@ set_user_handle_info(struct userNode *user, struct handle_info *hi, int stamp)
         if (!user->handle_info->users && !user->handle_info->opserv_level)
             HANDLE_CLEAR_FLAG(user->handle_info, HELPING);
         /* record them as being last seen at this time */
-        user->handle_info->lastseen = now;
+        handle_set_lastseen(user->handle_info, now);
         /* and record their hostmask */
         snprintf(user->handle_info->last_quit_host, sizeof(user->handle_info->last_quit_host), "%s@%s", user->ident, user->hostname);
     }
     old_info = user->handle_info;
     user->handle_info = hi;
+    user_forms_invalidate(user);
     if (hi && !hi->users && !hi->opserv_level)
         HANDLE_CLEAR_FLAG(hi, HELPING);
     for (n=0; n<auth_func_used; n++) {
-        auth_func_list[n](user, old_info);
+        HOOK_CALL(auth_func_stats[n], auth_func_list[n](user, old_info));
         if (user->dead)
             return;
     }
@@ -992,7 +1035,7 @@ set_user_handle_info(struct userNode *user, struct handle_info *hi, int stamp)
         }
         user->next_authed = hi->users;
         hi->users = user;
-        hi->lastseen = now;
+        handle_set_lastseen(hi, now);
         if (IsHelper(user) && !userList_contains(&curr_helpers, user))
             userList_append(&curr_helpers, user);
 
@@ -1040,8 +1083,8 @@ nickserv_register(struct userNode *user, struct userNode *settee, const char *ha
     hi->masks = alloc_string_list(1);
     hi->users = NULL;
     hi->language = lang_C;
-    hi->registered = now;
-    hi->lastseen = now;
+    handle_set_registered(hi, now);
+    handle_set_lastseen(hi, now);
     hi->flags = HI_DEFAULT_FLAGS;
     if (settee && !no_auth)
         set_user_handle_info(settee, hi, 1);
@@ -1163,26 +1206,50 @@ nickserv_free_email_addr(void *data)
     free(data);
 }
 
+/* Both email indexes map a key to a handle_info_list tagged with it. */
 static void
-nickserv_set_email_addr(struct handle_info *hi, const char *new_email_addr)
+nickserv_email_index_del(dict_t index, const char *key, struct handle_info *hi)
 {
     struct handle_info_list *hil;
-    /* Remove from old handle_info_list ... */
-    if (hi->email_addr && (hil = dict_find(nickserv_email_dict, hi->email_addr, 0))) {
+
+    if ((hil = dict_find(index, key, 0))) {
         handle_info_list_remove(hil, hi);
-        if (!hil->used) dict_remove(nickserv_email_dict, hil->tag);
+        if (!hil->used) dict_remove(index, hil->tag);
+    }
+}
+
+static char *
+nickserv_email_index_add(dict_t index, const char *key, struct handle_info *hi)
+{
+    struct handle_info_list *hil;
+
+    if (!(hil = dict_find(index, key, 0))) {
+        hil = calloc(1, sizeof(*hil));
+        hil->tag = strdup(key);
+        handle_info_list_init(hil);
+        dict_insert(index, hil->tag, hil);
+    }
+    handle_info_list_append(hil, hi);
+    return hil->tag;
+}
+
+static void
+nickserv_set_email_addr(struct handle_info *hi, const char *new_email_addr)
+{
+    const char *domain;
+
+    /* Remove from old handle_info_lists ... */
+    if (hi->email_addr) {
+        if ((domain = strrchr(hi->email_addr, '@')))
+            nickserv_email_index_del(nickserv_domain_dict, domain + 1, hi);
+        nickserv_email_index_del(nickserv_email_dict, hi->email_addr, hi);
         hi->email_addr = NULL;
     }
-    /* Add to the new list.. */
+    /* Add to the new lists.. */
     if (new_email_addr) {
-        if (!(hil = dict_find(nickserv_email_dict, new_email_addr, 0))) {
-            hil = calloc(1, sizeof(*hil));
-            hil->tag = strdup(new_email_addr);
-            handle_info_list_init(hil);
-            dict_insert(nickserv_email_dict, hil->tag, hil);
-        }
-        handle_info_list_append(hil, hi);
-        hi->email_addr = hil->tag;
+        hi->email_addr = nickserv_email_index_add(nickserv_email_dict, new_email_addr, hi);
+        if ((domain = strrchr(hi->email_addr, '@')))
+            nickserv_email_index_add(nickserv_domain_dict, domain + 1, hi);
     }
 }
 
@@ -1631,6 +1698,7 @@ static NICKSERV_FUNC(cmd_notes)
 static NICKSERV_FUNC(cmd_rename_handle)
 {
     struct handle_info *hi, *hi_tmp;
+    struct userNode *target;
     char msgbuf[MAXLEN], *old_handle;
     unsigned int nn;
 
@@ -1656,8 +1724,10 @@ static NICKSERV_FUNC(cmd_rename_handle)
     dict_remove2(nickserv_handle_dict, old_handle = hi->handle, 1);
     hi->handle = strdup(argv[2]);
     dict_insert(nickserv_handle_dict, hi->handle, hi);
+    for (target = hi->users; target; target = target->next_authed)
+        user_forms_invalidate(target);
     for (nn=0; nn<rf_list_used; nn++)
-        rf_list[nn](hi, old_handle);
+        HOOK_CALL(rf_stats[nn], rf_list[nn](hi, old_handle));
     snprintf(msgbuf, sizeof(msgbuf), "%s renamed account %s to %s.", user->handle_info->handle, old_handle, hi->handle);
     reply("NSMSG_HANDLE_CHANGED", old_handle, hi->handle);
     global_message(MESSAGE_RECIPIENT_STAFF, msgbuf);
@@ -1666,29 +1736,200 @@ static NICKSERV_FUNC(cmd_rename_handle)
 }
 
 static failpw_func_t *failpw_func_list;
+static struct hook_stat **failpw_func_stats;
 static unsigned int failpw_func_size = 0, failpw_func_used = 0;
 
 void
-reg_failpw_func(failpw_func_t func)
+reg_failpw_func_named(failpw_func_t func, const char *name, const char *file)
 {
     if (failpw_func_used == failpw_func_size) {
         if (failpw_func_size) {
             failpw_func_size <<= 1;
             failpw_func_list = realloc(failpw_func_list, failpw_func_size*sizeof(failpw_func_t));
+            failpw_func_stats = realloc(failpw_func_stats, failpw_func_size*sizeof(failpw_func_stats[0]));
         } else {
             failpw_func_size = 8;
             failpw_func_list = malloc(failpw_func_size*sizeof(failpw_func_t));
+            failpw_func_stats = malloc(failpw_func_size*sizeof(failpw_func_stats[0]));
         }
     }
+    failpw_func_stats[failpw_func_used] = hook_stat_register("failpw", name, file);
     failpw_func_list[failpw_func_used++] = func;
 }
 
+/* Passwords for AUTH, PASS and CHECKPASS are checked on the worker
+ * pool, so these requests carry what each command needs once the
+ * result comes back.  The account is remembered by name, along with
+ * the hash the password was checked against; user is cleared if the
+ * user quits, and handle when NickServ shuts down. */
+struct nickserv_pass_req {
+    struct userNode *user;
+    struct userNode *bot;
+    char *handle;
+    char crypted[MD5_CRYPT_LENGTH];
+    char *passwd;
+    unsigned int auth : 1;
+    struct nickserv_pass_req *next;
+};
+
+static struct nickserv_pass_req *nickserv_pass_reqs;
+
+static struct nickserv_pass_req *
+nickserv_pass_req_new(struct userNode *user, struct userNode *bot, struct handle_info *hi, const char *passwd)
+{
+    struct nickserv_pass_req *req;
+
+    req = calloc(1, sizeof(*req));
+    req->user = user;
+    req->bot = bot;
+    req->handle = strdup(hi->handle);
+    safestrncpy(req->crypted, hi->passwd, sizeof(req->crypted));
+    req->passwd = passwd ? strdup(passwd) : NULL;
+    req->next = nickserv_pass_reqs;
+    nickserv_pass_reqs = req;
+    return req;
+}
+
+static void
+nickserv_pass_req_free(struct nickserv_pass_req *req)
+{
+    struct nickserv_pass_req **pp;
+
+    for (pp = &nickserv_pass_reqs; *pp != req; pp = &(*pp)->next) ;
+    *pp = req->next;
+    if (req->passwd) {
+        memset(req->passwd, 0, strlen(req->passwd));
+        free(req->passwd);
+    }
+    free(req->handle);
+    free(req);
+}
+
+/* Finds the account a request is for.  If the account was dropped or
+ * renamed, or its password changed, while the request was pending,
+ * the result no longer applies: tell the user (if any) to try again
+ * and return NULL. */
+static struct handle_info *
+nickserv_pass_req_account(struct nickserv_pass_req *req)
+{
+    struct handle_info *hi;
+
+    if (!req->handle)
+        return NULL;
+    if ((hi = get_handle_info(req->handle)) && !strcmp(hi->passwd, req->crypted))
+        return hi;
+    if (req->user)
+        send_message(req->user, req->bot, "NSMSG_PASSWORD_STALE", req->handle);
+    return NULL;
+}
+
+static int
+nickserv_auth_pending(struct userNode *user)
+{
+    struct nickserv_pass_req *req;
+
+    for (req = nickserv_pass_reqs; req; req = req->next)
+        if (req->auth && (req->user == user))
+            return 1;
+    return 0;
+}
+
+static void
+nickserv_rehash_done(void *data, const char *crypted)
+{
+    struct nickserv_pass_req *req = data;
+    struct handle_info *hi;
+
+    if ((hi = nickserv_pass_req_account(req)))
+        safestrncpy(hi->passwd, crypted, sizeof(hi->passwd));
+    nickserv_pass_req_free(req);
+}
+
+static void
+nickserv_auth_checked(void *data, int matched)
+{
+    struct nickserv_pass_req *req = data;
+    struct userNode *user = req->user, *other;
+    struct handle_info *hi;
+    int used, maxlogins;
+
+    if (!user || !req->handle)
+        goto out;
+    /* A gag drops further AUTH lines, so it also drops answers that
+     * were still pending when it was placed. */
+    if (IsGagged(user))
+        goto out;
+    if (user->handle_info) {
+        send_message(user, req->bot, "NSMSG_ALREADY_AUTHED", user->handle_info->handle);
+        goto out;
+    }
+    if (!(hi = nickserv_pass_req_account(req)))
+        goto out;
+    if (!matched) {
+        unsigned int n;
+        send_message_type(4, user, req->bot,
+                          handle_find_message(hi, "NSMSG_PASSWORD_INVALID"));
+        for (n=0; n<failpw_func_used; n++)
+            HOOK_CALL(failpw_func_stats[n], failpw_func_list[n](user, hi));
+        if (nickserv_conf.autogag_enabled) {
+            if (!user->auth_policer.params) {
+                user->auth_policer.last_req = now;
+                user->auth_policer.params = nickserv_conf.auth_policer_params;
+            }
+            if (!policer_conforms(&user->auth_policer, now, 1.0)) {
+                char *hostmask;
+                hostmask = generate_hostmask(user, GENMASK_STRICT_HOST|GENMASK_BYIP|GENMASK_NO_HIDING);
+                log_module(NS_LOG, LOG_INFO, "%s auto-gagged for repeated password guessing.", hostmask);
+                gag_create(hostmask, nickserv->nick, "Repeated password guessing.", now+nickserv_conf.autogag_duration);
+                free(hostmask);
+            }
+        }
+        goto out;
+    }
+    /* Nor does a right guess count once the guessing has tripped the
+     * auth policer. */
+    if (user->auth_policer.params && !policer_conforms(&user->auth_policer, now, 0.0))
+        goto out;
+    if (HANDLE_FLAGGED(hi, SUSPENDED)) {
+        send_message_type(4, user, req->bot,
+                          handle_find_message(hi, "NSMSG_HANDLE_SUSPENDED"));
+        goto out;
+    }
+    maxlogins = hi->maxlogins ? hi->maxlogins : nickserv_conf.default_maxlogins;
+    for (used = 0, other = hi->users; other; other = other->next_authed) {
+        if (++used >= maxlogins) {
+            send_message_type(4, user, req->bot,
+                              handle_find_message(hi, "NSMSG_MAX_LOGINS"),
+                              maxlogins);
+            goto out;
+        }
+    }
+
+    set_user_handle_info(user, hi, 1);
+    if (nickserv_conf.email_required && !hi->email_addr)
+        send_message(user, req->bot, "NSMSG_PLEASE_SET_EMAIL");
+    if (!is_secure_password(hi->handle, req->passwd, NULL))
+        send_message(user, req->bot, "NSMSG_WEAK_PASSWORD");
+    if (hi->passwd[0] != '^')
+        cryptpass_async(req->passwd, nickserv_rehash_done, nickserv_pass_req_new(NULL, req->bot, hi, NULL));
+    if (!hi->masks->used) {
+        irc_in_addr_t ip;
+        string_list_append(hi->masks, generate_hostmask(user, GENMASK_OMITNICK|GENMASK_NO_HIDING|GENMASK_ANY_IDENT));
+        if (irc_in_addr_is_valid(user->ip) && irc_pton(&ip, NULL, user->hostname))
+            string_list_append(hi->masks, generate_hostmask(user, GENMASK_OMITNICK|GENMASK_BYIP|GENMASK_NO_HIDING|GENMASK_ANY_IDENT));
+    }
+    if (IsRemoteOper(hi))
+        irc_remote_oper(user, 0);
+    send_message(user, req->bot, "NSMSG_AUTH_SUCCESS");
+  out:
+    nickserv_pass_req_free(req);
+}
+
 static NICKSERV_FUNC(cmd_auth)
 {
-    int pw_arg, used, maxlogins;
+    int pw_arg;
     struct handle_info *hi;
-    const char *passwd;
-    struct userNode *other;
+    struct nickserv_pass_req *req;
 
     if (user->handle_info) {
         reply("NSMSG_ALREADY_AUTHED", user->handle_info->handle);
@@ -1701,6 +1942,10 @@ static NICKSERV_FUNC(cmd_auth)
         reply("NSMSG_STAMPED_AUTH");
         return 0;
     }
+    if (nickserv_auth_pending(user)) {
+        reply("NSMSG_AUTH_PENDING");
+        return 0;
+    }
     if (argc == 3) {
         hi = dict_find(nickserv_handle_dict, argv[1], NULL);
         pw_arg = 2;
@@ -1731,7 +1976,6 @@ static NICKSERV_FUNC(cmd_auth)
         return 0;
     }
     /* Responses from here on look up the language used by the handle they asked about. */
-    passwd = argv[pw_arg];
     if (!valid_user_for(user, hi)) {
         if (hi->email_addr && nickserv_conf.email_enabled)
             send_message_type(4, user, cmd->parent->bot,
@@ -1744,80 +1988,33 @@ static NICKSERV_FUNC(cmd_auth)
         argv[pw_arg] = "BADMASK";
         return 1;
     }
-    if (!checkpass(passwd, hi->passwd)) {
-        unsigned int n;
-        send_message_type(4, user, cmd->parent->bot,
-                          handle_find_message(hi, "NSMSG_PASSWORD_INVALID"));
-        argv[pw_arg] = "BADPASS";
-        for (n=0; n<failpw_func_used; n++) failpw_func_list[n](user, hi);
-        if (nickserv_conf.autogag_enabled) {
-            if (!user->auth_policer.params) {
-                user->auth_policer.last_req = now;
-                user->auth_policer.params = nickserv_conf.auth_policer_params;
-            }
-            if (!policer_conforms(&user->auth_policer, now, 1.0)) {
-                char *hostmask;
-                hostmask = generate_hostmask(user, GENMASK_STRICT_HOST|GENMASK_BYIP|GENMASK_NO_HIDING);
-                log_module(NS_LOG, LOG_INFO, "%s auto-gagged for repeated password guessing.", hostmask);
-                gag_create(hostmask, nickserv->nick, "Repeated password guessing.", now+nickserv_conf.autogag_duration);
-                free(hostmask);
-                argv[pw_arg] = "GAGGED";
-            }
-        }
-        return 1;
-    }
-    if (HANDLE_FLAGGED(hi, SUSPENDED)) {
-        send_message_type(4, user, cmd->parent->bot,
-                          handle_find_message(hi, "NSMSG_HANDLE_SUSPENDED"));
-        argv[pw_arg] = "SUSPENDED";
-        return 1;
-    }
-    maxlogins = hi->maxlogins ? hi->maxlogins : nickserv_conf.default_maxlogins;
-    for (used = 0, other = hi->users; other; other = other->next_authed) {
-        if (++used >= maxlogins) {
-            send_message_type(4, user, cmd->parent->bot,
-                              handle_find_message(hi, "NSMSG_MAX_LOGINS"),
-                              maxlogins);
-            argv[pw_arg] = "MAXLOGINS";
-            return 1;
-        }
-    }
-
-    set_user_handle_info(user, hi, 1);
-    if (nickserv_conf.email_required && !hi->email_addr)
-        reply("NSMSG_PLEASE_SET_EMAIL");
-    if (!is_secure_password(hi->handle, passwd, NULL))
-        reply("NSMSG_WEAK_PASSWORD");
-    if (hi->passwd[0] != '^')
-        cryptpass(passwd, hi->passwd);
-    if (!hi->masks->used) {
-        irc_in_addr_t ip;
-        string_list_append(hi->masks, generate_hostmask(user, GENMASK_OMITNICK|GENMASK_NO_HIDING|GENMASK_ANY_IDENT));
-        if (irc_in_addr_is_valid(user->ip) && irc_pton(&ip, NULL, user->hostname))
-            string_list_append(hi->masks, generate_hostmask(user, GENMASK_OMITNICK|GENMASK_BYIP|GENMASK_NO_HIDING|GENMASK_ANY_IDENT));
-    }
-    if (IsRemoteOper(hi))
-        irc_remote_oper(user, 0);
+    /* The rest happens in nickserv_auth_checked(). */
+    req = nickserv_pass_req_new(user, cmd->parent->bot, hi, argv[pw_arg]);
+    req->auth = 1;
+    checkpass_async(argv[pw_arg], hi->passwd, nickserv_auth_checked, req);
     argv[pw_arg] = "****";
-    reply("NSMSG_AUTH_SUCCESS");
     return 1;
 }
 
 static allowauth_func_t *allowauth_func_list;
+static struct hook_stat **allowauth_func_stats;
 static unsigned int allowauth_func_size = 0, allowauth_func_used = 0;
 
 void
-reg_allowauth_func(allowauth_func_t func)
+reg_allowauth_func_named(allowauth_func_t func, const char *name, const char *file)
 {
     if (allowauth_func_used == allowauth_func_size) {
         if (allowauth_func_size) {
             allowauth_func_size <<= 1;
             allowauth_func_list = realloc(allowauth_func_list, allowauth_func_size*sizeof(allowauth_func_t));
+            allowauth_func_stats = realloc(allowauth_func_stats, allowauth_func_size*sizeof(allowauth_func_stats[0]));
         } else {
             allowauth_func_size = 8;
             allowauth_func_list = malloc(allowauth_func_size*sizeof(allowauth_func_t));
+            allowauth_func_stats = malloc(allowauth_func_size*sizeof(allowauth_func_stats[0]));
         }
     }
+    allowauth_func_stats[allowauth_func_used] = hook_stat_register("allowauth", name, file);
     allowauth_func_list[allowauth_func_used++] = func;
 }
 
@@ -1872,7 +2069,7 @@ static NICKSERV_FUNC(cmd_allowauth)
             reply("NSMSG_AUTH_UNSPECIAL", target->nick);
     }
     for (n=0; n<allowauth_func_used; n++)
-        allowauth_func_list[n](user, target, hi);
+        HOOK_CALL(allowauth_func_stats[n], allowauth_func_list[n](user, target, hi));
     return 1;
 }
 
@@ -2098,9 +2295,42 @@ static NICKSERV_FUNC(cmd_regnick) {
     return 1;
 }
 
+static void
+nickserv_pass_crypted(void *data, const char *crypted)
+{
+    struct nickserv_pass_req *req = data;
+    struct handle_info *hi;
+
+    if ((hi = nickserv_pass_req_account(req))) {
+        safestrncpy(hi->passwd, crypted, sizeof(hi->passwd));
+        if (req->user)
+            send_message(req->user, req->bot, "NSMSG_PASS_SUCCESS");
+    }
+    nickserv_pass_req_free(req);
+}
+
+static void
+nickserv_pass_checked(void *data, int matched)
+{
+    struct nickserv_pass_req *req = data;
+
+    if (!nickserv_pass_req_account(req)) {
+        nickserv_pass_req_free(req);
+        return;
+    }
+    if (!matched) {
+        if (req->user)
+            send_message(req->user, req->bot, "NSMSG_PASSWORD_INVALID");
+        nickserv_pass_req_free(req);
+        return;
+    }
+    cryptpass_async(req->passwd, nickserv_pass_crypted, req);
+}
+
 static NICKSERV_FUNC(cmd_pass)
 {
     struct handle_info *hi;
+    struct nickserv_pass_req *req;
     const char *old_pass, *new_pass;
 
     NICKSERV_MIN_PARMS(3);
@@ -2109,14 +2339,9 @@ static NICKSERV_FUNC(cmd_pass)
     new_pass = argv[2];
     argv[2] = "****";
     if (!is_secure_password(hi->handle, new_pass, user)) return 0;
-    if (!checkpass(old_pass, hi->passwd)) {
-        argv[1] = "BADPASS";
-        reply("NSMSG_PASSWORD_INVALID");
-        return 0;
-    }
-    cryptpass(new_pass, hi->passwd);
+    req = nickserv_pass_req_new(user, cmd->parent->bot, hi, new_pass);
+    checkpass_async(old_pass, hi->passwd, nickserv_pass_checked, req);
     argv[1] = "****";
-    reply("NSMSG_PASS_SUCCESS");
     return 1;
 }
 
@@ -3121,20 +3346,24 @@ nickserv_saxdb_write(struct saxdb_context *ctx) {
 }
 
 static handle_merge_func_t *handle_merge_func_list;
+static struct hook_stat **handle_merge_func_stats;
 static unsigned int handle_merge_func_size = 0, handle_merge_func_used = 0;
 
 void
-reg_handle_merge_func(handle_merge_func_t func)
+reg_handle_merge_func_named(handle_merge_func_t func, const char *name, const char *file)
 {
     if (handle_merge_func_used == handle_merge_func_size) {
         if (handle_merge_func_size) {
             handle_merge_func_size <<= 1;
             handle_merge_func_list = realloc(handle_merge_func_list, handle_merge_func_size*sizeof(handle_merge_func_t));
+            handle_merge_func_stats = realloc(handle_merge_func_stats, handle_merge_func_size*sizeof(handle_merge_func_stats[0]));
         } else {
             handle_merge_func_size = 8;
             handle_merge_func_list = malloc(handle_merge_func_size*sizeof(handle_merge_func_t));
+            handle_merge_func_stats = malloc(handle_merge_func_size*sizeof(handle_merge_func_stats[0]));
         }
     }
+    handle_merge_func_stats[handle_merge_func_used] = hook_stat_register("handle_merge", name, file);
     handle_merge_func_list[handle_merge_func_used++] = func;
 }
 
@@ -3158,7 +3387,7 @@ static NICKSERV_FUNC(cmd_merge)
     }
 
     for (n=0; n<handle_merge_func_used; n++)
-        handle_merge_func_list[n](user, hi_to, hi_from);
+        HOOK_CALL(handle_merge_func_stats[n], handle_merge_func_list[n](user, hi_to, hi_from));
 
     /* Append "from" handle's nicks to "to" handle's nick list. */
     if (hi_to->nicks) {
@@ -3191,6 +3420,7 @@ static NICKSERV_FUNC(cmd_merge)
     /* Repoint the old "from" handle's users. */
     for (last_user=hi_from->users; last_user; last_user=last_user->next_authed) {
         last_user->handle_info = hi_to;
+        user_forms_invalidate(last_user);
     }
     hi_from->users = NULL;
 
@@ -3235,7 +3465,7 @@ static NICKSERV_FUNC(cmd_merge)
 
     /* What about last seen time? */
     if (hi_from->lastseen > hi_to->lastseen)
-        hi_to->lastseen = hi_from->lastseen;
+        handle_set_lastseen(hi_to, hi_from->lastseen);
 
     /* New karma is the sum of the two original karmas. */
     hi_to->karma += hi_from->karma;
@@ -3487,22 +3717,134 @@ nickserv_discrim_match(struct nickserv_discrim *discrim, struct handle_info *hi)
     return 1;
 }
 
-static unsigned int
-nickserv_discrim_search(struct nickserv_discrim *discrim, discrim_search_func dsf, struct userNode *source)
+/* Tests up to count accounts, starting at it, and returns where it
+ * stopped.  dsf may unregister the account it is given. */
+static dict_iterator_t
+nickserv_discrim_scan(struct nickserv_discrim *discrim, discrim_search_func dsf, struct userNode *source, dict_iterator_t it, unsigned int count, unsigned int *matched)
 {
-    dict_iterator_t it, next;
-    unsigned int matched;
+    dict_iterator_t next;
 
-    for (it = dict_first(nickserv_handle_dict), matched = 0;
-         it && (matched < discrim->limit);
-         it = next) {
+    for (; it && count && (*matched < discrim->limit); it = next, count--) {
         next = iter_next(it);
         if (nickserv_discrim_match(discrim, iter_data(it))) {
             dsf(source, iter_data(it));
-            matched++;
+            (*matched)++;
         }
     }
-    return matched;
+    return it;
+}
+
+/* Candidate sources for nickserv_discrim_plan(): each returns 0 if it
+ * cannot narrow the search, or would need more than cap accounts. */
+static int
+nickserv_discrim_from_email(struct nickserv_discrim *discrim, struct handle_info_list *list, unsigned int cap)
+{
+    struct handle_info_list *hil;
+    const char *mask;
+    unsigned int nn;
+
+    /* Only a literal address or a literal "*@domain" is indexed. */
+    if (!(mask = discrim->emailmask))
+        return 0;
+    if (!strpbrk(mask, "*?\\"))
+        hil = dict_find(nickserv_email_dict, mask, NULL);
+    else if ((mask[0] == '*') && (mask[1] == '@') && !strpbrk(mask + 2, "*?\\@"))
+        hil = dict_find(nickserv_domain_dict, mask + 2, NULL);
+    else
+        return 0;
+    if (hil && (hil->used > cap))
+        return 0;
+    for (nn = 0; hil && (nn < hil->used); nn++)
+        handle_info_list_append(list, hil->list[nn]);
+    return 1;
+}
+
+/* Collects the accounts with a time between min and max from one of
+ * the indexes kept by handle_set_time(). */
+static int
+nickserv_discrim_from_time(dict_t index, unsigned long min, unsigned long max, struct handle_info_list *list, unsigned int cap)
+{
+    dict_iterator_t it;
+    char key[24], max_key[24];
+
+    snprintf(key, sizeof(key), "%016lx", min);
+    snprintf(max_key, sizeof(max_key), "%016lx", max);
+    for (it = dict_lower_bound(index, key); it && (strncmp(iter_key(it), max_key, 16) <= 0); it = iter_next(it)) {
+        if (list->used >= cap)
+            return 0;
+        handle_info_list_append(list, iter_data(it));
+    }
+    return 1;
+}
+
+static int
+nickserv_discrim_from_registered(struct nickserv_discrim *discrim, struct handle_info_list *list, unsigned int cap)
+{
+    if (!discrim->min_registered && (discrim->max_registered == ULONG_MAX))
+        return 0;
+    return nickserv_discrim_from_time(nickserv_registered_dict, discrim->min_registered, discrim->max_registered, list, cap);
+}
+
+static int
+nickserv_discrim_from_lastseen(struct nickserv_discrim *discrim, struct handle_info_list *list, unsigned int cap)
+{
+    /* Logged-in accounts count as seen now, which is never earlier
+     * than their stored time; nickserv_discrim_match() sorts them out. */
+    if (discrim->lastseen == ULONG_MAX)
+        return 0;
+    return nickserv_discrim_from_time(nickserv_lastseen_dict, 0, discrim->lastseen, list, cap);
+}
+
+static int
+nickserv_compare_handles(const void *a_, const void *b_)
+{
+    struct handle_info *a = *(struct handle_info**)a_, *b = *(struct handle_info**)b_;
+    return irccasecmp(a->handle, b->handle);
+}
+
+/* Finds the smallest candidate list the indexes can give for discrim
+ * and puts the accounts on it that match into matched, in the same
+ * order a full scan would see them.  Returns 0 if a full scan is
+ * needed. */
+static int
+nickserv_discrim_plan(struct nickserv_discrim *discrim, struct handle_info_list *matched)
+{
+    static int (*const sources[])(struct nickserv_discrim *, struct handle_info_list *, unsigned int) = {
+        nickserv_discrim_from_email,
+        nickserv_discrim_from_registered,
+        nickserv_discrim_from_lastseen
+    };
+    struct handle_info_list best, trial, swap;
+    unsigned int ii, nn, cap, chosen;
+
+    handle_info_list_init(&best);
+    handle_info_list_init(&trial);
+    best.tag = trial.tag = NULL;
+    chosen = 0;
+    cap = dict_size(nickserv_handle_dict) / 2;
+    for (ii = 0; (ii < ArrayLength(sources)) && cap; ii++) {
+        trial.used = 0;
+        if (!sources[ii](discrim, &trial, cap))
+            continue;
+        swap = best;
+        best = trial;
+        trial = swap;
+        chosen = 1;
+        if (!best.used)
+            break;
+        cap = best.used - 1;
+    }
+    handle_info_list_clean(&trial);
+    if (!chosen) {
+        handle_info_list_clean(&best);
+        return 0;
+    }
+    qsort(best.list, best.used, sizeof(best.list[0]), nickserv_compare_handles);
+    for (nn = 0; (nn < best.used) && (matched->used < discrim->limit); nn++)
+        if (nickserv_discrim_match(discrim, best.list[nn]))
+            handle_info_list_append(matched, best.list[nn]);
+    handle_info_list_clean(&best);
+    return 1;
 }
 
 static void
@@ -3570,12 +3912,82 @@ nickserv_show_oper_accounts(struct userNode *user, struct svccmd *cmd)
     free(hil.list);
 }
 
+/* Searches of more accounts than this (or with more matches found
+ * through an index) are run a slice at a time from the main loop.  A
+ * full scan resumes at the first account name after the last one
+ * examined; indexed matches are kept by name and checked again when
+ * their turn comes, since accounts may be dropped in between. */
+#define NICKSERV_SEARCH_SLICE 4096
+
+struct nickserv_search {
+    struct nickserv_discrim *discrim;
+    discrim_search_func action;
+    char *split_discrim;
+    struct string_list *planned;
+    unsigned int next;
+    char *resume;
+    unsigned int matches;
+};
+
+static void
+nickserv_search_finish(struct nickserv_search *search, struct userNode *user, struct userNode *bot)
+{
+    if (search->matches)
+        send_message(user, bot, "MSG_MATCH_COUNT", search->matches);
+    else
+        send_message(user, bot, "MSG_NO_MATCHES");
+}
+
+static void
+nickserv_search_free(void *data)
+{
+    struct nickserv_search *search = data;
+
+    free(search->discrim);
+    free(search->split_discrim);
+    free_string_list(search->planned);
+    free(search->resume);
+    free(search);
+}
+
+static int
+nickserv_search_step(struct svccmd_cursor *cursor)
+{
+    struct nickserv_search *search = cursor->data;
+    struct handle_info *hi;
+    dict_iterator_t it;
+    unsigned int nn;
+
+    if (search->planned) {
+        for (nn = 0; (nn < NICKSERV_SEARCH_SLICE) && (search->next < search->planned->used); nn++) {
+            hi = get_handle_info(search->planned->list[search->next++]);
+            if (hi && nickserv_discrim_match(search->discrim, hi)) {
+                search->action(cursor->user, hi);
+                search->matches++;
+            }
+        }
+        if (search->next < search->planned->used)
+            return 1;
+    } else {
+        it = search->resume ? dict_lower_bound(nickserv_handle_dict, search->resume) : dict_first(nickserv_handle_dict);
+        it = nickserv_discrim_scan(search->discrim, search->action, cursor->user, it, NICKSERV_SEARCH_SLICE, &search->matches);
+        free(search->resume);
+        search->resume = it ? strdup(iter_key(it)) : NULL;
+        if (search->resume && (search->matches < search->discrim->limit))
+            return 1;
+    }
+    nickserv_search_finish(search, cursor->user, cursor->bot);
+    return 0;
+}
+
 static NICKSERV_FUNC(cmd_search)
 {
-    struct nickserv_discrim *discrim;
+    struct nickserv_search *search;
+    struct handle_info_list matched;
     discrim_search_func action;
     struct svccmd *subcmd;
-    unsigned int matches;
+    char *wordv[MAXNUMPARAMS];
+    unsigned int wordc, nn;
     char buf[MAXLEN];
 
     NICKSERV_MIN_PARMS(3);
@@ -3595,39 +4007,70 @@ static NICKSERV_FUNC(cmd_search)
     if (subcmd && !svccmd_can_invoke(user, nickserv, subcmd, NULL, SVCCMD_NOISY))
         return 0;
 
-    discrim = nickserv_discrim_create(user, argc-2, argv+2);
-    if (!discrim)
+    /* The search may outlive argv, so give it its own copy. */
+    search = calloc(1, sizeof(*search));
+    search->action = action;
+    search->split_discrim = strdup(unsplit_string(argv+2, argc-2, NULL));
+    wordc = split_line(search->split_discrim, false, ArrayLength(wordv), wordv);
+    search->discrim = nickserv_discrim_create(user, wordc, wordv);
+    if (!search->discrim) {
+        nickserv_search_free(search);
         return 0;
+    }
 
     if (action == search_print_func)
         reply("NSMSG_ACCOUNT_SEARCH_RESULTS");
     else if (action == search_count_func)
-        discrim->limit = INT_MAX;
-
-    matches = nickserv_discrim_search(discrim, action, user);
+        search->discrim->limit = INT_MAX;
+
+    handle_info_list_init(&matched);
+    if (nickserv_discrim_plan(search->discrim, &matched)) {
+        if (matched.used > NICKSERV_SEARCH_SLICE) {
+            search->planned = alloc_string_list(matched.used);
+            for (nn = 0; nn < matched.used; nn++)
+                string_list_append(search->planned, strdup(matched.list[nn]->handle));
+            handle_info_list_clean(&matched);
+            svccmd_cursor_start(user, cmd->parent->bot, nickserv_search_step, nickserv_search_free, search);
+            return 0;
+        }
+        /* Unregistering one account does not free any other. */
+        for (nn = 0; nn < matched.used; nn++)
+            action(user, matched.list[nn]);
+        search->matches = matched.used;
+    } else if (dict_size(nickserv_handle_dict) > NICKSERV_SEARCH_SLICE) {
+        handle_info_list_clean(&matched);
+        svccmd_cursor_start(user, cmd->parent->bot, nickserv_search_step, nickserv_search_free, search);
+        return 0;
+    } else
+        nickserv_discrim_scan(search->discrim, action, user, dict_first(nickserv_handle_dict), UINT_MAX, &search->matches);
+    handle_info_list_clean(&matched);
+    nickserv_search_finish(search, user, cmd->parent->bot);
+    nickserv_search_free(search);
+    return 0;
+}
 
-    if (matches)
-        reply("MSG_MATCH_COUNT", matches);
-    else
-        reply("MSG_NO_MATCHES");
+static void
+nickserv_checkpass_checked(void *data, int matched)
+{
+    struct nickserv_pass_req *req = data;
 
-    free(discrim);
-    return 0;
+    if (req->user && nickserv_pass_req_account(req))
+        send_message(req->user, req->bot, matched ? "CHECKPASS_YES" : "CHECKPASS_NO");
+    nickserv_pass_req_free(req);
 }
 
 static MODCMD_FUNC(cmd_checkpass)
 {
     struct handle_info *hi;
+    struct nickserv_pass_req *req;
 
     NICKSERV_MIN_PARMS(3);
     if (!(hi = get_handle_info(argv[1]))) {
         reply("MSG_HANDLE_UNKNOWN", argv[1]);
         return 0;
     }
-    if (checkpass(argv[2], hi->passwd))
-        reply("CHECKPASS_YES");
-    else
-        reply("CHECKPASS_NO");
+    req = nickserv_pass_req_new(user, cmd->parent->bot, hi, NULL);
+    checkpass_async(argv[2], hi->passwd, nickserv_checkpass_checked, req);
     argv[2] = "****";
     return 1;
 }
@@ -3698,6 +4141,7 @@ nickserv_db_read_handle(const char *handle, dict_t obj)
         hi->users = authed_users;
         while (authed_users) {
             authed_users->handle_info = hi;
+            user_forms_invalidate(authed_users);
             authed_users = authed_users->next_authed;
         }
     }
@@ -3714,9 +4158,9 @@ nickserv_db_read_handle(const char *handle, dict_t obj)
     if (str)
         hi->infoline = strdup(str);
     str = database_get_data(obj, KEY_REGISTER_ON, RECDB_QSTRING);
-    hi->registered = str ? strtoul(str, NULL, 0) : now;
+    handle_set_registered(hi, str ? strtoul(str, NULL, 0) : now);
     str = database_get_data(obj, KEY_LAST_SEEN, RECDB_QSTRING);
-    hi->lastseen = str ? strtoul(str, NULL, 0) : hi->registered;
+    handle_set_lastseen(hi, str ? strtoul(str, NULL, 0) : hi->registered);
     str = database_get_data(obj, KEY_KARMA, RECDB_QSTRING);
     hi->karma = str ? strtoul(str, NULL, 0) : 0;
     /* We want to read the nicks even if disable_nicks is set.  This is so
@@ -3876,14 +4320,36 @@ static NICKSERV_FUNC(cmd_mergedb)
     return 1;
 }
 
+/* Accounts are expired in batches, walking the lastseen index only as
+ * far as the shorter expiry delay reaches.  A pass that stops early
+ * picks up a second later at expire_resume, so a large backlog of
+ * expirations (and the ChanServ and MemoServ cleanup each one sets
+ * off) is spread out instead of stalling the main loop. */
+#define NICKSERV_EXPIRE_SLICE 4096
+#define NICKSERV_EXPIRE_BATCH 256
+
+static char *expire_resume;
+
 static void
 expire_handles(UNUSED_ARG(void *data))
 {
     dict_iterator_t it, next;
-    unsigned long expiry;
+    unsigned long expiry, delay;
+    unsigned int examined, expired;
     struct handle_info *hi;
-
-    for (it=dict_first(nickserv_handle_dict); it; it=next) {
+    char cutoff[24];
+
+    delay = nickserv_conf.handle_expire_delay;
+    if (nickserv_conf.nochan_handle_expire_delay < delay)
+        delay = nickserv_conf.nochan_handle_expire_delay;
+    it = NULL;
+    if (delay < now) {
+        snprintf(cutoff, sizeof(cutoff), "%016lx", now - delay);
+        it = expire_resume ? dict_lower_bound(nickserv_lastseen_dict, expire_resume) : dict_first(nickserv_lastseen_dict);
+    }
+    for (examined = expired = 0; it && (strncmp(iter_key(it), cutoff, 16) < 0); it = next) {
+        if ((examined++ == NICKSERV_EXPIRE_SLICE) || (expired == NICKSERV_EXPIRE_BATCH))
+            break;
         next = iter_next(it);
         hi = iter_data(it);
         if ((hi->opserv_level > 0)
@@ -3896,9 +4362,17 @@ expire_handles(UNUSED_ARG(void *data))
         if ((now - hi->lastseen) > expiry) {
             log_module(NS_LOG, LOG_INFO, "Expiring account %s for inactivity.", hi->handle);
             nickserv_unregister_handle(hi, NULL);
+            expired++;
         }
     }
 
+    free(expire_resume);
+    if (it && (strncmp(iter_key(it), cutoff, 16) < 0)) {
+        expire_resume = strdup(iter_key(it));
+        timeq_add(now + 1, expire_handles, NULL);
+        return;
+    }
+    expire_resume = NULL;
     if (nickserv_conf.handle_expire_frequency)
         timeq_add(now + nickserv_conf.handle_expire_frequency, expire_handles, NULL);
 }
@@ -4204,9 +4678,14 @@ handle_nick_change(struct userNode *user, const char *old_nick)
 void
 nickserv_remove_user(struct userNode *user, UNUSED_ARG(struct userNode *killer), UNUSED_ARG(const char *why))
 {
+    struct nickserv_pass_req *req;
+
     dict_remove(nickserv_allow_auth_dict, user->nick);
     timeq_del(0, nickserv_reclaim_p, user, TIMEQ_IGNORE_WHEN);
     set_user_handle_info(user, NULL, 0);
+    for (req = nickserv_pass_reqs; req; req = req->next)
+        if (req->user == user)
+            req->user = NULL;
 }
 
 static struct modcmd *
@@ -4238,6 +4717,15 @@ nickserv_define_func(const char *name, modcmd_func_t func, int min_level, int mu
 static void
 nickserv_db_cleanup(void)
 {
+    struct nickserv_pass_req *req;
+
+    /* Password checks still running finish after this; leave them
+     * nothing to look at. */
+    for (req = nickserv_pass_reqs; req; req = req->next) {
+        free(req->handle);
+        req->handle = NULL;
+        req->user = NULL;
+    }
     unreg_del_user_func(nickserv_remove_user);
     userList_clean(&curr_helpers);
     policer_params_delete(nickserv_conf.auth_policer_params);
@@ -4245,15 +4733,25 @@ nickserv_db_cleanup(void)
     dict_delete(nickserv_nick_dict);
     dict_delete(nickserv_opt_dict);
     dict_delete(nickserv_allow_auth_dict);
+    free(expire_resume);
     dict_delete(nickserv_email_dict);
+    dict_delete(nickserv_domain_dict);
+    dict_delete(nickserv_registered_dict);
+    dict_delete(nickserv_lastseen_dict);
     dict_delete(nickserv_id_dict);
     dict_delete(nickserv_conf.weak_password_dict);
     free(auth_func_list);
+    free(auth_func_stats);
     free(unreg_func_list);
+    free(unreg_func_stats);
     free(rf_list);
+    free(rf_stats);
     free(allowauth_func_list);
+    free(allowauth_func_stats);
     free(handle_merge_func_list);
+    free(handle_merge_func_stats);
     free(failpw_func_list);
+    free(failpw_func_stats);
     if (nickserv_conf.valid_handle_regex_set)
         regfree(&nickserv_conf.valid_handle_regex);
     if (nickserv_conf.valid_nick_regex_set)
@@ -4282,6 +4780,13 @@ init_nickserv(const char *nick)
     nickserv_email_dict = dict_new();
     dict_set_free_keys(nickserv_email_dict, free);
     dict_set_free_data(nickserv_email_dict, nickserv_free_email_addr);
+    nickserv_domain_dict = dict_new();
+    dict_set_free_keys(nickserv_domain_dict, free);
+    dict_set_free_data(nickserv_domain_dict, nickserv_free_email_addr);
+    nickserv_registered_dict = dict_new();
+    dict_set_free_keys(nickserv_registered_dict, free);
+    nickserv_lastseen_dict = dict_new();
+    dict_set_free_keys(nickserv_lastseen_dict, free);
 
     nickserv_module = module_register("NickServ", NS_LOG, "nickserv.help", NULL);
     modcmd_register(nickserv_module, "AUTH", cmd_auth, 2, MODCMD_KEEP_BOUND, "flags", "+qualified,+loghostmask", NULL);
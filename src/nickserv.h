@@ -143,29 +143,35 @@ void nickserv_show_oper_accounts(struct userNode *user, struct svccmd *cmd);
 /* auth_funcs are called when a user gets a new handle_info.  They are
  * called *after* user->handle_info has been updated.  */
 typedef void (*auth_func_t)(struct userNode *user, struct handle_info *old_handle);
-void reg_auth_func(auth_func_t func);
+void reg_auth_func_named(auth_func_t func, const char *name, const char *file);
+#define reg_auth_func(HANDLER) reg_auth_func_named(HOOK_SOURCE(HANDLER))
 
 /* Called just after a handle is renamed. */
 typedef void (*handle_rename_func_t)(struct handle_info *handle, const char *old_handle);
-void reg_handle_rename_func(handle_rename_func_t func);
+void reg_handle_rename_func_named(handle_rename_func_t func, const char *name, const char *file);
+#define reg_handle_rename_func(HANDLER) reg_handle_rename_func_named(HOOK_SOURCE(HANDLER))
 
 /* unreg_funcs are called right before a handle is unregistered.
  * `user' is the person who caused the handle to be unregistered (either a
  * client authed to the handle, or an oper). */
 typedef void (*unreg_func_t)(struct userNode *user, struct handle_info *handle);
-void reg_unreg_func(unreg_func_t func);
+void reg_unreg_func_named(unreg_func_t func, const char *name, const char *file);
+#define reg_unreg_func(HANDLER) reg_unreg_func_named(HOOK_SOURCE(HANDLER))
 
 /* Called just before a handle is merged */
 typedef void (*handle_merge_func_t)(struct userNode *user, struct handle_info *handle_to, struct handle_info *handle_from);
-void reg_handle_merge_func(handle_merge_func_t);
+void reg_handle_merge_func_named(handle_merge_func_t func, const char *name, const char *file);
+#define reg_handle_merge_func(HANDLER) reg_handle_merge_func_named(HOOK_SOURCE(HANDLER))
 
 /* Called after an allowauth. handle is null if allowauth authorization was
  * removed */
 typedef void (*allowauth_func_t)(struct userNode *user, struct userNode *target, struct handle_info *handle);
-void reg_allowauth_func(allowauth_func_t func);
+void reg_allowauth_func_named(allowauth_func_t func, const char *name, const char *file);
+#define reg_allowauth_func(HANDLER) reg_allowauth_func_named(HOOK_SOURCE(HANDLER))
 
 /* Called when an auth attempt fails because of a bad password */
 typedef void (*failpw_func_t)(struct userNode *user, struct handle_info *handle);
-void reg_failpw_func(failpw_func_t func);
+void reg_failpw_func_named(failpw_func_t func, const char *name, const char *file);
+#define reg_failpw_func(HANDLER) reg_failpw_func_named(HOOK_SOURCE(HANDLER))
 
 #endif
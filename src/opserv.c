@@ -18,12 +18,15 @@
  * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
  */
 
+#include "cidr.h"
 #include "conf.h"
 #include "gline.h"
 #include "global.h"
 #include "nickserv.h"
 #include "modcmd.h"
 #include "opserv.h"
+#include "perf.h"
+#include "sar.h"
 #include "timeq.h"
 #include "saxdb.h"
 
@@ -36,6 +39,9 @@
 #ifdef HAVE_ARPA_INET_H
 #include <arpa/inet.h>
 #endif
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_PTHREAD_CREATE)
+#include <pthread.h>
+#endif
 
 #define OPSERV_CONF_NAME "services/opserv"
 
@@ -73,13 +79,18 @@
 #define KEY_STAFF_AUTH_CHANNEL "staff_auth_channel"
 #define KEY_STAFF_AUTH_CHANNEL_MODES "staff_auth_channel_modes"
 #define KEY_CLONE_GLINE_DURATION "clone_gline_duration"
+#define KEY_CLONE_IPV4_PREFIX "clone_ipv4_prefix"
+#define KEY_CLONE_IPV6_PREFIX "clone_ipv6_prefix"
 #define KEY_BLOCK_GLINE_DURATION "block_gline_duration"
+#define KEY_SEARCH_THREADS "search_threads"
 #define KEY_ISSUER "issuer"
 #define KEY_ISSUED "issued"
 
 #define IDENT_FORMAT            "%s [%s@%s/%s]"
-#define IDENT_DATA(user)        user->nick, user->ident, user->hostname, irc_ntoa(&user->ip)
+#define IDENT_DATA(user)        user->nick, user->ident, user->hostname, user_ip_text(user)
 #define MAX_CHANNELS_WHOIS      50
+#define OPSERV_MAX_SEARCH_THREADS 16
+#define OPSERV_MIN_SEARCH_SLICE 4096 /* users per thread worth splitting for */
 #define OSMSG_PART_REASON       "%s has no reason."
 #define OSMSG_KICK_REQUESTED    "Kick requested by %s."
 #define OSMSG_KILL_REQUESTED    "Kill requested by %s."
@@ -165,6 +176,22 @@ static const struct message_entry msgtab[] = {
     { "OSMSG_HOST_IS_TRUSTED", "%s (%s; set %s ago by %s; expires %s: %s)" },
     { "OSMSG_HOST_NOT_TRUSTED", "%s does not have a special trust." },
     { "OSMSG_UPTIME_STATS", "Uptime: %s (%u lines processed, CPU time %.2fu/%.2fs)" },
+    { "OSMSG_PROFILING_STATUS", "Profiling is $b%s$b; statistics cover the last %s." },
+    { "OSMSG_PROFILING_ENABLED", "Profiling has been enabled." },
+    { "OSMSG_PROFILING_DISABLED", "Profiling has been disabled." },
+    { "OSMSG_PROFILING_RESET", "Profiling statistics have been reset." },
+    { "OSMSG_PROFILING_EMPTY", "No statistics have been collected." },
+    { "OSMSG_PROFILING_NO_ENTRY", "No statistics have been collected for $b%s$b." },
+    { "OSMSG_PROFILING_HISTOGRAM", "Latency histogram for $b%s$b (%lu calls):" },
+    { "OSMSG_PROFILING_BUCKET", "  %7lu - %7lu usec: %lu (%.1f%%)" },
+    { "OSMSG_EVENTS_DISABLED", "The stall detector is disabled." },
+    { "OSMSG_EVENTS_STATUS", "Stall threshold is $b%lu$b ms; showing %u of %u recorded events, newest first:" },
+    { "OSMSG_DNS_REQUESTS", "$b%u$b DNS requests outstanding." },
+    { "OSMSG_DNS_NAMESERVERS", "Nameservers:" },
+    { "OSMSG_DNS_CACHE_DISABLED", "The DNS cache is disabled." },
+    { "OSMSG_DNS_CACHE_SIZE", "DNS cache: $b%u$b entries using $b%lu$b of %lu bytes." },
+    { "OSMSG_DNS_CACHE_LOOKUPS", "Lookups: $b%lu$b; hits: $b%lu$b (%lu%%); expired: $b%lu$b." },
+    { "OSMSG_DNS_CACHE_STORED", "Responses stored: $b%lu$b (%lu negative); evicted: $b%lu$b." },
     { "OSMSG_LINE_DUMPED", "Raw line sent." },
     { "OSMSG_RAW_PARSE_ERROR", "Error parsing raw line (not dumping to uplink)." },
     { "OSMSG_COLLIDED_NICK", "Now temporarily holding nick $b%s$b." },
@@ -218,7 +245,9 @@ static const struct message_entry msgtab[] = {
     { "OSMSG_REMOVED_ALERT", "Removed alert named $b%s$b." },
     { "OSMSG_NO_SUCH_ALERT", "No alert named $b%s$b could be found." },
     { "OSMSG_ALERT_IS", "%s (by %s, reaction %s): %s" },
+    { "OSMSG_ALERT_COUNTS", "  Triggered %lu times in %lu checks; indexed by %s." },
     { "OSMSG_ALERTS_LIST", "Current $O alerts:" },
+    { "OSMSG_ALERT_INDEX", "%lu new users checked against %lu candidate alerts (%lu alerts skipped by the index)." },
     { "OSMSG_REHASH_COMPLETE", "Completed rehash of configuration database." },
     { "OSMSG_REHASH_FAILED", "Rehash of configuration database failed, previous configuration is intact." },
     { "OSMSG_REOPEN_COMPLETE", "Closed and reopened all log files." },
@@ -269,9 +298,13 @@ struct userNode *opserv;
 static dict_t opserv_chan_warn; /* data is char* */
 static dict_t opserv_reserved_nick_dict; /* data is struct userNode* */
 static struct string_list *opserv_bad_words;
+static struct string_matcher *opserv_bad_matcher;
 static dict_t opserv_exempt_channels; /* data is not used */
 static dict_t opserv_trusted_hosts; /* data is struct trusted_host* */
-static dict_t opserv_hostinfo_dict; /* data is struct opserv_hostinfo* */
+static struct cidr_tree opserv_trusted_tree; /* data is struct trusted_host* */
+static struct cidr_tree opserv_hostinfo_tree; /* data is struct opserv_hostinfo* */
+static dict_t opserv_host_users; /* key is reversed host name, data is struct ptrList* of users */
+static struct userList opserv_unhashed_users; /* local and service users, which have no hostinfo */
 static dict_t opserv_user_alerts; /* data is struct opserv_user_alert* */
 static dict_t opserv_nick_based_alerts; /* data is struct opserv_user_alert* */
 static dict_t opserv_channel_alerts; /* data is struct opserv_user_alert* */
@@ -289,14 +322,19 @@ static struct {
     struct policer new_user_policer;
     unsigned long untrusted_max;
     unsigned long clone_gline_duration;
+    unsigned char clone_ipv4_prefix;
+    unsigned char clone_ipv6_prefix;
     unsigned long block_gline_duration;
     unsigned long purge_lock_delay;
     unsigned long join_flood_moderate;
     unsigned long join_flood_moderate_threshold;
+    unsigned long search_threads;
 } opserv_conf;
 
 struct trusted_host {
     char *ipaddr;
+    irc_in_addr_t addr;
+    unsigned char bits; /* 0 if ipaddr did not parse */
     char *issuer;
     char *reason;
     unsigned long limit;
@@ -304,19 +342,207 @@ struct trusted_host {
     unsigned long expires;
 };
 
+DECLARE_LIST(ptrList, void*);
+DEFINE_LIST(ptrList, void*)
+
+/* A key index files entries under short literal keys (at most
+ * OPSERV_KEY_LEN characters, compared case-insensitively) and finds
+ * every entry whose key is a prefix, or a suffix, of some text.  lens
+ * counts the keys of each length so that lookups only try lengths
+ * that are present. */
+#define OPSERV_KEY_LEN 16
+
+struct opserv_key_index {
+    dict_t buckets; /* data is struct ptrList* */
+    unsigned int lens[OPSERV_KEY_LEN+1];
+};
+
+static void
+opserv_key_bucket_free(void *data)
+{
+    struct ptrList *bucket = data;
+    ptrList_clean(bucket);
+    free(bucket);
+}
+
+static void
+opserv_key_index_init(struct opserv_key_index *index)
+{
+    memset(index, 0, sizeof(*index));
+    index->buckets = dict_new();
+    dict_set_free_keys(index->buckets, free);
+    dict_set_free_data(index->buckets, opserv_key_bucket_free);
+}
+
+static void
+opserv_key_index_clean(struct opserv_key_index *index)
+{
+    dict_delete(index->buckets);
+    index->buckets = NULL;
+}
+
+static void
+opserv_key_index_add(struct opserv_key_index *index, const char *key, void *data)
+{
+    struct ptrList *bucket;
+
+    if (!(bucket = dict_find(index->buckets, key, NULL))) {
+        bucket = malloc(sizeof(*bucket));
+        ptrList_init(bucket);
+        dict_insert(index->buckets, strdup(key), bucket);
+        index->lens[strlen(key)]++;
+    }
+    ptrList_append(bucket, data);
+}
+
+static void
+opserv_key_index_remove(struct opserv_key_index *index, const char *key, void *data)
+{
+    struct ptrList *bucket;
+
+    if (!(bucket = dict_find(index->buckets, key, NULL)))
+        return;
+    ptrList_remove(bucket, data);
+    if (!bucket->used) {
+        index->lens[strlen(key)]--;
+        dict_remove(index->buckets, key);
+    }
+}
+
+/* Calls func for every entry filed under a prefix (or, if suffix is
+ * set, a suffix) of text, stopping like cidr_tree_walk(). */
+static void *
+opserv_key_index_walk(const struct opserv_key_index *index, const char *text, int suffix, cidr_walk_f func, void *extra)
+{
+    char key[OPSERV_KEY_LEN+1];
+    struct ptrList *bucket;
+    unsigned int len, text_len, ii;
+
+    text_len = strlen(text);
+    for (len = 1; (len <= OPSERV_KEY_LEN) && (len <= text_len); len++) {
+        if (!index->lens[len])
+            continue;
+        if (suffix) {
+            bucket = dict_find(index->buckets, text + text_len - len, NULL);
+        } else {
+            memcpy(key, text, len);
+            key[len] = '\0';
+            bucket = dict_find(index->buckets, key, NULL);
+        }
+        if (bucket)
+            for (ii = 0; ii < bucket->used; ii++)
+                if (func(bucket->list[ii], extra))
+                    return bucket->list[ii];
+    }
+    return NULL;
+}
+
 struct gag_entry {
     char *mask;
+    struct compiled_mask *compiled;
     char *owner;
     char *reason;
     unsigned long expires;
-    struct gag_entry *next;
+    struct gag_entry *prev, *next;
 };
 
 static struct gag_entry *gagList;
 
+/* Gags are indexed like G-lines, so that a new user is only compared
+ * against the gags that could cover them: by_ip holds gags for an
+ * address mask, by_host files gags under the literal end of their
+ * host glob, and residual holds the rest.  A gag for an address mask
+ * with a literal end, such as *@10.1.2.3, is in both by_ip and
+ * by_host, since it can also match a host name textually; one with a
+ * wildcard end, such as *@10.1.2.*, is only in by_ip. */
+static struct {
+    struct cidr_tree by_ip; /* data is struct gag_entry* */
+    struct opserv_key_index by_host; /* data is struct gag_entry* */
+    struct ptrList residual; /* data is struct gag_entry* */
+} opserv_gag_index;
+
+static int
+gag_matches_user(struct gag_entry *gag, struct userNode *user)
+{
+    if (gag->compiled)
+        return user_matches_compiled(user, gag->compiled, MATCH_USENICK);
+    return user_matches_glob(user, gag->mask, MATCH_USENICK);
+}
+
+/* Copies the host key for gag into key[], returning zero if it has
+ * none. */
+static unsigned int
+gag_host_key(struct gag_entry *gag, char key[])
+{
+    unsigned int len;
+
+    len = gag->compiled ? gag->compiled->host.tail_len : 0;
+    memcpy(key, gag->compiled ? gag->compiled->host.tail : "", len);
+    key[len] = '\0';
+    return len;
+}
+
+static void
+gag_index_add(struct gag_entry *gag)
+{
+    char key[OPSERV_KEY_LEN+1];
+
+    if (gag->compiled && gag->compiled->has_ip)
+        cidr_tree_insert(&opserv_gag_index.by_ip, &gag->compiled->ip, gag->compiled->ip_bits, gag);
+    if (gag_host_key(gag, key))
+        opserv_key_index_add(&opserv_gag_index.by_host, key, gag);
+    else if (!gag->compiled || !gag->compiled->has_ip)
+        ptrList_append(&opserv_gag_index.residual, gag);
+}
+
+static void
+gag_index_remove(struct gag_entry *gag)
+{
+    char key[OPSERV_KEY_LEN+1];
+
+    if (gag->compiled && gag->compiled->has_ip)
+        cidr_tree_remove(&opserv_gag_index.by_ip, &gag->compiled->ip, gag->compiled->ip_bits, gag);
+    if (gag_host_key(gag, key))
+        opserv_key_index_remove(&opserv_gag_index.by_host, key, gag);
+    else if (!gag->compiled || !gag->compiled->has_ip)
+        ptrList_remove(&opserv_gag_index.residual, gag);
+}
+
+static int
+gag_test_user(void *data, void *extra)
+{
+    return gag_matches_user(data, extra);
+}
+
+/* Returns a gag that covers user, or NULL.  A host key can only match
+ * the user's real, fake or account-based host name. */
+static struct gag_entry *
+gag_find_user(struct userNode *user)
+{
+    const char *hidden_host;
+    struct gag_entry *gag;
+    unsigned int nn;
+
+    if ((gag = cidr_tree_walk(&opserv_gag_index.by_ip, &user->ip, gag_test_user, user))
+        || (gag = opserv_key_index_walk(&opserv_gag_index.by_host, user->hostname, 1, gag_test_user, user))
+        || (IsFakeHost(user) && (gag = opserv_key_index_walk(&opserv_gag_index.by_host, user->fakehost, 1, gag_test_user, user))))
+        return gag;
+    if ((hidden_host = user_hidden_host(user))
+        && (gag = opserv_key_index_walk(&opserv_gag_index.by_host, hidden_host, 1, gag_test_user, user)))
+        return gag;
+    for (nn = 0; nn < opserv_gag_index.residual.used; nn++)
+        if (gag_matches_user(opserv_gag_index.residual.list[nn], user))
+            return opserv_gag_index.residual.list[nn];
+    return NULL;
+}
+
+/* Clients are counted against the prefix of their address given by
+ * clone_ipv4_prefix or clone_ipv6_prefix, so that a host cannot evade
+ * the clone limit by hopping around its IPv6 subnet. */
 struct opserv_hostinfo {
     struct userList clients;
     struct trusted_host *trusted;
+    unsigned char bits;
 };
 
 static void
@@ -327,12 +553,213 @@ opserv_free_hostinfo(void *data)
     free(ohi);
 }
 
+static unsigned char
+opserv_clone_bits(const irc_in_addr_t *ip)
+{
+    return irc_in_addr_is_ipv4(*ip) ? 96 + opserv_conf.clone_ipv4_prefix : opserv_conf.clone_ipv6_prefix;
+}
+
+static struct opserv_hostinfo *
+opserv_find_hostinfo(const irc_in_addr_t *ip)
+{
+    struct opserv_hostinfo *ohi;
+
+    ohi = cidr_tree_longest(&opserv_hostinfo_tree, ip);
+    if (ohi && (ohi->bits != opserv_clone_bits(ip)))
+        return NULL;
+    return ohi;
+}
+
+static struct opserv_hostinfo *
+opserv_add_hostinfo(struct userNode *user)
+{
+    struct opserv_hostinfo *ohi;
+
+    if (!(ohi = opserv_find_hostinfo(&user->ip))) {
+        ohi = calloc(1, sizeof(*ohi));
+        ohi->bits = opserv_clone_bits(&user->ip);
+        userList_init(&ohi->clients);
+        cidr_tree_insert(&opserv_hostinfo_tree, &user->ip, ohi->bits, ohi);
+    }
+    userList_append(&ohi->clients, user);
+    return ohi;
+}
+
+static void
+opserv_del_hostinfo(struct userNode *user)
+{
+    struct opserv_hostinfo *ohi;
+
+    if ((ohi = opserv_find_hostinfo(&user->ip))) {
+        userList_remove(&ohi->clients, user);
+        if (ohi->clients.used == 0) {
+            cidr_tree_remove(&opserv_hostinfo_tree, &user->ip, ohi->bits, ohi);
+            opserv_free_hostinfo(ohi);
+        }
+    }
+}
+
+/* Users are filed under their host name spelled backwards, so those
+ * whose hosts share a suffix form one run of opserv_host_users. */
+static void
+opserv_reverse_host(char *out, const char *host)
+{
+    unsigned int len, ii;
+
+    len = strlen(host);
+    for (ii = 0; ii < len; ii++)
+        out[ii] = host[len - 1 - ii];
+    out[len] = '\0';
+}
+
+static void
+opserv_add_host_user(struct userNode *user)
+{
+    char key[HOSTLEN+1];
+    struct ptrList *bucket;
+
+    opserv_reverse_host(key, user->hostname);
+    if (!(bucket = dict_find(opserv_host_users, key, NULL))) {
+        bucket = malloc(sizeof(*bucket));
+        ptrList_init(bucket);
+        dict_insert(opserv_host_users, strdup(key), bucket);
+    }
+    ptrList_append(bucket, user);
+}
+
+static void
+opserv_del_host_user(struct userNode *user)
+{
+    char key[HOSTLEN+1];
+    struct ptrList *bucket;
+
+    opserv_reverse_host(key, user->hostname);
+    if (!(bucket = dict_find(opserv_host_users, key, NULL)))
+        return;
+    ptrList_remove(bucket, user);
+    if (!bucket->used)
+        dict_remove(opserv_host_users, key);
+}
+
+static int
+opserv_rehash_hostinfo(void *data, UNUSED_ARG(void *extra))
+{
+    struct opserv_hostinfo *ohi = data;
+    unsigned int nn;
+
+    for (nn = 0; nn < ohi->clients.used; nn++)
+        opserv_add_hostinfo(ohi->clients.list[nn]);
+    opserv_free_hostinfo(ohi);
+    return 0;
+}
+
+static int
+opserv_free_hostinfo_walk(void *data, UNUSED_ARG(void *extra))
+{
+    opserv_free_hostinfo(data);
+    return 0;
+}
+
+/* Format the G-line target covering everyone counted with ip. */
+static void
+opserv_clone_target(char *target, const irc_in_addr_t *ip)
+{
+    irc_in_addr_t masked;
+    unsigned int bits, ii;
+
+    bits = opserv_clone_bits(ip);
+    for (ii = 0; ii < 8; ii++)
+        masked.in6[ii] = (bits >= (ii + 1) * 16) ? ip->in6[ii]
+            : (bits <= ii * 16) ? 0 : htons(ntohs(ip->in6[ii]) & ~(0xffff >> (bits - ii * 16)));
+    strcpy(target, "*@");
+    irc_ntop(target + 2, IRC_NTOP_MAX_SIZE, &masked);
+    if (bits < 128)
+        sprintf(target + strlen(target), "/%u", irc_in_addr_is_ipv4(*ip) ? bits - 96 : bits);
+}
+
+/* The most specific trust covering ip, if any. */
+static struct trusted_host *
+opserv_find_trust(const irc_in_addr_t *ip)
+{
+    return cidr_tree_longest(&opserv_trusted_tree, ip);
+}
+
+static int
+opserv_narrow_trust(void *data, void *extra)
+{
+    struct trusted_host *th = data;
+    return th->bits > *(unsigned char*)extra;
+}
+
+/* Is other held to the same clone limit as user?  A trust narrower
+ * than the clone prefix splits its hosts off from the rest of the
+ * prefix: they count only against that trust, and the others only
+ * against the prefix. */
+static int
+opserv_clone_peer(struct opserv_hostinfo *ohi, struct trusted_host *th, struct userNode *other)
+{
+    struct trusted_host *oth = opserv_find_trust(&other->ip);
+
+    if (th && (th->bits > ohi->bits))
+        return oth == th;
+    return !oth || (oth->bits <= ohi->bits);
+}
+
+static void
+opserv_clone_check(struct userNode *user, struct opserv_hostinfo *ohi)
+{
+    struct userList peers;
+    struct trusted_host *th;
+    char target[IRC_NTOP_MAX_SIZE + 7];
+    unsigned int limit, nn;
+
+    th = opserv_find_trust(&user->ip);
+    limit = th ? th->limit : opserv_conf.untrusted_max;
+    if (!limit) /* 0 means unlimited hosts */
+        return;
+
+    /* Usually nothing inside the prefix is trusted on its own, so
+     * everyone counted there shares one limit and one G-line. */
+    if ((!th || (th->bits <= ohi->bits))
+        && !cidr_tree_foreach_within(&opserv_trusted_tree, &user->ip, ohi->bits, opserv_narrow_trust, &ohi->bits)) {
+        if (ohi->clients.used == limit) {
+            for (nn=0; nn<ohi->clients.used; nn++)
+                send_message(ohi->clients.list[nn], opserv, "OSMSG_CLONE_WARNING");
+        } else if (ohi->clients.used > limit && !gline_match_user(user)) {
+            opserv_clone_target(target, &user->ip);
+            gline_add(opserv->nick, target, opserv_conf.clone_gline_duration, "AUTO Excessive connections from a single host.", now, now, 0, 1);
+        }
+        return;
+    }
+
+    /* Otherwise only count the clients held to the same limit, and
+     * G-line just their addresses so the trusted ones are spared. */
+    userList_init(&peers);
+    for (nn=0; nn<ohi->clients.used; nn++)
+        if (opserv_clone_peer(ohi, th, ohi->clients.list[nn]))
+            userList_append(&peers, ohi->clients.list[nn]);
+    if (peers.used == limit) {
+        for (nn=0; nn<peers.used; nn++)
+            send_message(peers.list[nn], opserv, "OSMSG_CLONE_WARNING");
+    } else if (peers.used > limit) {
+        for (nn=0; nn<peers.used; nn++) {
+            if (gline_match_user(peers.list[nn]))
+                continue;
+            strcpy(target, "*@");
+            irc_ntop(target + 2, IRC_NTOP_MAX_SIZE, &peers.list[nn]->ip);
+            gline_add(opserv->nick, target, opserv_conf.clone_gline_duration, "AUTO Excessive connections from a single host.", now, now, 0, 1);
+        }
+    }
+    userList_clean(&peers);
+}
+
 #define DISCRIM_MAX_CHANS 20
 
 typedef struct opservDiscrim {
     struct chanNode *channels[DISCRIM_MAX_CHANS];
     unsigned int channel_count;
     char *mask_nick, *mask_ident, *mask_host, *mask_info, *server, *reason, *notice_target, *accountmask;
+    struct compiled_glob nick_glob, ident_glob, host_glob, info_glob, server_glob, account_glob;
     irc_in_addr_t ip_mask;
     unsigned long limit;
     unsigned long min_ts, max_ts;
@@ -351,6 +778,7 @@ struct discrim_and_source {
 };
 
 static discrim_t opserv_discrim_create(struct userNode *user, unsigned int argc, char *argv[], int allow_channel);
+static void opserv_discrim_compile(discrim_t discrim);
 static unsigned int opserv_discrim_search(discrim_t discrim, discrim_search_func dsf, void *data);
 static int gag_helper_func(struct userNode *match, void *extra);
 static int ungag_helper_func(struct userNode *match, void *extra);
@@ -361,11 +789,44 @@ typedef enum {
     REACT_GLINE
 } opserv_alert_reaction;
 
+typedef enum {
+    ALERT_INDEX_NONE,
+    ALERT_INDEX_IP,
+    ALERT_INDEX_HOST,
+    ALERT_INDEX_NICK
+} opserv_alert_index_type;
+
 struct opserv_user_alert {
+    const char *name; /* key in opserv_user_alerts */
     char *owner;
     char *text_discrim, *split_discrim;
+    char *index_key;
     discrim_t discrim;
     opserv_alert_reaction reaction;
+    opserv_alert_index_type index_type;
+    unsigned long checks, hits;
+};
+
+DECLARE_LIST(alertList, struct opserv_user_alert*);
+DEFINE_LIST(alertList, struct opserv_user_alert*)
+
+/* New users are only checked against the alerts that could possibly
+ * match them.  Each alert is filed under at most one cheap test that
+ * its discriminator requires: an IP mask, a literal host suffix or a
+ * literal nick prefix.  Alerts with none of those are always checked. */
+static struct {
+    struct cidr_tree by_ip; /* data is struct opserv_user_alert* */
+    struct opserv_key_index by_host; /* data is struct opserv_user_alert* */
+    struct opserv_key_index by_nick; /* data is struct opserv_user_alert* */
+    struct alertList unindexed;
+    unsigned long users, candidates, skipped;
+} opserv_alert_index;
+
+static const char *opserv_alert_index_names[] = {
+    "nothing",
+    "IP mask",
+    "host suffix",
+    "nick prefix"
 };
 
 /* funny type to make it acceptible to dict_set_free_data, far below */
@@ -379,11 +840,115 @@ opserv_free_user_alert(void *data)
     free(alert->owner);
     free(alert->text_discrim);
     free(alert->split_discrim);
+    free(alert->index_key);
     free(alert->discrim->reason);
     free(alert->discrim);
     free(alert);
 }
 
+static void
+opserv_alert_index_init(void)
+{
+    memset(&opserv_alert_index, 0, sizeof(opserv_alert_index));
+    cidr_tree_init(&opserv_alert_index.by_ip);
+    opserv_key_index_init(&opserv_alert_index.by_host);
+    opserv_key_index_init(&opserv_alert_index.by_nick);
+    alertList_init(&opserv_alert_index.unindexed);
+}
+
+static void
+opserv_alert_index_clean(void)
+{
+    cidr_tree_clean(&opserv_alert_index.by_ip);
+    opserv_key_index_clean(&opserv_alert_index.by_host);
+    opserv_key_index_clean(&opserv_alert_index.by_nick);
+    alertList_clean(&opserv_alert_index.unindexed);
+}
+
+static void
+opserv_alert_index_add(struct opserv_user_alert *alert)
+{
+    discrim_t discrim = alert->discrim;
+    unsigned int host_len, nick_len;
+
+    host_len = discrim->mask_host ? discrim->host_glob.tail_len : 0;
+    nick_len = 0;
+    if (discrim->mask_nick)
+        while (discrim->mask_nick[nick_len] && !strchr("*?\\", discrim->mask_nick[nick_len]))
+            nick_len++;
+    if (nick_len > OPSERV_KEY_LEN)
+        nick_len = OPSERV_KEY_LEN;
+
+    if (discrim->ip_mask_bits) {
+        alert->index_type = ALERT_INDEX_IP;
+        cidr_tree_insert(&opserv_alert_index.by_ip, &discrim->ip_mask, discrim->ip_mask_bits, alert);
+    } else if (host_len && (host_len >= nick_len)) {
+        alert->index_type = ALERT_INDEX_HOST;
+        alert->index_key = malloc(host_len + 1);
+        memcpy(alert->index_key, discrim->host_glob.tail, host_len);
+        alert->index_key[host_len] = '\0';
+        opserv_key_index_add(&opserv_alert_index.by_host, alert->index_key, alert);
+    } else if (nick_len) {
+        alert->index_type = ALERT_INDEX_NICK;
+        alert->index_key = malloc(nick_len + 1);
+        memcpy(alert->index_key, discrim->mask_nick, nick_len);
+        alert->index_key[nick_len] = '\0';
+        opserv_key_index_add(&opserv_alert_index.by_nick, alert->index_key, alert);
+    } else {
+        alert->index_type = ALERT_INDEX_NONE;
+        alertList_append(&opserv_alert_index.unindexed, alert);
+    }
+}
+
+static void
+opserv_alert_index_remove(struct opserv_user_alert *alert)
+{
+    switch (alert->index_type) {
+    case ALERT_INDEX_IP:
+        cidr_tree_remove(&opserv_alert_index.by_ip, &alert->discrim->ip_mask, alert->discrim->ip_mask_bits, alert);
+        break;
+    case ALERT_INDEX_HOST:
+        opserv_key_index_remove(&opserv_alert_index.by_host, alert->index_key, alert);
+        break;
+    case ALERT_INDEX_NICK:
+        opserv_key_index_remove(&opserv_alert_index.by_nick, alert->index_key, alert);
+        break;
+    case ALERT_INDEX_NONE:
+        alertList_remove(&opserv_alert_index.unindexed, alert);
+        break;
+    }
+}
+
+static int
+opserv_alert_collect(void *data, void *extra)
+{
+    alertList_append(extra, data);
+    return 0;
+}
+
+static int
+opserv_alert_compare(const void *a, const void *b)
+{
+    const struct opserv_user_alert *alert_a = *(struct opserv_user_alert* const *)a;
+    const struct opserv_user_alert *alert_b = *(struct opserv_user_alert* const *)b;
+    return irccasecmp(alert_a->name, alert_b->name);
+}
+
+/* Fills list with the alerts that might match user, sorted the same
+ * way as opserv_user_alerts so that they fire in the usual order. */
+static void
+opserv_alert_candidates(struct userNode *user, struct alertList *list)
+{
+    unsigned int nn;
+
+    cidr_tree_walk(&opserv_alert_index.by_ip, &user->ip, opserv_alert_collect, list);
+    opserv_key_index_walk(&opserv_alert_index.by_host, user->hostname, 1, opserv_alert_collect, list);
+    opserv_key_index_walk(&opserv_alert_index.by_nick, user->nick, 0, opserv_alert_collect, list);
+    for (nn = 0; nn < opserv_alert_index.unindexed.used; nn++)
+        alertList_append(list, opserv_alert_index.unindexed.list[nn]);
+    qsort(list->list, list->used, sizeof(list->list[0]), opserv_alert_compare);
+}
+
 #if defined(GCC_VARMACROS)
 # define opserv_debug(ARGS...) do { if (opserv_conf.debug_channel) send_channel_notice(opserv_conf.debug_channel, opserv, ARGS); } while (0)
 # define opserv_alert(ARGS...) do { if (opserv_conf.alert_channel) send_channel_notice(opserv_conf.alert_channel, opserv, ARGS); } while (0)
@@ -784,8 +1349,8 @@ static MODCMD_FUNC(cmd_restart)
 static struct gline *
 opserv_block(struct userNode *target, char *src_handle, char *reason, unsigned long duration)
 {
-    char mask[IRC_NTOP_MAX_SIZE+3] = { '*', '@', '\0' };
-    irc_ntop(mask + 2, sizeof(mask) - 2, &target->ip);
+    char mask[IRC_NTOP_MAX_SIZE+3];
+    snprintf(mask, sizeof(mask), "*@%s", user_ip_text(target));
     if (!reason)
         snprintf(reason = alloca(MAXLEN), MAXLEN,
                  "G-line requested by %s.", src_handle);
@@ -813,14 +1378,14 @@ static MODCMD_FUNC(cmd_block)
         reply("MSG_SERVICE_IMMUNE", target->nick);
         return 0;
     }
-    if (dict_find(opserv_trusted_hosts, irc_ntoa(&target->ip), NULL)) {
+    if (opserv_find_trust(&target->ip)) {
         reply("OSMSG_BLOCK_TRUSTED", target->nick);
         return 0;
     }
 
     for(nn = 0; nn < curr_opers.used; nn++) {
         if(memcmp(&curr_opers.list[nn]->ip, &target->ip, sizeof(irc_in_addr_t)) == 0) {
-            reply("OSMSG_BLOCK_OPER", target->nick, irc_ntoa(&target->ip), curr_opers.list[nn]->nick);
+            reply("OSMSG_BLOCK_OPER", target->nick, user_ip_text(target), curr_opers.list[nn]->nick);
             return 0;
         }
     }
@@ -1273,7 +1838,7 @@ static MODCMD_FUNC(cmd_whois)
         reply("OSMSG_WHOIS_FAKEIDENT", target->fakeident);
     else if (IsFakeHost(target))
         reply("OSMSG_WHOIS_FAKEHOST", target->fakehost);
-    reply("OSMSG_WHOIS_IP", irc_ntoa(&target->ip));
+    reply("OSMSG_WHOIS_IP", user_ip_text(target));
     if (target->modes) {
         bpos = irc_user_modes(target, buffer, sizeof(buffer));
 #define buffer_cat(str) (herelen = strlen(str), memcpy(buffer+bpos, str, herelen), bpos += herelen)
@@ -1516,10 +2081,16 @@ static MODCMD_FUNC(cmd_stats_reserved) {
 static MODCMD_FUNC(cmd_stats_trusted) {
     dict_iterator_t it;
     struct trusted_host *th;
+    irc_in_addr_t addr;
+    unsigned int len;
+    unsigned char bits;
     char length[INTERVALLEN], issued[INTERVALLEN], limit[32];
 
     if (argc > 1) {
         th = dict_find(opserv_trusted_hosts, argv[1], NULL);
+        if (!th && (len = irc_pton(&addr, &bits, argv[1])) && !argv[1][len]
+            && (th = opserv_find_trust(&addr)) && (th->bits > bits))
+            th = NULL;
         if (th) {
             if (th->issued)
                 intervalString(issued, now - th->issued, user->handle_info);
@@ -1628,7 +2199,71 @@ static MODCMD_FUNC(cmd_stats_alerts) {
         default: reaction = "<unknown>"; break;
         }
         reply("OSMSG_ALERT_IS", iter_key(it), alert->owner, reaction, alert->text_discrim);
+        reply("OSMSG_ALERT_COUNTS", alert->hits, alert->checks, opserv_alert_index_names[alert->index_type]);
+    }
+    reply("OSMSG_ALERT_INDEX", opserv_alert_index.users, opserv_alert_index.candidates, opserv_alert_index.skipped);
+    return 1;
+}
+
+static MODCMD_FUNC(cmd_stats_dns) {
+    const struct sar_cache_stats *stats;
+    struct sar_nameserver_stats *ns;
+    struct helpfile_table tbl;
+    unsigned int count, nn;
+    char *buffer;
+
+    stats = sar_cache_stats();
+    reply("OSMSG_DNS_REQUESTS", stats->requests);
+    count = sar_nameserver_stats(NULL, 0);
+    if (count) {
+        ns = calloc(count, sizeof(*ns));
+        sar_nameserver_stats(ns, count);
+        reply("OSMSG_DNS_NAMESERVERS");
+        tbl.length = count + 1;
+        tbl.width = 7;
+        tbl.flags = TABLE_NO_FREE;
+        tbl.contents = calloc(tbl.length, sizeof(*tbl.contents));
+        tbl.contents[0] = calloc(tbl.width, sizeof(**tbl.contents));
+        tbl.contents[0][0] = "Server";
+        tbl.contents[0][1] = "Sent";
+        tbl.contents[0][2] = "Used";
+        tbl.contents[0][3] = "Timeouts";
+        tbl.contents[0][4] = "Failed";
+        tbl.contents[0][5] = "SRTT(ms)";
+        tbl.contents[0][6] = "Loss(%)";
+        for (nn = 0; nn < count; nn++) {
+            buffer = malloc(128);
+            tbl.contents[nn+1] = calloc(tbl.width, sizeof(**tbl.contents));
+            tbl.contents[nn+1][0] = ns[nn].name;
+            tbl.contents[nn+1][1] = buffer;
+            sprintf(buffer, "%u", ns[nn].req_sent);
+            tbl.contents[nn+1][2] = buffer + 20;
+            sprintf(buffer + 20, "%u", ns[nn].resp_used);
+            tbl.contents[nn+1][3] = buffer + 40;
+            sprintf(buffer + 40, "%u", ns[nn].timeouts);
+            tbl.contents[nn+1][4] = buffer + 60;
+            sprintf(buffer + 60, "%u", ns[nn].resp_servfail);
+            tbl.contents[nn+1][5] = buffer + 80;
+            sprintf(buffer + 80, "%lu.%lu", ns[nn].srtt / 1000, ns[nn].srtt / 100 % 10);
+            tbl.contents[nn+1][6] = buffer + 104;
+            sprintf(buffer + 104, "%u.%u", ns[nn].loss / 10, ns[nn].loss % 10);
+        }
+        table_send(cmd->parent->bot, user->nick, 0, 0, tbl);
+        for (nn = 1; nn < tbl.length; nn++) {
+            free((char*)tbl.contents[nn][1]);
+            free(tbl.contents[nn]);
+        }
+        free(tbl.contents[0]);
+        free(tbl.contents);
+        free(ns);
+    }
+    if (!stats->max_bytes) {
+        reply("OSMSG_DNS_CACHE_DISABLED");
+        return 1;
     }
+    reply("OSMSG_DNS_CACHE_SIZE", stats->entries, stats->bytes, stats->max_bytes);
+    reply("OSMSG_DNS_CACHE_LOOKUPS", stats->lookups, stats->hits, stats->lookups ? stats->hits * 100 / stats->lookups : 0, stats->expired);
+    reply("OSMSG_DNS_CACHE_STORED", stats->stored, stats->negative, stats->evictions);
     return 1;
 }
 
@@ -1673,39 +2308,276 @@ static MODCMD_FUNC(cmd_stats_gags) {
     return 1;
 }
 
-static MODCMD_FUNC(cmd_stats_timeq) {
-    reply("OSMSG_TIMEQ_INFO", timeq_size(), timeq_next()-now);
-    return 1;
+#define PERF_MAX_LABELS 3
+
+struct perf_row {
+    const char *labels[PERF_MAX_LABELS];
+    struct perf_stat *stat;
+};
+
+static int
+perf_row_compare(const void *a_, const void *b_)
+{
+    const struct perf_row *a = a_, *b = b_;
+    if (a->stat->total != b->stat->total)
+        return (a->stat->total < b->stat->total) ? 1 : -1;
+    return irccasecmp(a->labels[0], b->labels[0]);
 }
 
-static MODCMD_FUNC(cmd_stats_warn) {
+/* Collect every dict entry with current statistics, sorted by total time. */
+static struct perf_row *
+perf_rows_from_dict(dict_t dict, unsigned int *count)
+{
+    struct perf_row *rows;
     dict_iterator_t it;
+    unsigned int nn;
 
-    reply("OSMSG_WARN_LISTSTART");
-    for (it=dict_first(opserv_chan_warn); it; it=iter_next(it))
-        reply("OSMSG_WARN_LISTENTRY", iter_key(it), (char*)iter_data(it));
-    reply("OSMSG_WARN_LISTEND");
-    return 1;
+    rows = calloc(dict_size(dict) + 1, sizeof(*rows));
+    for (it = dict_first(dict), nn = 0; it; it = iter_next(it)) {
+        if (!perf_stat_current(iter_data(it)))
+            continue;
+        rows[nn].labels[0] = iter_key(it);
+        rows[nn].stat = iter_data(it);
+        nn++;
+    }
+    qsort(rows, nn, sizeof(*rows), perf_row_compare);
+    *count = nn;
+    return rows;
 }
 
-#if defined(WITH_MALLOC_SRVX)
-static MODCMD_FUNC(cmd_stats_memory) {
-    extern unsigned long alloc_count, alloc_size;
-    send_message_type(MSG_TYPE_NOXLATE, user, cmd->parent->bot,
-                      "%u allocations totalling %u bytes.",
-                      alloc_count, alloc_size);
-    return 1;
+static void
+opserv_perf_status(struct userNode *user, struct userNode *bot)
+{
+    char interval[INTERVALLEN];
+
+    intervalString(interval, now - perf_reset_time(), user->handle_info);
+    send_message(user, bot, "OSMSG_PROFILING_STATUS", (perf_enabled ? "enabled" : "disabled"), interval);
 }
-#elif defined(WITH_MALLOC_SLAB)
-static MODCMD_FUNC(cmd_stats_memory) {
-    extern unsigned long slab_alloc_count, slab_count, slab_alloc_size;
-    extern unsigned long big_alloc_count, big_alloc_size;
-    send_message_type(MSG_TYPE_NOXLATE, user, cmd->parent->bot,
-                      "%u allocations in %u slabs totalling %u bytes.",
-                      slab_alloc_count, slab_count, slab_alloc_size);
-    send_message_type(MSG_TYPE_NOXLATE, user, cmd->parent->bot,
-                      "%u big allocations totalling %u bytes.",
-                      big_alloc_count, big_alloc_size);
+
+/* Send a table with nlabels identifying columns (headed by titles)
+ * followed by the timing columns for each row. */
+static void
+opserv_perf_table(struct userNode *user, struct userNode *bot, const char **titles, unsigned int nlabels, struct perf_row *rows, unsigned int count)
+{
+    struct helpfile_table tbl;
+    unsigned int nn, ii, jj;
+
+    tbl.length = count + 1;
+    tbl.width = nlabels + 6;
+    tbl.flags = TABLE_NO_FREE | TABLE_PAD_LEFT;
+    tbl.contents = calloc(tbl.length, sizeof(*tbl.contents));
+    tbl.contents[0] = calloc(tbl.width, sizeof(**tbl.contents));
+    for (jj = 0; jj < nlabels; jj++)
+        tbl.contents[0][jj] = titles[jj];
+    tbl.contents[0][jj++] = "Count";
+    tbl.contents[0][jj++] = "Total ms";
+    tbl.contents[0][jj++] = "Avg us";
+    tbl.contents[0][jj++] = "p50 us";
+    tbl.contents[0][jj++] = "p99 us";
+    tbl.contents[0][jj++] = "Max us";
+    for (nn = 0; nn < count; nn++) {
+        struct perf_stat *stat = rows[nn].stat;
+        const char **row;
+        char *buffer = malloc(128);
+
+        row = tbl.contents[nn+1] = calloc(tbl.width, sizeof(**tbl.contents));
+        for (jj = 0; jj < nlabels; jj++)
+            row[jj] = rows[nn].labels[jj];
+        ii = 0;
+        row[jj++] = buffer + ii;
+        ii += sprintf(buffer + ii, "%lu", stat->count) + 1;
+        row[jj++] = buffer + ii;
+        ii += sprintf(buffer + ii, "%.1f", stat->total / 1000.0) + 1;
+        row[jj++] = buffer + ii;
+        ii += sprintf(buffer + ii, "%.0f", stat->total / stat->count) + 1;
+        row[jj++] = buffer + ii;
+        ii += sprintf(buffer + ii, "%lu", perf_percentile(stat, 0.50)) + 1;
+        row[jj++] = buffer + ii;
+        ii += sprintf(buffer + ii, "%lu", perf_percentile(stat, 0.99)) + 1;
+        row[jj++] = buffer + ii;
+        sprintf(buffer + ii, "%lu", stat->max);
+    }
+    table_send(bot, user->nick, 0, 0, tbl);
+    for (nn = 1; nn < tbl.length; nn++) {
+        free((char*)tbl.contents[nn][nlabels]);
+        free(tbl.contents[nn]);
+    }
+    free(tbl.contents[0]);
+    free(tbl.contents);
+}
+
+static void
+opserv_perf_histogram(struct userNode *user, struct userNode *bot, const char *name, struct perf_stat *stat)
+{
+    unsigned long low, high;
+    unsigned int nn;
+
+    send_message(user, bot, "OSMSG_PROFILING_HISTOGRAM", name, stat->count);
+    for (nn = 0; nn < PERF_BUCKETS; nn++) {
+        if (!stat->buckets[nn])
+            continue;
+        low = nn ? (1ul << (nn - 1)) : 0;
+        high = (nn == PERF_BUCKETS - 1) ? stat->max : ((1ul << nn) - 1);
+        send_message(user, bot, "OSMSG_PROFILING_BUCKET", low, high, stat->buckets[nn], stat->buckets[nn] * 100.0 / stat->count);
+    }
+}
+
+static MODCMD_FUNC(cmd_stats_protocol) {
+    extern dict_t irc_func_stats;
+    static const char *titles[] = { "Command" };
+    struct perf_stat *stat;
+    struct perf_row *rows;
+    unsigned int count;
+
+    opserv_perf_status(user, cmd->parent->bot);
+    if (argc > 1) {
+        stat = dict_find(irc_func_stats, argv[1], NULL);
+        if (!stat || !perf_stat_current(stat)) {
+            reply("OSMSG_PROFILING_NO_ENTRY", argv[1]);
+            return 0;
+        }
+        opserv_perf_histogram(user, cmd->parent->bot, argv[1], stat);
+        return 1;
+    }
+    rows = perf_rows_from_dict(irc_func_stats, &count);
+    if (count)
+        opserv_perf_table(user, cmd->parent->bot, titles, 1, rows, count);
+    else
+        reply("OSMSG_PROFILING_EMPTY");
+    free(rows);
+    return 1;
+}
+
+static MODCMD_FUNC(cmd_stats_hooks) {
+    static const char *titles[] = { "Hook", "Module", "Handler" };
+    struct hook_stat *hook;
+    struct perf_row *rows;
+    unsigned int nn, count;
+
+    opserv_perf_status(user, cmd->parent->bot);
+    rows = calloc(hook_stats.used + 1, sizeof(*rows));
+    for (nn = count = 0; nn < hook_stats.used; nn++) {
+        hook = hook_stats.list[nn];
+        if ((argc > 1) && irccasecmp(argv[1], hook->hook) && irccasecmp(argv[1], hook->module))
+            continue;
+        if (!perf_stat_current(&hook->cost))
+            continue;
+        rows[count].labels[0] = hook->hook;
+        rows[count].labels[1] = hook->module;
+        rows[count].labels[2] = hook->handler;
+        rows[count].stat = &hook->cost;
+        count++;
+    }
+    qsort(rows, count, sizeof(*rows), perf_row_compare);
+    if (count)
+        opserv_perf_table(user, cmd->parent->bot, titles, 3, rows, count);
+    else
+        reply("OSMSG_PROFILING_EMPTY");
+    free(rows);
+    return 1;
+}
+
+static MODCMD_FUNC(cmd_stats_events) {
+    struct helpfile_table tbl;
+    const struct perf_event *event;
+    unsigned int nn, count;
+    char *buffer;
+
+    if (!perf_stall_threshold) {
+        reply("OSMSG_EVENTS_DISABLED");
+        return 1;
+    }
+    count = (argc > 1) ? strtoul(argv[1], NULL, 0) : 20;
+    if (count > perf_event_count())
+        count = perf_event_count();
+    reply("OSMSG_EVENTS_STATUS", perf_stall_threshold / 1000, count, perf_event_count());
+    if (!count)
+        return 1;
+    tbl.length = count + 1;
+    tbl.width = 5;
+    tbl.flags = TABLE_NO_FREE;
+    tbl.contents = calloc(tbl.length, sizeof(*tbl.contents));
+    tbl.contents[0] = calloc(tbl.width, sizeof(**tbl.contents));
+    tbl.contents[0][0] = "Age";
+    tbl.contents[0][1] = "Kind";
+    tbl.contents[0][2] = "usec";
+    tbl.contents[0][3] = "Event";
+    tbl.contents[0][4] = "Command";
+    for (nn = 0; nn < count; nn++) {
+        event = perf_event_get(nn);
+        buffer = malloc(48);
+        tbl.contents[nn+1] = calloc(tbl.width, sizeof(**tbl.contents));
+        tbl.contents[nn+1][0] = buffer;
+        sprintf(buffer, "%lu", now - event->when);
+        tbl.contents[nn+1][1] = perf_event_kind_name(event->kind);
+        tbl.contents[nn+1][2] = buffer + 24;
+        sprintf(buffer + 24, "%lu", event->usec);
+        tbl.contents[nn+1][3] = event->label;
+        tbl.contents[nn+1][4] = event->command[0] ? event->command : "-";
+    }
+    table_send(cmd->parent->bot, user->nick, 0, 0, tbl);
+    for (nn = 1; nn < tbl.length; nn++) {
+        free((char*)tbl.contents[nn][0]);
+        free(tbl.contents[nn]);
+    }
+    free(tbl.contents[0]);
+    free(tbl.contents);
+    return 1;
+}
+
+static MODCMD_FUNC(cmd_profile)
+{
+    if (argc < 2) {
+        opserv_perf_status(user, cmd->parent->bot);
+    } else if (enabled_string(argv[1])) {
+        perf_enabled = 1;
+        reply("OSMSG_PROFILING_ENABLED");
+    } else if (disabled_string(argv[1])) {
+        perf_enabled = 0;
+        reply("OSMSG_PROFILING_DISABLED");
+    } else if (!irccasecmp(argv[1], "reset")) {
+        perf_reset();
+        reply("OSMSG_PROFILING_RESET");
+    } else {
+        reply("MSG_INVALID_BINARY", argv[1]);
+        return 0;
+    }
+    return 1;
+}
+
+static MODCMD_FUNC(cmd_stats_timeq) {
+    reply("OSMSG_TIMEQ_INFO", timeq_size(), timeq_next()-now);
+    return 1;
+}
+
+static MODCMD_FUNC(cmd_stats_warn) {
+    dict_iterator_t it;
+
+    reply("OSMSG_WARN_LISTSTART");
+    for (it=dict_first(opserv_chan_warn); it; it=iter_next(it))
+        reply("OSMSG_WARN_LISTENTRY", iter_key(it), (char*)iter_data(it));
+    reply("OSMSG_WARN_LISTEND");
+    return 1;
+}
+
+#if defined(WITH_MALLOC_SRVX)
+static MODCMD_FUNC(cmd_stats_memory) {
+    extern unsigned long alloc_count, alloc_size;
+    send_message_type(MSG_TYPE_NOXLATE, user, cmd->parent->bot,
+                      "%u allocations totalling %u bytes.",
+                      alloc_count, alloc_size);
+    return 1;
+}
+#elif defined(WITH_MALLOC_SLAB)
+static MODCMD_FUNC(cmd_stats_memory) {
+    extern unsigned long slab_alloc_count, slab_count, slab_alloc_size;
+    extern unsigned long big_alloc_count, big_alloc_size;
+    send_message_type(MSG_TYPE_NOXLATE, user, cmd->parent->bot,
+                      "%u allocations in %u slabs totalling %u bytes.",
+                      slab_alloc_count, slab_count, slab_alloc_size);
+    send_message_type(MSG_TYPE_NOXLATE, user, cmd->parent->bot,
+                      "%u big allocations totalling %u bytes.",
+                      big_alloc_count, big_alloc_size);
     return 1;
 }
 #endif
@@ -1829,33 +2701,38 @@ static void
 opserv_new_user_check(struct userNode *user)
 {
     struct opserv_hostinfo *ohi;
-    struct gag_entry *gag;
-    char addr[IRC_NTOP_MAX_SIZE];
+    struct alertList alerts;
+    unsigned int nn;
+
+    opserv_add_host_user(user);
 
     /* Check to see if we should ignore them entirely. */
-    if (IsLocal(user) || IsService(user))
+    if (IsLocal(user) || IsService(user)) {
+        userList_append(&opserv_unhashed_users, user);
         return;
+    }
 
     /* Check for alerts, and stop if we find one that kills them. */
-    if (dict_foreach(opserv_user_alerts, alert_check_user, user))
+    alertList_init(&alerts);
+    opserv_alert_candidates(user, &alerts);
+    opserv_alert_index.users++;
+    opserv_alert_index.candidates += alerts.used;
+    opserv_alert_index.skipped += dict_size(opserv_user_alerts) - alerts.used;
+    for (nn = 0; nn < alerts.used; nn++)
+        if (alert_check_user(alerts.list[nn]->name, alerts.list[nn], user))
+            break;
+    if (nn < alerts.used) {
+        alertList_clean(&alerts);
         return;
+    }
+    alertList_clean(&alerts);
 
     /* Gag them if appropriate. */
-    for (gag = gagList; gag; gag = gag->next) {
-        if (user_matches_glob(user, gag->mask, MATCH_USENICK)) {
-            gag_helper_func(user, NULL);
-            break;
-        }
-    }
+    if (gag_find_user(user))
+        gag_helper_func(user, NULL);
 
     /* Add to host info struct */
-    irc_ntop(addr, sizeof(addr), &user->ip);
-    if (!(ohi = dict_find(opserv_hostinfo_dict, addr, NULL))) {
-        ohi = calloc(1, sizeof(*ohi));
-        dict_insert(opserv_hostinfo_dict, strdup(addr), ohi);
-        userList_init(&ohi->clients);
-    }
-    userList_append(&ohi->clients, user);
+    ohi = opserv_add_hostinfo(user);
 
     /* Only warn of new user floods outside of bursts. */
     if (!user->uplink->burst) {
@@ -1872,29 +2749,15 @@ opserv_new_user_check(struct userNode *user)
     /* Only warn or G-line if there's an untrusted max and their IP is sane. */
     if (opserv_conf.untrusted_max
         && irc_in_addr_is_valid(user->ip)
-        && !irc_in_addr_is_loopback(user->ip)) {
-        struct trusted_host *th = dict_find(opserv_trusted_hosts, addr, NULL);
-        unsigned int limit = th ? th->limit : opserv_conf.untrusted_max;
-        if (!limit) {
-            /* 0 means unlimited hosts */
-        } else if (ohi->clients.used == limit) {
-            unsigned int nn;
-            for (nn=0; nn<ohi->clients.used; nn++)
-                send_message(ohi->clients.list[nn], opserv, "OSMSG_CLONE_WARNING");
-        } else if (ohi->clients.used > limit) {
-            char target[IRC_NTOP_MAX_SIZE + 3] = { '*', '@', '\0' };
-            strcpy(target + 2, addr);
-            gline_add(opserv->nick, target, opserv_conf.clone_gline_duration, "AUTO Excessive connections from a single host.", now, now, 0, 1);
-        }
-    }
+        && !irc_in_addr_is_loopback(user->ip))
+        opserv_clone_check(user, ohi);
 }
 
 static void
 opserv_user_cleanup(struct userNode *user, UNUSED_ARG(struct userNode *killer), UNUSED_ARG(const char *why))
 {
-    struct opserv_hostinfo *ohi;
-    char addr[IRC_NTOP_MAX_SIZE];
-
+    opserv_del_host_user(user);
+    userList_remove(&opserv_unhashed_users, user);
     if (IsLocal(user)) {
         /* Try to remove it from the reserved nick dict without
          * calling free_reserve, because that would call DelUser(),
@@ -1902,18 +2765,12 @@ opserv_user_cleanup(struct userNode *user, UNUSED_ARG(struct userNode *killer),
         dict_remove(opserv_reserved_nick_dict, user->nick);
         return;
     }
-    irc_ntop(addr, sizeof(addr), &user->ip);
-    if ((ohi = dict_find(opserv_hostinfo_dict, addr, NULL))) {
-        userList_remove(&ohi->clients, user);
-        if (ohi->clients.used == 0)
-            dict_remove(opserv_hostinfo_dict, addr);
-    }
+    opserv_del_hostinfo(user);
 }
 
 int
 opserv_bad_channel(const char *name)
 {
-    unsigned int found;
     int present;
 
     dict_find(opserv_exempt_channels, name, &present);
@@ -1923,13 +2780,21 @@ opserv_bad_channel(const char *name)
     if (gline_find(name))
         return 1;
 
-    for (found=0; found<opserv_bad_words->used; ++found)
-        if (irccasestr(name, opserv_bad_words->list[found]))
-            return 1;
+    if (opserv_bad_matcher && (string_matcher_find(opserv_bad_matcher, name) >= 0))
+        return 1;
 
     return 0;
 }
 
+/* Recompile opserv_bad_matcher; call this whenever opserv_bad_words
+ * changes. */
+static void
+opserv_bad_words_changed(void)
+{
+    string_matcher_free(opserv_bad_matcher);
+    opserv_bad_matcher = opserv_bad_words->used ? string_matcher_new(opserv_bad_words) : NULL;
+}
+
 static void
 opserv_shutdown_channel(struct chanNode *channel, const char *reason)
 {
@@ -2077,6 +2942,8 @@ static MODCMD_FUNC(cmd_addbad)
 
     /* Create the bad word if it doesn't exist. */
     bad_found = !opserv_add_bad_word(cmd, user, argv[1]);
+    if (!bad_found)
+        opserv_bad_words_changed();
 
     /* Look for exception modifiers. */
     for (arg=2; arg<argc; arg++) {
@@ -2131,6 +2998,7 @@ static MODCMD_FUNC(cmd_delbad)
     for (nn=0; nn<opserv_bad_words->used; nn++) {
         if (!irccasecmp(opserv_bad_words->list[nn], argv[1])) {
             string_list_delete(opserv_bad_words, nn);
+            opserv_bad_words_changed();
             for (it = dict_first(channels); it; it = iter_next(it)) {
                 channel = iter_data(it);
                 if (irccasestr(channel->name, argv[1])
@@ -2198,6 +3066,20 @@ opserv_expire_trusted_host(void *data)
     dict_remove(opserv_trusted_hosts, th->ipaddr);
 }
 
+/* Parses an address or CIDR range to trust; returns 0 for anything
+ * else, including ranges that would cover every address. */
+static unsigned char
+opserv_parse_trust(const char *ipaddr, irc_in_addr_t *addr)
+{
+    unsigned int len;
+    unsigned char bits;
+
+    len = irc_pton(addr, &bits, ipaddr);
+    if (!len || ipaddr[len] || strchr(ipaddr, '*'))
+        return 0;
+    return bits;
+}
+
 static void
 opserv_add_trusted_host(const char *ipaddr, unsigned int limit, const char *issuer, unsigned long issued, unsigned long expires, const char *reason)
 {
@@ -2206,6 +3088,8 @@ opserv_add_trusted_host(const char *ipaddr, unsigned int limit, const char *issu
     if (!th)
         return;
     th->ipaddr = strdup(ipaddr);
+    if ((th->bits = opserv_parse_trust(ipaddr, &th->addr)))
+        cidr_tree_insert(&opserv_trusted_tree, &th->addr, th->bits, th);
     th->reason = reason ? strdup(reason) : NULL;
     th->issuer = issuer ? strdup(issuer) : NULL;
     th->issued = issued;
@@ -2220,6 +3104,8 @@ static void
 free_trusted_host(void *data)
 {
     struct trusted_host *th = data;
+    if (th->bits)
+        cidr_tree_remove(&opserv_trusted_tree, &th->addr, th->bits, th);
     free(th->ipaddr);
     free(th->reason);
     free(th->issuer);
@@ -2238,7 +3124,7 @@ static MODCMD_FUNC(cmd_addtrust)
         return 0;
     }
 
-    if (!irc_pton(&tmpaddr, NULL, argv[1])) {
+    if (!opserv_parse_trust(argv[1], &tmpaddr)) {
         reply("OSMSG_BAD_IP", argv[1]);
         return 0;
     }
@@ -2560,6 +3446,7 @@ foreach_matching_user(const char *hostmask, discrim_search_func func, void *extr
     if (split_ircmask(dupmask, &discrim->mask_nick, &discrim->mask_ident, &discrim->mask_host)) {
         if (!irc_pton(&discrim->ip_mask, &discrim->ip_mask_bits, discrim->mask_host))
             discrim->ip_mask_bits = 0;
+        opserv_discrim_compile(discrim);
         matched = opserv_discrim_search(discrim, func, extra);
     } else {
         log_module(OS_LOG, LOG_ERROR, "Couldn't split IRC mask for gag %s!", hostmask);
@@ -2570,19 +3457,23 @@ foreach_matching_user(const char *hostmask, discrim_search_func func, void *extr
     return matched;
 }
 
+static void gag_expire(void *data);
+
 static unsigned int
 gag_free(struct gag_entry *gag)
 {
     unsigned int ungagged;
 
-    /* Remove from gag list */
-    if (gagList == gag) {
+    /* Remove from gag list and index, and cancel the expiry timer */
+    if (gag->prev)
+        gag->prev->next = gag->next;
+    else
         gagList = gag->next;
-    } else {
-        struct gag_entry *prev;
-        for (prev = gagList; prev->next != gag; prev = prev->next) ;
-        prev->next = gag->next;
-    }
+    if (gag->next)
+        gag->next->prev = gag->prev;
+    gag_index_remove(gag);
+    if (gag->expires)
+        timeq_del(gag->expires, gag_expire, gag, 0);
 
     ungagged = foreach_matching_user(gag->mask, ungag_helper_func, NULL);
 
@@ -2590,6 +3481,8 @@ gag_free(struct gag_entry *gag)
     free(gag->reason);
     free(gag->owner);
     free(gag->mask);
+    if (gag->compiled)
+        compiled_mask_free(gag->compiled);
     free(gag);
 
     return ungagged;
@@ -2598,7 +3491,11 @@ gag_free(struct gag_entry *gag)
 static void
 gag_expire(void *data)
 {
-    gag_free(data);
+    struct gag_entry *gag = data;
+
+    /* The timer has already fired, so gag_free() must not cancel it. */
+    gag->expires = 0;
+    gag_free(gag);
 }
 
 unsigned int
@@ -2606,16 +3503,20 @@ gag_create(const char *mask, const char *owner, const char *reason, unsigned lon
 {
     struct gag_entry *gag;
 
-    /* Create gag and put it into linked list */
+    /* Create gag and put it into linked list and index */
     gag = calloc(1, sizeof(*gag));
     gag->mask = strdup(mask);
+    gag->compiled = compiled_mask_new(mask, MATCH_USENICK);
     gag->owner = strdup(owner ? owner : "<unknown>");
     gag->reason = strdup(reason ? reason : "<unknown>");
     gag->expires = expires;
     if (gag->expires)
         timeq_add(gag->expires, gag_expire, gag);
     gag->next = gagList;
+    if (gagList)
+        gagList->prev = gag;
     gagList = gag;
+    gag_index_add(gag);
 
     /* If we're linked, see if who the gag applies to */
     return foreach_matching_user(mask, gag_helper_func, gag);
@@ -2649,7 +3550,7 @@ opserv_add_user_alert(struct userNode *req, const char *name, opserv_alert_react
         send_message(req, opserv, "OSMSG_ALERT_EXISTS", name);
         return NULL;
     }
-    alert = malloc(sizeof(*alert));
+    alert = calloc(1, sizeof(*alert));
     alert->owner = strdup(req->handle_info ? req->handle_info->handle : req->nick);
     alert->text_discrim = strdup(text_discrim);
     discrim_copy = strdup(text_discrim); /* save a copy of the discrim */
@@ -2666,7 +3567,9 @@ opserv_add_user_alert(struct userNode *req, const char *name, opserv_alert_react
     if (!alert->discrim->reason)
         alert->discrim->reason = strdup(name);
     alert->reaction = reaction;
+    alert->name = name_dup;
     dict_insert(opserv_user_alerts, name_dup, alert);
+    opserv_alert_index_add(alert);
     /* Stick the alert into the appropriate additional alert dict(s).
      * For channel alerts, we only use channels and min_channels;
      * max_channels would have to be checked on /part, which we do not
@@ -2796,6 +3699,7 @@ opserv_saxdb_read(struct dict *conf_db)
         default:
             /* do nothing */;
         }
+        opserv_bad_words_changed();
     }
     if ((rd = database_get_path(conf_db, KEY_EXEMPT_CHANNELS))
         && (rd->type == RECDB_STRING_LIST)) {
@@ -3212,12 +4116,27 @@ opserv_discrim_create(struct userNode *user, unsigned int argc, char *argv[], in
     if (discrim->mask_host && !discrim->mask_host[strspn(discrim->mask_host, "*.")]) {
         discrim->mask_host = 0;
     }
+    opserv_discrim_compile(discrim);
     return discrim;
   fail:
     free(discrim);
     return NULL;
 }
 
+/* Analyse the discrim's globs once rather than for every user tested.
+ * The compiled forms point at the mask strings, which must not change
+ * afterwards. */
+static void
+opserv_discrim_compile(discrim_t discrim)
+{
+    compiled_glob_init(&discrim->nick_glob, discrim->mask_nick);
+    compiled_glob_init(&discrim->ident_glob, discrim->mask_ident);
+    compiled_glob_init(&discrim->host_glob, discrim->mask_host);
+    compiled_glob_init(&discrim->info_glob, discrim->mask_info);
+    compiled_glob_init(&discrim->server_glob, discrim->server);
+    compiled_glob_init(&discrim->account_glob, discrim->accountmask);
+}
+
 static int
 discrim_match(discrim_t discrim, struct userNode *user)
 {
@@ -3231,12 +4150,12 @@ discrim_match(discrim_t discrim, struct userNode *user)
         || (discrim->authed == 1 && !user->handle_info)
         || (discrim->info_space == 0 && user->info[0] == ' ')
         || (discrim->info_space == 1 && user->info[0] != ' ')
-        || (discrim->mask_nick && !match_ircglob(user->nick, discrim->mask_nick))
-        || (discrim->mask_ident && !match_ircglob(user->ident, discrim->mask_ident))
-        || (discrim->mask_host && !match_ircglob(user->hostname, discrim->mask_host))
-        || (discrim->mask_info && !match_ircglob(user->info, discrim->mask_info))
-        || (discrim->server && !match_ircglob(user->uplink->name, discrim->server))
-        || (discrim->accountmask && (!user->handle_info || !match_ircglob(user->handle_info->handle, discrim->accountmask)))
+        || (discrim->mask_nick && !compiled_glob_match(&discrim->nick_glob, user->nick))
+        || (discrim->mask_ident && !compiled_glob_match(&discrim->ident_glob, user->ident))
+        || (discrim->mask_host && !compiled_glob_match(&discrim->host_glob, user->hostname))
+        || (discrim->mask_info && !compiled_glob_match(&discrim->info_glob, user->info))
+        || (discrim->server && !compiled_glob_match(&discrim->server_glob, user->uplink->name))
+        || (discrim->accountmask && (!user->handle_info || !compiled_glob_match(&discrim->account_glob, user->handle_info->handle)))
         || (discrim->ip_mask_bits && !irc_check_mask(&user->ip, &discrim->ip_mask, discrim->ip_mask_bits))
         )
         return 0;
@@ -3249,100 +4168,455 @@ discrim_match(discrim_t discrim, struct userNode *user)
         return 0;
     }
     if (discrim->min_clones > 1) {
-        struct opserv_hostinfo *ohi = dict_find(opserv_hostinfo_dict, irc_ntoa(&user->ip), NULL);
+        struct opserv_hostinfo *ohi = opserv_find_hostinfo(&user->ip);
         if (!ohi || (ohi->clients.used < discrim->min_clones))
             return 0;
     }
     return 1;
 }
 
+/* Channel membership is checked by discrim_match(); this checks the
+ * modes the user must (or must not) have in each channel. */
+static int
+discrim_match_modes(discrim_t discrim, struct userNode *user)
+{
+    struct modeNode *mn;
+    unsigned int ii;
+
+    for (ii = 0; ii < discrim->channel_count; ii++) {
+        if (!(mn = GetUserMode(discrim->channels[ii], user))
+            || ((mn->modes & discrim->chan_req_modes[ii]) != discrim->chan_req_modes[ii])
+            || (mn->modes & discrim->chan_no_modes[ii]))
+            return 0;
+    }
+    return 1;
+}
+
+/* Each candidate source below collects a superset of the users that
+ * can match a discrim.  It returns 1 if it applies and found no more
+ * than cap users, or 0 (leaving junk in the list) otherwise. */
+struct discrim_candidates {
+    struct userList *list;
+    unsigned int cap;
+    unsigned int min_clones;
+    unsigned char below_bits;
+};
+
+static int
+discrim_add_candidate(struct discrim_candidates *dc, struct userNode *user)
+{
+    if (dc->list->used >= dc->cap)
+        return 1;
+    userList_append(dc->list, user);
+    return 0;
+}
+
+static int
+discrim_add_hostinfo(void *data, void *extra)
+{
+    struct opserv_hostinfo *ohi = data;
+    struct discrim_candidates *dc = extra;
+    unsigned int nn;
+
+    if (ohi->clients.used < dc->min_clones)
+        return 0;
+    for (nn = 0; nn < ohi->clients.used; nn++)
+        if (discrim_add_candidate(dc, ohi->clients.list[nn]))
+            return 1;
+    return 0;
+}
+
+static int
+discrim_add_wider_hostinfo(void *data, void *extra)
+{
+    struct opserv_hostinfo *ohi = data;
+    struct discrim_candidates *dc = extra;
+
+    return (ohi->bits < dc->below_bits) && discrim_add_hostinfo(data, extra);
+}
+
+static int
+discrim_from_channel(discrim_t discrim, struct discrim_candidates *dc)
+{
+    struct chanNode *chan;
+    unsigned int nn;
+
+    if (!discrim->channel_count)
+        return 0;
+    chan = discrim->channels[0];
+    if (chan->members.used > dc->cap)
+        return 0;
+    for (nn = 0; nn < chan->members.used; nn++)
+        userList_append(dc->list, chan->members.list[nn]->user);
+    return 1;
+}
+
+static int
+discrim_from_account(discrim_t discrim, struct discrim_candidates *dc)
+{
+    struct handle_info *hi;
+    struct userNode *user;
+
+    if (!discrim->accountmask || (discrim->account_glob.type != GLOB_LITERAL))
+        return 0;
+    if (!(hi = get_handle_info(discrim->accountmask)))
+        return 1;
+    for (user = hi->users; user; user = user->next_authed)
+        if (discrim_add_candidate(dc, user))
+            return 0;
+    return 1;
+}
+
+static int
+discrim_from_ip(discrim_t discrim, struct discrim_candidates *dc)
+{
+    struct userNode *user;
+    unsigned int nn;
+
+    if (!discrim->ip_mask_bits)
+        return 0;
+    /* A hostinfo wider than the mask (such as an IPv6 /64, which is
+     * also where 0.x.x.x addresses end up) may hold some matching
+     * users; the ones inside the mask hold only matching users. */
+    dc->below_bits = discrim->ip_mask_bits;
+    if (cidr_tree_walk(&opserv_hostinfo_tree, &discrim->ip_mask, discrim_add_wider_hostinfo, dc)
+        || cidr_tree_foreach_within(&opserv_hostinfo_tree, &discrim->ip_mask, discrim->ip_mask_bits, discrim_add_hostinfo, dc))
+        return 0;
+    /* Local and service users are not in any hostinfo. */
+    for (nn = 0; nn < opserv_unhashed_users.used; nn++) {
+        user = opserv_unhashed_users.list[nn];
+        if (irc_check_mask(&user->ip, &discrim->ip_mask, discrim->ip_mask_bits)
+            && discrim_add_candidate(dc, user))
+            return 0;
+    }
+    return 1;
+}
+
+static int
+discrim_from_clones(discrim_t discrim, struct discrim_candidates *dc)
+{
+    if (discrim->min_clones < 2)
+        return 0;
+    dc->min_clones = discrim->min_clones;
+    return !cidr_tree_foreach(&opserv_hostinfo_tree, discrim_add_hostinfo, dc);
+}
+
+static int
+discrim_from_server(discrim_t discrim, struct discrim_candidates *dc)
+{
+    struct server *srv;
+    struct userNode *user;
+    dict_iterator_t it;
+    unsigned int total;
+#ifdef WITH_PROTOCOL_P10
+    unsigned int nn;
+#else
+    dict_iterator_t it2;
+#endif
+
+    if (!discrim->server)
+        return 0;
+    for (it = dict_first(servers), total = 0; it; it = iter_next(it)) {
+        srv = iter_data(it);
+        if (compiled_glob_match(&discrim->server_glob, srv->name)
+            && ((total += srv->clients) > dc->cap))
+            return 0;
+    }
+    for (it = dict_first(servers); it; it = iter_next(it)) {
+        srv = iter_data(it);
+        if (!compiled_glob_match(&discrim->server_glob, srv->name))
+            continue;
+#ifdef WITH_PROTOCOL_P10
+        for (nn = 0; nn <= srv->num_mask; nn++)
+            if ((user = srv->users[nn]) && (GetUserH(user->nick) == user))
+                userList_append(dc->list, user);
+#else
+        for (it2 = dict_first(srv->users); it2; it2 = iter_next(it2))
+            if (GetUserH(iter_key(it2)) == (user = iter_data(it2)))
+                userList_append(dc->list, user);
+#endif
+    }
+    return 1;
+}
+
+/* Length of the literal text at the start (or end) of a glob. */
 static unsigned int
-opserv_discrim_search(discrim_t discrim, discrim_search_func dsf, void *data)
+discrim_literal_len(const char *glob, int suffix)
 {
-    unsigned int nn, count, match;
-    struct userList matched;
+    unsigned int len, ii;
 
-    userList_init(&matched);
-    /* Try most optimized search methods first */
-    if (discrim->channel_count)
-    {
-        for (nn=0; (nn < discrim->channels[0]->members.used)
-             && (matched.used < discrim->limit);
-             nn++) {
-            struct modeNode *mn = discrim->channels[0]->members.list[nn];
-
-            if (((mn->modes & discrim->chan_req_modes[0]) != discrim->chan_req_modes[0])
-               || ((mn->modes & discrim->chan_no_modes[0]) != 0)) {
-                continue;
-            }
+    len = strlen(glob);
+    for (ii = 0; (ii < len) && !strchr("*?\\", glob[suffix ? len - 1 - ii : ii]); ii++) ;
+    return ii;
+}
 
-            if ((match = discrim_match(discrim, mn->user)))
-            {
-                unsigned int i;
-
-                for (i = 1; i < discrim->channel_count; i++) {
-                    struct modeNode *mn2 = GetUserMode(discrim->channels[i], mn->user);
-                    unsigned int req_modes = discrim->chan_req_modes[i];
-                    unsigned int no_modes = discrim->chan_no_modes[i];
-
-                    if ((req_modes && (!mn2 || ((mn2->modes & req_modes) != req_modes)))
-                        || (no_modes && mn2 && ((mn2->modes & no_modes) != 0))) {
-                        match = 0;
-                        break;
-                    }
-                }
+static int
+discrim_from_nick(discrim_t discrim, struct discrim_candidates *dc)
+{
+    dict_iterator_t it;
+    unsigned int len;
+    char *prefix;
 
-                if (match)
-                    userList_append(&matched, mn->user);
-            }
-        }
-    } else if (discrim->ip_mask_bits == 128) {
-        struct opserv_hostinfo *ohi = dict_find(opserv_hostinfo_dict, irc_ntoa(&discrim->ip_mask), NULL);
-        if (!ohi) {
-            userList_clean(&matched);
+    if (!discrim->mask_nick || !(len = discrim_literal_len(discrim->mask_nick, 0)))
+        return 0;
+    prefix = alloca(len + 1);
+    memcpy(prefix, discrim->mask_nick, len);
+    prefix[len] = '\0';
+    for (it = dict_lower_bound(clients, prefix); it && !ircncasecmp(iter_key(it), prefix, len); it = iter_next(it))
+        if (discrim_add_candidate(dc, iter_data(it)))
             return 0;
-        }
-        for (nn=0; (nn<ohi->clients.used) && (matched.used < discrim->limit); nn++) {
-            if (discrim_match(discrim, ohi->clients.list[nn])) {
-                userList_append(&matched, ohi->clients.list[nn]);
-            }
-        }
-    } else {
-        dict_iterator_t it;
-        for (it=dict_first(clients); it && (matched.used < discrim->limit); it=iter_next(it)) {
-            if (discrim_match(discrim, iter_data(it))) {
-                userList_append(&matched, iter_data(it));
-            }
-        }
+    return 1;
+}
+
+static int
+discrim_from_host(discrim_t discrim, struct discrim_candidates *dc)
+{
+    struct ptrList *bucket;
+    dict_iterator_t it;
+    unsigned int len, nn;
+    char *key;
+
+    if (!discrim->mask_host || !(len = discrim_literal_len(discrim->mask_host, 1)))
+        return 0;
+    key = alloca(len + 1);
+    opserv_reverse_host(key, discrim->mask_host + strlen(discrim->mask_host) - len);
+    for (it = dict_lower_bound(opserv_host_users, key); it && !ircncasecmp(iter_key(it), key, len); it = iter_next(it)) {
+        bucket = iter_data(it);
+        for (nn = 0; nn < bucket->used; nn++)
+            if (discrim_add_candidate(dc, bucket->list[nn]))
+                return 0;
     }
+    return 1;
+}
+
+static int
+discrim_compare_nicks(const void *a_, const void *b_)
+{
+    struct userNode *a = *(struct userNode**)a_, *b = *(struct userNode**)b_;
+    return irccasecmp(a->nick, b->nick);
+}
 
-    if (!matched.used) {
-        userList_clean(&matched);
+/* Tries each candidate source in turn, giving it a budget of one less
+ * than the smallest complete list so far, and matches discrim against
+ * the winner.  Returns 0 if no source beats a scan of the whole table
+ * (taken as anything over half of it). */
+static int
+opserv_discrim_plan(discrim_t discrim, struct userList *matched)
+{
+    static int (*const sources[])(discrim_t, struct discrim_candidates *) = {
+        discrim_from_account,
+        discrim_from_ip,
+        discrim_from_channel,
+        discrim_from_server,
+        discrim_from_host,
+        discrim_from_nick,
+        discrim_from_clones
+    };
+    struct userList best, trial, swap;
+    struct discrim_candidates dc;
+    unsigned int ii, nn, chosen;
+
+    userList_init(&best);
+    userList_init(&trial);
+    chosen = ArrayLength(sources);
+    dc.cap = dict_size(clients) / 2;
+    for (ii = 0; (ii < ArrayLength(sources)) && dc.cap; ii++) {
+        trial.used = 0;
+        dc.list = &trial;
+        dc.min_clones = 0;
+        if (!sources[ii](discrim, &dc))
+            continue;
+        swap = best;
+        best = trial;
+        trial = swap;
+        chosen = ii;
+        if (!best.used)
+            break;
+        dc.cap = best.used - 1;
+    }
+    userList_clean(&trial);
+    if (chosen == ArrayLength(sources)) {
+        userList_clean(&best);
         return 0;
     }
+    /* Report matches in the same order as a full scan would, except
+     * that channel searches keep the channel's member order. */
+    if (sources[chosen] != discrim_from_channel)
+        qsort(best.list, best.used, sizeof(best.list[0]), discrim_compare_nicks);
+    for (nn = 0; (nn < best.used) && (matched->used < discrim->limit); nn++)
+        if (discrim_match(discrim, best.list[nn]) && discrim_match_modes(discrim, best.list[nn]))
+            userList_append(matched, best.list[nn]);
+    userList_clean(&best);
+    return 1;
+}
 
-    if (discrim->option_log) {
-        log_module(OS_LOG, LOG_INFO, "Logging matches for search:");
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_PTHREAD_CREATE)
+
+/* One thread's share of a batch of users. */
+struct discrim_slice {
+    discrim_t discrim;
+    struct userNode **users;
+    unsigned int count;
+    unsigned long limit;
+    struct userNode **found;
+    unsigned int found_used;
+};
+
+static void *
+discrim_search_slice(void *arg)
+{
+    struct discrim_slice *slice = arg;
+    unsigned int nn;
+
+    for (nn = 0; (nn < slice->count) && (slice->found_used < slice->limit); nn++)
+        if (discrim_match(slice->discrim, slice->users[nn]) && discrim_match_modes(slice->discrim, slice->users[nn]))
+            slice->found[slice->found_used++] = slice->users[nn];
+    return NULL;
+}
+
+/* Splits users into one contiguous slice per thread.  This relies on
+ * discrim_match() and discrim_match_modes() only reading: the main
+ * thread searches the first slice and then waits for the others, so
+ * nothing can change underneath them, and the workers never allocate.
+ * Slices are merged in order, so the result is the same as a serial
+ * scan's. */
+static int
+opserv_discrim_match_parallel(discrim_t discrim, struct userNode **users, unsigned int count, unsigned long limit, struct userList *matched)
+{
+    struct discrim_slice slices[OPSERV_MAX_SEARCH_THREADS];
+    pthread_t threads[OPSERV_MAX_SEARCH_THREADS];
+    char started[OPSERV_MAX_SEARCH_THREADS];
+    unsigned int nslices, per, ii, jj;
+    sigset_t all, old;
+
+    nslices = opserv_conf.search_threads;
+    if ((nslices < 2) || (count < nslices * OPSERV_MIN_SEARCH_SLICE) || (matched->used >= limit))
+        return 0;
+    limit -= matched->used;
+    per = (count + nslices - 1) / nslices;
+    for (ii = 0; ii < nslices; ii++) {
+        slices[ii].discrim = discrim;
+        slices[ii].users = users + ii * per;
+        slices[ii].count = (ii + 1 < nslices) ? per : count - ii * per;
+        slices[ii].limit = limit;
+        slices[ii].found = malloc(((slices[ii].count < limit) ? slices[ii].count : limit) * sizeof(slices[ii].found[0]));
+        slices[ii].found_used = 0;
+    }
+    /* Leave signal handling to the main thread. */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (ii = 1; ii < nslices; ii++)
+        started[ii] = !pthread_create(&threads[ii], NULL, discrim_search_slice, &slices[ii]);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    discrim_search_slice(&slices[0]);
+    for (ii = 1; ii < nslices; ii++) {
+        if (started[ii])
+            pthread_join(threads[ii], NULL);
+        else
+            discrim_search_slice(&slices[ii]);
+    }
+    for (ii = 0; ii < nslices; ii++) {
+        for (jj = 0; (jj < slices[ii].found_used) && (limit > 0); jj++, limit--)
+            userList_append(matched, slices[ii].found[jj]);
+        free(slices[ii].found);
     }
-    for (nn=0; nn<matched.used; nn++) {
-        struct userNode *user = matched.list[nn];
+    return 1;
+}
+
+#else
+
+static int
+opserv_discrim_match_parallel(UNUSED_ARG(discrim_t discrim), UNUSED_ARG(struct userNode **users), UNUSED_ARG(unsigned int count), UNUSED_ARG(unsigned long limit), UNUSED_ARG(struct userList *matched))
+{
+    return 0;
+}
+
+#endif
+
+/* Appends the users that match discrim to matched, in order, until
+ * matched holds limit entries. */
+static void
+opserv_discrim_match_users(discrim_t discrim, struct userNode **users, unsigned int count, unsigned long limit, struct userList *matched)
+{
+    unsigned int nn;
+
+    if (opserv_discrim_match_parallel(discrim, users, count, limit, matched))
+        return;
+    for (nn = 0; (nn < count) && (matched->used < limit); nn++)
+        if (discrim_match(discrim, users[nn]) && discrim_match_modes(discrim, users[nn]))
+            userList_append(matched, users[nn]);
+}
+
+/* Tests every user against discrim, in the order of the clients dict. */
+static void
+opserv_discrim_scan(discrim_t discrim, struct userList *matched)
+{
+    struct userNode **users;
+    dict_iterator_t it;
+    unsigned int count;
+
+    users = malloc(dict_size(clients) * sizeof(users[0]));
+    for (it = dict_first(clients), count = 0; it; it = iter_next(it))
+        users[count++] = iter_data(it);
+    opserv_discrim_match_users(discrim, users, count, discrim->limit, matched);
+    free(users);
+}
+
+/* Runs dsf over each user in matched.  Returns non-zero if dsf gave
+ * up part of the way through. */
+static int
+opserv_discrim_apply(discrim_t discrim, struct userList *matched, discrim_search_func dsf, void *data)
+{
+    unsigned int nn;
+
+    for (nn=0; nn<matched->used; nn++) {
+        struct userNode *user = matched->list[nn];
         if (discrim->option_log) {
             log_module(OS_LOG, LOG_INFO, "  %s!%s@%s", user->nick, user->ident, user->hostname);
         }
         if (dsf(user, data)) {
             /* If a search function returns true, it ran into a
                problem. Stop going through the list. */
-            break;
+            return 1;
         }
     }
+    return 0;
+}
+
+/* Applies dsf to an already-matched list and frees the list. */
+static unsigned int
+opserv_discrim_report(discrim_t discrim, struct userList *matched, discrim_search_func dsf, void *data)
+{
+    unsigned int count;
+
+    if (!matched->used) {
+        userList_clean(matched);
+        return 0;
+    }
+
+    if (discrim->option_log) {
+        log_module(OS_LOG, LOG_INFO, "Logging matches for search:");
+    }
+    opserv_discrim_apply(discrim, matched, dsf, data);
     if (discrim->option_log) {
         log_module(OS_LOG, LOG_INFO, "End of matching users.");
     }
-    count = matched.used;
-    userList_clean(&matched);
+    count = matched->used;
+    userList_clean(matched);
     return count;
 }
 
+static unsigned int
+opserv_discrim_search(discrim_t discrim, discrim_search_func dsf, void *data)
+{
+    struct userList matched;
+
+    userList_init(&matched);
+    if (!opserv_discrim_plan(discrim, &matched))
+        opserv_discrim_scan(discrim, &matched);
+    return opserv_discrim_report(discrim, &matched, dsf, data);
+}
+
 static int
 trace_print_func(struct userNode *match, void *extra)
 {
@@ -3387,7 +4661,7 @@ is_oper_victim(struct userNode *user, struct userNode *target, int match_opers,
 static int
 is_trust_victim(struct userNode *target, int match_trusted)
 {
-    return (match_trusted || !dict_find(opserv_trusted_hosts, irc_ntoa(&target->ip), NULL));
+    return (match_trusted || !opserv_find_trust(&target->ip));
 }
 
 static int
@@ -3523,12 +4797,97 @@ opserv_show_hostinfo(const char *key, void *data, void *extra)
     return !--das->disp_limit;
 }
 
+/* A trace that has to look at every user is run a slice at a time
+ * from the main loop, resuming at the first nick after the last one
+ * examined, so a user who changes nick part way through may be missed
+ * or seen twice. */
+struct trace_search {
+    struct discrim_and_source das;
+    discrim_search_func action;
+    char *split_discrim;
+    char *resume;
+    unsigned int matches;
+};
+
+static unsigned int
+opserv_trace_slice(void)
+{
+    return OPSERV_MIN_SEARCH_SLICE * opserv_conf.search_threads;
+}
+
+static void
+trace_search_finish(struct trace_search *ts, struct userNode *bot)
+{
+    if (ts->matches && ts->das.discrim->option_log)
+        log_module(OS_LOG, LOG_INFO, "End of matching users.");
+
+    if (ts->action == trace_domains_func)
+        dict_foreach(ts->das.dict, opserv_show_hostinfo, &ts->das);
+
+    if (ts->matches)
+        send_message(ts->das.source, bot, "MSG_MATCH_COUNT", ts->matches);
+    else
+        send_message(ts->das.source, bot, "MSG_NO_MATCHES");
+}
+
+static void
+trace_search_free(void *data)
+{
+    struct trace_search *ts = data;
+    unsigned int i;
+
+    for (i = 0; i < ts->das.discrim->channel_count; i++)
+        UnlockChannel(ts->das.discrim->channels[i]);
+    free(ts->das.discrim->reason);
+    free(ts->das.discrim);
+    dict_delete(ts->das.dict);
+    free(ts->split_discrim);
+    free(ts->resume);
+    free(ts);
+}
+
+static int
+trace_search_step(struct svccmd_cursor *cursor)
+{
+    struct trace_search *ts = cursor->data;
+    discrim_t discrim = ts->das.discrim;
+    struct userNode **users;
+    struct userList matched;
+    dict_iterator_t it;
+    unsigned int count, slice;
+    int stopped;
+
+    slice = opserv_trace_slice();
+    users = malloc(slice * sizeof(users[0]));
+    it = ts->resume ? dict_lower_bound(clients, ts->resume) : dict_first(clients);
+    for (count = 0; it && (count < slice); it = iter_next(it))
+        users[count++] = iter_data(it);
+    free(ts->resume);
+    ts->resume = it ? strdup(iter_key(it)) : NULL;
+
+    userList_init(&matched);
+    opserv_discrim_match_users(discrim, users, count, discrim->limit - ts->matches, &matched);
+    free(users);
+    if (matched.used && !ts->matches && discrim->option_log)
+        log_module(OS_LOG, LOG_INFO, "Logging matches for search:");
+    stopped = opserv_discrim_apply(discrim, &matched, ts->action, &ts->das);
+    ts->matches += matched.used;
+    userList_clean(&matched);
+
+    if (ts->resume && !stopped && (ts->matches < discrim->limit))
+        return 1;
+    trace_search_finish(ts, cursor->bot);
+    return 0;
+}
+
 static MODCMD_FUNC(cmd_trace)
 {
-    struct discrim_and_source das;
+    struct trace_search *ts;
     discrim_search_func action;
-    unsigned int matches, i;
+    struct userList matched;
     struct svccmd *subcmd;
+    char *wordv[MAXNUMPARAMS];
+    unsigned int wordc;
     char buf[MAXLEN];
 
     sprintf(buf, "trace %s", argv[1]);
@@ -3560,40 +4919,45 @@ static MODCMD_FUNC(cmd_trace)
         return 0;
     }
 
-    das.dict = NULL;
-    das.source = user;
-    das.discrim = opserv_discrim_create(user, argc-2, argv+2, 1);
-    if (!das.discrim)
+    /* The search may outlive argv, so give it its own copy. */
+    ts = calloc(1, sizeof(*ts));
+    ts->action = action;
+    ts->das.source = user;
+    ts->split_discrim = strdup(unsplit_string(argv+2, argc-2, NULL));
+    wordc = split_line(ts->split_discrim, false, ArrayLength(wordv), wordv);
+    ts->das.discrim = opserv_discrim_create(user, wordc, wordv, 1);
+    if (!ts->das.discrim) {
+        free(ts->split_discrim);
+        free(ts);
         return 0;
+    }
 
     if (action == trace_print_func)
         reply("OSMSG_USER_SEARCH_RESULTS");
     else if (action == trace_count_func)
-        das.discrim->limit = INT_MAX;
-    else if ((action == trace_gline_func) && !das.discrim->duration)
-        das.discrim->duration = opserv_conf.block_gline_duration;
+        ts->das.discrim->limit = INT_MAX;
+    else if ((action == trace_gline_func) && !ts->das.discrim->duration)
+        ts->das.discrim->duration = opserv_conf.block_gline_duration;
     else if (action == trace_domains_func) {
-        das.dict = dict_new();
-        dict_set_free_data(das.dict, free);
-        dict_set_free_keys(das.dict, free);
-        das.disp_limit = das.discrim->limit;
-        das.discrim->limit = INT_MAX;
+        ts->das.dict = dict_new();
+        dict_set_free_data(ts->das.dict, free);
+        dict_set_free_keys(ts->das.dict, free);
+        ts->das.disp_limit = ts->das.discrim->limit;
+        ts->das.discrim->limit = INT_MAX;
     }
-    matches = opserv_discrim_search(das.discrim, action, &das);
-
-    if (action == trace_domains_func)
-        dict_foreach(das.dict, opserv_show_hostinfo, &das);
-
-    if (matches)
-        reply("MSG_MATCH_COUNT", matches);
-    else
-        reply("MSG_NO_MATCHES");
 
-    for (i = 0; i < das.discrim->channel_count; i++)
-        UnlockChannel(das.discrim->channels[i]);
-    free(das.discrim->reason);
-    free(das.discrim);
-    dict_delete(das.dict);
+    userList_init(&matched);
+    if (!opserv_discrim_plan(ts->das.discrim, &matched)) {
+        if (dict_size(clients) > opserv_trace_slice()) {
+            userList_clean(&matched);
+            svccmd_cursor_start(user, cmd->parent->bot, trace_search_step, trace_search_free, ts);
+            return 1;
+        }
+        opserv_discrim_scan(ts->das.discrim, &matched);
+    }
+    ts->matches = opserv_discrim_report(ts->das.discrim, &matched, action, &ts->das);
+    trace_search_finish(ts, cmd->parent->bot);
+    trace_search_free(ts);
     return 1;
 }
 
@@ -3609,7 +4973,6 @@ typedef struct channel_discrim {
 } *cdiscrim_t;
 
 static cdiscrim_t opserv_cdiscrim_create(struct userNode *user, unsigned int argc, char *argv[]);
-static unsigned int opserv_cdiscrim_search(cdiscrim_t discrim, cdiscrim_search_func dsf, void *data);
 
 static unsigned long
 smart_parse_time(const char *str) {
@@ -3714,12 +5077,126 @@ cdiscrim_match(cdiscrim_t discrim, struct chanNode *chan)
     return 1;
 }
 
-static unsigned int opserv_cdiscrim_search(cdiscrim_t discrim, cdiscrim_search_func dsf, void *data)
+/* Candidate sources for opserv_cdiscrim_plan(): each returns 0 if it
+ * cannot narrow the search, or would need more than cap channels. */
+static int
+cdiscrim_from_name(cdiscrim_t discrim, struct channelList *list, unsigned int cap)
+{
+    dict_iterator_t it;
+    unsigned int len;
+    char *prefix;
+
+    /* Every channel name starts with the same character or two. */
+    if (!discrim->name || ((len = discrim_literal_len(discrim->name, 0)) < 2))
+        return 0;
+    prefix = alloca(len + 1);
+    memcpy(prefix, discrim->name, len);
+    prefix[len] = '\0';
+    for (it = dict_lower_bound(channels, prefix); it && !ircncasecmp(iter_key(it), prefix, len); it = iter_next(it)) {
+        if (list->used >= cap)
+            return 0;
+        channelList_append(list, iter_data(it));
+    }
+    return 1;
+}
+
+static int
+cdiscrim_from_users(cdiscrim_t discrim, struct channelList *list, unsigned int cap)
+{
+    unsigned int lo, hi, bucket, total, nn;
+
+    if ((discrim->min_users < 2) && (discrim->max_users == UINT_MAX))
+        return 0;
+    lo = channel_size_bucket(discrim->min_users ? discrim->min_users : 1);
+    hi = channel_size_bucket(discrim->max_users);
+    for (bucket = lo, total = 0; bucket <= hi; bucket++)
+        if ((total += channels_by_size[bucket].used) > cap)
+            return 0;
+    for (bucket = lo; bucket <= hi; bucket++)
+        for (nn = 0; nn < channels_by_size[bucket].used; nn++)
+            channelList_append(list, channels_by_size[bucket].list[nn]);
+    return 1;
+}
+
+static int
+cdiscrim_from_time(cdiscrim_t discrim, struct channelList *list, unsigned int cap)
+{
+    struct chanNode *chan;
+    dict_iterator_t it;
+    char key[24];
+
+    if (!discrim->min_ts && (discrim->max_ts == ULONG_MAX))
+        return 0;
+    snprintf(key, sizeof(key), "%016lx", discrim->min_ts);
+    for (it = dict_lower_bound(channels_by_time, key); it; it = iter_next(it)) {
+        chan = iter_data(it);
+        if (chan->timestamp > discrim->max_ts)
+            break;
+        if (list->used >= cap)
+            return 0;
+        channelList_append(list, chan);
+    }
+    return 1;
+}
+
+static int
+cdiscrim_compare_names(const void *a_, const void *b_)
+{
+    struct chanNode *a = *(struct chanNode**)a_, *b = *(struct chanNode**)b_;
+    return irccasecmp(a->name, b->name);
+}
+
+/* Like opserv_discrim_plan(), but for channels: finds the smallest
+ * candidate list and puts the channels on it that match discrim into
+ * matched, in name order.  Returns 0 if a full scan is needed. */
+static int
+opserv_cdiscrim_plan(cdiscrim_t discrim, struct channelList *matched)
+{
+    static int (*const sources[])(cdiscrim_t, struct channelList *, unsigned int) = {
+        cdiscrim_from_name,
+        cdiscrim_from_users,
+        cdiscrim_from_time
+    };
+    struct channelList best, trial, swap;
+    unsigned int ii, nn, cap, chosen;
+
+    channelList_init(&best);
+    channelList_init(&trial);
+    chosen = 0;
+    cap = dict_size(channels) / 2;
+    for (ii = 0; (ii < ArrayLength(sources)) && cap; ii++) {
+        trial.used = 0;
+        if (!sources[ii](discrim, &trial, cap))
+            continue;
+        swap = best;
+        best = trial;
+        trial = swap;
+        chosen = 1;
+        if (!best.used)
+            break;
+        cap = best.used - 1;
+    }
+    channelList_clean(&trial);
+    if (!chosen) {
+        channelList_clean(&best);
+        return 0;
+    }
+    qsort(best.list, best.used, sizeof(best.list[0]), cdiscrim_compare_names);
+    for (nn = 0; (nn < best.used) && (matched->used < discrim->limit); nn++)
+        if ((best.list[nn]->members.used > 0) && cdiscrim_match(discrim, best.list[nn]))
+            channelList_append(matched, best.list[nn]);
+    channelList_clean(&best);
+    return 1;
+}
+
+/* Tests up to count channels, starting at it, and returns where it
+ * stopped. */
+static dict_iterator_t
+opserv_cdiscrim_scan(cdiscrim_t discrim, cdiscrim_search_func dsf, void *data, dict_iterator_t it, unsigned int count, unsigned int *matched)
 {
-    unsigned int count = 0;
-    dict_iterator_t it, next;
+    dict_iterator_t next;
 
-    for (it = dict_first(channels); it && count < discrim->limit ; it = next) {
+    for (; it && count && (*matched < discrim->limit); it = next, count--) {
         struct chanNode *chan = iter_data(it);
 
         /* Hold on to the next channel in case we decide to
@@ -3727,11 +5204,10 @@ static unsigned int opserv_cdiscrim_search(cdiscrim_t discrim, cdiscrim_search_f
         next = iter_next(it);
         if ((chan->members.used > 0) && cdiscrim_match(discrim, chan)) {
             dsf(chan, data);
-            count++;
+            (*matched)++;
         }
     }
-
-    return count;
+    return it;
 }
 
 void channel_count(UNUSED_ARG(struct chanNode *channel), UNUSED_ARG(void *data))
@@ -3745,12 +5221,84 @@ void channel_print(struct chanNode *channel, void *data)
     send_message(data, opserv, "OSMSG_CSEARCH_CHANNEL_INFO", channel->name, channel->members.used, modes, channel->topic);
 }
 
-static MODCMD_FUNC(cmd_csearch)
-{
+/* Like a large trace, a csearch with many matches (or that has to
+ * look at every channel) runs a slice at a time from the main loop.
+ * Matches found through an index are locked until they are reported;
+ * a full scan resumes at the first name after the last one examined. */
+#define OPSERV_CSEARCH_SLICE 4096
+
+struct csearch {
     cdiscrim_t discrim;
+    cdiscrim_search_func action;
+    char *split_discrim;
+    struct channelList matched;
+    unsigned int next; /* matched[next] onwards are still locked */
+    unsigned int scanning : 1;
+    char *resume;
     unsigned int matches;
+};
+
+static void
+csearch_finish(struct csearch *cs, struct userNode *user, struct userNode *bot)
+{
+    if (cs->matches)
+        send_message(user, bot, "MSG_MATCH_COUNT", cs->matches);
+    else
+        send_message(user, bot, "MSG_NO_MATCHES");
+}
+
+static void
+csearch_free(void *data)
+{
+    struct csearch *cs = data;
+
+    while (cs->next < cs->matched.used)
+        UnlockChannel(cs->matched.list[cs->next++]);
+    channelList_clean(&cs->matched);
+    free(cs->discrim);
+    free(cs->split_discrim);
+    free(cs->resume);
+    free(cs);
+}
+
+static int
+csearch_step(struct svccmd_cursor *cursor)
+{
+    struct csearch *cs = cursor->data;
+    struct chanNode *chan;
+    dict_iterator_t it;
+    unsigned int nn;
+
+    if (cs->scanning) {
+        it = cs->resume ? dict_lower_bound(channels, cs->resume) : dict_first(channels);
+        it = opserv_cdiscrim_scan(cs->discrim, cs->action, cursor->user, it, OPSERV_CSEARCH_SLICE, &cs->matches);
+        free(cs->resume);
+        cs->resume = it ? strdup(iter_key(it)) : NULL;
+        if (cs->resume && (cs->matches < cs->discrim->limit))
+            return 1;
+    } else {
+        for (nn = 0; (nn < OPSERV_CSEARCH_SLICE) && (cs->next < cs->matched.used); nn++) {
+            chan = cs->matched.list[cs->next++];
+            if (chan->members.used > 0) {
+                cs->action(chan, cursor->user);
+                cs->matches++;
+            }
+            UnlockChannel(chan);
+        }
+        if (cs->next < cs->matched.used)
+            return 1;
+    }
+    csearch_finish(cs, cursor->user, cursor->bot);
+    return 0;
+}
+
+static MODCMD_FUNC(cmd_csearch)
+{
+    struct csearch *cs;
     cdiscrim_search_func action;
     struct svccmd *subcmd;
+    char *wordv[MAXNUMPARAMS];
+    unsigned int wordc, nn;
     char buf[MAXLEN];
 
     if (!irccasecmp(argv[1], "count"))
@@ -3768,23 +5316,42 @@ static MODCMD_FUNC(cmd_csearch)
         return 0;
     }
 
-    discrim = opserv_cdiscrim_create(user, argc - 2, argv + 2);
-    if (!discrim)
+    /* The search may outlive argv, so give it its own copy. */
+    cs = calloc(1, sizeof(*cs));
+    cs->action = action;
+    channelList_init(&cs->matched);
+    cs->split_discrim = strdup(unsplit_string(argv + 2, argc - 2, NULL));
+    wordc = split_line(cs->split_discrim, false, ArrayLength(wordv), wordv);
+    cs->discrim = opserv_cdiscrim_create(user, wordc, wordv);
+    if (!cs->discrim) {
+        csearch_free(cs);
         return 0;
+    }
 
     if (action == channel_print)
         reply("OSMSG_CHANNEL_SEARCH_RESULTS");
     else if (action == channel_count)
-        discrim->limit = INT_MAX;
-
-    matches = opserv_cdiscrim_search(discrim, action, user);
+        cs->discrim->limit = INT_MAX;
 
-    if (matches)
-        reply("MSG_MATCH_COUNT", matches);
-    else
-        reply("MSG_NO_MATCHES");
+    if (opserv_cdiscrim_plan(cs->discrim, &cs->matched)) {
+        if (cs->matched.used > OPSERV_CSEARCH_SLICE) {
+            for (nn = 0; nn < cs->matched.used; nn++)
+                LockChannel(cs->matched.list[nn]);
+            svccmd_cursor_start(user, cmd->parent->bot, csearch_step, csearch_free, cs);
+            return 1;
+        }
+        for (nn = 0; nn < cs->matched.used; nn++)
+            action(cs->matched.list[nn], user);
+        cs->matches = cs->next = cs->matched.used;
+    } else if (dict_size(channels) > OPSERV_CSEARCH_SLICE) {
+        cs->scanning = 1;
+        svccmd_cursor_start(user, cmd->parent->bot, csearch_step, csearch_free, cs);
+        return 1;
+    } else
+        opserv_cdiscrim_scan(cs->discrim, action, user, dict_first(channels), UINT_MAX, &cs->matches);
 
-    free(discrim);
+    csearch_finish(cs, user, cmd->parent->bot);
+    csearch_free(cs);
     return 1;
 }
 
@@ -3924,6 +5491,7 @@ alert_check_user(const char *key, void *data, void *extra)
     struct opserv_user_alert *alert = data;
     struct userNode *user = extra;
 
+    alert->checks++;
     if (!discrim_match(alert->discrim, user))
         return 0;
 
@@ -3939,6 +5507,7 @@ alert_check_user(const char *key, void *data, void *extra)
     }
 
     /* The user matches the alert criteria, so trigger the reaction. */
+    alert->hits++;
     if (alert->discrim->option_log)
         log_module(OS_LOG, LOG_INFO, "Alert %s triggered by user %s!%s@%s (%s).", key, user->nick, user->ident, user->hostname, alert->discrim->reason);
 
@@ -3964,16 +5533,11 @@ alert_check_user(const char *key, void *data, void *extra)
 static void
 opserv_alert_check_nick(struct userNode *user, UNUSED_ARG(const char *old_nick))
 {
-    struct gag_entry *gag;
     dict_foreach(opserv_nick_based_alerts, alert_check_user, user);
     /* Gag them if appropriate (and only if). */
     user->modes &= ~FLAGS_GAGGED;
-    for (gag = gagList; gag; gag = gag->next) {
-        if (user_matches_glob(user, gag->mask, MATCH_USENICK)) {
-            gag_helper_func(user, NULL);
-            break;
-        }
-    }
+    if (gag_find_user(user))
+        gag_helper_func(user, NULL);
 }
 
 static void
@@ -4042,7 +5606,6 @@ gag_helper_func(struct userNode *match, UNUSED_ARG(void *extra))
 
 static MODCMD_FUNC(cmd_gag)
 {
-    struct gag_entry *gag;
     unsigned int gagged;
     unsigned long duration;
     char *reason;
@@ -4054,11 +5617,7 @@ static MODCMD_FUNC(cmd_gag)
         return 0;
     }
 
-    for (gag = gagList; gag; gag = gag->next)
-        if (match_ircglobs(gag->mask, argv[1]))
-            break;
-
-    if (gag) {
+    if (is_gagged(argv[1])) {
         reply("OSMSG_REDUNDANT_GAG", argv[1]);
         return 0;
     }
@@ -4094,7 +5653,6 @@ static MODCMD_FUNC(cmd_ungag)
         return 0;
     }
 
-    timeq_del(gag->expires, gag_expire, gag, 0);
     ungagged = gag_free(gag);
 
     if (ungagged)
@@ -4136,8 +5694,11 @@ static MODCMD_FUNC(cmd_addalert)
 
 static MODCMD_FUNC(cmd_delalert)
 {
+    struct opserv_user_alert *alert;
     unsigned int i;
     for (i=1; i<argc; i++) {
+        if ((alert = dict_find(opserv_user_alerts, argv[i], NULL)))
+            opserv_alert_index_remove(alert);
         dict_remove(opserv_nick_based_alerts, argv[i]);
         dict_remove(opserv_channel_alerts, argv[i]);
         dict_remove(opserv_account_alerts, argv[i]);
@@ -4157,6 +5718,7 @@ opserv_conf_read(void)
     const char *str, *str2;
     struct policer_params *pp;
     dict_iterator_t it;
+    unsigned int ipv4_prefix, ipv6_prefix;
 
     rd = conf_get_node(OPSERV_CONF_NAME);
     if (!rd || rd->type != RECDB_OBJECT) {
@@ -4202,11 +5764,35 @@ opserv_conf_read(void)
     opserv_conf.join_flood_moderate = str ? strtoul(str, NULL, 0) : 1;
     str = database_get_data(conf_node, KEY_JOIN_FLOOD_MODERATE_THRESH, RECDB_QSTRING);
     opserv_conf.join_flood_moderate_threshold = str ? strtoul(str, NULL, 0) : 50;
+    str = database_get_data(conf_node, KEY_SEARCH_THREADS, RECDB_QSTRING);
+    opserv_conf.search_threads = str ? strtoul(str, NULL, 0) : 1;
+    if (!opserv_conf.search_threads)
+        opserv_conf.search_threads = 1;
+    else if (opserv_conf.search_threads > OPSERV_MAX_SEARCH_THREADS)
+        opserv_conf.search_threads = OPSERV_MAX_SEARCH_THREADS;
     str = database_get_data(conf_node, KEY_NICK, RECDB_QSTRING);
     if (opserv && str)
         NickChange(opserv, str, 0);
     str = database_get_data(conf_node, KEY_CLONE_GLINE_DURATION, RECDB_QSTRING);
     opserv_conf.clone_gline_duration = str ? ParseInterval(str) : 3600;
+    str = database_get_data(conf_node, KEY_CLONE_IPV4_PREFIX, RECDB_QSTRING);
+    ipv4_prefix = str ? strtoul(str, NULL, 0) : 32;
+    if (!ipv4_prefix || (ipv4_prefix > 32))
+        ipv4_prefix = 32;
+    str = database_get_data(conf_node, KEY_CLONE_IPV6_PREFIX, RECDB_QSTRING);
+    ipv6_prefix = str ? strtoul(str, NULL, 0) : 64;
+    if (!ipv6_prefix || (ipv6_prefix > 128))
+        ipv6_prefix = 64;
+    if ((ipv4_prefix != opserv_conf.clone_ipv4_prefix)
+        || (ipv6_prefix != opserv_conf.clone_ipv6_prefix)) {
+        struct cidr_tree old_tree = opserv_hostinfo_tree;
+
+        cidr_tree_init(&opserv_hostinfo_tree);
+        opserv_conf.clone_ipv4_prefix = ipv4_prefix;
+        opserv_conf.clone_ipv6_prefix = ipv6_prefix;
+        cidr_tree_foreach(&old_tree, opserv_rehash_hostinfo, NULL);
+        cidr_tree_clean(&old_tree);
+    }
     str = database_get_data(conf_node, KEY_BLOCK_GLINE_DURATION, RECDB_QSTRING);
     opserv_conf.block_gline_duration = str ? ParseInterval(str) : 3600;
 
@@ -4244,6 +5830,8 @@ opserv_db_init(void) {
     dict_set_free_keys(opserv_chan_warn, free);
     dict_set_free_data(opserv_chan_warn, free);
     /* set up opserv_user_alerts */
+    opserv_alert_index_clean();
+    opserv_alert_index_init();
     dict_delete(opserv_account_alerts);
     opserv_account_alerts = dict_new();
     dict_delete(opserv_channel_alerts);
@@ -4257,6 +5845,12 @@ opserv_db_init(void) {
     /* set up opserv_bad_words */
     free_string_list(opserv_bad_words);
     opserv_bad_words = alloc_string_list(4);
+    string_matcher_free(opserv_bad_matcher);
+    opserv_bad_matcher = NULL;
+    /* and the gag index */
+    cidr_tree_init(&opserv_gag_index.by_ip);
+    opserv_key_index_init(&opserv_gag_index.by_host);
+    ptrList_init(&opserv_gag_index.residual);
     /* and opserv_exempt_channels */
     dict_delete(opserv_exempt_channels);
     opserv_exempt_channels = dict_new();
@@ -4268,13 +5862,17 @@ opserv_db_cleanup(void)
 {
     unsigned int nn;
 
+    svccmd_cursors_cancel(trace_search_step);
+    svccmd_cursors_cancel(csearch_step);
     dict_delete(opserv_chan_warn);
     dict_delete(opserv_reserved_nick_dict);
     free_string_list(opserv_bad_words);
+    string_matcher_free(opserv_bad_matcher);
     dict_delete(opserv_exempt_channels);
     dict_delete(opserv_trusted_hosts);
+    cidr_tree_clean(&opserv_trusted_tree);
     unreg_del_user_func(opserv_user_cleanup);
-    dict_delete(opserv_hostinfo_dict);
+    opserv_alert_index_clean();
     dict_delete(opserv_nick_based_alerts);
     dict_delete(opserv_account_alerts);
     dict_delete(opserv_channel_alerts);
@@ -4283,6 +5881,14 @@ opserv_db_cleanup(void)
         free(level_strings[nn]);
     while (gagList)
         gag_free(gagList);
+    /* Ungagging searches for users, which uses these indexes. */
+    cidr_tree_foreach(&opserv_hostinfo_tree, opserv_free_hostinfo_walk, NULL);
+    cidr_tree_clean(&opserv_hostinfo_tree);
+    dict_delete(opserv_host_users);
+    userList_clean(&opserv_unhashed_users);
+    cidr_tree_clean(&opserv_gag_index.by_ip);
+    opserv_key_index_clean(&opserv_gag_index.by_host);
+    ptrList_clean(&opserv_gag_index.residual);
     policer_params_delete(opserv_conf.join_policer_params);
     policer_params_delete(opserv_conf.new_user_policer.params);
 }
@@ -4290,11 +5896,19 @@ opserv_db_cleanup(void)
 void
 init_opserv(const char *nick)
 {
+    dict_iterator_t it;
+
     OS_LOG = log_register_type("OpServ", "file:opserv.log");
     if (nick) {
         const char *modes = conf_get_data("services/opserv/modes", RECDB_QSTRING);
         opserv = AddLocalUser(nick, nick, NULL, "Oper Services", modes);
     }
+    cidr_tree_init(&opserv_trusted_tree);
+    cidr_tree_init(&opserv_hostinfo_tree);
+    opserv_host_users = dict_new();
+    dict_set_free_keys(opserv_host_users, free);
+    dict_set_free_data(opserv_host_users, opserv_key_bucket_free);
+    userList_init(&opserv_unhashed_users);
     conf_register_reload(opserv_conf_read);
 
     memset(level_strings, 0, sizeof(level_strings));
@@ -4348,6 +5962,7 @@ init_opserv(const char *nick)
     opserv_define_func("OP", cmd_op, 100, 2, 2);
     opserv_define_func("OPALL", cmd_opall, 400, 2, 0);
     opserv_define_func("PART", cmd_part, 601, 2, 0);
+    opserv_define_func("PROFILE", cmd_profile, 900, 0, 0);
     opserv_define_func("QUERY", cmd_query, 0, 0, 0);
     opserv_define_func("RAW", cmd_raw, 999, 0, 2);
     opserv_define_func("RECONNECT", cmd_reconnect, 900, 0, 0);
@@ -4360,12 +5975,16 @@ init_opserv(const char *nick)
     opserv_define_func("SETTIME", cmd_settime, 901, 0, 0);
     opserv_define_func("STATS ALERTS", cmd_stats_alerts, 0, 0, 0);
     opserv_define_func("STATS BAD", cmd_stats_bad, 0, 0, 0);
+    opserv_define_func("STATS DNS", cmd_stats_dns, 0, 0, 0);
+    opserv_define_func("STATS EVENTS", cmd_stats_events, 0, 0, 0);
     opserv_define_func("STATS GAGS", cmd_stats_gags, 0, 0, 0);
     opserv_define_func("STATS GLINES", cmd_stats_glines, 0, 0, 0);
+    opserv_define_func("STATS HOOKS", cmd_stats_hooks, 0, 0, 0);
     opserv_define_func("STATS LINKS", cmd_stats_links, 0, 0, 0);
     opserv_define_func("STATS MAX", cmd_stats_max, 0, 0, 0);
     opserv_define_func("STATS NETWORK", cmd_stats_network, 0, 0, 0);
     opserv_define_func("STATS NETWORK2", cmd_stats_network2, 0, 0, 0);
+    opserv_define_func("STATS PROTOCOL", cmd_stats_protocol, 0, 0, 0);
     opserv_define_func("STATS RESERVED", cmd_stats_reserved, 0, 0, 0);
     opserv_define_func("STATS TIMEQ", cmd_stats_timeq, 0, 0, 0);
     opserv_define_func("STATS TRUSTED", cmd_stats_trusted, 0, 0, 0);
@@ -4394,10 +6013,12 @@ init_opserv(const char *nick)
     opserv_define_func("WHOIS", cmd_whois, 0, 0, 2);
 
     opserv_reserved_nick_dict = dict_new();
-    opserv_hostinfo_dict = dict_new();
-    dict_set_free_keys(opserv_hostinfo_dict, free);
-    dict_set_free_data(opserv_hostinfo_dict, opserv_free_hostinfo);
 
+    /* Users that already exist (such as OpServ) never reach the hook. */
+    for (it = dict_first(clients); it; it = iter_next(it)) {
+        opserv_add_host_user(iter_data(it));
+        userList_append(&opserv_unhashed_users, iter_data(it));
+    }
     reg_new_user_func(opserv_new_user_check);
     reg_nick_change_func(opserv_alert_check_nick);
     reg_del_user_func(opserv_user_cleanup);
@@ -0,0 +1,259 @@
+/* perf.c - Lightweight latency accounting
+ * Copyright 2026 srvx Development Team
+ *
+ * This file is part of srvx.
+ *
+ * srvx is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with srvx; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+ */
+
+/* dladdr() is only declared by glibc when this is set. */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "common.h"
+#include "conf.h"
+#include "log.h"
+#include "perf.h"
+
+#if defined(HAVE_DLFCN_H) && defined(HAVE_DLADDR)
+#include <dlfcn.h>
+#endif
+
+int perf_enabled;
+
+/* Stats are reset lazily: bumping the generation makes every
+ * perf_stat look empty the next time it is touched. */
+static unsigned long perf_generation = 1;
+static unsigned long perf_reset_at;
+
+unsigned long perf_stall_threshold;
+
+/* Flight recorder: perf_events_next is the slot the next event goes
+ * into; once perf_events_used reaches perf_events_size it wraps. */
+static struct perf_event *perf_events;
+static unsigned int perf_events_size, perf_events_used, perf_events_next;
+
+/* The service command run since the last event was recorded, if any;
+ * it is attached to (and cleared by) the next event. */
+static char perf_event_cmd[PERF_EVENT_LABEL];
+
+static const char *perf_event_kinds[] = {
+    "loop",
+    "timer",
+    "line",
+    "saxdb"
+};
+
+static void
+perf_conf_read(void)
+{
+    static int perf_conf_loaded;
+    const char *str;
+    unsigned int size;
+
+    /* Only the initial state comes from the config file, so a rehash
+     * does not undo PROFILE ON or OFF. */
+    if (!perf_conf_loaded) {
+        perf_conf_loaded = 1;
+        str = conf_get_data("server/profiling", RECDB_QSTRING);
+        perf_enabled = str ? enabled_string(str) : 0;
+    }
+    str = conf_get_data("server/stall_threshold", RECDB_QSTRING);
+    perf_stall_threshold = str ? strtoul(str, NULL, 0) * 1000 : 0;
+    str = conf_get_data("server/flight_recorder", RECDB_QSTRING);
+    size = str ? strtoul(str, NULL, 0) : 256;
+    if (!size)
+        size = 1;
+    if (size != perf_events_size) {
+        free(perf_events);
+        perf_events = calloc(size, sizeof(*perf_events));
+        perf_events_size = size;
+        perf_events_used = perf_events_next = 0;
+    }
+}
+
+static void
+perf_cleanup(void)
+{
+    free(perf_events);
+    perf_events = NULL;
+    perf_events_size = perf_events_used = perf_events_next = 0;
+}
+
+void
+perf_init(void)
+{
+    perf_reset_at = now;
+    conf_register_reload(perf_conf_read);
+    reg_exit_func(perf_cleanup);
+}
+
+unsigned long
+perf_now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000ul + tv.tv_usec;
+}
+
+int
+perf_stat_current(struct perf_stat *stat)
+{
+    if (stat->generation != perf_generation) {
+        memset(stat, 0, sizeof(*stat));
+        stat->generation = perf_generation;
+    }
+    return stat->count != 0;
+}
+
+void
+perf_record(struct perf_stat *stat, unsigned long usec)
+{
+    unsigned long tmp;
+    unsigned int bucket;
+
+    perf_stat_current(stat);
+    for (tmp = usec, bucket = 0; tmp && (bucket < PERF_BUCKETS - 1); tmp >>= 1)
+        bucket++;
+    stat->buckets[bucket]++;
+    stat->count++;
+    stat->total += usec;
+    if (usec > stat->max)
+        stat->max = usec;
+}
+
+unsigned long
+perf_percentile(const struct perf_stat *stat, double fraction)
+{
+    unsigned long target, seen;
+    unsigned int bucket;
+
+    if (!stat->count)
+        return 0;
+    target = stat->count * fraction;
+    if (target >= stat->count)
+        target = stat->count - 1;
+    for (bucket = seen = 0; bucket < PERF_BUCKETS - 1; bucket++) {
+        seen += stat->buckets[bucket];
+        if (seen > target)
+            break;
+    }
+    /* Report the upper bound of the bucket, but never more than the
+     * largest sample actually seen. */
+    return (bucket == PERF_BUCKETS - 1 || (1ul << bucket) > stat->max) ? stat->max : (1ul << bucket);
+}
+
+void
+perf_reset(void)
+{
+    perf_generation++;
+    perf_reset_at = now;
+}
+
+unsigned long
+perf_reset_time(void)
+{
+    return perf_reset_at;
+}
+
+const char *
+perf_event_kind_name(enum perf_event_kind kind)
+{
+    return perf_event_kinds[kind];
+}
+
+void
+perf_event_record(enum perf_event_kind kind, unsigned long usec, const char *label)
+{
+    struct perf_event *event;
+
+    if (!perf_events_size)
+        return;
+    event = perf_events + perf_events_next;
+    event->when = now;
+    event->usec = usec;
+    event->kind = kind;
+    safestrncpy(event->label, label, sizeof(event->label));
+    strcpy(event->command, perf_event_cmd);
+    perf_event_cmd[0] = '\0';
+    if (++perf_events_next == perf_events_size)
+        perf_events_next = 0;
+    if (perf_events_used < perf_events_size)
+        perf_events_used++;
+    if (perf_stall_threshold && usec >= perf_stall_threshold)
+        log_module(MAIN_LOG, LOG_WARNING, "Stall: %s %s%s%s took %lu.%03lu ms.", perf_event_kinds[kind], event->label, (event->command[0] ? " -> " : ""), event->command, usec / 1000, usec % 1000);
+}
+
+/* Note which service command is running, so a stall in the line that
+ * invoked it can be attributed to the command. */
+void
+perf_event_command(const char *service, const char *command)
+{
+    if (perf_events_size)
+        snprintf(perf_event_cmd, sizeof(perf_event_cmd), "%s %s", service, command);
+}
+
+unsigned int
+perf_event_count(void)
+{
+    return perf_events_used;
+}
+
+/* Returns the nth most recent event (0 is the newest). */
+const struct perf_event *
+perf_event_get(unsigned int n)
+{
+    if (n >= perf_events_used)
+        return NULL;
+    return perf_events + (perf_events_next + perf_events_size - 1 - n) % perf_events_size;
+}
+
+void
+perf_event_dump(void)
+{
+    const struct perf_event *event;
+    unsigned int nn;
+
+    log_module(MAIN_LOG, LOG_INFO, "Flight recorder: %u events, oldest first.", perf_events_used);
+    for (nn = perf_events_used; nn > 0; nn--) {
+        event = perf_event_get(nn - 1);
+        log_module(MAIN_LOG, LOG_INFO, "  [%lu] %s %s%s%s: %lu usec", event->when, perf_event_kinds[event->kind], event->label, (event->command[0] ? " -> " : ""), event->command, event->usec);
+    }
+}
+
+/* Describe a code address as symbol+offset (or object+offset when
+ * the symbol is not exported), for use with addr2line. */
+void
+perf_func_name(void *addr, char *buf, unsigned int len)
+{
+#if defined(HAVE_DLFCN_H) && defined(HAVE_DLADDR)
+    Dl_info info;
+
+    if (dladdr(addr, &info) && info.dli_fname) {
+        const char *sep;
+
+        if (info.dli_sname && info.dli_saddr) {
+            snprintf(buf, len, "%s+%#lx", info.dli_sname, (unsigned long)((char*)addr - (char*)info.dli_saddr));
+            return;
+        }
+        sep = strrchr(info.dli_fname, '/');
+        snprintf(buf, len, "%s+%#lx", sep ? sep + 1 : info.dli_fname, (unsigned long)((char*)addr - (char*)info.dli_fbase));
+        return;
+    }
+#endif
+    snprintf(buf, len, "%p", addr);
+}
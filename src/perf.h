@@ -0,0 +1,78 @@
+/* perf.h - Lightweight latency accounting
+ * Copyright 2026 srvx Development Team
+ *
+ * This file is part of srvx.
+ *
+ * srvx is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with srvx; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+ */
+
+#ifndef PERF_H
+#define PERF_H
+
+/* Bucket 0 holds samples under 1 usec; bucket N (N > 0) holds samples
+ * in [2^(N-1), 2^N) usec.  The last bucket also holds anything larger. */
+#define PERF_BUCKETS 24
+
+struct perf_stat {
+    unsigned long generation;
+    unsigned long count;
+    unsigned long max;
+    double total;
+    unsigned long buckets[PERF_BUCKETS];
+};
+
+/* Callers should only take timestamps when this is non-zero. */
+extern int perf_enabled;
+
+void perf_init(void);
+unsigned long perf_now(void);
+void perf_record(struct perf_stat *stat, unsigned long usec);
+int perf_stat_current(struct perf_stat *stat);
+unsigned long perf_percentile(const struct perf_stat *stat, double fraction);
+void perf_reset(void);
+unsigned long perf_reset_time(void);
+
+/* The stall detector times each event loop iteration, timer callback
+ * and protocol line, keeps the most recent ones in a ring buffer and
+ * logs any that take longer than perf_stall_threshold. */
+enum perf_event_kind {
+    PERF_EVENT_LOOP,
+    PERF_EVENT_TIMER,
+    PERF_EVENT_LINE,
+    PERF_EVENT_SAXDB
+};
+
+#define PERF_EVENT_LABEL 64
+
+struct perf_event {
+    unsigned long when;
+    unsigned long usec;
+    enum perf_event_kind kind;
+    char label[PERF_EVENT_LABEL];
+    char command[PERF_EVENT_LABEL];
+};
+
+/* In usec; events are only timed and recorded when this is non-zero. */
+extern unsigned long perf_stall_threshold;
+
+void perf_event_record(enum perf_event_kind kind, unsigned long usec, const char *label);
+void perf_event_command(const char *service, const char *command);
+const char *perf_event_kind_name(enum perf_event_kind kind);
+unsigned int perf_event_count(void);
+const struct perf_event *perf_event_get(unsigned int n);
+void perf_event_dump(void);
+void perf_func_name(void *addr, char *buf, unsigned int len);
+
+#endif /* ndef PERF_H */
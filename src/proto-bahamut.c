@@ -66,7 +66,7 @@ AddServer(struct server *uplink, const char *name, int hops, unsigned long boot,
     if (hops && !self->burst) {
         unsigned int n;
         for (n=0; n<slf_used; n++) {
-            slf_list[n](sNode);
+            HOOK_CALL(slf_stats[n], slf_list[n](sNode));
         }
     }
 
@@ -173,7 +173,7 @@ AddUser(struct server* uplink, const char *nick, const char *ident, const char *
     if (stamp) call_account_func(uNode, NULL, 0, stamp);
     if (IsLocal(uNode)) irc_user(uNode);
     for (nn=0; (nn<nuf_used) && !uNode->dead; nn++)
-        nuf_list[nn](uNode);
+        HOOK_CALL(nuf_stats[nn], nuf_list[nn](uNode));
     return uNode;
 }
 
@@ -215,7 +215,10 @@ DelUser(struct userNode* user, struct userNode *killer, int announce, const char
     for (nn=user->channels.used; nn>0;) {
         DelChannelUser(user, user->channels.list[--nn]->channel, NULL, false);
     }
-    for (nn=duf_used; nn>0; ) duf_list[--nn](user, killer, why);
+    for (nn=duf_used; nn>0; ) {
+        nn--;
+        HOOK_CALL(duf_stats[nn], duf_list[nn](user, killer, why));
+    }
     user->uplink->clients--;
     dict_remove(user->uplink->users, user->nick);
     if (IsOper(user)) userList_remove(&curr_opers, user);
@@ -909,7 +912,7 @@ static CMD_FUNC(cmd_mode) {
                 mn->idle_since = now;
         } else {
             /* Must be a server in burst or something.  Make sure we're using the right timestamp. */
-            cn->timestamp = atoi(argv[2]);
+            SetChannelTimestamp(cn, atoi(argv[2]));
         }
 
         return mod_chanmode(un, cn, argv+3, argc-3, MCP_ALLOW_OVB|MCP_FROM_SERVER|MC_ANNOUNCE);
@@ -1070,6 +1073,7 @@ void parse_cleanup(void) {
     unsigned int nn;
     free(of_list);
     dict_delete(irc_func_dict);
+    dict_delete(irc_func_stats);
     dict_delete(service_msginfo_dict);
     free(mcf_list);
     for (nn=0; nn<dead_users.used; nn++) free_user(dead_users.list[nn]);
@@ -1098,6 +1102,9 @@ void init_parse(void) {
 
     service_msginfo_dict = dict_new();
     dict_set_free_data(service_msginfo_dict, free);
+    irc_func_stats = dict_new();
+    dict_set_free_keys(irc_func_stats, free);
+    dict_set_free_data(irc_func_stats, free);
     irc_func_dict = dict_new();
     dict_insert(irc_func_dict, "ADMIN", cmd_admin);
     dict_insert(irc_func_dict, "AWAY", cmd_away);
@@ -1153,7 +1160,7 @@ int parse_line(char *line, int recursive) {
         } else {
             origin = NULL;
         }
-        res = func(origin, argc-cmd, argv+cmd);
+        res = irc_func_dispatch(func, origin, argc-cmd, argv+cmd);
     } else {
         res = 0;
     }
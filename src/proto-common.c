@@ -22,7 +22,9 @@
 #include "gline.h"
 #include "ioset.h"
 #include "log.h"
+#include "modcmd.h"
 #include "nickserv.h"
+#include "perf.h"
 #include "timeq.h"
 #ifdef HAVE_SYS_SOCKET_H
 #include <sys/socket.h>
@@ -35,6 +37,7 @@
 #endif
 
 unsigned int lines_processed;
+dict_t irc_func_stats;
 FILE *replay_file;
 struct io_fd *socket_io_fd;
 int force_n2k;
@@ -52,10 +55,13 @@ extern unsigned long burst_length;
 extern struct cManagerNode cManager;
 extern struct policer_params *oper_policer_params, *luser_policer_params;
 extern server_link_func_t *slf_list;
+extern struct hook_stat **slf_stats;
 extern unsigned int slf_size, slf_used;
 extern new_user_func_t *nuf_list;
+extern struct hook_stat **nuf_stats;
 extern unsigned int nuf_size, nuf_used;
 extern del_user_func_t *duf_list;
+extern struct hook_stat **duf_stats;
 extern unsigned int duf_size, duf_used;
 extern unsigned long boot_time;
 
@@ -113,7 +119,9 @@ void replay_event_loop(void)
             log_module(MAIN_LOG, LOG_ERROR, "Connection to server lost.");
             close_socket();
         }
+        ioset_work_wait();
         timeq_run();
+        svccmd_cursors_run();
     }
 }
 
@@ -282,6 +290,37 @@ close_socket(void)
 #define CMD_FUNC(NAME) int NAME(UNUSED_ARG(const char *origin), UNUSED_ARG(unsigned int argc), UNUSED_ARG(char **argv))
 typedef CMD_FUNC(cmd_func_t);
 
+/* Invoke a protocol handler, accounting how long it took (keyed by
+ * command token) when profiling is enabled, and passing it to the
+ * stall detector (labelled by the start of the line) if that is on. */
+static int
+irc_func_dispatch(cmd_func_t *func, const char *origin, unsigned int argc, char **argv)
+{
+    struct perf_stat *stat;
+    unsigned long start, elapsed;
+    char label[PERF_EVENT_LABEL];
+    int res;
+
+    if (!perf_enabled && !perf_stall_threshold)
+        return func(origin, argc, argv);
+    stat = NULL;
+    if (perf_enabled && !(stat = dict_find(irc_func_stats, argv[0], NULL))) {
+        stat = calloc(1, sizeof(*stat));
+        dict_insert(irc_func_stats, strdup(argv[0]), stat);
+    }
+    /* The handler may modify argv, so build the label first. */
+    if (perf_stall_threshold)
+        snprintf(label, sizeof(label), "%s %s %s", (origin ? origin : "-"), argv[0], (argc > 1 ? argv[1] : ""));
+    start = perf_now();
+    res = func(origin, argc, argv);
+    elapsed = perf_now() - start;
+    if (stat)
+        perf_record(stat, elapsed);
+    if (perf_stall_threshold)
+        perf_event_record(PERF_EVENT_LINE, elapsed, label);
+    return res;
+}
+
 static void timed_ping_timeout(void *data);
 
 /* Ping state is kept in the timeq (only one of these two can be in
@@ -775,12 +814,11 @@ generate_hostmask(struct userNode *user, int options)
     hostname = user->hostname;
     if (IsFakeHost(user) && IsHiddenHost(user) && !(options & GENMASK_NO_HIDING)) {
         hostname = user->fakehost;
-    } else if (IsHiddenHost(user) && user->handle_info && hidden_host_suffix && !(options & GENMASK_NO_HIDING)) {
-        hostname = alloca(strlen(user->handle_info->handle) + strlen(hidden_host_suffix) + 2);
-        sprintf(hostname, "%s.%s", user->handle_info->handle, hidden_host_suffix);
+    } else if (IsHiddenHost(user) && !(options & GENMASK_NO_HIDING) && user_hidden_host(user)) {
+        hostname = (char*)user_hidden_host(user);
     } else if (options & GENMASK_STRICT_HOST) {
         if (options & GENMASK_BYIP)
-            hostname = (char*)irc_ntoa(&user->ip);
+            hostname = (char*)user_ip_text(user);
     } else if ((options & GENMASK_BYIP) || irc_pton(&ip, NULL, hostname)) {
         /* Should generate an IP-based hostmask. */
         hostname = alloca(IRC_NTOP_MAX_SIZE);
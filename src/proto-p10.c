@@ -971,8 +971,8 @@ static CMD_FUNC(cmd_whois)
         irc_numeric(from, RPL_WHOISUSER, "%s %s %s * :%s", who->nick, who->fakeident, who->hostname, who->info);
     else if (IsFakeHost(who) && IsHiddenHost(who))
         irc_numeric(from, RPL_WHOISUSER, "%s %s %s * :%s", who->nick, who->ident, who->fakehost, who->info);
-    else if (IsHiddenHost(who) && who->handle_info && hidden_host_suffix)
-        irc_numeric(from, RPL_WHOISUSER, "%s %s %s.%s * :%s", who->nick, who->ident, who->handle_info->handle, hidden_host_suffix, who->info);
+    else if (IsHiddenHost(who) && user_hidden_host(who))
+        irc_numeric(from, RPL_WHOISUSER, "%s %s %s * :%s", who->nick, who->ident, user_hidden_host(who), who->info);
     else
         irc_numeric(from, RPL_WHOISUSER, "%s %s %s * :%s", who->nick, who->ident, who->hostname, who->info);
 
@@ -1027,7 +1027,7 @@ static CMD_FUNC(cmd_whois)
     if (who->handle_info)
         irc_numeric(from, RPL_WHOISACCOUNT, "%s %s :is logged in as", who->nick, who->handle_info->handle);
     if (IsHiddenHost(who) && who->handle_info && (IsOper(from) || from == who))
-        irc_numeric(from, RPL_WHOISACTUALLY, "%s %s@%s %s :Actual user@host, Actual IP", who->nick, who->ident, who->hostname, irc_ntoa(&who->ip));
+        irc_numeric(from, RPL_WHOISACTUALLY, "%s %s@%s %s :Actual user@host, Actual IP", who->nick, who->ident, who->hostname, user_ip_text(who));
     if (IsLocal(who) && !IsService(who) && (!IsNoIdle(who) || IsOper(from) || from == who))
         irc_numeric(from, RPL_WHOISIDLE, "%s %ld %ld :seconds idle, signon time", who->nick, now - who->idle_since, who->timestamp);
 
@@ -1107,7 +1107,7 @@ static CMD_FUNC(cmd_eob)
     sender->self_burst = 0;
     recalc_bursts(sender);
     for (ii=0; ii<slf_used; ii++)
-        slf_list[ii](sender);
+        HOOK_CALL(slf_stats[ii], slf_list[ii](sender));
     return 1;
 }
 
@@ -1347,7 +1347,7 @@ static CMD_FUNC(cmd_burst)
 
     in_timestamp = atoi(argv[2]);
     if ((cNode = dict_find(unbursted_channels, argv[1], NULL))) {
-        cNode->timestamp = in_timestamp;
+        SetChannelTimestamp(cNode, in_timestamp);
         dict_remove(unbursted_channels, cNode->name);
         irc_burst(cNode);
     }
@@ -1423,7 +1423,7 @@ static CMD_FUNC(cmd_mode)
             mn->idle_since = now;
     } else {
         /* If it came from a server, reset timestamp to re-sync. */
-        cn->timestamp = atoi(argv[argc-1]);
+        SetChannelTimestamp(cn, atoi(argv[argc-1]));
     }
 
     return mod_chanmode(un, cn, argv+2, argc-2, MCP_ALLOW_OVB|MCP_FROM_SERVER|(un ? MC_NOTIFY : 0));
@@ -1751,6 +1751,7 @@ parse_cleanup(void)
     num_notice_funcs = 0;
     free(mcf_list);
     dict_delete(irc_func_dict);
+    dict_delete(irc_func_stats);
     for (nn=0; nn<dead_users.used; nn++)
         free_user(dead_users.list[nn]);
     userList_clean(&dead_users);
@@ -1759,6 +1760,7 @@ parse_cleanup(void)
 static void
 p10_conf_reload(void) {
     hidden_host_suffix = conf_get_data("server/hidden_host", RECDB_QSTRING);
+    user_forms_invalidate_all();
     his_servername = conf_get_data("server/his_servername", RECDB_QSTRING);
     his_servercomment = conf_get_data("server/his_servercomment", RECDB_QSTRING);
 }
@@ -1807,6 +1809,9 @@ init_parse(void)
     self = AddServer(NULL, str, 0, boot_time, now, numer, desc);
     conf_register_reload(p10_conf_reload);
 
+    irc_func_stats = dict_new();
+    dict_set_free_keys(irc_func_stats, free);
+    dict_set_free_data(irc_func_stats, free);
     irc_func_dict = dict_new();
     dict_insert(irc_func_dict, CMD_BURST, cmd_burst);
     dict_insert(irc_func_dict, TOK_BURST, cmd_burst);
@@ -1960,7 +1965,7 @@ parse_line(char *line, int recursive)
         } else
             origin = 0;
         if ((func = dict_find(irc_func_dict, argv[cmd], NULL)))
-            res = func(origin, argc-cmd, argv+cmd);
+            res = irc_func_dispatch(func, origin, argc-cmd, argv+cmd);
     }
     if (!res) {
         log_module(MAIN_LOG, LOG_ERROR, "PARSE ERROR on line: %s", unsplit_string(argv, argc, NULL));
@@ -2290,7 +2295,7 @@ AddUser(struct server* uplink, const char *nick, const char *ident, const char *
     if (IsLocal(uNode))
         irc_user(uNode);
     for (n=0; (n<nuf_used) && !uNode->dead; n++)
-        nuf_list[n](uNode);
+        HOOK_CALL(nuf_stats[n], nuf_list[n](uNode));
     return uNode;
 }
 
@@ -2311,8 +2316,10 @@ DelUser(struct userNode* user, struct userNode *killer, int announce, const char
 
     /* Call these in reverse order so ChanServ can update presence
        information before NickServ nukes the handle_info. */
-    for (n = duf_used; n > 0; )
-        duf_list[--n](user, killer, why);
+    for (n = duf_used; n > 0; ) {
+        n--;
+        HOOK_CALL(duf_stats[n], duf_list[n](user, killer, why));
+    }
 
     user->uplink->clients--;
     user->uplink->users[user->num_local] = NULL;
@@ -20,8 +20,10 @@
 
 #include "sar.h"
 #include "conf.h"
+#include "heap.h"
 #include "ioset.h"
 #include "log.h"
+#include "perf.h"
 #include "timeq.h"
 
 #if defined(HAVE_NETINET_IN_H)
@@ -163,6 +165,10 @@ static struct {
     unsigned int sar_retries;
     unsigned int sar_ndots;
     unsigned int sar_edns0;
+    unsigned long sar_cache_size;
+    unsigned long sar_cache_min_ttl;
+    unsigned long sar_cache_max_ttl;
+    unsigned long sar_cache_negative_ttl;
     char sar_localdomain[MAXLEN];
     struct string_list *sar_search;
     struct string_list *sar_nslist;
@@ -179,9 +185,11 @@ static struct log_type *sar_log;
  * future support.
  * DNSSEC (including RFCs 2535, 3007, 3655, etc) is less likely until
  * a good application is found.
- * Caching (RFC 2308) and redirection (RFC 2672) are much less likely,
- * since most users will have a separate local, caching, recursive
- * nameserver.
+ * Redirection (RFC 2672) is much less likely, since most users will
+ * have a separate local, caching, recursive nameserver.  Answers are
+ * nonetheless cached here (including negative answers, per RFC 2308)
+ * so that repeated lookups for the same name do not each cost a
+ * round trip to that nameserver.
  * Other DNS extensions (at least through RFC 3755) are believed to be
  * too rare or insufficiently useful to bother supporting.
  *
@@ -191,6 +199,15 @@ static struct log_type *sar_log;
  * http://www.ietf.org/html.charters/dnsext-charter.html
  */
 
+/* Each nameserver keeps a smoothed round-trip time (in usec, zero
+ * until the first sample) and a smoothed failure rate (per mille),
+ * both updated with a gain of 1/8 as TCP does.  A timeout also doubles
+ * the server's round-trip time.  A new query goes only to the fastest
+ * server whose failure rate is below SAR_NS_UNHEALTHY; retries, and
+ * requests marked critical, go to every server. */
+#define SAR_NS_UNHEALTHY 500
+#define SAR_NS_MAX_SRTT 60000000ul
+
 struct sar_nameserver {
     char *name;
     unsigned int valid;
@@ -201,6 +218,9 @@ struct sar_nameserver {
     unsigned int resp_fallback;
     unsigned int resp_failures;
     unsigned int resp_scrambled;
+    unsigned int timeouts;
+    unsigned int loss;
+    unsigned long srtt;
     unsigned int ss_len;
     void *ss;
 };
@@ -221,11 +241,73 @@ enum {
 #define RES_SF_LABEL   0x00
 #define RES_SF_POINTER 0xc0
 
-static dict_t sar_requests;
+/* Outstanding requests, indexed by their 16-bit ID.  sar_expiries
+ * holds request IDs keyed by the expiry time they were sent with;
+ * entries for requests that have since finished or been resent are
+ * skipped when they reach the top. */
+static struct sar_request *sar_requests[65536];
+static unsigned int sar_request_count;
+static heap_t sar_expiries;
 static dict_t sar_nameservers;
+static dict_t sar_cache; /* contains struct sar_cache_entry */
+
+static void sar_cache_deliver(void *data);
+static void sar_cache_trim(unsigned long limit);
 static struct io_fd *sar_fd;
 static int sar_fd_fd;
 
+static void
+sar_nameserver_answered(struct sar_nameserver *ns, struct sar_request *req)
+{
+    unsigned long sample;
+
+    ns->resp_used++;
+    ns->loss -= ns->loss / 8;
+    /* As in Karn's algorithm, only time queries sent once. */
+    if (req->retries != 1 || !req->sent_at)
+        return;
+    sample = perf_now() - req->sent_at;
+    if (!ns->srtt)
+        ns->srtt = sample;
+    else if (sample > ns->srtt)
+        ns->srtt += (sample - ns->srtt) / 8;
+    else
+        ns->srtt -= (ns->srtt - sample) / 8;
+}
+
+static void
+sar_nameserver_failed(struct sar_nameserver *ns)
+{
+    ns->loss += (1000 - ns->loss) / 8;
+}
+
+static void
+sar_nameserver_timeout(struct sar_nameserver *ns)
+{
+    ns->timeouts++;
+    sar_nameserver_failed(ns);
+    /* Back off so that servers which answer are preferred. */
+    ns->srtt = ns->srtt ? ns->srtt * 2 : conf.sar_timeout * 1000000ul;
+    if (ns->srtt > SAR_NS_MAX_SRTT)
+        ns->srtt = SAR_NS_MAX_SRTT;
+}
+
+static struct sar_nameserver *
+sar_pick_nameserver(void)
+{
+    struct sar_nameserver *best, *ns;
+    dict_iterator_t it;
+
+    for (it = dict_first(sar_nameservers), best = NULL; it; it = iter_next(it)) {
+        ns = iter_data(it);
+        if (ns->loss >= SAR_NS_UNHEALTHY)
+            continue;
+        if (!best || ns->srtt < best->srtt)
+            best = ns;
+    }
+    return best;
+}
+
 const char *
 sar_rcode_text(unsigned int rcode)
 {
@@ -260,55 +342,84 @@ sar_request_fail(struct sar_request *req, unsigned int rcode)
 }
 
 static unsigned long next_sar_timeout;
+static int sar_timeout_running;
+
+static void sar_timeout_cb(void *data);
 
 static void
-sar_timeout_cb(void *data)
+sar_schedule_timeout(void)
 {
-    dict_iterator_t it;
-    dict_iterator_t next;
-    unsigned long next_timeout = INT_MAX;
+    void *key, *id;
+    unsigned long when;
 
-    for (it = dict_first(sar_requests); it; it = next) {
-        struct sar_request *req;
+    if (!heap_size(sar_expiries))
+        return;
+    heap_peek(sar_expiries, &key, &id);
+    when = (unsigned long)key;
+    if (!next_sar_timeout || when < next_sar_timeout) {
+        timeq_del(0, sar_timeout_cb, NULL, TIMEQ_IGNORE_WHEN | TIMEQ_IGNORE_DATA);
+        timeq_add(when, sar_timeout_cb, NULL);
+        next_sar_timeout = when;
+    }
+}
 
-        req = iter_data(it);
-        next = iter_next(it);
-        if (req->expiry > next_timeout)
+static void
+sar_timeout_cb(UNUSED_ARG(void *data))
+{
+    struct sar_request *req;
+    void *key, *id;
+
+    next_sar_timeout = 0;
+    sar_timeout_running = 1;
+    while (heap_size(sar_expiries)) {
+        heap_peek(sar_expiries, &key, &id);
+        if ((unsigned long)key > now)
+            break;
+        heap_pop(sar_expiries);
+        req = sar_requests[(unsigned long)id];
+        if (!req || req->cached || req->expiry != (unsigned long)key)
             continue;
-        else if (req->expiry > now)
-            next_timeout = req->expiry;
-        else if (req->retries >= conf.sar_retries)
+        if (req->ns)
+            sar_nameserver_timeout(req->ns);
+        if (req->retries >= conf.sar_retries)
             sar_request_fail(req, RCODE_TIMED_OUT);
         else
             sar_request_send(req);
     }
-    if (next_timeout < INT_MAX) {
-        next_sar_timeout = next_timeout;
-        timeq_add(next_timeout, sar_timeout_cb, data);
-    }
+    sar_timeout_running = 0;
+    sar_schedule_timeout();
 }
 
 static void
-sar_check_timeout(unsigned long when)
+sar_check_timeout(struct sar_request *req)
 {
-    if (!next_sar_timeout || when < next_sar_timeout) {
-        timeq_del(0, sar_timeout_cb, NULL, TIMEQ_IGNORE_WHEN | TIMEQ_IGNORE_DATA);
-        timeq_add(when, sar_timeout_cb, NULL);
-        next_sar_timeout = when;
-    }
+    heap_insert(sar_expiries, (void*)req->expiry, (void*)(unsigned long)req->id);
+    if (!sar_timeout_running)
+        sar_schedule_timeout();
 }
 
 static void
-sar_request_cleanup(void *d)
+sar_request_cleanup(struct sar_request *req)
 {
-    struct sar_request *req = d;
     log_module(sar_log, LOG_DEBUG, "sar_request_cleanup({id=%d})", req->id);
+    if (req->cached) {
+        timeq_del(0, sar_cache_deliver, req->cached, TIMEQ_IGNORE_WHEN);
+        free(req->cached);
+    }
     free(req->body);
     if (req->cb_fail)
         req->cb_fail(req, RCODE_DESTROYED);
     free(req);
 }
 
+static void
+sar_request_remove(struct sar_request *req)
+{
+    sar_requests[req->id] = NULL;
+    sar_request_count--;
+    sar_request_cleanup(req);
+}
+
 static void
 sar_dns_init(const char *resolv_conf_path)
 {
@@ -324,6 +435,10 @@ sar_dns_init(const char *resolv_conf_path)
     conf.sar_retries = 3;
     conf.sar_ndots = 1;
     conf.sar_edns0 = 0;
+    conf.sar_cache_size = 1 << 20;
+    conf.sar_cache_min_ttl = 0;
+    conf.sar_cache_max_ttl = 86400;
+    conf.sar_cache_negative_ttl = 10800;
     ns_sv = alloc_string_list(4);
     ds_sv = alloc_string_list(4);
 
@@ -403,6 +518,14 @@ sar_dns_init(const char *resolv_conf_path)
         if (str) conf.sar_ndots = atoi(str);
         str = database_get_data(node, "edns0", RECDB_QSTRING);
         if (str) conf.sar_edns0 = enabled_string(str);
+        str = database_get_data(node, "cache_size", RECDB_QSTRING);
+        if (str) conf.sar_cache_size = strtoul(str, NULL, 0);
+        str = database_get_data(node, "cache_min_ttl", RECDB_QSTRING);
+        if (str) conf.sar_cache_min_ttl = ParseInterval(str);
+        str = database_get_data(node, "cache_max_ttl", RECDB_QSTRING);
+        if (str) conf.sar_cache_max_ttl = ParseInterval(str);
+        str = database_get_data(node, "cache_negative_ttl", RECDB_QSTRING);
+        if (str) conf.sar_cache_negative_ttl = ParseInterval(str);
         str = database_get_data(node, "domain", RECDB_QSTRING);
         if (str) safestrncpy(conf.sar_localdomain, str, sizeof(conf.sar_localdomain));
         slist = database_get_data(node, "search", RECDB_STRING_LIST);
@@ -434,6 +557,9 @@ sar_dns_init(const char *resolv_conf_path)
         }
     }
 
+    /* Shrink the cache if its limit was lowered. */
+    sar_cache_trim(conf.sar_cache_size);
+
     /* Replace config lists with their new values. */
     free_string_list(conf.sar_search);
     conf.sar_search = ds_sv;
@@ -446,11 +572,11 @@ sar_request_abort(struct sar_request *req)
 {
     if (!req)
         return;
-    assert(dict_find(sar_requests, req->id_text, NULL) == req);
+    assert(sar_requests[req->id] == req);
     log_module(sar_log, LOG_DEBUG, "sar_request_abort({id=%d})", req->id);
     req->cb_ok = NULL;
     req->cb_fail = NULL;
-    dict_remove(sar_requests, req->id_text);
+    sar_request_remove(req);
 }
 
 static struct sar_nameserver *
@@ -519,7 +645,7 @@ sar_extract_name(const unsigned char *buf, unsigned int size, unsigned int *ppos
 }
 
 static int
-sar_decode_answer(struct sar_request *req, struct dns_header *hdr, unsigned char *buf, unsigned int size)
+sar_decode_answer(struct sar_request *req, struct dns_header *hdr, unsigned char *buf, unsigned int size, unsigned long age)
 {
     struct dns_rr *rr;
     unsigned int ii, rr_count, pos;
@@ -568,6 +694,7 @@ sar_decode_answer(struct sar_request *req, struct dns_header *hdr, unsigned char
         rr[ii].type = buf[pos+0] << 8 | buf[pos+1];
         rr[ii].class = buf[pos+2] << 8 | buf[pos+3];
         rr[ii].ttl = buf[pos+4] << 24 | buf[pos+5] << 16 | buf[pos+6] << 8 | buf[pos+7];
+        rr[ii].ttl = (rr[ii].ttl > age) ? rr[ii].ttl - age : 0;
         rr[ii].rdlength = buf[pos+8] << 8 | buf[pos+9];
         rr[ii].rd_start = pos + 10;
         pos = pos + rr[ii].rdlength + 10;
@@ -582,7 +709,7 @@ sar_decode_answer(struct sar_request *req, struct dns_header *hdr, unsigned char
     if (!req->expiry) {
         req->cb_ok = NULL;
         req->cb_fail = NULL;
-        dict_remove(sar_requests, req->id_text);
+        sar_request_remove(req);
     }
 
 out:
@@ -602,6 +729,56 @@ sar_extract_rdata(struct dns_rr *rr, unsigned int len, unsigned char *raw, unsig
     return raw + rr->rd_start;
 }
 
+/* Hand a response to \a req; \a age is how long it has been cached.
+ * Returns non-zero if the response could not be parsed. */
+static int
+sar_request_answer(struct sar_request *req, struct dns_header *hdr, unsigned char *buf, unsigned int size, unsigned long age)
+{
+    int rcode;
+
+    rcode = hdr->flags & REQ_FLAG_RCODE_MASK;
+    if (rcode != RCODE_NO_ERROR) {
+        sar_request_fail(req, rcode);
+    } else if (sar_decode_answer(req, hdr, buf, size, age)) {
+        sar_request_fail(req, RCODE_FORMAT_ERROR);
+        return 1;
+    }
+    return 0;
+}
+
+static void sar_cache_store(struct sar_request *req, struct dns_header *hdr, const unsigned char *buf, unsigned int size);
+
+/* Does the question section of a response repeat the request's?  A
+ * response with the right ID but another question is most likely
+ * forged, so it must not be used or cached. */
+static int
+sar_question_matches(struct sar_request *req, struct dns_header *hdr, const unsigned char *buf, unsigned int size)
+{
+    unsigned int ii, qdcount, rpos, qpos;
+    char *rname, *qname;
+    int match;
+
+    qdcount = req->body[4] << 8 | req->body[5];
+    if (hdr->qdcount != qdcount)
+        return 0;
+    for (ii = 0, rpos = qpos = 12; ii < qdcount; ++ii) {
+        rname = sar_extract_name(buf, size, &rpos);
+        qname = sar_extract_name(req->body, req->body_len, &qpos);
+        match = rname && qname
+            && (rpos + 4 <= size)
+            && (qpos + 4 <= req->body_len)
+            && !strcasecmp(rname, qname)
+            && !memcmp(buf + rpos, req->body + qpos, 4);
+        free(rname);
+        free(qname);
+        if (!match)
+            return 0;
+        rpos += 4;
+        qpos += 4;
+    }
+    return 1;
+}
+
 static void
 sar_fd_readable(struct io_fd *fd)
 {
@@ -611,8 +788,7 @@ sar_fd_readable(struct io_fd *fd)
     void *ss;
     unsigned char *buf;
     socklen_t ss_len;
-    int res, rcode, buf_len;
-    char id_text[6];
+    int res, buf_len;
 
     assert(sar_fd == fd);
     buf_len = conf.sar_edns0;
@@ -631,20 +807,358 @@ sar_fd_readable(struct io_fd *fd)
     hdr.nscount = buf[8] << 8 | buf[9];
     hdr.arcount = buf[10] << 8 | buf[11];
 
-    sprintf(id_text, "%d", hdr.id);
-    req = dict_find(sar_requests, id_text, NULL);
+    req = sar_requests[hdr.id];
     log_module(sar_log, LOG_DEBUG, "sar_fd_readable(%p): hdr {id=%d, flags=0x%x, qdcount=%d, ancount=%d, nscount=%d, arcount=%d} -> req %p", (void*)fd, hdr.id, hdr.flags, hdr.qdcount, hdr.ancount, hdr.nscount, hdr.arcount, (void*)req);
-    if (!req || !req->retries || !(hdr.flags & REQ_FLAG_QR)) {
+    if (!req || !req->retries || req->cached || !(hdr.flags & REQ_FLAG_QR)
+        || !sar_question_matches(req, &hdr, buf, res)) {
         ns->resp_ignored++;
         return;
     }
-    rcode = hdr.flags & REQ_FLAG_RCODE_MASK;
-    if (rcode != RCODE_NO_ERROR) {
-        sar_request_fail(req, rcode);
-    } else if (sar_decode_answer(req, &hdr, (unsigned char*)buf, res)) {
+    switch (hdr.flags & REQ_FLAG_RCODE_MASK) {
+    case RCODE_SERVER_FAILURE:
+    case RCODE_REFUSED:
+        /* Ask the other servers, if this one was asked alone. */
+        ns->resp_servfail++;
+        sar_nameserver_failed(ns);
+        if (req->ns == ns && req->retries < conf.sar_retries) {
+            ns->resp_fallback++;
+            sar_request_send(req);
+            return;
+        }
+        /* If every server was asked, another may still answer. */
+        if (!req->ns && dict_size(sar_nameservers) > 1)
+            return;
+        break;
+    default:
+        sar_nameserver_answered(ns, req);
+        break;
+    }
+    sar_cache_store(req, &hdr, buf, res);
+    if (sar_request_answer(req, &hdr, buf, res, 0))
         ns->resp_scrambled++;
-        sar_request_fail(req, RCODE_FORMAT_ERROR);
+}
+
+/* DNS response cache.
+ *
+ * Responses are cached by their question section, so a request is
+ * answered from the cache if an identical question was answered
+ * recently.  Entries live for the smallest TTL in the answer section,
+ * or (for NXDOMAIN and NODATA responses) the lesser of the SOA's TTL
+ * and MINIMUM fields, as RFC 2308 specifies; both are clamped to the
+ * configured limits.  Cached responses are delivered from the timeq
+ * rather than from inside sar_request_send(), and their TTLs are
+ * reduced by the entry's age.  Once the cache exceeds cache_size
+ * bytes, the least recently used entries are discarded.
+ */
+
+struct sar_cache_entry {
+    struct sar_cache_entry *prev;
+    struct sar_cache_entry *next;
+    unsigned long stored;
+    unsigned long expires;
+    unsigned int size;
+    unsigned char *packet;
+    char key[1];
+};
+
+struct sar_cache_answer {
+    struct sar_request *req;
+    unsigned long age;
+    unsigned int size;
+    unsigned char packet[1];
+};
+
+static struct sar_cache_entry *sar_cache_head; /* most recently used */
+static struct sar_cache_entry *sar_cache_tail; /* least recently used */
+static struct sar_cache_stats sar_cache_counts;
+
+static void
+sar_cache_unlink(struct sar_cache_entry *entry)
+{
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        sar_cache_head = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        sar_cache_tail = entry->prev;
+    entry->prev = entry->next = NULL;
+}
+
+static void
+sar_cache_link(struct sar_cache_entry *entry)
+{
+    entry->prev = NULL;
+    entry->next = sar_cache_head;
+    if (sar_cache_head)
+        sar_cache_head->prev = entry;
+    else
+        sar_cache_tail = entry;
+    sar_cache_head = entry;
+}
+
+static void
+sar_cache_free(void *data)
+{
+    struct sar_cache_entry *entry = data;
+
+    sar_cache_unlink(entry);
+    sar_cache_counts.bytes -= sizeof(*entry) + strlen(entry->key) + entry->size;
+    free(entry);
+}
+
+static void
+sar_cache_trim(unsigned long limit)
+{
+    while (sar_cache_tail && sar_cache_counts.bytes > limit) {
+        sar_cache_counts.evictions++;
+        dict_remove(sar_cache, sar_cache_tail->key);
+    }
+}
+
+/* Build a cache key from the question section of \a body: each
+ * question's name and type, so that the request ID is ignored. */
+static char *
+sar_cache_key(const unsigned char *body, unsigned int len)
+{
+    struct string_buffer cv;
+    unsigned int ii, qdcount, pos;
+    char *name;
+
+    if (!body || len < 12)
+        return NULL;
+    qdcount = body[4] << 8 | body[5];
+    cv.used = 0;
+    cv.size = 64;
+    cv.list = malloc(cv.size);
+    for (ii = 0, pos = 12; ii < qdcount; ++ii) {
+        name = sar_extract_name(body, len, &pos);
+        if (!name || pos + 4 > len) {
+            free(name);
+            free(cv.list);
+            return NULL;
+        }
+        string_buffer_append_printf(&cv, "%s/%u ", name, body[pos] << 8 | body[pos+1]);
+        free(name);
+        pos += 4;
+    }
+    string_buffer_append(&cv, '\0');
+    return cv.list;
+}
+
+static int
+sar_skip_name(const unsigned char *buf, unsigned int size, unsigned int *ppos)
+{
+    unsigned int pos = *ppos;
+
+    while (pos < size) {
+        switch (buf[pos] & RES_SIZE_FLAGS) {
+        case RES_SF_LABEL:
+            if (!buf[pos]) {
+                *ppos = pos + 1;
+                return 0;
+            }
+            pos += buf[pos] + 1;
+            break;
+        case RES_SF_POINTER:
+            *ppos = pos + 2;
+            return 0;
+        default:
+            return 1;
+        }
+    }
+    return 1;
+}
+
+/* Work out how long a response may be cached; zero means not at all. */
+static unsigned long
+sar_cache_ttl(struct dns_header *hdr, const unsigned char *buf, unsigned int size)
+{
+    unsigned long ttl, soa_ttl, rr_ttl, minimum;
+    unsigned int ii, pos, type, rdlength, rdpos;
+    int rcode;
+
+    rcode = hdr->flags & REQ_FLAG_RCODE_MASK;
+    if ((hdr->flags & REQ_FLAG_TC)
+        || (rcode != RCODE_NO_ERROR && rcode != RCODE_NAME_ERROR))
+        return 0;
+
+    for (ii = 0, pos = 12; ii < hdr->qdcount; ++ii) {
+        if (sar_skip_name(buf, size, &pos))
+            return 0;
+        pos += 4;
+    }
+
+    ttl = soa_ttl = ULONG_MAX;
+    for (ii = 0; ii < (unsigned int)hdr->ancount + hdr->nscount; ++ii) {
+        if (sar_skip_name(buf, size, &pos) || pos + 10 > size)
+            return 0;
+        type = buf[pos+0] << 8 | buf[pos+1];
+        rr_ttl = (unsigned long)buf[pos+4] << 24 | buf[pos+5] << 16 | buf[pos+6] << 8 | buf[pos+7];
+        rdlength = buf[pos+8] << 8 | buf[pos+9];
+        rdpos = pos + 10;
+        pos = rdpos + rdlength;
+        if (pos > size)
+            return 0;
+        if (ii < hdr->ancount) {
+            if (rr_ttl < ttl)
+                ttl = rr_ttl;
+        } else if (type == REQ_TYPE_SOA && soa_ttl == ULONG_MAX) {
+            if (sar_skip_name(buf, size, &rdpos)
+                || sar_skip_name(buf, size, &rdpos)
+                || rdpos + 20 > pos)
+                return 0;
+            minimum = (unsigned long)buf[rdpos+16] << 24 | buf[rdpos+17] << 16 | buf[rdpos+18] << 8 | buf[rdpos+19];
+            soa_ttl = (rr_ttl < minimum) ? rr_ttl : minimum;
+        }
+    }
+
+    if (rcode == RCODE_NO_ERROR && hdr->ancount) {
+        if (ttl < conf.sar_cache_min_ttl)
+            ttl = conf.sar_cache_min_ttl;
+        if (ttl > conf.sar_cache_max_ttl)
+            ttl = conf.sar_cache_max_ttl;
+    } else if (soa_ttl != ULONG_MAX) {
+        /* Negative answers without an SOA must not be cached. */
+        ttl = soa_ttl;
+        if (ttl < conf.sar_cache_min_ttl)
+            ttl = conf.sar_cache_min_ttl;
+        if (ttl > conf.sar_cache_negative_ttl)
+            ttl = conf.sar_cache_negative_ttl;
+    } else
+        ttl = 0;
+    return ttl;
+}
+
+static void
+sar_cache_store(struct sar_request *req, struct dns_header *hdr, const unsigned char *buf, unsigned int size)
+{
+    struct sar_cache_entry *entry;
+    unsigned long ttl;
+    unsigned int len;
+    char *key;
+
+    if (!conf.sar_cache_size)
+        return;
+    ttl = sar_cache_ttl(hdr, buf, size);
+    if (!ttl)
+        return;
+    key = sar_cache_key(req->body, req->body_len);
+    if (!key)
+        return;
+    len = strlen(key);
+    if (sizeof(*entry) + len + size > conf.sar_cache_size) {
+        free(key);
+        return;
+    }
+
+    entry = malloc(sizeof(*entry) + len + size);
+    entry->stored = now;
+    entry->expires = now + ttl;
+    entry->size = size;
+    memcpy(entry->key, key, len + 1);
+    entry->packet = (unsigned char*)entry->key + len + 1;
+    memcpy(entry->packet, buf, size);
+    free(key);
+
+    dict_remove(sar_cache, entry->key);
+    sar_cache_link(entry);
+    dict_insert(sar_cache, entry->key, entry);
+    sar_cache_counts.bytes += sizeof(*entry) + len + size;
+    sar_cache_counts.stored++;
+    if (hdr->ancount == 0 || (hdr->flags & REQ_FLAG_RCODE_MASK) != RCODE_NO_ERROR)
+        sar_cache_counts.negative++;
+    sar_cache_trim(conf.sar_cache_size);
+}
+
+/* Try to answer \a req from the cache.  Returns non-zero if the
+ * answer will be delivered. */
+static int
+sar_cache_lookup(struct sar_request *req)
+{
+    struct sar_cache_entry *entry;
+    struct sar_cache_answer *ans;
+    char *key;
+
+    if (!conf.sar_cache_size || !(key = sar_cache_key(req->body, req->body_len)))
+        return 0;
+    sar_cache_counts.lookups++;
+    entry = dict_find(sar_cache, key, NULL);
+    free(key);
+    if (!entry)
+        return 0;
+    if (entry->expires <= now) {
+        sar_cache_counts.expired++;
+        dict_remove(sar_cache, entry->key);
+        return 0;
+    }
+    sar_cache_counts.hits++;
+    sar_cache_unlink(entry);
+    sar_cache_link(entry);
+
+    ans = malloc(sizeof(*ans) + entry->size);
+    ans->req = req;
+    ans->age = now - entry->stored;
+    ans->size = entry->size;
+    memcpy(ans->packet, entry->packet, entry->size);
+    req->cached = ans;
+    req->expiry = now + conf.sar_timeout;
+    timeq_add(now, sar_cache_deliver, ans);
+    return 1;
+}
+
+static void
+sar_cache_deliver(void *data)
+{
+    struct sar_cache_answer *ans = data;
+    struct sar_request *req;
+    struct dns_header hdr;
+
+    req = ans->req;
+    req->cached = NULL;
+    log_module(sar_log, LOG_DEBUG, "sar_cache_deliver({id=%d}): %u bytes, %lu seconds old", req->id, ans->size, ans->age);
+    hdr.id = req->id;
+    hdr.flags = ans->packet[2] << 8 | ans->packet[3];
+    hdr.qdcount = ans->packet[4] << 8 | ans->packet[5];
+    hdr.ancount = ans->packet[6] << 8 | ans->packet[7];
+    hdr.nscount = ans->packet[8] << 8 | ans->packet[9];
+    hdr.arcount = ans->packet[10] << 8 | ans->packet[11];
+    sar_request_answer(req, &hdr, ans->packet, ans->size, ans->age);
+    free(ans);
+}
+
+const struct sar_cache_stats *
+sar_cache_stats(void)
+{
+    sar_cache_counts.entries = dict_size(sar_cache);
+    sar_cache_counts.max_bytes = conf.sar_cache_size;
+    sar_cache_counts.requests = sar_request_count;
+    return &sar_cache_counts;
+}
+
+unsigned int
+sar_nameserver_stats(struct sar_nameserver_stats *stats, unsigned int max)
+{
+    struct sar_nameserver *ns;
+    dict_iterator_t it;
+    unsigned int count;
+
+    for (it = dict_first(sar_nameservers), count = 0; it; it = iter_next(it), ++count) {
+        if (count >= max)
+            continue;
+        ns = iter_data(it);
+        stats[count].name = ns->name;
+        stats[count].srtt = ns->srtt;
+        stats[count].loss = ns->loss;
+        stats[count].req_sent = ns->req_sent;
+        stats[count].resp_used = ns->resp_used;
+        stats[count].resp_ignored = ns->resp_ignored;
+        stats[count].resp_servfail = ns->resp_servfail;
+        stats[count].resp_fallback = ns->resp_fallback;
+        stats[count].timeouts = ns->timeouts;
     }
+    return count;
 }
 
 static void
@@ -687,8 +1201,12 @@ sar_build_nslist(struct string_list *nslist)
     for (it = dict_first(sar_nameservers); it; it = next) {
         next = iter_next(it);
         ns = iter_data(it);
-        if (!ns->valid)
-            dict_remove(sar_nameservers, ns->name);
+        if (ns->valid)
+            continue;
+        for (ii = 0; ii < ArrayLength(sar_requests); ++ii)
+            if (sar_requests[ii] && sar_requests[ii]->ns == ns)
+                sar_requests[ii]->ns = NULL;
+        dict_remove(sar_nameservers, ns->name);
     }
 }
 
@@ -870,6 +1388,8 @@ sar_request_vbuild(struct sar_request *req, va_list args)
     } else cv.list[11] = 0;
 
 out:
+    /* A new question starts with a fresh set of retries. */
+    req->retries = 0;
     free(req->body);
     req->body = (unsigned char*)cv.list;
     req->body_len = cv.used;
@@ -896,6 +1416,10 @@ sar_request_send(struct sar_request *req)
 {
     dict_iterator_t it;
 
+    /* answer from the cache if we can */
+    if (sar_cache_lookup(req))
+        return;
+
     /* make sure we have our local socket */
     if (!sar_fd && sar_open_fd()) {
         sar_request_fail(req, RCODE_SOCKET_FAILURE);
@@ -904,12 +1428,19 @@ sar_request_send(struct sar_request *req)
 
     log_module(sar_log, LOG_DEBUG, "sar_request_send({id=%d})", req->id);
 
-    /* send query to each configured nameserver */
+    /* send a new query to the best nameserver, or a retry (or
+     * critical query) to each configured nameserver */
+    req->ns = NULL;
+    if (!req->retries && !req->critical)
+        req->ns = sar_pick_nameserver();
+    req->sent_at = perf_now();
     for (it = dict_first(sar_nameservers); it; it = iter_next(it)) {
         struct sar_nameserver *ns;
         int res;
 
         ns = iter_data(it);
+        if (req->ns && ns != req->ns)
+            continue;
         res = sendto(sar_fd_fd, req->body, req->body_len, 0, (struct sockaddr*)ns->ss, ns->ss_len);
         if (res > 0) {
             ns->req_sent++;
@@ -922,7 +1453,7 @@ sar_request_send(struct sar_request *req)
 
     /* Check that query timeout is soon enough. */
     req->expiry = now + (conf.sar_timeout << ++req->retries);
-    sar_check_timeout(req->expiry);
+    sar_check_timeout(req);
 }
 
 struct sar_request *
@@ -930,14 +1461,18 @@ sar_request_alloc(unsigned int data_len, sar_request_ok_cb ok_cb, sar_request_fa
 {
     struct sar_request *req;
 
+    if (sar_request_count >= ArrayLength(sar_requests)) {
+        log_module(sar_log, LOG_ERROR, "Unable to allocate a DNS request: all IDs are in use.");
+        return NULL;
+    }
     req = calloc(1, sizeof(*req) + data_len);
     req->cb_ok = ok_cb;
     req->cb_fail = fail_cb;
     do {
         req->id = rand() & 0xffff;
-        sprintf(req->id_text, "%d", req->id);
-    } while (dict_find(sar_requests, req->id_text, NULL));
-    dict_insert(sar_requests, req->id_text, req);
+    } while (sar_requests[req->id]);
+    sar_requests[req->id] = req;
+    sar_request_count++;
     log_module(sar_log, LOG_DEBUG, "sar_request_alloc(%d) -> {id=%d}", data_len, req->id);
     return req;
 }
@@ -1408,6 +1943,10 @@ sar_getaddr(const char *node, const char *service, const struct addrinfo *hints_
         unsigned int len, ii;
 
         req = sar_request_alloc(sizeof(*state), sar_getaddr_ok, sar_getaddr_fail);
+        if (!req) {
+            cb(cb_ctx, NULL, SAI_AGAIN);
+            return NULL;
+        }
 
         state = (struct sar_getaddr_state*)(req + 1);
         state->helper = helper;
@@ -1603,6 +2142,10 @@ sar_getname(const struct sockaddr *sa, unsigned int salen, int flags, sar_name_c
     }
 
     req = sar_request_alloc(sizeof(*state), sar_getname_ok, sar_getname_fail);
+    if (!req) {
+        cb(cb_ctx, NULL, NULL, SAI_AGAIN);
+        return NULL;
+    }
 
     state = (struct sar_getname_state*)(req + 1);
     state->cb = cb;
@@ -2026,11 +2569,17 @@ static struct sar_family_helper sar_ipv6_helper = {
 static void
 sar_cleanup(void)
 {
+    unsigned int ii;
+
     ioset_close(sar_fd, 1);
     dict_delete(services_byname);
     dict_delete(services_byport);
     dict_delete(sar_nameservers);
-    dict_delete(sar_requests);
+    for (ii = 0; sar_request_count && ii < ArrayLength(sar_requests); ++ii)
+        if (sar_requests[ii])
+            sar_request_remove(sar_requests[ii]);
+    heap_delete(sar_expiries);
+    dict_delete(sar_cache);
     free_string_list(conf.sar_search);
     free_string_list(conf.sar_nslist);
 }
@@ -2061,12 +2610,14 @@ sar_init(void)
     reg_exit_func(sar_cleanup);
     sar_log = log_register_type("sar", NULL);
 
-    sar_requests = dict_new();
-    dict_set_free_data(sar_requests, sar_request_cleanup);
+    sar_expiries = heap_new(ulong_comparator);
 
     sar_nameservers = dict_new();
     dict_set_free_data(sar_nameservers, sar_free_nameserver);
 
+    sar_cache = dict_new();
+    dict_set_free_data(sar_cache, sar_cache_free);
+
     sar_register_helper(&sar_ipv4_helper);
 #if defined(AF_INET6)
     sar_register_helper(&sar_ipv6_helper);
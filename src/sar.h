@@ -130,6 +130,8 @@ struct dns_rr {
 #define REQ_QCLASS_ALL 255
 
 struct sar_request;
+struct sar_nameserver;
+struct sar_cache_answer;
 typedef void (*sar_request_ok_cb)(struct sar_request *req, struct dns_header *hdr, struct dns_rr *rr, unsigned char *raw, unsigned int raw_size);
 typedef void (*sar_request_fail_cb)(struct sar_request *req, unsigned int rcode);
 
@@ -144,7 +146,35 @@ struct sar_request {
     unsigned char *body;
     unsigned int body_len;
     unsigned char retries;
-    char id_text[6];
+    unsigned int critical : 1; /* send to every nameserver at once */
+    unsigned long sent_at;
+    struct sar_nameserver *ns; /* NULL if last sent to every server */
+    struct sar_cache_answer *cached;
+};
+
+struct sar_nameserver_stats {
+    const char *name;
+    unsigned long srtt; /* smoothed round-trip time in usec */
+    unsigned int loss; /* smoothed failure rate, per mille */
+    unsigned int req_sent;
+    unsigned int resp_used;
+    unsigned int resp_ignored;
+    unsigned int resp_servfail;
+    unsigned int resp_fallback;
+    unsigned int timeouts;
+};
+
+struct sar_cache_stats {
+    unsigned long lookups;
+    unsigned long hits;
+    unsigned long expired;
+    unsigned long stored;
+    unsigned long negative;
+    unsigned long evictions;
+    unsigned long bytes;
+    unsigned long max_bytes;
+    unsigned int entries;
+    unsigned int requests;
 };
 
 const char *sar_rcode_text(unsigned int rcode);
@@ -154,5 +184,7 @@ void sar_request_send(struct sar_request *req);
 struct sar_request *sar_request_simple(unsigned int data_len, sar_request_ok_cb ok_cb, sar_request_fail_cb fail_cb, ...);
 void sar_request_abort(struct sar_request *req);
 char *sar_extract_name(const unsigned char *buf, unsigned int size, unsigned int *ppos);
+const struct sar_cache_stats *sar_cache_stats(void);
+unsigned int sar_nameserver_stats(struct sar_nameserver_stats *stats, unsigned int max);
 
 #endif /* !defined(SRVX_SAR_H) */
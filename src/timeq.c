@@ -20,6 +20,7 @@
 
 #include "common.h"
 #include "heap.h"
+#include "perf.h"
 #include "timeq.h"
 
 heap_t timeq;
@@ -113,13 +114,21 @@ timeq_run(void)
 {
     void *k, *d;
     struct timeq_entry *ent;
+    unsigned long start;
+    char label[PERF_EVENT_LABEL];
     while (heap_size(timeq) > 0) {
         heap_peek(timeq, &k, &d);
         if ((unsigned long)k > now)
             break;
         ent = d;
         heap_pop(timeq);
-        ent->func(ent->data);
+        if (perf_stall_threshold) {
+            start = perf_now();
+            ent->func(ent->data);
+            perf_func_name((void*)ent->func, label, sizeof(label));
+            perf_event_record(PERF_EVENT_TIMER, perf_now() - start, label);
+        } else
+            ent->func(ent->data);
         free(ent);
     }
 }
@@ -436,6 +436,113 @@ ircstrlower(char *str) {
     return str;
 }
 
+/* An Aho-Corasick automaton, stored as a complete transition table
+ * so that matching costs one lookup per character of text.  Columns
+ * are indexed by character class rather than by character: each
+ * (case-folded) character that appears in some word gets its own
+ * class, and every other character shares class 0, which always
+ * leads back to the start state. */
+struct string_matcher {
+    unsigned int width;
+    unsigned int states;
+    unsigned int *next;
+    int *match;
+    unsigned char column[256];
+};
+
+struct string_matcher *
+string_matcher_new(const struct string_list *words)
+{
+    struct string_matcher *sm;
+    unsigned int *fail, *queue;
+    unsigned int max_states, head, tail, state, target, ii, jj;
+    const char *word;
+
+    sm = calloc(1, sizeof(*sm));
+    for (ii = max_states = 0; ii < words->used; ii++) {
+        for (word = words->list[ii]; *word; word++, max_states++) {
+            if (!sm->column[(unsigned char)tolower(*word)])
+                sm->column[(unsigned char)tolower(*word)] = ++sm->width;
+        }
+    }
+    for (ii = 0; ii < 256; ii++)
+        sm->column[ii] = sm->column[(unsigned char)tolower(ii)];
+    sm->width++;
+    max_states++;
+
+    /* Build the trie of words; a zero transition means "no child". */
+    sm->next = calloc(max_states * sm->width, sizeof(sm->next[0]));
+    sm->match = malloc(max_states * sizeof(sm->match[0]));
+    sm->match[0] = -1;
+    sm->states = 1;
+    for (ii = 0; ii < words->used; ii++) {
+        for (word = words->list[ii], state = 0; *word; word++) {
+            target = state * sm->width + sm->column[(unsigned char)*word];
+            if (!sm->next[target]) {
+                sm->match[sm->states] = -1;
+                sm->next[target] = sm->states++;
+            }
+            state = sm->next[target];
+        }
+        if (sm->match[state] < 0)
+            sm->match[state] = ii;
+    }
+
+    /* Walk the trie breadth-first, pointing each missing transition at
+     * the state its failure link would reach, and letting each state
+     * inherit any match from its failure link. */
+    fail = calloc(sm->states, sizeof(fail[0]));
+    queue = malloc(sm->states * sizeof(queue[0]));
+    head = tail = 0;
+    for (jj = 1; jj < sm->width; jj++)
+        if ((target = sm->next[jj]))
+            queue[tail++] = target;
+    while (head < tail) {
+        state = queue[head++];
+        for (jj = 1; jj < sm->width; jj++) {
+            target = sm->next[state * sm->width + jj];
+            if (target) {
+                fail[target] = sm->next[fail[state] * sm->width + jj];
+                if (sm->match[target] < 0)
+                    sm->match[target] = sm->match[fail[target]];
+                queue[tail++] = target;
+            } else {
+                sm->next[state * sm->width + jj] = sm->next[fail[state] * sm->width + jj];
+            }
+        }
+    }
+    free(queue);
+    free(fail);
+    return sm;
+}
+
+void
+string_matcher_free(struct string_matcher *sm)
+{
+    if (!sm)
+        return;
+    free(sm->next);
+    free(sm->match);
+    free(sm);
+}
+
+/* Returns the index of a word that occurs in text, or -1 if none do.
+ * When several words occur, which one is reported is unspecified. */
+int
+string_matcher_find(const struct string_matcher *sm, const char *text)
+{
+    unsigned int state;
+
+    if (sm->match[0] >= 0)
+        return sm->match[0];
+    for (state = 0; *text; text++) {
+        state = sm->next[state * sm->width + sm->column[(unsigned char)*text]];
+        if (sm->match[state] >= 0)
+            return sm->match[state];
+    }
+    return -1;
+}
+
 int
 split_line(char *line, int irc_colon, int argv_size, char *argv[])
 {
@@ -629,10 +736,47 @@ match_ircglob(const char *text, const char *glob)
 
 extern const char *hidden_host_suffix;
 
+/* Bumped to discard every user's cached hidden host at once; a user
+ * whose hidden_host_gen does not match must rebuild it. */
+static unsigned long user_forms_generation = 1;
+
+const char *
+user_ip_text(struct userNode *user)
+{
+    if (!user->ip_text[0])
+        irc_ntop(user->ip_text, sizeof(user->ip_text), &user->ip);
+    return user->ip_text;
+}
+
+const char *
+user_hidden_host(struct userNode *user)
+{
+    if (!hidden_host_suffix || !user->handle_info)
+        return NULL;
+    if (user->hidden_host_gen != user_forms_generation) {
+        snprintf(user->hidden_host, sizeof(user->hidden_host), "%s.%s", user->handle_info->handle, hidden_host_suffix);
+        user->hidden_host_gen = user_forms_generation;
+    }
+    return user->hidden_host;
+}
+
+void
+user_forms_invalidate(struct userNode *user)
+{
+    user->hidden_host_gen = 0;
+}
+
+void
+user_forms_invalidate_all(void)
+{
+    user_forms_generation++;
+}
+
 int
 user_matches_glob(struct userNode *user, const char *orig_glob, int flags)
 {
     irc_in_addr_t mask;
+    const char *hidden_host;
     char *glob, *marker;
     unsigned char mask_bits;
 
@@ -663,15 +807,12 @@ user_matches_glob(struct userNode *user, const char *orig_glob, int flags)
     if (IsFakeHost(user) && match_ircglob(user->fakehost, glob))
         return 1;
     /* Check for an account match. */
-    if (hidden_host_suffix && user->handle_info) {
-        char hidden_host[HOSTLEN+1];
-        snprintf(hidden_host, sizeof(hidden_host), "%s.%s", user->handle_info->handle, hidden_host_suffix);
-        if (match_ircglob(hidden_host, glob))
-            return 1;
-    }
+    hidden_host = user_hidden_host(user);
+    if (hidden_host && match_ircglob(hidden_host, glob))
+        return 1;
     /* If only matching the visible hostnames, bail early. */
     if ((flags & MATCH_VISIBLE) && IsHiddenHost(user)
-        && (IsFakeHost(user) || (hidden_host_suffix && user->handle_info)))
+        && (IsFakeHost(user) || hidden_host))
         return 0;
     /* If it might be an IP glob, test that. */
     if (irc_pton(&mask, &mask_bits, glob)
@@ -681,6 +822,164 @@ user_matches_glob(struct userNode *user, const char *orig_glob, int flags)
     return match_ircglob(user->hostname, glob);
 }
 
+/* Classify a glob so the common shapes ("*", "literal", "prefix*",
+ * "*suffix") avoid the general matcher, and remember the tail of its
+ * final literal run so most non-matching texts are rejected cheaply. */
+void
+compiled_glob_init(struct compiled_glob *cg, const char *glob)
+{
+    const char *lit, *pos;
+    unsigned int len, stars, ii;
+
+    memset(cg, 0, sizeof(*cg));
+    cg->glob = glob;
+    if (!glob)
+        return;
+    len = strlen(glob);
+    for (pos = glob, stars = 0, lit = glob; *pos; pos++) {
+        if (*pos == '\\') {
+            /* Escapes force exact case; leave these to match_ircglob(). */
+            cg->type = GLOB_GENERAL;
+            cg->min_len = 0;
+            return;
+        } else if (*pos == '*') {
+            stars++;
+            lit = pos + 1;
+        } else {
+            if (*pos == '?')
+                lit = pos + 1;
+            cg->min_len++;
+        }
+    }
+    cg->lit_len = glob + len - lit;
+    if (!stars && !strchr(glob, '?'))
+        cg->type = GLOB_LITERAL;
+    else if (stars == len)
+        cg->type = GLOB_ANY;
+    else if ((stars == 1) && (glob[len - 1] == '*') && !strchr(glob, '?')) {
+        cg->type = GLOB_PREFIX;
+        cg->lit_len = len - 1;
+    } else if ((stars == 1) && (glob[0] == '*') && !strchr(glob, '?'))
+        cg->type = GLOB_SUFFIX;
+    else
+        cg->type = GLOB_GENERAL;
+    if (cg->type == GLOB_PREFIX)
+        return;
+    cg->tail_len = (cg->lit_len < sizeof(cg->tail)) ? cg->lit_len : sizeof(cg->tail);
+    for (ii = 0; ii < cg->tail_len; ii++)
+        cg->tail[ii] = tolower(glob[len - cg->tail_len + ii]);
+}
+
+int
+compiled_glob_match(const struct compiled_glob *cg, const char *text)
+{
+    unsigned int len, ii;
+
+    if (cg->type == GLOB_ANY)
+        return 1;
+    len = strlen(text);
+    if (len < cg->min_len)
+        return 0;
+    for (ii = 0; ii < cg->tail_len; ii++)
+        if (tolower(text[len - cg->tail_len + ii]) != cg->tail[ii])
+            return 0;
+    switch (cg->type) {
+    case GLOB_LITERAL:
+        if (len != cg->lit_len)
+            return 0;
+        /* fall through */
+    case GLOB_SUFFIX:
+        if (cg->lit_len <= cg->tail_len)
+            return 1;
+        text += len - cg->lit_len;
+        for (ii = 0; ii < (unsigned int)(cg->lit_len - cg->tail_len); ii++)
+            if (tolower(text[ii]) != tolower(cg->glob[cg->glob[0] == '*' ? ii + 1 : ii]))
+                return 0;
+        return 1;
+    case GLOB_PREFIX:
+        for (ii = 0; ii < cg->lit_len; ii++)
+            if (tolower(text[ii]) != tolower(cg->glob[ii]))
+                return 0;
+        return 1;
+    default:
+        return match_ircglob(text, cg->glob);
+    }
+}
+
+/* Split and compile a ban-style mask once so that it can be tested
+ * against many users.  Returns NULL if the mask is missing the '!'
+ * (when MATCH_USENICK is given) or '@' that user_matches_glob()
+ * requires. */
+struct compiled_mask *
+compiled_mask_new(const char *mask, int flags)
+{
+    struct compiled_mask *cm;
+    unsigned int len;
+    char *glob, *marker;
+
+    len = strlen(mask) + 1;
+    cm = calloc(1, sizeof(*cm) + 2 * len);
+    cm->mask = (char*)(cm + 1);
+    memcpy(cm->mask, mask, len);
+    glob = cm->mask + len;
+    memcpy(glob, mask, len);
+    compiled_glob_init(&cm->full, cm->mask);
+    cm->flags = flags & MATCH_USENICK;
+    if (flags & MATCH_USENICK) {
+        if (!(marker = strchr(glob, '!')))
+            goto fail;
+        *marker = 0;
+        compiled_glob_init(&cm->nick, glob);
+        glob = marker + 1;
+    }
+    if (!(marker = strchr(glob, '@')))
+        goto fail;
+    *marker = 0;
+    compiled_glob_init(&cm->ident, glob);
+    glob = marker + 1;
+    compiled_glob_init(&cm->host, glob);
+    cm->has_ip = irc_pton(&cm->ip, &cm->ip_bits, glob) != 0;
+    return cm;
+  fail:
+    free(cm);
+    return NULL;
+}
+
+void
+compiled_mask_free(struct compiled_mask *cm)
+{
+    free(cm);
+}
+
+/* Equivalent to user_matches_glob(user, cm->mask, flags), except that
+ * MATCH_USENICK is fixed by compiled_mask_new(). */
+int
+user_matches_compiled(struct userNode *user, const struct compiled_mask *cm, int flags)
+{
+    const char *hidden_host;
+
+    if ((flags & MATCH_USENICK) != cm->flags)
+        return user_matches_glob(user, cm->mask, flags);
+    if ((cm->flags & MATCH_USENICK) && !compiled_glob_match(&cm->nick, user->nick))
+        return 0;
+    if (((IsFakeIdent(user) && IsHiddenHost(user) && (flags & MATCH_VISIBLE)) || !compiled_glob_match(&cm->ident, user->ident)) &&
+        !(IsFakeIdent(user) && compiled_glob_match(&cm->ident, user->fakeident)))
+        return 0;
+    if (cm->host.type == GLOB_ANY)
+        return 1;
+    if (IsFakeHost(user) && compiled_glob_match(&cm->host, user->fakehost))
+        return 1;
+    hidden_host = user_hidden_host(user);
+    if (hidden_host && compiled_glob_match(&cm->host, hidden_host))
+        return 1;
+    if ((flags & MATCH_VISIBLE) && IsHiddenHost(user)
+        && (IsFakeHost(user) || hidden_host))
+        return 0;
+    if (cm->has_ip && irc_check_mask(&user->ip, &cm->ip, cm->ip_bits))
+        return 1;
+    return compiled_glob_match(&cm->host, user->hostname);
+}
+
 int
 is_ircmask(const char *text)
 {